@@ -0,0 +1,317 @@
+/* See bench_json.h for details about the functions in this module */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include "bench_json.h"
+
+#ifndef CHIRC_BUILD_TYPE
+#define CHIRC_BUILD_TYPE "unknown"
+#endif
+
+/* Parts of a result, in the order they are written */
+enum {
+    SECTION_PARAMS = 0,
+    SECTION_PERCENTILES,
+    SECTION_THROUGHPUT,
+    SECTION_ALLOCATIONS,
+    SECTION_METRICS,
+    SECTION_SAMPLES,
+    SECTION_COUNT
+};
+
+static const char *section_names[SECTION_COUNT] = {
+    "params", "percentiles", "throughput", "allocations", "metrics", "samples"
+};
+
+/* A part of the document, built in memory since its members can be
+ * added in any order */
+typedef struct {
+    char *buf;
+    size_t len;
+    FILE *f;
+    int n;
+} section_t;
+
+static struct {
+    bool in_result;
+    int nresults;
+    /* The document's params, until the first result */
+    section_t params;
+    section_t sections[SECTION_COUNT];
+} doc;
+
+
+static void write_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; s && *s; s++)
+    {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void write_number(FILE *out, double value)
+{
+    if (isfinite(value))
+        fprintf(out, "%.10g", value);
+    else
+        fputs("null", out);
+}
+
+static void section_open(section_t *s)
+{
+    s->f = open_memstream(&s->buf, &s->len);
+    s->n = 0;
+}
+
+/* Starts a member of a section, and returns the stream to write its
+ * value to */
+static FILE *section_member(section_t *s, const char *name)
+{
+    if (s->n++ > 0)
+        fputs(", ", s->f);
+    write_string(s->f, name);
+    fputs(": ", s->f);
+
+    return s->f;
+}
+
+/* Writes a section as a member of the enclosing object, and frees it */
+static void section_flush(section_t *s, const char *name, bool always)
+{
+    fclose(s->f);
+    if (s->n > 0 || always)
+        printf(",\n      \"%s\": {%s}", name, s->buf);
+    free(s->buf);
+    s->buf = NULL;
+    s->f = NULL;
+}
+
+static section_t *params_section(void)
+{
+    return doc.in_result ? &doc.sections[SECTION_PARAMS] : &doc.params;
+}
+
+/* Writes the document's params, which end before the first result */
+static void finish_params(void)
+{
+    fclose(doc.params.f);
+    printf("  \"params\": {%s},\n  \"results\": [", doc.params.buf);
+    free(doc.params.buf);
+    doc.params.buf = NULL;
+}
+
+static void finish_result(void)
+{
+    if (!doc.in_result)
+        return;
+
+    for (int i = 0; i < SECTION_COUNT; i++)
+        section_flush(&doc.sections[i], section_names[i], i == SECTION_PARAMS);
+    printf("\n    }");
+    doc.in_result = false;
+}
+
+/* Gets the value of "key: value" lines in files like /proc/cpuinfo */
+static bool read_proc_field(const char *path, const char *key, char *value, size_t len)
+{
+    char line[512];
+    size_t klen = strlen(key);
+    bool found = false;
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        return false;
+
+    while (!found && fgets(line, sizeof(line), f))
+    {
+        char *p = line + klen;
+
+        if (strncmp(line, key, klen) != 0 || (*p != ' ' && *p != '\t' && *p != ':'))
+            continue;
+        while (*p == ' ' || *p == '\t' || *p == ':')
+            p++;
+        p[strcspn(p, "\n")] = '\0';
+        snprintf(value, len, "%s", p);
+        found = true;
+    }
+    fclose(f);
+
+    return found;
+}
+
+static void write_host(void)
+{
+    struct utsname uts;
+    char hostname[256] = "", cpu_model[256] = "", mem[64] = "";
+    long long mem_bytes = -1;
+
+    gethostname(hostname, sizeof(hostname) - 1);
+    memset(&uts, 0, sizeof(uts));
+    uname(&uts);
+    read_proc_field("/proc/cpuinfo", "model name", cpu_model, sizeof(cpu_model));
+    if (read_proc_field("/proc/meminfo", "MemTotal", mem, sizeof(mem)))
+        mem_bytes = atoll(mem) * 1024;
+
+    printf("  \"host\": {\"hostname\": ");
+    write_string(stdout, hostname);
+    printf(", \"os\": ");
+    write_string(stdout, uts.sysname);
+    printf(", \"kernel\": ");
+    write_string(stdout, uts.release);
+    printf(", \"arch\": ");
+    write_string(stdout, uts.machine);
+    printf(", \"cpus\": %ld, \"cpu_model\": ", sysconf(_SC_NPROCESSORS_ONLN));
+    write_string(stdout, cpu_model);
+    printf(", \"memory_bytes\": %lld, \"compiler\": ", mem_bytes);
+    write_string(stdout, __VERSION__);
+    printf(", \"build_type\": ");
+    write_string(stdout, CHIRC_BUILD_TYPE);
+    printf("},\n");
+}
+
+/* See bench_json.h */
+void bench_json_begin(const char *suite)
+{
+    char timestamp[32];
+    time_t now = time(NULL);
+    const char *commit = getenv("CHIRC_BENCH_COMMIT");
+
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    printf("{\n  \"schema\": \"%s\",\n  \"suite\": ", BENCH_JSON_SCHEMA);
+    write_string(stdout, suite);
+    printf(",\n  \"timestamp\": \"%s\",\n  \"commit\": ", timestamp);
+    if (commit && *commit)
+        write_string(stdout, commit);
+    else
+        printf("null");
+    printf(",\n");
+    write_host();
+
+    doc.in_result = false;
+    doc.nresults = 0;
+    section_open(&doc.params);
+}
+
+/* See bench_json.h */
+void bench_json_param_int(const char *name, long long value)
+{
+    fprintf(section_member(params_section(), name), "%lld", value);
+}
+
+/* See bench_json.h */
+void bench_json_param_num(const char *name, double value)
+{
+    write_number(section_member(params_section(), name), value);
+}
+
+/* See bench_json.h */
+void bench_json_param_str(const char *name, const char *value)
+{
+    write_string(section_member(params_section(), name), value);
+}
+
+/* See bench_json.h */
+void bench_json_result(const char *scenario)
+{
+    if (doc.nresults == 0)
+        finish_params();
+
+    finish_result();
+
+    printf("%s\n    {\n      \"scenario\": ", doc.nresults > 0 ? "," : "");
+    write_string(stdout, scenario);
+
+    for (int i = 0; i < SECTION_COUNT; i++)
+        section_open(&doc.sections[i]);
+    doc.in_result = true;
+    doc.nresults++;
+}
+
+/* See bench_json.h */
+void bench_json_percentiles(const char *name, const chirc_histogram_t *hist)
+{
+    static const struct { const char *name; double q; } quantiles[] = {
+        {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}
+    };
+    FILE *f;
+
+    if (hist->total == 0)
+        return;
+
+    f = section_member(&doc.sections[SECTION_PERCENTILES], name);
+    fprintf(f, "{\"count\": %llu, \"mean\": ", (unsigned long long) hist->total);
+    write_number(f, (double) hist->sum_ns / hist->total);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+        fprintf(f, ", \"%s\": %llu", quantiles[i].name,
+                (unsigned long long) chirc_histogram_quantile(hist, quantiles[i].q));
+    fprintf(f, ", \"max\": %llu}", (unsigned long long) hist->max_ns);
+}
+
+/* See bench_json.h */
+void bench_json_throughput(const char *name, double per_second)
+{
+    write_number(section_member(&doc.sections[SECTION_THROUGHPUT], name), per_second);
+}
+
+/* See bench_json.h */
+void bench_json_allocations(const char *name, double per_op)
+{
+    write_number(section_member(&doc.sections[SECTION_ALLOCATIONS], name), per_op);
+}
+
+/* See bench_json.h */
+void bench_json_metric(const char *name, double value, const char *unit, bench_better_t better)
+{
+    static const char *better_names[] = {"none", "lower", "higher"};
+    FILE *f = section_member(&doc.sections[SECTION_METRICS], name);
+
+    fputs("{\"value\": ", f);
+    write_number(f, value);
+    fputs(", \"unit\": ", f);
+    write_string(f, unit);
+    fprintf(f, ", \"better\": \"%s\"}", better_names[better]);
+}
+
+/* See bench_json.h */
+void bench_json_samples(const char *path, const double *values, int n)
+{
+    FILE *f = section_member(&doc.sections[SECTION_SAMPLES], path);
+
+    fputc('[', f);
+    for (int i = 0; i < n; i++)
+    {
+        if (i > 0)
+            fputs(", ", f);
+        write_number(f, values[i]);
+    }
+    fputc(']', f);
+}
+
+/* See bench_json.h */
+void bench_json_end(void)
+{
+    if (doc.nresults == 0)
+        finish_params();
+
+    finish_result();
+    printf("\n  ]\n}\n");
+    fflush(stdout);
+}
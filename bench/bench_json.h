@@ -0,0 +1,138 @@
+/*! \file bench_json.h
+ *  \brief Common JSON schema for benchmark results
+ *
+ *  Every benchmark prints its results (with -j) as one JSON document
+ *  on stdout, in the same schema, so results from any of them can be
+ *  stored and compared across commits (see tools/benchstore.py):
+ *
+ *      {
+ *        "schema": "chirc-bench/1",
+ *        "suite": "chirc-bench-fanout",
+ *        "timestamp": "2026-10-19T12:00:00Z",
+ *        "commit": "c1486fe",
+ *        "host": {"hostname": ..., "os": ..., "kernel": ..., "arch": ...,
+ *                 "cpus": ..., "cpu_model": ..., "memory_bytes": ...,
+ *                 "compiler": ..., "build_type": ...},
+ *        "params": {...},
+ *        "results": [
+ *          {
+ *            "scenario": "default",
+ *            "params": {"size": 100, "rate": 1000},
+ *            "percentiles": {"latency": {"count": ..., "mean": ..., "p50": ...,
+ *                            "p90": ..., "p99": ..., "p999": ..., "max": ...}},
+ *            "throughput": {"deliveries": 98000.0},
+ *            "allocations": {"per_op": 2.0},
+ *            "metrics": {"delivered": {"value": 1000, "unit": "messages",
+ *                                      "better": "higher"}},
+ *            "samples": {"metrics.ns_per_op": [...]}
+ *          }
+ *        ]
+ *      }
+ *
+ *  The document's params apply to every result (e.g., the corpus
+ *  seed); a result is identified by its suite, scenario and params.
+ *  Percentiles are always in nanoseconds, throughputs in operations
+ *  per second, and allocations in allocations per operation. Lower
+ *  percentiles and allocations are better, and higher throughputs;
+ *  other metrics say which way is better, if any. Samples hold the
+ *  individual measurements behind a value (e.g., every run of a
+ *  microbenchmark), keyed by the path of the value, and are what
+ *  significance tests are run on; other sample lists (e.g., the time
+ *  series of the soak test) are only kept for reference.
+ *
+ *  The commit is taken from the CHIRC_BENCH_COMMIT environment
+ *  variable (null if it is not set).
+ *
+ *  A document is written with bench_json_begin, then the document's
+ *  params, then, for each result, bench_json_result followed by its
+ *  params and values (in any order), and finally bench_json_end.
+ */
+
+#ifndef BENCH_JSON_H_
+#define BENCH_JSON_H_
+
+#include <stdint.h>
+
+#include "cmdstats.h"
+
+#define BENCH_JSON_SCHEMA "chirc-bench/1"
+
+/*! \brief Which way a metric is better */
+typedef enum {
+    /*! Not a measure of performance (e.g., a count), not compared */
+    BENCH_BETTER_NONE = 0,
+    BENCH_BETTER_LOWER,
+    BENCH_BETTER_HIGHER
+} bench_better_t;
+
+/*! \brief Starts a document (on stdout), with the host's information
+ *
+ * \param suite Name of the benchmark
+ */
+void bench_json_begin(const char *suite);
+
+/*! \brief Adds an integer parameter to the document, or to the
+ *         current result if there is one
+ *
+ * \param name Name of the parameter
+ * \param value Value
+ */
+void bench_json_param_int(const char *name, long long value);
+
+/*! \brief Adds a numeric parameter (see bench_json_param_int) */
+void bench_json_param_num(const char *name, double value);
+
+/*! \brief Adds a string parameter (see bench_json_param_int) */
+void bench_json_param_str(const char *name, const char *value);
+
+/*! \brief Starts a result (and finishes the previous one)
+ *
+ * \param scenario Name of the scenario
+ */
+void bench_json_result(const char *scenario);
+
+/*! \brief Adds the percentiles of a latency histogram to the result
+ *
+ * Nothing is added if the histogram is empty.
+ *
+ * \param name Name of the latency
+ * \param hist Histogram (in nanoseconds)
+ */
+void bench_json_percentiles(const char *name, const chirc_histogram_t *hist);
+
+/*! \brief Adds a throughput to the result
+ *
+ * \param name Name of the throughput (what is being counted)
+ * \param per_second Operations per second
+ */
+void bench_json_throughput(const char *name, double per_second);
+
+/*! \brief Adds an allocation count to the result
+ *
+ * \param name Name of the count (usually "per_op")
+ * \param per_op Heap allocations per operation
+ */
+void bench_json_allocations(const char *name, double per_op);
+
+/*! \brief Adds any other metric to the result
+ *
+ * \param name Name of the metric
+ * \param value Value (NaN for unknown, written as null)
+ * \param unit Unit of the value
+ * \param better Which way the metric is better
+ */
+void bench_json_metric(const char *name, double value, const char *unit, bench_better_t better);
+
+/*! \brief Adds the individual measurements behind a value
+ *
+ * \param path Path of the value (e.g., "metrics.ns_per_op" or
+ *             "throughput.pings")
+ * \param values Measurements
+ * \param n Number of measurements
+ */
+void bench_json_samples(const char *path, const double *values, int n);
+
+/*! \brief Finishes the document */
+void bench_json_end(void);
+
+#endif /* BENCH_JSON_H_ */
@@ -0,0 +1,187 @@
+/*! \file bench_log.c
+ *  \brief Cost of chilog/serverlog calls
+ *
+ *  Measures how much a log call costs when its level is disabled at
+ *  run time, when it is compiled out (see CHIRC_LOG_COMPILE_LEVEL in
+ *  log.h), and when it is enabled (synchronously and through the
+ *  asynchronous writer). Enabled output goes to /dev/null.
+ *
+ *  The arguments of the disabled calls have a side effect (they bump
+ *  a counter), so the benchmark also checks that disabled calls do
+ *  not evaluate their arguments.
+ *
+ *  Usage: chirc-bench-log [-j] [ITERATIONS]
+ *
+ *      -j          Print the results as JSON (see bench_json.h)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "log.h"
+#include "bench_json.h"
+
+#define DEFAULT_ITERATIONS (10 * 1000 * 1000)
+#define MAX_RESULTS (16)
+
+#define STRINGIFY(x) #x
+#define XSTRINGIFY(x) STRINGIFY(x)
+
+static unsigned long evaluated = 0;
+
+static bool json = false;
+static struct {
+    char *name;
+    double ns_per_op;
+    long iterations;
+} results[MAX_RESULTS];
+static int nresults = 0;
+
+/* Stands in for an argument that is expensive to compute */
+static char *expensive_arg()
+{
+    evaluated++;
+    return "expensive";
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(char *name, double start, double end, long n)
+{
+    if (!json)
+        fprintf(stderr, "%-28s %10.2f ns/op\n", name, (end - start) / n);
+    else if (nresults < MAX_RESULTS)
+    {
+        results[nresults].name = name;
+        results[nresults].ns_per_op = (end - start) / n;
+        results[nresults].iterations = n;
+        nresults++;
+    }
+}
+
+/* Prints the results on the original stdout (saved as out) */
+static void print_json(int out, long iterations)
+{
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+
+    bench_json_begin("chirc-bench-log");
+    bench_json_param_int("iterations", iterations);
+    bench_json_param_str("compile_level", XSTRINGIFY(CHIRC_LOG_COMPILE_LEVEL));
+    for (int i = 0; i < nresults; i++)
+    {
+        bench_json_result(results[i].name);
+        bench_json_metric("ns_per_op", results[i].ns_per_op, "ns", BENCH_BETTER_LOWER);
+        bench_json_metric("iterations", results[i].iterations, "iterations", BENCH_BETTER_NONE);
+    }
+    bench_json_end();
+}
+
+int main(int argc, char *argv[])
+{
+    long n = DEFAULT_ITERATIONS, iterations;
+    volatile long sink = 0;
+    chirc_connection_t conn;
+    chirc_user_t user;
+    double start;
+    int opt, out;
+
+    while ((opt = getopt(argc, argv, "jh")) != -1)
+        switch (opt)
+        {
+        case 'j':
+            json = true;
+            break;
+        case 'h':
+        default:
+            fprintf(opt == 'h' ? stdout : stderr, "Usage: chirc-bench-log [-j] [ITERATIONS]\n");
+            exit(opt == 'h' ? 0 : -1);
+        }
+    if (optind < argc)
+        n = atol(argv[optind]);
+    iterations = n;
+
+    /* The log goes to stdout, so the results go to a copy of it */
+    out = dup(STDOUT_FILENO);
+    if (out < 0 || !freopen("/dev/null", "w", stdout))
+    {
+        perror("freopen");
+        return 1;
+    }
+
+    user.nick = "bench";
+    user.username = "bench";
+    conn.type = CONN_TYPE_USER;
+    conn.peer.user = &user;
+    conn.hostname = "localhost";
+
+    chirc_setloglevel(INFO);
+
+    start = now_ns();
+    for (long i = 0; i < n; i++)
+        sink += i;
+    report("empty loop", start, now_ns(), n);
+
+    start = now_ns();
+    for (long i = 0; i < n; i++)
+    {
+        sink += i;
+        chilog(DEBUG, "iteration %ld: %s", i, expensive_arg());
+    }
+    report("chilog DEBUG (disabled)", start, now_ns(), n);
+
+    start = now_ns();
+    for (long i = 0; i < n; i++)
+    {
+        sink += i;
+        serverlog(DEBUG, &conn, "iteration %ld: %s", i, expensive_arg());
+    }
+    report("serverlog DEBUG (disabled)", start, now_ns(), n);
+
+    start = now_ns();
+    for (long i = 0; i < n; i++)
+    {
+        sink += i;
+        chilog(TRACE, "iteration %ld: %s", i, expensive_arg());
+    }
+    report(TRACE > CHIRC_LOG_COMPILE_LEVEL ? "chilog TRACE (compiled out)"
+                                           : "chilog TRACE (disabled)",
+           start, now_ns(), n);
+
+    if (evaluated != 0)
+    {
+        fprintf(stderr, "FAIL: arguments of disabled log calls were evaluated %lu times\n", evaluated);
+        return 1;
+    }
+
+    /* Enabled calls are much slower, so we run fewer of them */
+    n = n / 10 > 0 ? n / 10 : 1;
+
+    start = now_ns();
+    for (long i = 0; i < n; i++)
+        chilog(INFO, "iteration %ld: %s", i, "enabled");
+    report("chilog INFO (sync)", start, now_ns(), n);
+
+    chirc_log_start(LOG_OVERFLOW_BLOCK, 4096);
+    start = now_ns();
+    for (long i = 0; i < n; i++)
+        chilog(INFO, "iteration %ld: %s", i, "enabled");
+    report("chilog INFO (async)", start, now_ns(), n);
+    chirc_log_stop();
+
+    if (json)
+        print_json(out, iterations);
+
+    return 0;
+}
@@ -0,0 +1,588 @@
+/*! \file bench_micro.c
+ *  \brief Microbenchmarks for chirc's parser, serializer and data structures
+ *
+ *  Each benchmark runs an operation in a loop, over a corpus generated
+ *  from a fixed seed, and reports the time and the number of heap
+ *  allocations (calls to malloc, calloc and realloc) per operation.
+ *  Every benchmark is run several times; the median run is reported.
+ *
+ *  The corpus of IRC lines is a mix of what a server typically sees
+ *  (mostly PRIVMSGs with text of varying length, then PINGs, JOINs,
+ *  numeric replies, etc.). The lookup benchmarks search tables of a
+ *  given size for nicks picked at random. The connection benchmarks
+ *  send messages from the corpus through a connection backed by each
+ *  transport (an in-memory duplex and a Unix socket pair), flush its
+ *  mailbox, and read them back on the client's end.
+ *
+ *  Usage: chirc-bench [-j] [-f FILTER] [-s SEED] [-n SIZE] [-r RUNS] [-t SECS]
+ *
+ *      -j         Print the results as JSON (see bench_json.h)
+ *      -f FILTER  Only run benchmarks whose name contains FILTER
+ *      -s SEED    Seed for the corpus and the lookups (default: 1)
+ *      -n SIZE    Number of users/channels/nicks in the tables (default: 1000)
+ *      -r RUNS    Runs per benchmark (default: 5)
+ *      -t SECS    Minimum duration of a run (default: 0.2)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "chirc.h"
+#include "ctx.h"
+#include "message.h"
+#include "user.h"
+#include "channel.h"
+#include "connection.h"
+#include "duplex.h"
+#include "mailbox.h"
+#include "utils.h"
+#include "my_utils.h"
+#include "bench_json.h"
+
+#define CORPUS_SIZE (1024)
+#define LOOKUPS (4096)
+#define MAX_RUNS (64)
+
+/* Allocation counting. We wrap glibc's allocator, which also catches
+ * the allocations made inside libc (e.g., by strdup). */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations = 0;
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+
+static struct {
+    bool json;
+    const char *filter;
+    uint64_t seed;
+    int size;
+    int runs;
+    double min_time;
+} opts = {false, NULL, 1, 1000, 5, 0.2};
+
+static uint64_t rng_state;
+
+/* xorshift64* */
+static uint64_t rng()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static int rng_range(int lo, int hi)
+{
+    return lo + (int) (rng() % (uint64_t) (hi - lo + 1));
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile unsigned long sink;
+
+/* Benchmark state */
+static char *corpus[CORPUS_SIZE];
+static char *spaced_corpus[CORPUS_SIZE];
+static int spaced_len[CORPUS_SIZE];
+static chirc_message_t parsed[CORPUS_SIZE];
+static char **nicks;
+static char **channel_names;
+static int lookups[LOOKUPS];
+static user_node_t *nick_list = NULL;
+static connection_map_t *connection_hash = NULL;
+static sockfd_nick_map_t *sockfd_hash = NULL;
+static chirc_ctx_t ctx;
+static chirc_connection_t duplex_conn, socket_conn;
+static chirc_mailbox_t duplex_mailbox, socket_mailbox;
+static chirc_duplex_t *duplex;
+static int socket_peer;
+
+
+static void random_word(char *buf, int len)
+{
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
+
+    for (int i = 0; i < len; i++)
+        buf[i] = letters[rng() % 26];
+    buf[len] = '\0';
+}
+
+static void random_text(char *buf, int len)
+{
+    int pos = 0;
+
+    while (pos < len)
+    {
+        int wlen = rng_range(1, 9);
+        if (pos + wlen > len)
+            wlen = len - pos;
+        random_word(buf + pos, wlen);
+        pos += wlen;
+        if (pos < len)
+            buf[pos++] = ' ';
+    }
+    buf[len] = '\0';
+}
+
+static char *random_line()
+{
+    char line[600], text[400], nick[16], user[16], chan[16];
+    int kind = rng_range(0, 99);
+
+    random_word(nick, rng_range(3, 9));
+    random_word(user, rng_range(3, 9));
+    random_word(chan, rng_range(3, 12));
+
+    if (kind < 35)
+    {
+        random_text(text, rng_range(5, 300));
+        if (rng() % 2)
+            snprintf(line, sizeof(line), ":%s!%s@host-%d.example.com PRIVMSG #%s :%s\r\n",
+                     nick, user, rng_range(1, 9999), chan, text);
+        else
+            snprintf(line, sizeof(line), "PRIVMSG %s :%s\r\n", nick, text);
+    }
+    else if (kind < 50)
+        snprintf(line, sizeof(line), "PING :irc-%d.example.net\r\n", rng_range(1, 9));
+    else if (kind < 60)
+        snprintf(line, sizeof(line), "JOIN #%s,#%s-%d\r\n", chan, chan, rng_range(1, 99));
+    else if (kind < 65)
+        snprintf(line, sizeof(line), "NICK %s\r\n", nick);
+    else if (kind < 70)
+    {
+        random_text(text, rng_range(5, 30));
+        snprintf(line, sizeof(line), "USER %s * * :%s\r\n", user, text);
+    }
+    else if (kind < 80)
+        snprintf(line, sizeof(line), ":%s!%s@example.com MODE #%s +o %s\r\n", nick, user, chan, user);
+    else if (kind < 90)
+    {
+        random_text(text, rng_range(10, 200));
+        snprintf(line, sizeof(line), ":irc.example.net 353 %s = #%s :%s\r\n", nick, chan, text);
+    }
+    else if (kind < 95)
+        snprintf(line, sizeof(line), "WHOIS %s\r\n", nick);
+    else
+    {
+        random_text(text, rng_range(0, 40));
+        snprintf(line, sizeof(line), "QUIT :%s\r\n", text);
+    }
+
+    return strdup(line);
+}
+
+/* Adds runs of spaces between the words of a line */
+static char *add_spaces(const char *line, int *len)
+{
+    char out[1200];
+    int o = 0;
+
+    for (const char *p = line; *p && o < (int) sizeof(out) - 8; p++)
+    {
+        out[o++] = *p;
+        if (*p == ' ')
+            for (int n = rng_range(0, 2); n > 0; n--)
+                out[o++] = ' ';
+    }
+    out[o] = '\0';
+    *len = o;
+
+    return strdup(out);
+}
+
+static void setup_corpus()
+{
+    for (int i = 0; i < CORPUS_SIZE; i++)
+    {
+        corpus[i] = random_line();
+        spaced_corpus[i] = add_spaces(corpus[i], &spaced_len[i]);
+        chirc_message_from_string(&parsed[i], corpus[i]);
+    }
+}
+
+/* A connection of each transport, with the client's end kept here */
+static void setup_connections()
+{
+    int fds[2];
+
+    duplex = chirc_duplex_new(0);
+    chirc_connection_init_duplex(&duplex_conn, duplex);
+    chirc_mailbox_init(&duplex_mailbox);
+    duplex_conn.mailbox = &duplex_mailbox;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    chirc_connection_init_socket(&socket_conn, fds[0]);
+    chirc_mailbox_init(&socket_mailbox);
+    socket_conn.mailbox = &socket_mailbox;
+    socket_peer = fds[1];
+}
+
+static void setup_tables()
+{
+    nicks = malloc(opts.size * sizeof(char *));
+    channel_names = malloc(opts.size * sizeof(char *));
+
+    chirc_ctx_init(&ctx);
+
+    for (int i = 0; i < opts.size; i++)
+    {
+        char name[32];
+        chirc_user_t *user;
+        chirc_channel_t *channel;
+
+        random_word(name, 6);
+        snprintf(name + 6, sizeof(name) - 6, "%d", i);
+        nicks[i] = strdup(name);
+
+        random_word(name, 8);
+        snprintf(name + 8, sizeof(name) - 8, "%d", i);
+        channel_names[i] = malloc(strlen(name) + 2);
+        sprintf(channel_names[i], "#%s", name);
+
+        /* my_utils.h tables */
+        user_node_t *node = calloc(1, sizeof(user_node_t));
+        strcpy(node->name, nicks[i]);
+        add_user_node(&nick_list, node);
+
+        connection_map_t *cnode = calloc(1, sizeof(connection_map_t));
+        strcpy(cnode->name, nicks[i]);
+        cnode->fd = i + 3;
+        add_connection_map_node(&connection_hash, cnode);
+
+        sockfd_nick_map_t *snode = calloc(1, sizeof(sockfd_nick_map_t));
+        strcpy(snode->name, nicks[i]);
+        snode->fd = i + 3;
+        add_sockfd_nick_map_node(&sockfd_hash, snode);
+
+        /* Server context */
+        chirc_ctx_get_or_create_user(&ctx, nicks[i], &user);
+        chirc_ctx_get_or_create_channel(&ctx, channel_names[i], &channel);
+    }
+
+    for (int i = 0; i < LOOKUPS; i++)
+        lookups[i] = rng_range(0, opts.size - 1);
+}
+
+
+static void bench_message_from_string(long n)
+{
+    chirc_message_t msg;
+
+    for (long i = 0; i < n; i++)
+    {
+        chirc_message_from_string(&msg, corpus[i % CORPUS_SIZE]);
+        sink += msg.nparams;
+        chirc_message_free(&msg);
+    }
+}
+
+static void bench_message_to_string(long n)
+{
+    char *s;
+
+    for (long i = 0; i < n; i++)
+    {
+        chirc_message_to_string(&parsed[i % CORPUS_SIZE], &s);
+        sink += s[0];
+        free(s);
+    }
+}
+
+static void bench_send_message_duplex(long n)
+{
+    static char buf[4096];
+
+    for (long i = 0; i < n; i++)
+    {
+        chirc_connection_send_message(&ctx, &duplex_conn, &parsed[i % CORPUS_SIZE]);
+        chirc_connection_flush(&duplex_conn);
+        sink += chirc_duplex_client_read(duplex, buf, sizeof(buf), 0);
+    }
+}
+
+static void bench_send_message_socket(long n)
+{
+    static char buf[4096];
+
+    for (long i = 0; i < n; i++)
+    {
+        chirc_connection_send_message(&ctx, &socket_conn, &parsed[i % CORPUS_SIZE]);
+        chirc_connection_flush(&socket_conn);
+        sink += read(socket_peer, buf, sizeof(buf));
+    }
+}
+
+static void bench_trim_space(long n)
+{
+    static char out[1200];
+
+    for (long i = 0; i < n; i++)
+    {
+        int c = i % CORPUS_SIZE;
+        memset(out, 0, spaced_len[c] + 1);
+        trim_space(spaced_corpus[c], spaced_len[c], out);
+        sink += out[0];
+    }
+}
+
+static void bench_find_user_node(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += (unsigned long) find_user_node(nick_list, nicks[lookups[i % LOOKUPS]]);
+}
+
+static void bench_find_user_node_miss(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += (unsigned long) find_user_node(nick_list, "nosuchnick");
+}
+
+static void bench_find_connection_map_node(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += (unsigned long) find_connection_map_node(connection_hash, nicks[lookups[i % LOOKUPS]]);
+}
+
+static void bench_find_sockfd_nick_map_node(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += (unsigned long) find_sockfd_nick_map_node(sockfd_hash, lookups[i % LOOKUPS] + 3);
+}
+
+static void bench_ctx_get_user(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += (unsigned long) chirc_ctx_get_user(&ctx, nicks[lookups[i % LOOKUPS]]);
+}
+
+static void bench_ctx_add_remove_user(long n)
+{
+    chirc_user_t *user;
+
+    for (long i = 0; i < n; i++)
+    {
+        chirc_ctx_get_or_create_user(&ctx, "newcomer", &user);
+        chirc_ctx_remove_user(&ctx, user);
+        chirc_user_free(user);
+        free(user);
+    }
+}
+
+static void bench_ctx_get_channel(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += (unsigned long) chirc_ctx_get_channel(&ctx, channel_names[lookups[i % LOOKUPS]]);
+}
+
+static void bench_ctx_add_remove_channel(long n)
+{
+    chirc_channel_t *channel;
+
+    for (long i = 0; i < n; i++)
+    {
+        chirc_ctx_get_or_create_channel(&ctx, "#newchannel", &channel);
+        chirc_ctx_remove_channel(&ctx, channel);
+        chirc_channel_free(channel);
+        free(channel);
+    }
+}
+
+static void bench_has_mode(long n)
+{
+    static char modes[] = "aiwroO";
+    static const char probe[] = "aiwroOstvm";
+
+    for (long i = 0; i < n; i++)
+        sink += has_mode(modes, probe[i % 10]);
+}
+
+static void bench_set_mode(long n)
+{
+    static char modes[16] = "iw";
+    static const char probe[] = "aoOrs";
+
+    for (long i = 0; i < n; i++)
+    {
+        char mode = probe[i % 5];
+        sink += set_mode(modes, mode);
+        remove_mode(modes, mode);
+    }
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(long n);
+} bench_t;
+
+static bench_t benchmarks[] = {
+    {"message_from_string", bench_message_from_string},
+    {"message_to_string", bench_message_to_string},
+    {"trim_space", bench_trim_space},
+    {"connection/send_message_duplex", bench_send_message_duplex},
+    {"connection/send_message_socket", bench_send_message_socket},
+    {"my_utils/find_user_node", bench_find_user_node},
+    {"my_utils/find_user_node_miss", bench_find_user_node_miss},
+    {"my_utils/find_connection_map_node", bench_find_connection_map_node},
+    {"my_utils/find_sockfd_nick_map_node", bench_find_sockfd_nick_map_node},
+    {"ctx/get_user", bench_ctx_get_user},
+    {"ctx/add_remove_user", bench_ctx_add_remove_user},
+    {"ctx/get_channel", bench_ctx_get_channel},
+    {"ctx/add_remove_channel", bench_ctx_add_remove_channel},
+    {"modes/has_mode", bench_has_mode},
+    {"modes/set_mode", bench_set_mode},
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void run_benchmark(bench_t *b)
+{
+    long n = 1;
+    double elapsed, times[MAX_RUNS], start;
+    unsigned long allocs = 0;
+
+    /* Find how many iterations take at least min_time */
+    for (;;)
+    {
+        start = now_ns();
+        b->run(n);
+        elapsed = now_ns() - start;
+        if (elapsed >= opts.min_time * 1e9 || n >= (1L << 40))
+            break;
+        n = (elapsed > 1e6) ? (long) (n * opts.min_time * 1e9 / elapsed * 1.1) + 1 : n * 10;
+    }
+
+    for (int r = 0; r < opts.runs; r++)
+    {
+        unsigned long before = allocations;
+        start = now_ns();
+        b->run(n);
+        times[r] = (now_ns() - start) / n;
+        allocs += allocations - before;
+    }
+
+    if (opts.json)
+    {
+        /* The runs in the order they were made */
+        bench_json_result(b->name);
+        bench_json_samples("metrics.ns_per_op", times, opts.runs);
+    }
+
+    qsort(times, opts.runs, sizeof(double), compare_doubles);
+
+    if (opts.json)
+    {
+        bench_json_metric("ns_per_op", times[opts.runs / 2], "ns", BENCH_BETTER_LOWER);
+        bench_json_metric("iterations", n, "iterations", BENCH_BETTER_NONE);
+        bench_json_allocations("per_op", (double) allocs / ((double) n * opts.runs));
+    }
+    else
+        printf("%-36s %12.1f ns/op %10.2f allocs/op %12ld iters\n", b->name, times[opts.runs / 2],
+               (double) allocs / ((double) n * opts.runs), n);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "jf:s:n:r:t:h")) != -1)
+        switch (opt)
+        {
+        case 'j':
+            opts.json = true;
+            break;
+        case 'f':
+            opts.filter = optarg;
+            break;
+        case 's':
+            opts.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            opts.size = atoi(optarg);
+            break;
+        case 'r':
+            opts.runs = atoi(optarg);
+            break;
+        case 't':
+            opts.min_time = atof(optarg);
+            break;
+        case 'h':
+        default:
+            fprintf(opt == 'h' ? stdout : stderr,
+                    "Usage: chirc-bench [-j] [-f FILTER] [-s SEED] [-n SIZE] [-r RUNS] [-t SECS]\n");
+            exit(opt == 'h' ? 0 : -1);
+        }
+
+    if (opts.size <= 0 || opts.runs <= 0 || opts.runs > MAX_RUNS || opts.min_time <= 0)
+    {
+        fprintf(stderr, "ERROR: Invalid options\n");
+        exit(-1);
+    }
+
+    /* The lookups and the corpus must not depend on each other, so
+     * that changing the table size doesn't change the corpus */
+    chirc_setloglevel(QUIET);
+    rng_state = opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+    setup_corpus();
+    rng_state = opts.seed * 0xD1B54A32D192ED03ULL + 1;
+    setup_tables();
+    setup_connections();
+
+    if (opts.json)
+    {
+        bench_json_begin("chirc-bench");
+        bench_json_param_int("seed", opts.seed);
+        bench_json_param_int("size", opts.size);
+    }
+
+    for (size_t i = 0; i < NUM_BENCHMARKS; i++)
+    {
+        if (opts.filter && !strstr(benchmarks[i].name, opts.filter))
+            continue;
+        run_benchmark(&benchmarks[i]);
+        fflush(stdout);
+    }
+
+    if (opts.json)
+        bench_json_end();
+
+    return 0;
+}
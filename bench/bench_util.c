@@ -0,0 +1,473 @@
+/* See bench_util.h for details about the functions in this module */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "bench_util.h"
+
+#define MAX_EVENTS (1024)
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+
+/* See bench_util.h */
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* See bench_util.h */
+long bench_raise_fd_limit(long n)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return -1;
+
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (rlim_t) n)
+    {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= (rlim_t) n) ? (rlim_t) n : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    return rl.rlim_cur == RLIM_INFINITY ? n : (long) rl.rlim_cur;
+}
+
+/* See bench_util.h */
+int bench_pool_init(bench_pool_t *pool, const char *host, int port, int nsources)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    pool->server.sin_family = AF_INET;
+    pool->server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &pool->server.sin_addr) != 1)
+        return -1;
+
+    /* Extra source addresses only make sense on loopback */
+    if ((ntohl(pool->server.sin_addr.s_addr) >> 24) == 127)
+        pool->nsources = nsources;
+
+    pool->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    return pool->epfd < 0 ? -1 : 0;
+}
+
+static void update_events(bench_pool_t *pool, bench_conn_t *c)
+{
+    struct epoll_event ev = {.data.ptr = c};
+    bool want_write = c->state == BENCH_CONN_CONNECTING || c->out_len > 0;
+
+    if (want_write == c->want_write)
+        return;
+
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    epoll_ctl(pool->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_write = want_write;
+}
+
+/* See bench_util.h */
+int bench_conn_open(bench_pool_t *pool, bench_conn_t *c)
+{
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    int one = 1;
+
+    c->in_len = c->out_len = 0;
+    c->start_ns = bench_now_ns();
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+        goto _error;
+
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (pool->nsources > 0)
+    {
+        struct sockaddr_in src = {.sin_family = AF_INET};
+
+        /* Let the kernel pick the port at connect() time, so ports
+         * are only unique per (source, destination) pair */
+        setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        src.sin_addr.s_addr = htonl(0x7f000001 + (c->idx % pool->nsources));
+        if (bind(c->fd, (struct sockaddr *) &src, sizeof(src)) < 0)
+            goto _error;
+    }
+
+    if (connect(c->fd, (struct sockaddr *) &pool->server, sizeof(pool->server)) < 0 && errno != EINPROGRESS)
+        goto _error;
+
+    c->state = BENCH_CONN_CONNECTING;
+    c->want_write = true;
+    if (epoll_ctl(pool->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        goto _error;
+
+    pool->open++;
+
+    return 0;
+
+_error:
+    pool->errors++;
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    c->state = BENCH_CONN_CLOSED;
+    return -1;
+}
+
+/* See bench_util.h */
+void bench_conn_close(bench_pool_t *pool, bench_conn_t *c)
+{
+    if (c->state == BENCH_CONN_CLOSED)
+        return;
+
+    epoll_ctl(pool->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->state = BENCH_CONN_CLOSED;
+    pool->open--;
+}
+
+static void fail(bench_pool_t *pool, bench_conn_t *c, int err)
+{
+    pool->errors++;
+    bench_conn_close(pool, c);
+    if (pool->on_close)
+        pool->on_close(c, err);
+}
+
+static void flush(bench_pool_t *pool, bench_conn_t *c)
+{
+    while (c->out_len > 0)
+    {
+        ssize_t n = write(c->fd, c->out, c->out_len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+            {
+                fail(pool, c, errno);
+                return;
+            }
+            break;
+        }
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+
+    update_events(pool, c);
+}
+
+/* See bench_util.h */
+bool bench_conn_send(bench_pool_t *pool, bench_conn_t *c, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (c->state == BENCH_CONN_CLOSED)
+        return false;
+
+    va_start(ap, fmt);
+    n = vsnprintf(c->out + c->out_len, BENCH_OUT_BUF_SIZE - c->out_len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t) n + 2 > BENCH_OUT_BUF_SIZE - c->out_len)
+        return false;
+
+    memcpy(c->out + c->out_len + n, "\r\n", 2);
+    c->out_len += n + 2;
+
+    /* Lines queued while connecting are sent once connected */
+    if (c->state == BENCH_CONN_OPEN)
+        flush(pool, c);
+
+    return true;
+}
+
+static void readable(bench_pool_t *pool, bench_conn_t *c)
+{
+    for (;;)
+    {
+        ssize_t n = read(c->fd, c->in + c->in_len, BENCH_IN_BUF_SIZE - 1 - c->in_len);
+        uint64_t now;
+        char *start, *eol;
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0)
+        {
+            fail(pool, c, n == 0 ? 0 : errno);
+            return;
+        }
+
+        now = bench_now_ns();
+        c->in_len += n;
+        c->in[c->in_len] = '\0';
+
+        start = c->in;
+        while ((eol = strchr(start, '\n')) != NULL)
+        {
+            *eol = '\0';
+            if (eol > start && eol[-1] == '\r')
+                eol[-1] = '\0';
+            pool->on_line(c, start, now);
+            if (c->state == BENCH_CONN_CLOSED)
+                return;
+            start = eol + 1;
+        }
+
+        c->in_len -= start - c->in;
+        memmove(c->in, start, c->in_len);
+
+        /* A line that doesn't fit in the buffer is dropped */
+        if (c->in_len == BENCH_IN_BUF_SIZE - 1)
+            c->in_len = 0;
+    }
+}
+
+/* See bench_util.h */
+void bench_pool_poll(bench_pool_t *pool, int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(pool->epfd, events, MAX_EVENTS, timeout_ms);
+
+    for (int i = 0; i < n; i++)
+    {
+        bench_conn_t *c = events[i].data.ptr;
+
+        if (c->state == BENCH_CONN_CONNECTING)
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if (!(events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                continue;
+
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err)
+            {
+                fail(pool, c, err);
+                continue;
+            }
+            c->state = BENCH_CONN_OPEN;
+            if (pool->on_connect)
+                pool->on_connect(c, bench_now_ns());
+        }
+
+        if (c->state == BENCH_CONN_OPEN && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+            readable(pool, c);
+        if (c->state == BENCH_CONN_OPEN)
+            flush(pool, c);
+    }
+}
+
+/* See bench_util.h */
+pid_t bench_spawn_server(const char *exe, int port, char *const env[])
+{
+    char portstr[16];
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    pid_t pid;
+
+    snprintf(portstr, sizeof(portstr), "%d", port);
+
+    pid = fork();
+    if (pid < 0)
+        return -1;
+
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+
+        putenv("CHIRC_FLOOD_RATE=-1");
+        putenv("CHIRC_IP_CONNS=-1");
+        putenv("CHIRC_IP_CONNECT_RATE=-1");
+        for (int i = 0; env && env[i]; i++)
+            putenv(env[i]);
+        if (devnull >= 0)
+        {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+        execl(exe, exe, "-p", portstr, "-o", "benchpass", "-q", (char *) NULL);
+        perror(exe);
+        _exit(127);
+    }
+
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* Wait until the server accepts connections */
+    for (int tries = 0; tries < 500; tries++)
+    {
+        int fd, status;
+
+        if (waitpid(pid, &status, WNOHANG) == pid)
+            return -1;
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+        {
+            close(fd);
+            return pid;
+        }
+        if (fd >= 0)
+            close(fd);
+        usleep(10000);
+    }
+
+    bench_stop_server(pid);
+
+    return -1;
+}
+
+/* See bench_util.h */
+void bench_stop_server(pid_t pid)
+{
+    int status;
+
+    if (pid <= 0)
+        return;
+
+    kill(pid, SIGTERM);
+    for (int tries = 0; tries < 500; tries++)
+    {
+        if (waitpid(pid, &status, WNOHANG) == pid)
+            return;
+        usleep(10000);
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+}
+
+/* Reads a numeric field of /proc/PID/stat (fields are numbered as in
+ * proc(5), starting at 1) */
+static long long proc_stat_field(pid_t pid, int field)
+{
+    char path[64], buf[1024], *p;
+    FILE *f;
+    long long value = -1;
+    size_t n;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    /* The command name (field 2) can contain spaces, so we start
+     * counting after its closing parenthesis (i.e., at field 3) */
+    p = strrchr(buf, ')');
+    if (!p)
+        return -1;
+    p++;
+
+    for (int i = 3; i <= field && p; i++)
+    {
+        while (*p == ' ')
+            p++;
+        if (i == field)
+            value = strtoll(p, NULL, 10);
+        p = strchr(p, ' ');
+    }
+
+    return value;
+}
+
+/* See bench_util.h */
+uint64_t bench_proc_cpu_ns(pid_t pid)
+{
+    long long utime = proc_stat_field(pid, 14), stime = proc_stat_field(pid, 15);
+    long hz = sysconf(_SC_CLK_TCK);
+
+    if (utime < 0 || stime < 0)
+        return 0;
+
+    return (uint64_t) (utime + stime) * (1000000000ULL / hz);
+}
+
+/* See bench_util.h */
+uint64_t bench_proc_rss(pid_t pid)
+{
+    char path[64];
+    unsigned long size, resident;
+    FILE *f;
+    int n;
+
+    snprintf(path, sizeof(path), "/proc/%d/statm", (int) pid);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+
+    return n == 2 ? (uint64_t) resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+/* See bench_util.h */
+long bench_proc_threads(pid_t pid)
+{
+    return proc_stat_field(pid, 20);
+}
+
+/* See bench_util.h */
+long bench_proc_fds(pid_t pid)
+{
+    char path[64];
+    struct dirent *ent;
+    long n = 0;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int) pid);
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+    while ((ent = readdir(dir)) != NULL)
+        if (ent->d_name[0] != '.')
+            n++;
+    closedir(dir);
+
+    return n;
+}
+
+/* See bench_util.h */
+int bench_parse_list(const char *s, long *values, int max)
+{
+    int n = 0;
+
+    while (*s && n < max)
+    {
+        char *end;
+        values[n++] = strtol(s, &end, 10);
+        if (end == s)
+            return n - 1;
+        s = (*end == ',') ? end + 1 : end;
+    }
+
+    return n;
+}
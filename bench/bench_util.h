@@ -0,0 +1,155 @@
+/*! \file bench_util.h
+ *  \brief Helpers shared by the server benchmarks
+ *
+ *  A pool of non-blocking IRC client connections driven by a single
+ *  epoll loop, plus helpers to start a chirc process and to sample its
+ *  resource usage from /proc.
+ *
+ *  Connections can be spread over several loopback source addresses
+ *  (127.0.0.1, 127.0.0.2, ...), since a single source address runs out
+ *  of ephemeral ports after ~28k connections to the same server port.
+ */
+
+#ifndef BENCH_UTIL_H_
+#define BENCH_UTIL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define BENCH_IN_BUF_SIZE (4096)
+#define BENCH_OUT_BUF_SIZE (4096)
+
+typedef enum {
+    BENCH_CONN_CLOSED = 0,
+    BENCH_CONN_CONNECTING,
+    BENCH_CONN_OPEN
+} bench_conn_state_t;
+
+typedef struct bench_conn bench_conn_t;
+typedef struct bench_pool bench_pool_t;
+
+/*! \brief A client connection */
+struct bench_conn {
+    int fd;
+    int idx;
+    bench_conn_state_t state;
+    bool want_write;
+    /*! When the connection was opened */
+    uint64_t start_ns;
+    /*! For the benchmark's use */
+    int phase;
+    size_t in_len;
+    size_t out_len;
+    char in[BENCH_IN_BUF_SIZE];
+    char out[BENCH_OUT_BUF_SIZE];
+};
+
+/*! \brief A set of connections to a server */
+struct bench_pool {
+    int epfd;
+    struct sockaddr_in server;
+    int nsources;
+    /*! Called when a connection is established */
+    void (*on_connect)(bench_conn_t *c, uint64_t now);
+    /*! Called for every line received (without the CRLF) */
+    void (*on_line)(bench_conn_t *c, char *line, uint64_t now);
+    /*! Called when a connection fails or is closed by the server */
+    void (*on_close)(bench_conn_t *c, int err);
+    unsigned long open;
+    unsigned long errors;
+};
+
+/*! \brief Monotonic time in nanoseconds */
+uint64_t bench_now_ns(void);
+
+/*! \brief Raises RLIMIT_NOFILE to at least n (if the hard limit allows)
+ *
+ * \return The new soft limit
+ */
+long bench_raise_fd_limit(long n);
+
+/*! \brief Initializes a connection pool
+ *
+ * \param pool Pool
+ * \param host Server address (IPv4)
+ * \param port Server port
+ * \param nsources Number of loopback source addresses to use (only
+ *                 used if the server is on loopback; 0 lets the kernel
+ *                 choose)
+ * \return 0 on success, -1 on failure
+ */
+int bench_pool_init(bench_pool_t *pool, const char *host, int port, int nsources);
+
+/*! \brief Starts connecting a client
+ *
+ * \param pool Pool
+ * \param c Connection (c->idx must be set; it picks the source address)
+ * \return 0 if the connection is in progress, -1 on failure
+ */
+int bench_conn_open(bench_pool_t *pool, bench_conn_t *c);
+
+/*! \brief Closes a connection (without calling on_close) */
+void bench_conn_close(bench_pool_t *pool, bench_conn_t *c);
+
+/*! \brief Queues a line (the CRLF is added) and tries to send it
+ *
+ * Lines queued while the connection is still being established are
+ * sent as soon as it is.
+ *
+ * \return false if the output buffer is full or the connection is closed
+ */
+bool bench_conn_send(bench_pool_t *pool, bench_conn_t *c, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/*! \brief Waits for events and dispatches them to the callbacks
+ *
+ * \param pool Pool
+ * \param timeout_ms Maximum time to wait
+ */
+void bench_pool_poll(bench_pool_t *pool, int timeout_ms);
+
+/*! \brief Starts a chirc server in a child process
+ *
+ * The server runs quietly (-q) with operator password "benchpass", and
+ * without flood control for users (CHIRC_FLOOD_RATE=-1) or per-address
+ * limits (CHIRC_IP_CONNS=-1, CHIRC_IP_CONNECT_RATE=-1), unless env sets
+ * them, since the benchmarks send faster, and open more connections from
+ * one address, than any client is allowed to.
+ * Returns once the server accepts connections.
+ *
+ * \param exe Path of the chirc executable
+ * \param port Port to listen on
+ * \param env Extra environment variables ("NAME=VALUE"), NULL-terminated
+ *            (can be NULL)
+ * \return Pid of the server, or -1 on failure
+ */
+pid_t bench_spawn_server(const char *exe, int port, char *const env[]);
+
+/*! \brief Stops a server started with bench_spawn_server */
+void bench_stop_server(pid_t pid);
+
+/*! \brief CPU time (user + system) used by a process, in nanoseconds */
+uint64_t bench_proc_cpu_ns(pid_t pid);
+
+/*! \brief Resident set size of a process, in bytes */
+uint64_t bench_proc_rss(pid_t pid);
+
+/*! \brief Number of threads of a process */
+long bench_proc_threads(pid_t pid);
+
+/*! \brief Number of open file descriptors of a process */
+long bench_proc_fds(pid_t pid);
+
+/*! \brief Splits a comma-separated list of numbers
+ *
+ * \param s List (e.g., "10,100,1000")
+ * \param values (Output parameter) Array of at least max values
+ * \param max Maximum number of values
+ * \return Number of values
+ */
+int bench_parse_list(const char *s, long *values, int max);
+
+#endif /* BENCH_UTIL_H_ */
@@ -0,0 +1,487 @@
+/*! \file connscale.c
+ *  \brief Connection-scale and memory-per-connection benchmark
+ *
+ *  Opens registered client connections to a server in steps (e.g.,
+ *  1000, then 10000, then 100000 connections in total) and, after each
+ *  step, samples the server's resident memory, thread count and open
+ *  descriptors. From these it reports:
+ *
+ *   - the "accept latency" of the new connections, i.e., the time from
+ *     connect() until the server's RPL_WELCOME, which includes any time
+ *     spent in the listen backlog and in setting the connection up;
+ *   - the server memory per idle connection, i.e., the growth of the
+ *     server's RSS since before the first connection divided by the
+ *     number of open connections;
+ *   - the PING round-trip time of a few active clients while all the
+ *     other connections are idle.
+ *
+ *  With -B, the benchmark fails (exit status 1) if the memory per idle
+ *  connection at the largest step exceeds the given number of bytes,
+ *  so it can be used to catch regressions.
+ *
+ *  Connections are spread over several loopback source addresses (see
+ *  -a), and the descriptor limit is raised as needed; a server started
+ *  by the benchmark inherits the raised limit.
+ *
+ *  Usage: chirc-bench-connscale [options]
+ *
+ *      -x EXE      chirc executable to start (default: ./chirc)
+ *      -E          Use an already running server instead (see -H, -p, -P)
+ *      -H HOST     Server address (default: 127.0.0.1)
+ *      -p PORT     Server port (default: 16667)
+ *      -P PID      Pid of the running server, for the samples (with -E)
+ *      -s STEPS    Total connections after each step
+ *                  (default: 1000,10000,50000,100000)
+ *      -a N        Number of loopback source addresses (default: one
+ *                  per 20000 connections)
+ *      -A N        Number of active clients (default: 100)
+ *      -n N        PINGs sent by each active client (default: 10)
+ *      -w MSECS    How long to let the server settle before sampling
+ *                  (default: 500)
+ *      -T SECS     How long to wait for registrations, on top of one
+ *                  second per 5000 connections (default: 10)
+ *      -B BYTES    Maximum server memory per idle connection
+ *      -j          Print the results as JSON (see bench_json.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <math.h>
+#include <sys/wait.h>
+
+#include "bench_util.h"
+#include "cmdstats.h"
+#include "bench_json.h"
+
+#define MAX_STEPS (16)
+
+/* Phases of a connection */
+enum {
+    PHASE_REGISTERING = 0,
+    PHASE_IDLE,
+    PHASE_PINGING,
+    PHASE_FAILED
+};
+
+static struct {
+    const char *exe;
+    bool external;
+    const char *host;
+    int port;
+    pid_t pid;
+    long steps[MAX_STEPS];
+    int nsteps;
+    int nsources;
+    int nactive;
+    int npings;
+    int settle_ms;
+    double timeout;
+    long max_bytes;
+    bool json;
+} opts = {
+    .exe = "./chirc", .host = "127.0.0.1", .port = 16667,
+    .steps = {1000, 10000, 50000, 100000}, .nsteps = 4,
+    .nactive = 100, .npings = 10, .settle_ms = 500, .timeout = 10
+};
+
+static bench_pool_t pool;
+static bench_conn_t *conns;
+static int nconns = 0;
+static int nregistered = 0, nfailed = 0;
+
+/* Current step */
+static chirc_histogram_t accept_latency;
+static chirc_histogram_t ping_rtt;
+static uint64_t *ping_sent;
+static int *pings_left;
+static int pinging = 0;
+static bool first_row = true;
+static pid_t server_pid;
+static bool server_gone = false;
+
+
+static void on_connect(bench_conn_t *c, uint64_t now)
+{
+    c->phase = PHASE_REGISTERING;
+    bench_conn_send(&pool, c, "NICK cs%d", c->idx);
+    bench_conn_send(&pool, c, "USER cs%d * * :Connection-scale benchmark", c->idx);
+}
+
+static void send_ping(bench_conn_t *c)
+{
+    ping_sent[c->idx] = bench_now_ns();
+    if (!bench_conn_send(&pool, c, "PING cs%d", c->idx))
+    {
+        c->phase = PHASE_IDLE;
+        pinging--;
+    }
+}
+
+static void on_line(bench_conn_t *c, char *line, uint64_t now)
+{
+    char *cmd = line, *p;
+
+    if (*cmd == ':')
+    {
+        cmd = strchr(cmd, ' ');
+        if (!cmd)
+            return;
+        cmd++;
+    }
+
+    if (strncmp(cmd, "001 ", 4) == 0 && c->phase == PHASE_REGISTERING)
+    {
+        chirc_histogram_add(&accept_latency, now - c->start_ns);
+        nregistered++;
+        c->phase = PHASE_IDLE;
+    }
+    else if (strncmp(cmd, "PONG", 4) == 0 && c->phase == PHASE_PINGING)
+    {
+        /* The server's PONG doesn't echo our token, but each client
+         * only has one PING in flight */
+        chirc_histogram_add(&ping_rtt, now - ping_sent[c->idx]);
+        if (--pings_left[c->idx] > 0)
+            send_ping(c);
+        else
+        {
+            c->phase = PHASE_IDLE;
+            pinging--;
+        }
+    }
+    else if (strncmp(cmd, "PING", 4) == 0)
+    {
+        p = strchr(cmd, ' ');
+        bench_conn_send(&pool, c, "PONG%s", p ? p : "");
+    }
+}
+
+static void on_close(bench_conn_t *c, int err)
+{
+    if (c->phase == PHASE_PINGING)
+        pinging--;
+    if (c->phase == PHASE_IDLE || c->phase == PHASE_PINGING)
+        nregistered--;
+    c->phase = PHASE_FAILED;
+    nfailed++;
+}
+
+/* Checks whether the server has exited (e.g., because it ran out of
+ * descriptors or threads) */
+static bool server_exited()
+{
+    int status;
+
+    if (server_gone || server_pid <= 0)
+        return server_gone;
+
+    if (opts.external)
+        server_gone = kill(server_pid, 0) < 0 && errno == ESRCH;
+    else
+        server_gone = waitpid(server_pid, &status, WNOHANG) == server_pid;
+
+    return server_gone;
+}
+
+static void poll_until(uint64_t deadline, bool (*done)(void))
+{
+    while (bench_now_ns() < deadline && !(done && done()))
+        bench_pool_poll(&pool, 1);
+}
+
+static bool all_settled()
+{
+    return nregistered + nfailed >= nconns;
+}
+
+static bool pings_done()
+{
+    return pinging == 0;
+}
+
+/* Opens connections until there are n in total */
+static void grow(int n)
+{
+    uint64_t deadline;
+
+    while (nconns < n && !server_exited())
+    {
+        /* Keep the number of connections being set up close to the
+         * size of the server's listen backlog */
+        for (int batch = 0; batch < 128 && nconns < n; batch++)
+        {
+            conns[nconns].idx = nconns;
+            if (bench_conn_open(&pool, &conns[nconns]) < 0)
+            {
+                conns[nconns].phase = PHASE_FAILED;
+                nfailed++;
+            }
+            nconns++;
+        }
+
+        deadline = bench_now_ns() + 1000000000ULL;
+        while (nconns - nregistered - nfailed > 128 && bench_now_ns() < deadline)
+            bench_pool_poll(&pool, 1);
+    }
+
+    deadline = bench_now_ns() + (uint64_t) ((opts.timeout + n / 5000.0) * 1e9);
+    poll_until(deadline, all_settled);
+
+    /* Connections that never got a welcome count as failed */
+    for (int i = 0; i < nconns; i++)
+        if (conns[i].phase == PHASE_REGISTERING)
+        {
+            bench_conn_close(&pool, &conns[i]);
+            conns[i].phase = PHASE_FAILED;
+            nfailed++;
+        }
+}
+
+/* Has the first nactive idle connections PING the server */
+static void run_active()
+{
+    int started = 0;
+
+    for (int i = 0; i < nconns && started < opts.nactive; i++)
+        if (conns[i].phase == PHASE_IDLE)
+        {
+            conns[i].phase = PHASE_PINGING;
+            pings_left[i] = opts.npings;
+            pinging++;
+            started++;
+            send_ping(&conns[i]);
+        }
+
+    poll_until(bench_now_ns() + (uint64_t) (opts.timeout * 1e9), pings_done);
+
+    for (int i = 0; i < nconns; i++)
+        if (conns[i].phase == PHASE_PINGING)
+        {
+            conns[i].phase = PHASE_IDLE;
+            pinging--;
+        }
+}
+
+/* Prints one step, and returns the server memory per connection (or
+ * -1 if unknown) */
+static double print_row(long step, uint64_t rss0, uint64_t rss, long threads, long fds)
+{
+    double per_conn = (rss && nregistered > 0) ? ((double) rss - rss0) / nregistered : -1;
+
+    if (opts.json)
+    {
+        bench_json_result("idle");
+        bench_json_param_int("connections", step);
+        bench_json_metric("registered", nregistered, "connections", BENCH_BETTER_HIGHER);
+        bench_json_metric("failed", nfailed, "connections", BENCH_BETTER_LOWER);
+        bench_json_metric("baseline_rss", rss0 ? (double) rss0 : NAN, "bytes", BENCH_BETTER_NONE);
+        bench_json_metric("rss", rss ? (double) rss : NAN, "bytes", BENCH_BETTER_LOWER);
+        bench_json_metric("threads", threads >= 0 ? threads : NAN, "threads", BENCH_BETTER_NONE);
+        bench_json_metric("fds", fds >= 0 ? fds : NAN, "descriptors", BENCH_BETTER_NONE);
+        bench_json_metric("bytes_per_conn", per_conn >= 0 ? per_conn : NAN, "bytes", BENCH_BETTER_LOWER);
+        bench_json_percentiles("accept", &accept_latency);
+        bench_json_percentiles("ping", &ping_rtt);
+    }
+    else
+    {
+        if (first_row)
+            printf("%7s %10s %7s %10s %8s %8s %10s %10s %10s %10s %9s %9s\n",
+                   "step", "registered", "failed", "rss(MiB)", "threads", "fds", "bytes/conn",
+                   "acc-p50ms", "acc-p99ms", "acc-maxms", "ping-p50", "ping-p99");
+        printf("%7ld %10d %7d %10.1f %8ld %8ld %10.0f %10.3f %10.3f %10.3f %9.1f %9.1f\n",
+               step, nregistered, nfailed, rss / 1048576.0, threads, fds, per_conn,
+               chirc_histogram_quantile(&accept_latency, 0.5) / 1e6,
+               chirc_histogram_quantile(&accept_latency, 0.99) / 1e6, accept_latency.max_ns / 1e6,
+               chirc_histogram_quantile(&ping_rtt, 0.5) / 1e3, chirc_histogram_quantile(&ping_rtt, 0.99) / 1e3);
+    }
+    first_row = false;
+    fflush(stdout);
+
+    return per_conn;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, ret = 0;
+    long max_conns = 0;
+    pid_t pid;
+    uint64_t rss0;
+    double per_conn = -1;
+
+    while ((opt = getopt(argc, argv, "x:EH:p:P:s:a:A:n:w:T:B:jh")) != -1)
+        switch (opt)
+        {
+        case 'x':
+            opts.exe = optarg;
+            break;
+        case 'E':
+            opts.external = true;
+            break;
+        case 'H':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = atoi(optarg);
+            break;
+        case 'P':
+            opts.pid = atoi(optarg);
+            break;
+        case 's':
+            opts.nsteps = bench_parse_list(optarg, opts.steps, MAX_STEPS);
+            break;
+        case 'a':
+            opts.nsources = atoi(optarg);
+            break;
+        case 'A':
+            opts.nactive = atoi(optarg);
+            break;
+        case 'n':
+            opts.npings = atoi(optarg);
+            break;
+        case 'w':
+            opts.settle_ms = atoi(optarg);
+            break;
+        case 'T':
+            opts.timeout = atof(optarg);
+            break;
+        case 'B':
+            opts.max_bytes = atol(optarg);
+            break;
+        case 'j':
+            opts.json = true;
+            break;
+        case 'h':
+        default:
+            fprintf(opt == 'h' ? stdout : stderr,
+                    "Usage: chirc-bench-connscale [-x EXE] [-E [-H HOST] [-p PORT] [-P PID]] [-s STEPS] [-a SOURCES]\n"
+                    "                             [-A ACTIVE] [-n PINGS] [-w MSECS] [-T SECS] [-B BYTES] [-j]\n");
+            exit(opt == 'h' ? 0 : -1);
+        }
+
+    if (opts.nsteps <= 0 || opts.nactive < 0 || opts.npings <= 0 || opts.settle_ms < 0)
+    {
+        fprintf(stderr, "ERROR: Invalid options\n");
+        exit(-1);
+    }
+    for (int s = 0; s < opts.nsteps; s++)
+    {
+        if (opts.steps[s] <= max_conns)
+        {
+            fprintf(stderr, "ERROR: Steps must be increasing\n");
+            exit(-1);
+        }
+        max_conns = opts.steps[s];
+    }
+
+    /* The server needs one descriptor per connection too (and inherits
+     * our limit if we start it) */
+    if (bench_raise_fd_limit(max_conns + 64) < max_conns + 64)
+        fprintf(stderr, "WARNING: The descriptor limit is too low for %ld connections\n", max_conns);
+
+    pid = opts.pid;
+    if (!opts.external)
+    {
+        pid = bench_spawn_server(opts.exe, opts.port, NULL);
+        if (pid < 0)
+        {
+            fprintf(stderr, "ERROR: Could not start %s\n", opts.exe);
+            exit(-1);
+        }
+    }
+
+    if (bench_pool_init(&pool, opts.host, opts.port,
+                        opts.nsources ? opts.nsources : max_conns / 20000 + 1) < 0)
+    {
+        fprintf(stderr, "ERROR: Invalid address: %s\n", opts.host);
+        exit(-1);
+    }
+    pool.on_connect = on_connect;
+    pool.on_line = on_line;
+    pool.on_close = on_close;
+
+    conns = calloc(max_conns, sizeof(bench_conn_t));
+    ping_sent = calloc(max_conns, sizeof(uint64_t));
+    pings_left = calloc(max_conns, sizeof(int));
+    if (!conns || !ping_sent || !pings_left)
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(-1);
+    }
+
+    server_pid = pid;
+    rss0 = pid > 0 ? bench_proc_rss(pid) : 0;
+
+    if (opts.json)
+    {
+        bench_json_begin("chirc-bench-connscale");
+        bench_json_param_int("active", opts.nactive);
+        bench_json_param_int("pings", opts.npings);
+    }
+
+    for (int s = 0; s < opts.nsteps; s++)
+    {
+        uint64_t rss = 0;
+        long threads = -1, fds = -1;
+
+        memset(&accept_latency, 0, sizeof(accept_latency));
+        memset(&ping_rtt, 0, sizeof(ping_rtt));
+
+        grow(opts.steps[s]);
+
+        /* Sample while every connection is idle */
+        poll_until(bench_now_ns() + opts.settle_ms * 1000000ULL, NULL);
+        if (pid > 0)
+        {
+            rss = bench_proc_rss(pid);
+            threads = bench_proc_threads(pid);
+            fds = bench_proc_fds(pid);
+        }
+
+        if (server_exited())
+        {
+            fprintf(stderr, "ERROR: The server exited during the %ld-connection step\n", opts.steps[s]);
+            per_conn = -1;
+            ret = 1;
+            break;
+        }
+
+        run_active();
+
+        per_conn = print_row(opts.steps[s], rss0, rss, threads, fds);
+    }
+
+    if (opts.json)
+        bench_json_end();
+
+    if (opts.max_bytes > 0 && !server_gone)
+    {
+        if (per_conn < 0)
+        {
+            fprintf(stderr, "ERROR: Memory per connection unknown (is the server's pid known?)\n");
+            ret = 1;
+        }
+        else if (per_conn > opts.max_bytes)
+        {
+            fprintf(stderr, "FAIL: %.0f bytes per idle connection (maximum: %ld)\n", per_conn, opts.max_bytes);
+            ret = 1;
+        }
+    }
+
+    for (int i = 0; i < nconns; i++)
+        bench_conn_close(&pool, &conns[i]);
+    close(pool.epfd);
+    free(conns);
+    free(ping_sent);
+    free(pings_left);
+
+    if (!opts.external && !server_gone)
+        bench_stop_server(pid);
+
+    return ret;
+}
@@ -0,0 +1,479 @@
+/*! \file fanout.c
+ *  \brief Channel fan-out scaling benchmark
+ *
+ *  One sender posts messages to a channel with many members, and every
+ *  member measures how long each message took to reach it. The
+ *  benchmark sweeps the channel size and the message rate, and for
+ *  each step reports the distribution of per-recipient delivery
+ *  latencies, the time until a message reached *every* member, and the
+ *  server CPU time spent per delivered message.
+ *
+ *  By default the benchmark starts its own server (one per mode, see
+ *  -M), so it can measure the server's CPU time. Each mode is a name
+ *  plus environment variables for the server, which is how the
+ *  server's concurrency options are selected; the output has one row
+ *  per (mode, channel size, rate), so modes can be compared directly.
+ *
+ *  Usage: chirc-bench-fanout [options]
+ *
+ *      -x EXE      chirc executable to start (default: ./chirc)
+ *      -M MODE     Server mode, as NAME[:VAR=VALUE,...] (can be given
+ *                  several times; default: "default")
+ *      -E          Use an already running server instead (see -H, -p, -P)
+ *      -H HOST     Server address (default: 127.0.0.1)
+ *      -p PORT     Server port (default: 16667)
+ *      -P PID      Pid of the running server, for CPU accounting (with -E)
+ *      -s SIZES    Channel sizes (default: 10,100,1000,10000)
+ *      -R RATES    Messages per second (default: 10,100)
+ *      -n N        Messages per step (default: 100)
+ *      -S BYTES    Message payload size (default: 32)
+ *      -a N        Number of loopback source addresses (default: one
+ *                  per 20000 connections)
+ *      -T SECS     How long to wait for joins and deliveries (default: 5)
+ *      -j          Print the results as JSON (see bench_json.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "bench_util.h"
+#include "cmdstats.h"
+#include "bench_json.h"
+
+#define MAX_MODES (8)
+#define MAX_STEPS (16)
+#define MAX_ENV (16)
+#define CHANNEL "#fanout"
+
+/* Phases of a member connection */
+enum {
+    PHASE_REGISTERING = 0,
+    PHASE_JOINING,
+    PHASE_JOINED,
+    PHASE_FAILED
+};
+
+typedef struct {
+    char *name;
+    char *env[MAX_ENV];
+} server_mode_t;
+
+static struct {
+    const char *exe;
+    server_mode_t modes[MAX_MODES];
+    int nmodes;
+    bool external;
+    const char *host;
+    int port;
+    pid_t pid;
+    long sizes[MAX_STEPS];
+    int nsizes;
+    long rates[MAX_STEPS];
+    int nrates;
+    int nmsgs;
+    int payload;
+    int nsources;
+    double timeout;
+    bool json;
+} opts = {
+    .exe = "./chirc", .host = "127.0.0.1", .port = 16667,
+    .sizes = {10, 100, 1000, 10000}, .nsizes = 4,
+    .rates = {10, 100}, .nrates = 2,
+    .nmsgs = 100, .payload = 32, .timeout = 5
+};
+
+static bench_pool_t pool;
+static bench_conn_t *conns;     /* conns[0] is the sender */
+static int nconns = 0;
+static int nregistered = 0, njoined = 0, nfailed = 0;
+
+/* Current step */
+static int step = 0;
+static uint64_t *sent_at;
+static uint64_t *last_delivery;
+static uint64_t delivered;
+static chirc_histogram_t latency;
+static bool first_row = true;
+
+
+static void on_connect(bench_conn_t *c, uint64_t now)
+{
+    c->phase = PHASE_REGISTERING;
+    bench_conn_send(&pool, c, "NICK fo%d", c->idx);
+    bench_conn_send(&pool, c, "USER fo%d * * :Fan-out benchmark", c->idx);
+}
+
+static void set_phase(bench_conn_t *c, int phase)
+{
+    if (c->phase == PHASE_JOINED)
+        njoined--;
+    c->phase = phase;
+    if (phase == PHASE_JOINED)
+        njoined++;
+    else if (phase == PHASE_FAILED)
+        nfailed++;
+}
+
+static void on_line(bench_conn_t *c, char *line, uint64_t now)
+{
+    char *cmd = line, *p;
+
+    if (*cmd == ':')
+    {
+        cmd = strchr(cmd, ' ');
+        if (!cmd)
+            return;
+        cmd++;
+    }
+
+    if (strncmp(cmd, "PRIVMSG ", 8) == 0 && (p = strstr(cmd, " :FO ")) != NULL)
+    {
+        char *end;
+        long msg_step = strtol(p + 5, &end, 10);
+        long seq = strtol(end, NULL, 10);
+
+        if (msg_step != step || seq < 0 || seq >= opts.nmsgs || !sent_at[seq])
+            return;
+
+        chirc_histogram_add(&latency, now - sent_at[seq]);
+        if (now > last_delivery[seq])
+            last_delivery[seq] = now;
+        delivered++;
+    }
+    else if (strncmp(cmd, "001 ", 4) == 0 && c->phase == PHASE_REGISTERING)
+    {
+        nregistered++;
+        c->phase = PHASE_JOINING;
+        bench_conn_send(&pool, c, "JOIN " CHANNEL);
+    }
+    else if (c->phase == PHASE_JOINING && (strncmp(cmd, "366 ", 4) == 0 || strncmp(cmd, "JOIN ", 5) == 0))
+    {
+        set_phase(c, PHASE_JOINED);
+    }
+    else if (c->phase == PHASE_JOINING && cmd[0] >= '4' && cmd[0] <= '5' && cmd[3] == ' ')
+    {
+        /* Any error reply (e.g., 421 ERR_UNKNOWNCOMMAND) to the JOIN */
+        set_phase(c, PHASE_FAILED);
+    }
+    else if (strncmp(cmd, "PING", 4) == 0)
+    {
+        p = strchr(cmd, ' ');
+        bench_conn_send(&pool, c, "PONG%s", p ? p : "");
+    }
+}
+
+static void on_close(bench_conn_t *c, int err)
+{
+    if (c->phase == PHASE_REGISTERING || c->phase == PHASE_JOINING || c->phase == PHASE_JOINED)
+        set_phase(c, PHASE_FAILED);
+}
+
+static void poll_until(uint64_t deadline, bool (*done)(void))
+{
+    while (bench_now_ns() < deadline && !(done && done()))
+        bench_pool_poll(&pool, 1);
+}
+
+static bool all_settled()
+{
+    return njoined + nfailed >= nconns;
+}
+
+/* Number of members that can receive messages (the sender is
+ * a member too, but doesn't get its own messages) */
+static int receivers()
+{
+    return conns[0].phase == PHASE_JOINED ? njoined - 1 : njoined;
+}
+
+static bool all_delivered()
+{
+    return delivered >= (uint64_t) opts.nmsgs * receivers();
+}
+
+/* Opens connections until there are n members (plus the sender) */
+static void grow(int n)
+{
+    uint64_t deadline;
+
+    while (nconns < n + 1)
+    {
+        /* Don't flood the listen backlog */
+        for (int batch = 0; batch < 256 && nconns < n + 1; batch++)
+        {
+            conns[nconns].idx = nconns;
+            if (bench_conn_open(&pool, &conns[nconns]) < 0)
+                set_phase(&conns[nconns], PHASE_FAILED);
+            nconns++;
+        }
+        bench_pool_poll(&pool, 0);
+    }
+
+    deadline = bench_now_ns() + (uint64_t) ((opts.timeout + n / 5000.0) * 1e9);
+    poll_until(deadline, all_settled);
+}
+
+static void print_row(const char *mode, int size, long rate, double cpu_ns)
+{
+    int members = receivers();
+    uint64_t expected = (uint64_t) opts.nmsgs * size;
+    chirc_histogram_t done;
+    char cpu[32] = "null";
+
+    if (delivered && cpu_ns >= 0)
+        snprintf(cpu, sizeof(cpu), "%.3f", cpu_ns / delivered / 1e3);
+
+    memset(&done, 0, sizeof(done));
+    for (int i = 0; i < opts.nmsgs; i++)
+        if (last_delivery[i])
+            chirc_histogram_add(&done, last_delivery[i] - sent_at[i]);
+
+    if (opts.json)
+    {
+        bench_json_result(mode);
+        bench_json_param_int("size", size);
+        bench_json_param_int("rate", rate);
+        bench_json_metric("members", members, "clients", BENCH_BETTER_NONE);
+        bench_json_metric("expected", expected, "deliveries", BENCH_BETTER_NONE);
+        bench_json_metric("delivered", delivered, "deliveries", BENCH_BETTER_NONE);
+        bench_json_metric("delivered_ratio", expected ? (double) delivered / expected : NAN, "ratio",
+                          BENCH_BETTER_HIGHER);
+        bench_json_metric("cpu_per_delivery", delivered && cpu_ns >= 0 ? cpu_ns / delivered : NAN, "ns",
+                          BENCH_BETTER_LOWER);
+        bench_json_percentiles("latency", &latency);
+        bench_json_percentiles("complete", &done);
+    }
+    else
+    {
+        if (first_row)
+            printf("%-12s %7s %7s %6s %6s %10s %9s %9s %9s %9s %10s %10s %9s\n",
+                   "mode", "size", "members", "rate", "msgs", "delivered", "p50(us)", "p99(us)",
+                   "p999(us)", "max(us)", "all-p50ms", "all-p99ms", "cpu(us)");
+        printf("%-12s %7d %7d %6ld %6d %9.1f%% %9.1f %9.1f %9.1f %9.1f %10.3f %10.3f ",
+               mode, size, members, rate, opts.nmsgs, expected ? 100.0 * delivered / expected : 0.0,
+               chirc_histogram_quantile(&latency, 0.5) / 1e3, chirc_histogram_quantile(&latency, 0.99) / 1e3,
+               chirc_histogram_quantile(&latency, 0.999) / 1e3, latency.max_ns / 1e3,
+               chirc_histogram_quantile(&done, 0.5) / 1e6, chirc_histogram_quantile(&done, 0.99) / 1e6);
+        printf("%9s\n", strcmp(cpu, "null") ? cpu : "-");
+    }
+    first_row = false;
+    fflush(stdout);
+}
+
+/* Sends the messages of one step, and waits for them to be delivered */
+static void run_step(const char *mode, pid_t pid, int size, long rate)
+{
+    uint64_t start, cpu0 = 0, cpu1 = 0;
+
+    step++;
+    delivered = 0;
+    memset(&latency, 0, sizeof(latency));
+    memset(sent_at, 0, opts.nmsgs * sizeof(uint64_t));
+    memset(last_delivery, 0, opts.nmsgs * sizeof(uint64_t));
+
+    if (pid > 0)
+        cpu0 = bench_proc_cpu_ns(pid);
+
+    start = bench_now_ns();
+    for (int i = 0; i < opts.nmsgs; i++)
+    {
+        uint64_t due = start + (uint64_t) (i * 1e9 / rate);
+
+        while (bench_now_ns() < due)
+            bench_pool_poll(&pool, 1);
+
+        sent_at[i] = bench_now_ns();
+        if (!bench_conn_send(&pool, &conns[0], "PRIVMSG " CHANNEL " :FO %d %d %.*s",
+                             step, i, opts.payload, "................................................................"
+                             "................................................................"))
+            sent_at[i] = 0;
+    }
+
+    if (receivers() > 0)
+        poll_until(bench_now_ns() + (uint64_t) (opts.timeout * 1e9), all_delivered);
+
+    if (pid > 0)
+        cpu1 = bench_proc_cpu_ns(pid);
+
+    print_row(mode, size, rate, pid > 0 ? (double) (cpu1 - cpu0) : -1);
+}
+
+static void run_mode(server_mode_t *mode, int port)
+{
+    pid_t pid = opts.pid;
+    int max_size = 0;
+
+    if (!opts.external)
+    {
+        pid = bench_spawn_server(opts.exe, port, mode->env);
+        if (pid < 0)
+        {
+            fprintf(stderr, "ERROR: Could not start %s (mode %s)\n", opts.exe, mode->name);
+            return;
+        }
+    }
+
+    for (int s = 0; s < opts.nsizes; s++)
+        if (opts.sizes[s] > max_size)
+            max_size = opts.sizes[s];
+
+    if (bench_pool_init(&pool, opts.host, port,
+                        opts.nsources ? opts.nsources : (max_size + 1) / 20000 + 1) < 0)
+    {
+        fprintf(stderr, "ERROR: Invalid address: %s\n", opts.host);
+        exit(-1);
+    }
+    pool.on_connect = on_connect;
+    pool.on_line = on_line;
+    pool.on_close = on_close;
+
+    conns = calloc(max_size + 1, sizeof(bench_conn_t));
+    nconns = nregistered = njoined = nfailed = 0;
+
+    for (int s = 0; s < opts.nsizes; s++)
+    {
+        grow(opts.sizes[s]);
+        if (conns[0].phase != PHASE_JOINED)
+        {
+            fprintf(stderr, "WARNING: mode %s: the sender could not join " CHANNEL
+                            " (%d registered, %d joined, %d failed)\n", mode->name, nregistered, njoined, nfailed);
+        }
+        for (int r = 0; r < opts.nrates; r++)
+            run_step(mode->name, pid, opts.sizes[s], opts.rates[r]);
+    }
+
+    for (int i = 0; i < nconns; i++)
+        bench_conn_close(&pool, &conns[i]);
+    close(pool.epfd);
+    free(conns);
+
+    if (!opts.external)
+        bench_stop_server(pid);
+}
+
+static void parse_mode(char *arg)
+{
+    server_mode_t *mode = &opts.modes[opts.nmodes];
+    char *colon = strchr(arg, ':'), *tok, *save;
+    int nenv = 0;
+
+    if (opts.nmodes == MAX_MODES)
+    {
+        fprintf(stderr, "ERROR: Too many modes\n");
+        exit(-1);
+    }
+
+    mode->name = arg;
+    if (colon)
+    {
+        *colon = '\0';
+        for (tok = strtok_r(colon + 1, ",", &save); tok && nenv < MAX_ENV - 1; tok = strtok_r(NULL, ",", &save))
+            mode->env[nenv++] = tok;
+    }
+    mode->env[nenv] = NULL;
+    opts.nmodes++;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    long max_size = 0;
+
+    while ((opt = getopt(argc, argv, "x:M:EH:p:P:s:R:n:S:a:T:jh")) != -1)
+        switch (opt)
+        {
+        case 'x':
+            opts.exe = optarg;
+            break;
+        case 'M':
+            parse_mode(optarg);
+            break;
+        case 'E':
+            opts.external = true;
+            break;
+        case 'H':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = atoi(optarg);
+            break;
+        case 'P':
+            opts.pid = atoi(optarg);
+            break;
+        case 's':
+            opts.nsizes = bench_parse_list(optarg, opts.sizes, MAX_STEPS);
+            break;
+        case 'R':
+            opts.nrates = bench_parse_list(optarg, opts.rates, MAX_STEPS);
+            break;
+        case 'n':
+            opts.nmsgs = atoi(optarg);
+            break;
+        case 'S':
+            opts.payload = atoi(optarg);
+            break;
+        case 'a':
+            opts.nsources = atoi(optarg);
+            break;
+        case 'T':
+            opts.timeout = atof(optarg);
+            break;
+        case 'j':
+            opts.json = true;
+            break;
+        case 'h':
+        default:
+            fprintf(opt == 'h' ? stdout : stderr,
+                    "Usage: chirc-bench-fanout [-x EXE] [-M NAME[:VAR=VALUE,...]]... [-E [-H HOST] [-p PORT] [-P PID]]\n"
+                    "                          [-s SIZES] [-R RATES] [-n MSGS] [-S BYTES] [-a SOURCES] [-T SECS] [-j]\n");
+            exit(opt == 'h' ? 0 : -1);
+        }
+
+    if (opts.nsizes <= 0 || opts.nrates <= 0 || opts.nmsgs <= 0 || opts.payload < 0 || opts.payload > 128)
+    {
+        fprintf(stderr, "ERROR: Invalid options\n");
+        exit(-1);
+    }
+    for (int r = 0; r < opts.nrates; r++)
+        if (opts.rates[r] <= 0)
+        {
+            fprintf(stderr, "ERROR: Rates must be positive\n");
+            exit(-1);
+        }
+
+    if (opts.nmodes == 0)
+        parse_mode(opts.external ? "external" : "default");
+
+    for (int s = 0; s < opts.nsizes; s++)
+        if (opts.sizes[s] > max_size)
+            max_size = opts.sizes[s];
+    if (bench_raise_fd_limit(max_size + 64) < max_size + 64)
+        fprintf(stderr, "WARNING: The descriptor limit is too low for %ld connections\n", max_size);
+
+    sent_at = calloc(opts.nmsgs, sizeof(uint64_t));
+    last_delivery = calloc(opts.nmsgs, sizeof(uint64_t));
+
+    if (opts.json)
+    {
+        bench_json_begin("chirc-bench-fanout");
+        bench_json_param_int("messages", opts.nmsgs);
+        bench_json_param_int("payload", opts.payload);
+    }
+
+    for (int m = 0; m < opts.nmodes; m++)
+        run_mode(&opts.modes[m], opts.external ? opts.port : opts.port + m);
+
+    if (opts.json)
+        bench_json_end();
+
+    free(sent_at);
+    free(last_delivery);
+
+    return 0;
+}
@@ -0,0 +1,433 @@
+/*! \file inproc.c
+ *  \brief In-process benchmark of the server core
+ *
+ *  Runs the server inside the benchmark (through libchirc.h), without
+ *  a listening socket, and connects clients to it over in-memory
+ *  duplexes (see duplex.h). Nothing goes through the TCP stack, so the
+ *  results are the cost of the server's threads, parsing, dispatch and
+ *  replies, and they are not limited by descriptors or ports.
+ *
+ *  All the clients are driven from a single thread: the server signals
+ *  a client whenever it writes to it, and the client is queued until
+ *  the benchmark thread reads its replies.
+ *
+ *  The benchmark first connects and registers every client, and
+ *  reports how long that took. Then, for a fixed time, every client
+ *  keeps a number of PINGs outstanding (-d), and the benchmark reports
+ *  the PING throughput and round-trip latency, followed by the server's
+ *  own statistics (chirc_get_stats).
+ *
+ *  Usage: chirc-bench-inproc [options]
+ *
+ *      -c N        Number of clients (default: 1000)
+ *      -t SECS     How long to send PINGs (default: 5)
+ *      -d N        PINGs outstanding per client (default: 1)
+ *      -T SECS     How long to wait for registrations (default: 30)
+ *      -j          Print the results as JSON (see bench_json.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libchirc.h"
+#include "cmdstats.h"
+#include "log.h"
+#include "bench_json.h"
+
+/* Most PINGs a client can have outstanding */
+#define MAX_DEPTH (64)
+
+#define IN_BUF_SIZE (8192)
+
+typedef struct client
+{
+    int idx;
+    chirc_duplex_t *duplex;
+    bool registered;
+    bool closed;
+
+    /* Send times of the outstanding PINGs (oldest first) */
+    uint64_t sent[MAX_DEPTH];
+    int head, outstanding;
+
+    char in[IN_BUF_SIZE];
+    size_t in_len;
+
+    /* On the ready list */
+    bool queued;
+    struct client *next_ready;
+} client_t;
+
+static struct {
+    int nclients;
+    double duration;
+    int depth;
+    double timeout;
+    bool json;
+} opts = {
+    .nclients = 1000, .duration = 5, .depth = 1, .timeout = 30
+};
+
+static client_t *clients;
+/* Clients taken off the ready list */
+static client_t **batch;
+
+/* Clients the server has written to (or disconnected) since they
+ * were last read */
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+static client_t *ready_head = NULL;
+
+static int nregistered = 0, nclosed = 0;
+static bool pinging = false;
+static uint64_t pongs = 0;
+static chirc_histogram_t ping_rtt;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Called from the server's threads */
+static void on_server_write(chirc_duplex_t *duplex, void *arg)
+{
+    client_t *c = arg;
+
+    (void) duplex;
+
+    pthread_mutex_lock(&ready_lock);
+    if (!c->queued)
+    {
+        c->queued = true;
+        c->next_ready = ready_head;
+        ready_head = c;
+        pthread_cond_signal(&ready_cond);
+    }
+    pthread_mutex_unlock(&ready_lock);
+}
+
+/* Takes every ready client off the list (into batch), waiting up to
+ * timeout_ms for one if there are none. Returns the number taken. */
+static int take_ready(int timeout_ms, client_t **batch)
+{
+    struct timespec deadline;
+    int n = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&ready_lock);
+    while (!ready_head && timeout_ms > 0)
+        if (pthread_cond_timedwait(&ready_cond, &ready_lock, &deadline) != 0)
+            break;
+
+    for (client_t *c = ready_head; c; c = c->next_ready)
+    {
+        c->queued = false;
+        batch[n++] = c;
+    }
+    ready_head = NULL;
+    pthread_mutex_unlock(&ready_lock);
+
+    return n;
+}
+
+static void send_line(client_t *c, const char *fmt, ...)
+{
+    char line[512];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line) - 2, fmt, ap);
+    va_end(ap);
+    memcpy(line + len, "\r\n", 2);
+    len += 2;
+
+    for (int n = 0; n < len; )
+    {
+        ssize_t w = chirc_duplex_client_write(c->duplex, line + n, len - n, -1);
+        if (w < 0)
+        {
+            c->closed = true;
+            return;
+        }
+        n += w;
+    }
+}
+
+static void send_ping(client_t *c)
+{
+    c->sent[(c->head + c->outstanding) % MAX_DEPTH] = now_ns();
+    c->outstanding++;
+    send_line(c, "PING ip%d", c->idx);
+}
+
+static void on_line(client_t *c, char *line, uint64_t now)
+{
+    char *cmd = line;
+
+    /* Skip the prefix */
+    if (*cmd == ':')
+    {
+        cmd = strchr(cmd, ' ');
+        if (!cmd)
+            return;
+        cmd++;
+    }
+
+    if (strncmp(cmd, "001 ", 4) == 0 && !c->registered)
+    {
+        c->registered = true;
+        nregistered++;
+    }
+    else if (strncmp(cmd, "PONG", 4) == 0 && c->outstanding > 0)
+    {
+        chirc_histogram_add(&ping_rtt, now - c->sent[c->head]);
+        c->head = (c->head + 1) % MAX_DEPTH;
+        c->outstanding--;
+        pongs++;
+
+        if (pinging)
+            send_ping(c);
+    }
+}
+
+static void read_client(client_t *c)
+{
+    uint64_t now;
+    ssize_t n;
+
+    /* Only what is already there: the server notifies us again when it
+     * writes more, and a client that keeps answering must not hold up
+     * the others */
+    for (bool more = true; more && !c->closed; )
+    {
+        size_t room = sizeof(c->in) - c->in_len - 1;
+
+        n = chirc_duplex_client_read(c->duplex, c->in + c->in_len, room, 0);
+        more = n == (ssize_t) room;
+        if (n < 0)
+            return;
+        /* Taken after every read, since replying to a PONG can send a
+         * PING whose own PONG is read in the same loop */
+        now = now_ns();
+        if (n == 0)
+        {
+            c->closed = true;
+            nclosed++;
+            return;
+        }
+        c->in_len += n;
+        c->in[c->in_len] = '\0';
+
+        char *line = c->in, *end;
+        while ((end = strstr(line, "\r\n")) != NULL)
+        {
+            *end = '\0';
+            on_line(c, line, now);
+            line = end + 2;
+        }
+        c->in_len -= line - c->in;
+        memmove(c->in, line, c->in_len);
+
+        /* A line that does not fit is dropped */
+        if (c->in_len == sizeof(c->in) - 1)
+            c->in_len = 0;
+    }
+}
+
+/* Reads the replies of every ready client, for up to timeout_ms */
+static void poll_clients(int timeout_ms)
+{
+    int n = take_ready(timeout_ms, batch);
+
+    for (int i = 0; i < n; i++)
+        read_client(batch[i]);
+}
+
+int main(int argc, char *argv[])
+{
+    chirc_ctx_t ctx;
+    chirc_stats_t stats;
+    uint64_t start, registered_at, ping_start, ping_end, deadline;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:t:d:T:jh")) != -1)
+        switch (opt)
+        {
+        case 'c':
+            opts.nclients = atoi(optarg);
+            break;
+        case 't':
+            opts.duration = atof(optarg);
+            break;
+        case 'd':
+            opts.depth = atoi(optarg);
+            break;
+        case 'T':
+            opts.timeout = atof(optarg);
+            break;
+        case 'j':
+            opts.json = true;
+            break;
+        case 'h':
+        default:
+            fprintf(opt == 'h' ? stdout : stderr,
+                    "Usage: chirc-bench-inproc [-c CLIENTS] [-t SECS] [-d DEPTH] [-T SECS] [-j]\n");
+            exit(opt == 'h' ? 0 : -1);
+        }
+
+    if (opts.nclients <= 0 || opts.duration <= 0 || opts.depth <= 0 || opts.depth > MAX_DEPTH)
+    {
+        fprintf(stderr, "ERROR: Invalid options\n");
+        exit(-1);
+    }
+
+    chirc_setloglevel(QUIET);
+
+    clients = calloc(opts.nclients, sizeof(client_t));
+    batch = calloc(opts.nclients, sizeof(client_t *));
+    if (!clients || !batch || chirc_init(&ctx, "inproc.bench", NULL, "benchpass") != CHIRC_OK)
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(-1);
+    }
+
+    /* The clients send as fast as the server takes their commands */
+    chirc_set_flood(&ctx, CONN_TYPE_USER, -1, 0);
+
+    if (chirc_start(&ctx) != CHIRC_OK)
+    {
+        fprintf(stderr, "ERROR: Could not start the server\n");
+        exit(-1);
+    }
+
+    /* Registration */
+    start = now_ns();
+    for (int i = 0; i < opts.nclients; i++)
+    {
+        client_t *c = &clients[i];
+
+        c->idx = i;
+        c->duplex = chirc_connect_duplex(&ctx);
+        if (!c->duplex)
+        {
+            fprintf(stderr, "ERROR: Could not connect client %d\n", i);
+            exit(-1);
+        }
+        chirc_duplex_set_notify(c->duplex, on_server_write, c);
+
+        send_line(c, "NICK ip%d", i);
+        send_line(c, "USER ip%d * * :In-process benchmark", i);
+
+        /* Keep up with the replies, so no server thread is left waiting
+         * for room in its duplex */
+        poll_clients(0);
+    }
+
+    deadline = start + (uint64_t) (opts.timeout * 1e9);
+    while (nregistered + nclosed < opts.nclients && now_ns() < deadline)
+        poll_clients(10);
+    registered_at = now_ns();
+
+    if (nregistered < opts.nclients)
+        fprintf(stderr, "WARNING: Only %d of %d clients registered\n", nregistered, opts.nclients);
+
+    /* PINGs */
+    pinging = true;
+    ping_start = now_ns();
+    for (int i = 0; i < opts.nclients; i++)
+        for (int d = 0; d < opts.depth && clients[i].registered && !clients[i].closed; d++)
+            send_ping(&clients[i]);
+
+    deadline = ping_start + (uint64_t) (opts.duration * 1e9);
+    while (now_ns() < deadline)
+        poll_clients(10);
+    pinging = false;
+    ping_end = now_ns();
+
+    /* Let the last PINGs come back */
+    deadline = ping_end + 1000000000ULL;
+    for (bool waiting = true; waiting && now_ns() < deadline; )
+    {
+        poll_clients(10);
+        waiting = false;
+        for (int i = 0; i < opts.nclients && !waiting; i++)
+            waiting = clients[i].outstanding > 0 && !clients[i].closed;
+    }
+
+    chirc_get_stats(&ctx, &stats);
+
+    if (opts.json)
+    {
+        bench_json_begin("chirc-bench-inproc");
+        bench_json_param_int("clients", opts.nclients);
+
+        bench_json_result("register");
+        bench_json_metric("registered", nregistered, "clients", BENCH_BETTER_HIGHER);
+        bench_json_throughput("registrations", nregistered / ((registered_at - start) / 1e9));
+
+        bench_json_result("ping");
+        bench_json_param_int("depth", opts.depth);
+        bench_json_param_num("duration", opts.duration);
+        bench_json_throughput("pings", pongs / ((ping_end - ping_start) / 1e9));
+        bench_json_percentiles("rtt", &ping_rtt);
+        bench_json_metric("connections", stats.connections, "connections", BENCH_BETTER_NONE);
+        bench_json_metric("users", stats.users, "users", BENCH_BETTER_NONE);
+        bench_json_metric("connections_total", stats.connections_total, "connections", BENCH_BETTER_NONE);
+        bench_json_metric("workers", stats.workers, "threads", BENCH_BETTER_NONE);
+        bench_json_metric("bytes_in", stats.bytes_in, "bytes", BENCH_BETTER_NONE);
+        bench_json_metric("bytes_out", stats.bytes_out, "bytes", BENCH_BETTER_NONE);
+        bench_json_metric("lines_in", stats.lines_in, "lines", BENCH_BETTER_NONE);
+        bench_json_metric("lines_out", stats.lines_out, "lines", BENCH_BETTER_NONE);
+
+        bench_json_end();
+    }
+    else
+    {
+        printf("Registered %d of %d clients in %.3f s (%.1f/s)\n", nregistered, opts.nclients,
+               (registered_at - start) / 1e9, nregistered / ((registered_at - start) / 1e9));
+        printf("PING: %llu round trips in %.3f s (%.1f/s), %d outstanding per client\n",
+               (unsigned long long) pongs, (ping_end - ping_start) / 1e9,
+               pongs / ((ping_end - ping_start) / 1e9), opts.depth);
+        printf("PING round trip (us): p50 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n",
+               chirc_histogram_quantile(&ping_rtt, 0.5) / 1e3, chirc_histogram_quantile(&ping_rtt, 0.99) / 1e3,
+               chirc_histogram_quantile(&ping_rtt, 0.999) / 1e3, ping_rtt.max_ns / 1e3);
+        printf("Server: %ld connections, %ld users, %lu connected in total, %d workers\n",
+               stats.connections, stats.users, stats.connections_total, stats.workers);
+        printf("Server traffic: %llu bytes and %llu lines in, %llu bytes and %llu lines out\n",
+               (unsigned long long) stats.bytes_in, (unsigned long long) stats.lines_in,
+               (unsigned long long) stats.bytes_out, (unsigned long long) stats.lines_out);
+    }
+
+    /* The server may still write to a client until it is stopped, so
+     * the clients are only freed afterwards */
+    for (int i = 0; i < opts.nclients; i++)
+        chirc_duplex_client_close(clients[i].duplex);
+    chirc_stop(&ctx);
+    free(clients);
+    free(batch);
+
+    return nregistered == opts.nclients ? 0 : 1;
+}
@@ -0,0 +1,794 @@
+/*! \file loadgen.c
+ *  \brief Multi-connection load generator for chirc
+ *
+ *  Opens N client connections to a running server (at a configurable
+ *  ramp rate), registers them, and then drives a mix of commands at a
+ *  configurable rate:
+ *
+ *      privmsg  PRIVMSG to a random user
+ *      chanmsg  PRIVMSG to the channel the sender is in
+ *      join     JOIN an extra channel (or PART it, if already joined)
+ *      whois    WHOIS a random user
+ *      ping     PING the server
+ *
+ *  Messages carry the time they were sent (all connections run in this
+ *  process, so they share a clock), which gives end-to-end delivery
+ *  latencies. For PING and WHOIS, the latency is the time until the
+ *  reply (PONG, or the end of the WHOIS reply) arrives.
+ *
+ *  Usage: chirc-loadgen [options]
+ *
+ *      -H HOST     Server address (default: 127.0.0.1)
+ *      -p PORT     Server port (default: 6667)
+ *      -c N        Number of connections (default: 100)
+ *      -r RATE     Connections opened per second (default: 0, all at once)
+ *      -R RATE     Commands per second, over all connections (default: 1000)
+ *      -d SECS     Duration of the load phase (default: 10)
+ *      -m MIX      Command mix, as weights (default:
+ *                  privmsg=40,chanmsg=30,join=10,whois=10,ping=10)
+ *      -C N        Number of channels; every connection joins one
+ *                  (default: 10, 0 disables channels)
+ *      -S BYTES    Size of message payloads (default: 64)
+ *      -n PREFIX   Nick prefix (default: lg)
+ *      -s SEED     Random seed (default: 1)
+ *      -j          Print the results as JSON (see bench_json.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "cmdstats.h"
+#include "bench_json.h"
+
+#define IN_BUF_SIZE (8192)
+#define OUT_BUF_SIZE (8192)
+#define MAX_PENDING (32)
+#define MAX_EVENTS (256)
+
+/* How long we wait for replies after the load phase */
+#define DRAIN_NS (2000000000ULL)
+
+/* How long we wait for connections to register */
+#define REGISTER_TIMEOUT_NS (30000000000ULL)
+
+typedef enum {
+    OP_PRIVMSG = 0,
+    OP_CHANMSG,
+    OP_JOIN,
+    OP_WHOIS,
+    OP_PING,
+    NUM_OPS
+} op_t;
+
+static const char *op_names[NUM_OPS] = {"privmsg", "chanmsg", "join", "whois", "ping"};
+
+typedef enum {
+    LAT_REGISTER = 0,
+    LAT_PRIVMSG,
+    LAT_CHANMSG,
+    LAT_WHOIS,
+    LAT_PING,
+    NUM_LATENCIES
+} latency_t;
+
+static const char *latency_names[NUM_LATENCIES] = {"register", "privmsg", "chanmsg", "whois", "ping"};
+
+typedef enum {
+    CONN_CONNECTING,
+    CONN_REGISTERING,
+    CONN_READY,
+    CONN_CLOSED
+} conn_state_t;
+
+/* Send times of requests that are waiting for a reply */
+typedef struct {
+    uint64_t sent[MAX_PENDING];
+    unsigned head, tail;
+} pending_t;
+
+typedef struct {
+    int fd;
+    int idx;
+    conn_state_t state;
+    uint64_t start_ns;
+    bool in_extra_channel;
+    bool want_write;
+    pending_t pings;
+    pending_t whois;
+    size_t in_len;
+    size_t out_len;
+    char in[IN_BUF_SIZE];
+    char out[OUT_BUF_SIZE];
+} lg_conn_t;
+
+static struct {
+    const char *host;
+    int port;
+    int nconns;
+    double ramp;
+    double rate;
+    double duration;
+    int weights[NUM_OPS];
+    int nchannels;
+    int payload;
+    const char *prefix;
+    unsigned seed;
+    bool json;
+} opts = {"127.0.0.1", 6667, 100, 0, 1000, 10, {40, 30, 10, 10, 10}, 10, 64, "lg", 1, false};
+
+static struct {
+    uint64_t sent[NUM_OPS];
+    uint64_t skipped;
+    uint64_t delivered[NUM_LATENCIES];
+    uint64_t lines_in;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t errors;
+    chirc_histogram_t latency[NUM_LATENCIES];
+} results;
+
+static lg_conn_t *conns;
+static int epfd;
+static int nready = 0;
+static char *padding;
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pending_push(pending_t *p, uint64_t t)
+{
+    if (p->tail - p->head == MAX_PENDING)
+        p->head++;
+    p->sent[p->tail++ % MAX_PENDING] = t;
+}
+
+static bool pending_pop(pending_t *p, uint64_t *t)
+{
+    if (p->head == p->tail)
+        return false;
+    *t = p->sent[p->head++ % MAX_PENDING];
+    return true;
+}
+
+static void update_events(lg_conn_t *c)
+{
+    struct epoll_event ev = {.data.ptr = c};
+    bool want_write = c->state == CONN_CONNECTING || c->out_len > 0;
+
+    if (want_write == c->want_write)
+        return;
+
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_write = want_write;
+}
+
+static void close_conn(lg_conn_t *c)
+{
+    if (c->state == CONN_CLOSED)
+        return;
+    if (c->state == CONN_READY)
+        nready--;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->state = CONN_CLOSED;
+}
+
+static void flush_conn(lg_conn_t *c)
+{
+    while (c->out_len > 0)
+    {
+        ssize_t n = write(c->fd, c->out, c->out_len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+            {
+                results.errors++;
+                close_conn(c);
+                return;
+            }
+            break;
+        }
+        results.bytes_out += n;
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+
+    update_events(c);
+}
+
+/* Queues a line (without the trailing CRLF). Returns false if the
+ * output buffer is full (i.e., the server is not keeping up). */
+static bool send_line(lg_conn_t *c, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (c->state == CONN_CLOSED)
+        return false;
+
+    va_start(ap, fmt);
+    n = vsnprintf(c->out + c->out_len, OUT_BUF_SIZE - c->out_len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t) n + 2 > OUT_BUF_SIZE - c->out_len)
+        return false;
+
+    memcpy(c->out + c->out_len + n, "\r\n", 2);
+    c->out_len += n + 2;
+
+    return true;
+}
+
+static void open_conn(lg_conn_t *c, struct sockaddr_in *addr)
+{
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    int one = 1;
+
+    c->start_ns = now_ns();
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+    {
+        perror("socket");
+        results.errors++;
+        c->state = CONN_CLOSED;
+        return;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->fd, (struct sockaddr *) addr, sizeof(*addr)) < 0 && errno != EINPROGRESS)
+    {
+        perror("connect");
+        results.errors++;
+        close(c->fd);
+        c->state = CONN_CLOSED;
+        return;
+    }
+
+    c->state = CONN_CONNECTING;
+    c->want_write = true;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void on_connected(lg_conn_t *c)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err)
+    {
+        fprintf(stderr, "connect: %s\n", strerror(err));
+        results.errors++;
+        close_conn(c);
+        return;
+    }
+
+    c->state = CONN_REGISTERING;
+    send_line(c, "NICK %s%d", opts.prefix, c->idx);
+    send_line(c, "USER %s%d * * :Load Generator", opts.prefix, c->idx);
+}
+
+/* Handles one line received from the server */
+static void on_line(lg_conn_t *c, char *line)
+{
+    char *cmd = line, *p;
+    uint64_t now = now_ns(), sent;
+
+    results.lines_in++;
+
+    if (*cmd == ':')
+    {
+        cmd = strchr(cmd, ' ');
+        if (!cmd)
+            return;
+        cmd++;
+    }
+
+    if (strncmp(cmd, "001 ", 4) == 0)
+    {
+        if (c->state == CONN_REGISTERING)
+        {
+            chirc_histogram_add(&results.latency[LAT_REGISTER], now - c->start_ns);
+            c->state = CONN_READY;
+            nready++;
+            if (opts.nchannels > 0)
+                send_line(c, "JOIN #%s%d", opts.prefix, c->idx % opts.nchannels);
+        }
+    }
+    else if (strncmp(cmd, "PONG ", 5) == 0)
+    {
+        if (pending_pop(&c->pings, &sent))
+            chirc_histogram_add(&results.latency[LAT_PING], now - sent);
+    }
+    else if (strncmp(cmd, "318 ", 4) == 0 || strncmp(cmd, "401 ", 4) == 0)
+    {
+        if (pending_pop(&c->whois, &sent))
+            chirc_histogram_add(&results.latency[LAT_WHOIS], now - sent);
+    }
+    else if (strncmp(cmd, "PRIVMSG ", 8) == 0 && (p = strstr(cmd, " :LG ")) != NULL)
+    {
+        latency_t kind = p[5] == 'C' ? LAT_CHANMSG : LAT_PRIVMSG;
+
+        sent = strtoull(p + 7, NULL, 10);
+        if (sent && sent <= now)
+        {
+            chirc_histogram_add(&results.latency[kind], now - sent);
+            results.delivered[kind]++;
+        }
+    }
+    else if (strncmp(cmd, "PING", 4) == 0)
+    {
+        p = strchr(cmd, ' ');
+        send_line(c, "PONG%s", p ? p : "");
+    }
+    else if (strncmp(cmd, "ERROR", 5) == 0)
+    {
+        close_conn(c);
+    }
+}
+
+static void on_readable(lg_conn_t *c)
+{
+    for (;;)
+    {
+        ssize_t n = read(c->fd, c->in + c->in_len, IN_BUF_SIZE - 1 - c->in_len);
+        char *start, *eol;
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0)
+        {
+            if (n < 0)
+                results.errors++;
+            close_conn(c);
+            return;
+        }
+
+        results.bytes_in += n;
+        c->in_len += n;
+        c->in[c->in_len] = '\0';
+
+        start = c->in;
+        while ((eol = strchr(start, '\n')) != NULL)
+        {
+            *eol = '\0';
+            if (eol > start && eol[-1] == '\r')
+                eol[-1] = '\0';
+            on_line(c, start);
+            if (c->state == CONN_CLOSED)
+                return;
+            start = eol + 1;
+        }
+
+        c->in_len -= start - c->in;
+        memmove(c->in, start, c->in_len);
+
+        /* A line that doesn't fit in the buffer is dropped */
+        if (c->in_len == IN_BUF_SIZE - 1)
+            c->in_len = 0;
+    }
+}
+
+static lg_conn_t *random_ready_conn()
+{
+    for (int tries = 0; tries < 16; tries++)
+    {
+        lg_conn_t *c = &conns[rand() % opts.nconns];
+        if (c->state == CONN_READY)
+            return c;
+    }
+
+    return NULL;
+}
+
+static op_t random_op()
+{
+    int total = 0, r;
+
+    for (int i = 0; i < NUM_OPS; i++)
+        total += opts.weights[i];
+
+    r = rand() % total;
+    for (int i = 0; i < NUM_OPS; i++)
+    {
+        if (r < opts.weights[i])
+            return (op_t) i;
+        r -= opts.weights[i];
+    }
+
+    return OP_PING;
+}
+
+static void issue_op(op_t op)
+{
+    lg_conn_t *c = random_ready_conn();
+    uint64_t t = now_ns();
+    bool ok = false;
+    int target;
+
+    if (!c)
+    {
+        results.skipped++;
+        return;
+    }
+
+    switch (op)
+    {
+    case OP_PRIVMSG:
+        target = rand() % opts.nconns;
+        ok = send_line(c, "PRIVMSG %s%d :LG U %llu %.*s", opts.prefix, target,
+                       (unsigned long long) t, opts.payload, padding);
+        break;
+    case OP_CHANMSG:
+        if (opts.nchannels > 0)
+            ok = send_line(c, "PRIVMSG #%s%d :LG C %llu %.*s", opts.prefix, c->idx % opts.nchannels,
+                           (unsigned long long) t, opts.payload, padding);
+        break;
+    case OP_JOIN:
+        ok = send_line(c, "%s #%sx%d", c->in_extra_channel ? "PART" : "JOIN", opts.prefix, c->idx % 16);
+        if (ok)
+            c->in_extra_channel = !c->in_extra_channel;
+        break;
+    case OP_WHOIS:
+        target = rand() % opts.nconns;
+        ok = send_line(c, "WHOIS %s%d", opts.prefix, target);
+        if (ok)
+            pending_push(&c->whois, t);
+        break;
+    case OP_PING:
+        ok = send_line(c, "PING %llu", (unsigned long long) t);
+        if (ok)
+            pending_push(&c->pings, t);
+        break;
+    default:
+        break;
+    }
+
+    if (ok)
+    {
+        results.sent[op]++;
+        flush_conn(c);
+    }
+    else
+        results.skipped++;
+}
+
+/* Runs the event loop until the deadline (or until done() is true) */
+static void run_until(uint64_t deadline, bool (*tick)(uint64_t now))
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;)
+    {
+        uint64_t now = now_ns();
+        int n;
+
+        if (now >= deadline || (tick && tick(now)))
+            return;
+
+        n = epoll_wait(epfd, events, MAX_EVENTS, 1);
+        for (int i = 0; i < n; i++)
+        {
+            lg_conn_t *c = events[i].data.ptr;
+
+            if (c->state == CONN_CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                on_connected(c);
+            if (c->state != CONN_CLOSED && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                on_readable(c);
+            if (c->state != CONN_CLOSED)
+                flush_conn(c);
+        }
+    }
+}
+
+static struct sockaddr_in server_addr;
+static uint64_t phase_start;
+static int nopened = 0;
+static uint64_t nissued = 0;
+
+static bool ramp_tick(uint64_t now)
+{
+    int target = opts.nconns;
+
+    if (opts.ramp > 0)
+    {
+        target = (int) ((now - phase_start) / 1e9 * opts.ramp) + 1;
+        if (target > opts.nconns)
+            target = opts.nconns;
+    }
+
+    while (nopened < target)
+    {
+        conns[nopened].idx = nopened;
+        open_conn(&conns[nopened], &server_addr);
+        nopened++;
+    }
+
+    if (nopened < opts.nconns)
+        return false;
+
+    for (int i = 0; i < opts.nconns; i++)
+        if (conns[i].state == CONN_CONNECTING || conns[i].state == CONN_REGISTERING)
+            return false;
+
+    return true;
+}
+
+static bool load_tick(uint64_t now)
+{
+    uint64_t target = (uint64_t) ((now - phase_start) / 1e9 * opts.rate);
+
+    /* Don't try to catch up with more than a second's worth at once */
+    if (target - nissued > opts.rate)
+        nissued = target - (uint64_t) opts.rate;
+
+    while (nissued < target)
+    {
+        issue_op(random_op());
+        nissued++;
+    }
+
+    return false;
+}
+
+static void parse_mix(const char *mix)
+{
+    char *copy = strdup(mix), *tok, *save;
+
+    memset(opts.weights, 0, sizeof(opts.weights));
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        char *eq = strchr(tok, '=');
+        int i;
+
+        if (eq)
+            *eq = '\0';
+        for (i = 0; i < NUM_OPS; i++)
+            if (strcmp(tok, op_names[i]) == 0)
+                break;
+        if (i == NUM_OPS)
+        {
+            fprintf(stderr, "ERROR: Unknown command in mix: %s\n", tok);
+            exit(-1);
+        }
+        opts.weights[i] = eq ? atoi(eq + 1) : 1;
+    }
+    free(copy);
+
+    int total = 0;
+    for (int i = 0; i < NUM_OPS; i++)
+        total += opts.weights[i];
+    if (total <= 0)
+    {
+        fprintf(stderr, "ERROR: The command mix is empty\n");
+        exit(-1);
+    }
+}
+
+static void raise_fd_limit(int needed)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= (rlim_t) needed)
+        return;
+
+    rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= (rlim_t) needed) ? (rlim_t) needed : rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur < (rlim_t) needed)
+        fprintf(stderr, "WARNING: Can only open %lu descriptors\n", (unsigned long) rl.rlim_cur);
+}
+
+static void print_results(double load_secs)
+{
+    uint64_t total_sent = 0;
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    for (int i = 0; i < NUM_OPS; i++)
+        total_sent += results.sent[i];
+
+    if (opts.json)
+    {
+        char mix[256] = "";
+
+        for (int i = 0, len = 0; i < NUM_OPS; i++)
+            len += snprintf(mix + len, sizeof(mix) - len, "%s%s=%d", i ? "," : "", op_names[i], opts.weights[i]);
+
+        bench_json_begin("chirc-loadgen");
+        bench_json_result("mix");
+        bench_json_param_int("connections", opts.nconns);
+        bench_json_param_num("rate", opts.rate);
+        bench_json_param_num("duration", opts.duration);
+        bench_json_param_str("mix", mix);
+        bench_json_param_int("channels", opts.nchannels);
+        bench_json_param_int("payload", opts.payload);
+        bench_json_param_int("seed", opts.seed);
+
+        bench_json_throughput("commands", total_sent / load_secs);
+        bench_json_throughput("lines_in", results.lines_in / load_secs);
+        bench_json_metric("registered", results.latency[LAT_REGISTER].total, "connections", BENCH_BETTER_HIGHER);
+        bench_json_metric("sent", total_sent, "commands", BENCH_BETTER_NONE);
+        bench_json_metric("skipped", results.skipped, "commands", BENCH_BETTER_LOWER);
+        bench_json_metric("errors", results.errors, "errors", BENCH_BETTER_LOWER);
+        bench_json_metric("bytes_in", results.bytes_in, "bytes", BENCH_BETTER_NONE);
+        bench_json_metric("bytes_out", results.bytes_out, "bytes", BENCH_BETTER_NONE);
+        for (int i = 0; i < NUM_OPS; i++)
+        {
+            char name[64];
+
+            snprintf(name, sizeof(name), "sent_%s", op_names[i]);
+            bench_json_metric(name, results.sent[i], "commands", BENCH_BETTER_NONE);
+        }
+        for (int l = 0; l < NUM_LATENCIES; l++)
+            bench_json_percentiles(latency_names[l], &results.latency[l]);
+
+        bench_json_end();
+        return;
+    }
+
+    printf("connections: %d (%llu registered), errors: %llu\n", opts.nconns,
+           (unsigned long long) results.latency[LAT_REGISTER].total, (unsigned long long) results.errors);
+    printf("sent:        %llu commands in %.2f s (%.1f/s, target %.1f/s), %llu skipped\n",
+           (unsigned long long) total_sent, load_secs, total_sent / load_secs, opts.rate,
+           (unsigned long long) results.skipped);
+    for (int i = 0; i < NUM_OPS; i++)
+        printf("             %-8s %llu\n", op_names[i], (unsigned long long) results.sent[i]);
+    printf("received:    %llu lines, %llu bytes (%.1f lines/s)\n", (unsigned long long) results.lines_in,
+           (unsigned long long) results.bytes_in, results.lines_in / load_secs);
+    printf("\n%-10s %10s %10s %10s %10s %10s %10s %10s\n", "latency", "count", "mean(us)",
+           "p50", "p90", "p99", "p99.9", "max");
+    for (int l = 0; l < NUM_LATENCIES; l++)
+    {
+        chirc_histogram_t *h = &results.latency[l];
+        printf("%-10s %10llu %10.1f", latency_names[l], (unsigned long long) h->total,
+               h->total ? h->sum_ns / 1e3 / h->total : 0.0);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            printf(" %10.1f", chirc_histogram_quantile(h, quantiles[q]) / 1e3);
+        printf(" %10.1f\n", h->max_ns / 1e3);
+    }
+}
+
+static void usage(FILE *f)
+{
+    fprintf(f, "Usage: chirc-loadgen [-H HOST] [-p PORT] [-c CONNS] [-r CONNS_PER_SEC] [-R CMDS_PER_SEC]\n"
+               "                     [-d SECS] [-m MIX] [-C CHANNELS] [-S BYTES] [-n PREFIX] [-s SEED] [-j]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    uint64_t load_start, load_end;
+
+    while ((opt = getopt(argc, argv, "H:p:c:r:R:d:m:C:S:n:s:jh")) != -1)
+        switch (opt)
+        {
+        case 'H':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = atoi(optarg);
+            break;
+        case 'c':
+            opts.nconns = atoi(optarg);
+            break;
+        case 'r':
+            opts.ramp = atof(optarg);
+            break;
+        case 'R':
+            opts.rate = atof(optarg);
+            break;
+        case 'd':
+            opts.duration = atof(optarg);
+            break;
+        case 'm':
+            parse_mix(optarg);
+            break;
+        case 'C':
+            opts.nchannels = atoi(optarg);
+            break;
+        case 'S':
+            opts.payload = atoi(optarg);
+            break;
+        case 'n':
+            opts.prefix = optarg;
+            break;
+        case 's':
+            opts.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            opts.json = true;
+            break;
+        case 'h':
+            usage(stdout);
+            exit(0);
+        default:
+            usage(stderr);
+            exit(-1);
+        }
+
+    if (opts.nconns <= 0 || opts.rate < 0 || opts.duration <= 0 || opts.payload < 0 || opts.payload > 400)
+    {
+        fprintf(stderr, "ERROR: Invalid options\n");
+        usage(stderr);
+        exit(-1);
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(opts.port);
+    if (inet_pton(AF_INET, opts.host, &server_addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "ERROR: Invalid address: %s\n", opts.host);
+        exit(-1);
+    }
+
+    srand(opts.seed);
+    raise_fd_limit(opts.nconns + 16);
+
+    padding = malloc(opts.payload + 1);
+    memset(padding, 'x', opts.payload);
+    padding[opts.payload] = '\0';
+
+    conns = calloc(opts.nconns, sizeof(lg_conn_t));
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!conns || !padding || epfd < 0)
+    {
+        perror("chirc-loadgen");
+        exit(-1);
+    }
+    for (int i = 0; i < opts.nconns; i++)
+        conns[i].state = CONN_CLOSED;
+
+    /* Connect and register */
+    phase_start = now_ns();
+    run_until(phase_start + (uint64_t) (opts.ramp > 0 ? opts.nconns / opts.ramp * 1e9 : 0) + REGISTER_TIMEOUT_NS,
+              ramp_tick);
+    if (nready < opts.nconns)
+        fprintf(stderr, "WARNING: Only %d of %d connections registered\n", nready, opts.nconns);
+
+    /* Let the JOINs sent after registration go through */
+    run_until(now_ns() + 200000000ULL, NULL);
+
+    /* Load */
+    load_start = phase_start = now_ns();
+    run_until(load_start + (uint64_t) (opts.duration * 1e9), load_tick);
+    load_end = now_ns();
+
+    /* Wait for outstanding replies */
+    run_until(now_ns() + DRAIN_NS, NULL);
+
+    print_results((load_end - load_start) / 1e9);
+
+    for (int i = 0; i < opts.nconns; i++)
+        close_conn(&conns[i]);
+    close(epfd);
+    free(conns);
+    free(padding);
+
+    return 0;
+}
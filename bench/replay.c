@@ -0,0 +1,365 @@
+/*! \file replay.c
+ *  \brief Replays a traffic capture against a server
+ *
+ *  Reads a capture written by a server running with CHIRC_CAPTURE set
+ *  (see capture.h) and plays it back: every connection in the capture
+ *  is reopened when it was originally opened, sends the same lines at
+ *  the same relative times, and is closed when the original was. The
+ *  timing can be accelerated (-x), or dropped altogether to send the
+ *  traffic as fast as the server takes it.
+ *
+ *  Replies from the server are counted and discarded. Nothing is sent
+ *  that is not in the capture (e.g., PONGs), so the same capture always
+ *  produces the same stream of lines on every connection.
+ *
+ *  Usage: chirc-replay [options] FILE
+ *
+ *      -H HOST     Server address (default: 127.0.0.1)
+ *      -p PORT     Server port (default: 16667)
+ *      -x SPEED    Replay SPEED times faster than the original (default:
+ *                  1; 0 replays as fast as possible)
+ *      -a N        Number of loopback source addresses (default: 1)
+ *      -T SECS     How long to wait for replies after the last record
+ *                  (default: 1)
+ *      -d          Print the capture as text instead of replaying it
+ *      -j          Print the summary as JSON (see bench_json.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <uthash.h>
+
+#include "bench_util.h"
+#include "bench_json.h"
+#include "capture.h"
+#include "varint.h"
+
+/* Longest line we accept from a capture */
+#define MAX_LINE (BENCH_OUT_BUF_SIZE - 2)
+
+/* A connection being replayed, by capture connection id */
+typedef struct {
+    unsigned long id;
+    bench_conn_t conn;
+    UT_hash_handle hh;
+} replay_conn_t;
+
+/* A record read from the capture */
+typedef struct {
+    int type;
+    uint64_t time_us;
+    unsigned long conn_id;
+    size_t len;
+    char line[MAX_LINE + 1];
+} record_t;
+
+static struct {
+    const char *host;
+    int port;
+    double speed;
+    int nsources;
+    double wait;
+    bool dump;
+    bool json;
+} opts = {
+    .host = "127.0.0.1", .port = 16667, .speed = 1, .nsources = 1, .wait = 1
+};
+
+static bench_pool_t pool;
+static replay_conn_t *conns = NULL;
+static unsigned long opened = 0, lines_sent = 0, lines_dropped = 0, lines_received = 0;
+static unsigned long closed_by_server = 0;
+
+
+static bool read_varint(FILE *f, uint64_t *value)
+{
+    unsigned char buf[VARINT_MAX];
+
+    for (size_t i = 0; i < VARINT_MAX; i++)
+    {
+        int c = getc(f);
+        if (c == EOF)
+            return false;
+        buf[i] = (unsigned char) c;
+        if (!(c & 0x80))
+            return varint_decode(buf, i + 1, value) == i + 1;
+    }
+
+    return false;
+}
+
+/* Reads the next record. Returns 1 if a record was read, 0 at the end
+ * of the file, and -1 if the file is corrupt. */
+static int read_record(FILE *f, record_t *rec)
+{
+    uint64_t delta, conn_id, len = 0;
+    int type = getc(f);
+
+    if (type == EOF)
+        return 0;
+    if (type != CHIRC_CAPTURE_OPEN && type != CHIRC_CAPTURE_LINE && type != CHIRC_CAPTURE_CLOSE)
+        return -1;
+    if (!read_varint(f, &delta) || !read_varint(f, &conn_id))
+        return -1;
+
+    rec->type = type;
+    rec->time_us += delta;
+    rec->conn_id = conn_id;
+    rec->len = 0;
+
+    if (type == CHIRC_CAPTURE_LINE)
+    {
+        if (!read_varint(f, &len) || len > MAX_LINE || fread(rec->line, 1, len, f) != len)
+            return -1;
+        rec->len = len;
+    }
+    rec->line[rec->len] = '\0';
+
+    return 1;
+}
+
+static void on_line(bench_conn_t *c, char *line, uint64_t now)
+{
+    lines_received++;
+}
+
+static void on_close(bench_conn_t *c, int err)
+{
+    closed_by_server++;
+}
+
+static replay_conn_t *open_conn(unsigned long id)
+{
+    replay_conn_t *rc = calloc(1, sizeof(replay_conn_t));
+
+    rc->id = id;
+    rc->conn.idx = opened++;
+    bench_conn_open(&pool, &rc->conn);
+    HASH_ADD(hh, conns, id, sizeof(rc->id), rc);
+
+    return rc;
+}
+
+static void close_conn(replay_conn_t *rc)
+{
+    /* Give queued lines a chance to go out first */
+    uint64_t deadline = bench_now_ns() + 1000000000ULL;
+
+    while (rc->conn.state != BENCH_CONN_CLOSED && rc->conn.out_len > 0 && bench_now_ns() < deadline)
+        bench_pool_poll(&pool, 1);
+
+    bench_conn_close(&pool, &rc->conn);
+    HASH_DEL(conns, rc);
+    free(rc);
+}
+
+static void send_line(replay_conn_t *rc, record_t *rec)
+{
+    uint64_t deadline = bench_now_ns() + 5000000000ULL;
+
+    while (!bench_conn_send(&pool, &rc->conn, "%.*s", (int) rec->len, rec->line))
+    {
+        /* Either the connection is gone, or its output buffer is full
+         * (in which case we wait for the server to catch up) */
+        if (rc->conn.state == BENCH_CONN_CLOSED || bench_now_ns() >= deadline)
+        {
+            lines_dropped++;
+            return;
+        }
+        bench_pool_poll(&pool, 1);
+    }
+
+    lines_sent++;
+}
+
+static int dump(FILE *f)
+{
+    record_t rec = {0};
+    int ret;
+
+    while ((ret = read_record(f, &rec)) > 0)
+    {
+        printf("%12.6f %8lu ", rec.time_us / 1e6, rec.conn_id);
+        if (rec.type == CHIRC_CAPTURE_OPEN)
+            printf("OPEN\n");
+        else if (rec.type == CHIRC_CAPTURE_CLOSE)
+            printf("CLOSE\n");
+        else
+            printf("LINE %s\n", rec.line);
+    }
+
+    if (ret < 0)
+        fprintf(stderr, "WARNING: The capture is truncated or corrupt\n");
+
+    return ret;
+}
+
+static int replay(FILE *f)
+{
+    record_t rec = {0};
+    replay_conn_t *rc, *tmp;
+    uint64_t start, end, max_lag = 0;
+    unsigned long records = 0;
+    int ret;
+
+    /* A reconnect storm can have many connections open at once */
+    bench_raise_fd_limit(65536);
+
+    if (bench_pool_init(&pool, opts.host, opts.port, opts.nsources) < 0)
+    {
+        fprintf(stderr, "ERROR: Invalid address: %s\n", opts.host);
+        return -1;
+    }
+    pool.on_line = on_line;
+    pool.on_close = on_close;
+
+    start = bench_now_ns();
+    while ((ret = read_record(f, &rec)) > 0)
+    {
+        records++;
+
+        if (opts.speed > 0)
+        {
+            uint64_t due = start + (uint64_t) (rec.time_us * 1000 / opts.speed), now;
+
+            while ((now = bench_now_ns()) < due)
+                bench_pool_poll(&pool, (due - now) / 1000000 > 10 ? 10 : (int) ((due - now) / 1000000));
+            if (now - due > max_lag)
+                max_lag = now - due;
+        }
+        else
+            bench_pool_poll(&pool, 0);
+
+        HASH_FIND(hh, conns, &rec.conn_id, sizeof(rec.conn_id), rc);
+
+        switch (rec.type)
+        {
+        case CHIRC_CAPTURE_OPEN:
+            if (rc)
+                close_conn(rc);
+            open_conn(rec.conn_id);
+            break;
+        case CHIRC_CAPTURE_LINE:
+            /* The capture may have started after the connection */
+            if (!rc)
+                rc = open_conn(rec.conn_id);
+            send_line(rc, &rec);
+            break;
+        case CHIRC_CAPTURE_CLOSE:
+            if (rc)
+                close_conn(rc);
+            break;
+        }
+    }
+
+    if (ret < 0)
+        fprintf(stderr, "WARNING: The capture is truncated or corrupt (after %lu records)\n", records);
+
+    end = bench_now_ns();
+    while (bench_now_ns() < end + (uint64_t) (opts.wait * 1e9))
+        bench_pool_poll(&pool, 10);
+
+    HASH_ITER(hh, conns, rc, tmp)
+    {
+        bench_conn_close(&pool, &rc->conn);
+        HASH_DEL(conns, rc);
+        free(rc);
+    }
+    close(pool.epfd);
+
+    if (opts.json)
+    {
+        bench_json_begin("chirc-replay");
+        bench_json_result("replay");
+        bench_json_param_num("speed", opts.speed);
+        bench_json_param_int("records", records);
+        bench_json_metric("capture_s", rec.time_us / 1e6, "s", BENCH_BETTER_NONE);
+        bench_json_metric("replay_s", (end - start) / 1e9, "s", BENCH_BETTER_LOWER);
+        bench_json_metric("max_lag", max_lag, "ns", BENCH_BETTER_LOWER);
+        bench_json_metric("connections", opened, "connections", BENCH_BETTER_NONE);
+        bench_json_metric("connect_errors", pool.errors, "connections", BENCH_BETTER_LOWER);
+        bench_json_metric("closed_by_server", closed_by_server, "connections", BENCH_BETTER_NONE);
+        bench_json_metric("lines_sent", lines_sent, "lines", BENCH_BETTER_NONE);
+        bench_json_metric("lines_dropped", lines_dropped, "lines", BENCH_BETTER_LOWER);
+        bench_json_metric("lines_received", lines_received, "lines", BENCH_BETTER_NONE);
+        bench_json_throughput("lines_sent", lines_sent / ((end - start) / 1e9));
+        bench_json_end();
+    }
+    else
+    {
+        printf("Replayed %lu records (%.3f s captured) in %.3f s, at most %.3f ms behind schedule\n",
+               records, rec.time_us / 1e6, (end - start) / 1e9, max_lag / 1e6);
+        printf("Connections: %lu opened, %lu errors, %lu closed by the server\n",
+               opened, pool.errors, closed_by_server);
+        printf("Lines: %lu sent, %lu dropped, %lu received\n", lines_sent, lines_dropped, lines_received);
+    }
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char hdr[CHIRC_CAPTURE_HEADER_SIZE];
+    FILE *f;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "H:p:x:a:T:djh")) != -1)
+        switch (opt)
+        {
+        case 'H':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = atoi(optarg);
+            break;
+        case 'x':
+            opts.speed = atof(optarg);
+            break;
+        case 'a':
+            opts.nsources = atoi(optarg);
+            break;
+        case 'T':
+            opts.wait = atof(optarg);
+            break;
+        case 'd':
+            opts.dump = true;
+            break;
+        case 'j':
+            opts.json = true;
+            break;
+        case 'h':
+        default:
+            fprintf(opt == 'h' ? stdout : stderr,
+                    "Usage: chirc-replay [-H HOST] [-p PORT] [-x SPEED] [-a SOURCES] [-T SECS] [-d] [-j] FILE\n");
+            exit(opt == 'h' ? 0 : -1);
+        }
+
+    if (optind != argc - 1 || opts.speed < 0)
+    {
+        fprintf(stderr, "Usage: chirc-replay [-H HOST] [-p PORT] [-x SPEED] [-a SOURCES] [-T SECS] [-d] [-j] FILE\n");
+        exit(-1);
+    }
+
+    f = fopen(argv[optind], "rb");
+    if (!f)
+    {
+        perror(argv[optind]);
+        exit(-1);
+    }
+
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || memcmp(hdr, CHIRC_CAPTURE_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "ERROR: %s is not a chirc capture\n", argv[optind]);
+        exit(-1);
+    }
+
+    ret = opts.dump ? dump(f) : replay(f);
+    fclose(f);
+
+    return ret < 0 ? 1 : 0;
+}
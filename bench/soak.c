@@ -0,0 +1,613 @@
+/*! \file soak.c
+ *  \brief Soak test: long-running connection churn with leak detection
+ *
+ *  Keeps a server busy for a long time (minutes to hours) with a steady
+ *  stream of short client sessions. Each session connects, registers
+ *  (with the nick of its client slot, so nicks are reused every time a
+ *  slot reconnects), JOINs a channel, sends PRIVMSGs to another client
+ *  and to the channel, WHOISes another client, PINGs the server, waits
+ *  for the PONG, and QUITs. New sessions are started at a fixed rate,
+ *  with at most one session per slot at a time.
+ *
+ *  Every sampling interval the benchmark records the server's resident
+ *  memory, open descriptors and thread count (from /proc) and the sizes
+ *  of its lookup tables (scraped from the metrics endpoint, see
+ *  CHIRC_METRICS). Since the number of sessions open at any time is
+ *  bounded by the number of slots, none of these should keep growing.
+ *  After a warm-up period, a least-squares line is fitted to each
+ *  series, and the test fails (exit status 1) if the growth it projects
+ *  over the measured part of the run exceeds the limit for that series
+ *  (see -R and -G). It also fails if the server exits, or if a
+ *  reconnecting slot finds its own nick still in use, which means the
+ *  server did not forget the previous session.
+ *
+ *  Usage: chirc-bench-soak [options]
+ *
+ *      -x EXE      chirc executable to start (default: ./chirc)
+ *      -E          Use an already running server instead (see -H, -p,
+ *                  -P, -M)
+ *      -H HOST     Server address (default: 127.0.0.1)
+ *      -p PORT     Server port (default: 16667)
+ *      -P PID      Pid of the running server, for the samples (with -E)
+ *      -M PORT     Port of the server's metrics endpoint on HOST
+ *                  (default: PORT + 1000 for a server started by the
+ *                  benchmark; none with -E)
+ *      -d TIME     Duration of the run, in seconds, or with an m or h
+ *                  suffix (default: 60)
+ *      -i SECS     Sampling interval (default: 5)
+ *      -W TIME     Warm-up period, not used for the growth check
+ *                  (default: a tenth of the duration)
+ *      -c N        Number of client slots (default: 50)
+ *      -r N        Sessions started per second (default: 50)
+ *      -T SECS     Maximum duration of a session (default: 10)
+ *      -R BYTES    Maximum RSS growth over the measured period
+ *                  (default: 16 MiB)
+ *      -G N        Maximum growth of the descriptor, thread and table
+ *                  counts over the measured period (default: the number
+ *                  of slots)
+ *      -j          Print the samples and the verdict as JSON (see
+ *                  bench_json.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "bench_util.h"
+#include "bench_json.h"
+
+/* Number of channels the slots are spread over */
+#define NCHANNELS (8)
+
+/* Phases of a client slot */
+enum {
+    PHASE_IDLE = 0,
+    PHASE_REGISTERING,
+    PHASE_ACTIVE,
+    PHASE_QUITTING
+};
+
+/* Sampled series */
+enum {
+    SERIES_RSS = 0,
+    SERIES_FDS,
+    SERIES_THREADS,
+    SERIES_CONNECTIONS,
+    SERIES_SOCKETS,
+    SERIES_NICKS,
+    SERIES_USERS,
+    NSERIES
+};
+
+static const char *series_names[NSERIES] = {
+    "rss_bytes", "fds", "threads", "connections", "sockets", "nicks", "users"
+};
+
+/* Names of the tables in the chirc_table_entries metric */
+static const char *table_labels[NSERIES] = {
+    NULL, NULL, NULL, "connections", "sockets", "nicks", "users"
+};
+
+typedef struct {
+    double t;
+    double values[NSERIES];
+} sample_t;
+
+static struct {
+    const char *exe;
+    bool external;
+    const char *host;
+    int port;
+    pid_t pid;
+    int metrics_port;
+    double duration;
+    double interval;
+    double warmup;
+    int nslots;
+    double rate;
+    double session_timeout;
+    double max_rss_growth;
+    double max_count_growth;
+    bool json;
+} opts = {
+    .exe = "./chirc", .host = "127.0.0.1", .port = 16667, .metrics_port = -1,
+    .duration = 60, .interval = 5, .warmup = -1, .nslots = 50, .rate = 50,
+    .session_timeout = 10, .max_rss_growth = 16 * 1048576.0, .max_count_growth = -1
+};
+
+static bench_pool_t pool;
+static bench_conn_t *slots;
+static int next_slot = 0;
+static pid_t server_pid;
+static bool server_gone = false;
+
+static unsigned long sessions_started = 0, sessions_completed = 0, sessions_failed = 0;
+static unsigned long sessions_timed_out = 0, sessions_skipped = 0, nick_collisions = 0;
+
+static sample_t *samples;
+static int nsamples = 0, max_samples = 0;
+
+
+static double parse_time(const char *s)
+{
+    char *end;
+    double v = strtod(s, &end);
+
+    if (*end == 'm')
+        v *= 60;
+    else if (*end == 'h')
+        v *= 3600;
+    else if (*end != '\0' && *end != 's')
+        return -1;
+
+    return v;
+}
+
+static void on_connect(bench_conn_t *c, uint64_t now)
+{
+    c->phase = PHASE_REGISTERING;
+    bench_conn_send(&pool, c, "NICK sk%d", c->idx);
+    bench_conn_send(&pool, c, "USER sk%d * * :Soak test", c->idx);
+}
+
+static void quit(bench_conn_t *c)
+{
+    c->phase = PHASE_QUITTING;
+    bench_conn_send(&pool, c, "QUIT :Soak test session %lu done", sessions_started);
+}
+
+static void on_line(bench_conn_t *c, char *line, uint64_t now)
+{
+    int peer = (c->idx + 1) % opts.nslots;
+    char *cmd = line, *p;
+
+    if (*cmd == ':')
+    {
+        cmd = strchr(cmd, ' ');
+        if (!cmd)
+            return;
+        cmd++;
+    }
+
+    if (strncmp(cmd, "001 ", 4) == 0 && c->phase == PHASE_REGISTERING)
+    {
+        c->phase = PHASE_ACTIVE;
+        bench_conn_send(&pool, c, "JOIN #soak%d", c->idx % NCHANNELS);
+        bench_conn_send(&pool, c, "PRIVMSG sk%d :Hello from sk%d", peer, c->idx);
+        bench_conn_send(&pool, c, "PRIVMSG #soak%d :Hello from sk%d", c->idx % NCHANNELS, c->idx);
+        bench_conn_send(&pool, c, "WHOIS sk%d", peer);
+        bench_conn_send(&pool, c, "PING sk%d", c->idx);
+    }
+    else if (strncmp(cmd, "433 ", 4) == 0 && c->phase == PHASE_REGISTERING)
+    {
+        nick_collisions++;
+        quit(c);
+    }
+    else if (strncmp(cmd, "PONG", 4) == 0 && c->phase == PHASE_ACTIVE)
+    {
+        quit(c);
+    }
+    else if (strncmp(cmd, "PING", 4) == 0)
+    {
+        p = strchr(cmd, ' ');
+        bench_conn_send(&pool, c, "PONG%s", p ? p : "");
+    }
+}
+
+static void on_close(bench_conn_t *c, int err)
+{
+    if (c->phase == PHASE_QUITTING)
+        sessions_completed++;
+    else
+        sessions_failed++;
+    c->phase = PHASE_IDLE;
+}
+
+/* Starts a session on the next idle slot */
+static void start_session()
+{
+    for (int i = 0; i < opts.nslots; i++)
+    {
+        bench_conn_t *c = &slots[(next_slot + i) % opts.nslots];
+
+        if (c->phase == PHASE_IDLE && c->state == BENCH_CONN_CLOSED)
+        {
+            next_slot = (c->idx + 1) % opts.nslots;
+            sessions_started++;
+            if (bench_conn_open(&pool, c) < 0)
+                sessions_failed++;
+            else
+                c->phase = PHASE_REGISTERING;
+            return;
+        }
+    }
+
+    /* Every slot is busy, so the server is not keeping up */
+    sessions_skipped++;
+}
+
+/* Closes sessions that have been open for too long */
+static void expire_sessions(uint64_t now)
+{
+    for (int i = 0; i < opts.nslots; i++)
+        if (slots[i].state != BENCH_CONN_CLOSED
+            && now > slots[i].start_ns + (uint64_t) (opts.session_timeout * 1e9))
+        {
+            bench_conn_close(&pool, &slots[i]);
+            slots[i].phase = PHASE_IDLE;
+            sessions_timed_out++;
+        }
+}
+
+static bool server_exited()
+{
+    int status;
+
+    if (server_gone || server_pid <= 0)
+        return server_gone;
+
+    if (opts.external)
+        server_gone = kill(server_pid, 0) < 0 && errno == ESRCH;
+    else
+        server_gone = waitpid(server_pid, &status, WNOHANG) == server_pid;
+
+    return server_gone;
+}
+
+/* Reads the table sizes from the metrics endpoint. Sizes that could not
+ * be read are left at -1. */
+static void scrape_tables(double *values)
+{
+    static char resp[256 * 1024];
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(opts.metrics_port)};
+    struct timeval tv = {.tv_sec = 2};
+    const char *req = "GET /metrics HTTP/1.0\r\n\r\n";
+    size_t len = 0;
+    ssize_t n;
+    int fd;
+
+    for (int s = 0; s < NSERIES; s++)
+        if (table_labels[s])
+            values[s] = -1;
+
+    if (opts.metrics_port <= 0 || inet_pton(AF_INET, opts.host, &addr.sin_addr) != 1)
+        return;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+        || write(fd, req, strlen(req)) != (ssize_t) strlen(req))
+    {
+        close(fd);
+        return;
+    }
+
+    while (len < sizeof(resp) - 1 && (n = read(fd, resp + len, sizeof(resp) - 1 - len)) > 0)
+        len += n;
+    resp[len] = '\0';
+    close(fd);
+
+    for (char *line = strstr(resp, "\nchirc_table_entries{"); line;
+         line = strstr(line + 1, "\nchirc_table_entries{"))
+    {
+        char label[32];
+        long value;
+
+        if (sscanf(line, "\nchirc_table_entries{table=\"%31[^\"]\"} %ld", label, &value) != 2)
+            continue;
+        for (int s = 0; s < NSERIES; s++)
+            if (table_labels[s] && strcmp(label, table_labels[s]) == 0)
+                values[s] = value;
+    }
+}
+
+static void print_sample(sample_t *smp)
+{
+    /* The JSON document has every sample, written at the end */
+    if (!opts.json)
+    {
+        if (nsamples == 1)
+            printf("%8s %10s %10s %6s %8s %11s %8s %8s %8s\n", "t(s)", "sessions", "rss(MiB)", "fds",
+                   "threads", "connections", "sockets", "nicks", "users");
+        printf("%8.1f %10lu %10.1f %6.0f %8.0f %11.0f %8.0f %8.0f %8.0f\n", smp->t, sessions_started,
+               smp->values[SERIES_RSS] / 1048576.0, smp->values[SERIES_FDS], smp->values[SERIES_THREADS],
+               smp->values[SERIES_CONNECTIONS], smp->values[SERIES_SOCKETS], smp->values[SERIES_NICKS],
+               smp->values[SERIES_USERS]);
+    }
+    fflush(stdout);
+}
+
+static void take_sample(pid_t pid, double t)
+{
+    sample_t *smp;
+
+    if (nsamples == max_samples)
+    {
+        max_samples = max_samples ? 2 * max_samples : 256;
+        samples = realloc(samples, max_samples * sizeof(sample_t));
+    }
+
+    smp = &samples[nsamples++];
+    smp->t = t;
+    smp->values[SERIES_RSS] = pid > 0 ? (double) bench_proc_rss(pid) : -1;
+    smp->values[SERIES_FDS] = pid > 0 ? bench_proc_fds(pid) : -1;
+    smp->values[SERIES_THREADS] = pid > 0 ? bench_proc_threads(pid) : -1;
+    scrape_tables(smp->values);
+
+    print_sample(smp);
+}
+
+/* Fits a line to a series over the samples after the warm-up, and
+ * returns the growth it projects over that period. Returns false if
+ * there are not enough samples of the series. */
+static bool fit_growth(int series, double *growth)
+{
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0, t0 = -1, t1 = 0;
+
+    for (int i = 0; i < nsamples; i++)
+    {
+        double x = samples[i].t, y = samples[i].values[series];
+
+        if (x < opts.warmup || y < 0)
+            continue;
+        if (t0 < 0)
+            t0 = x;
+        t1 = x;
+        n++;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    if (n < 3 || n * sxx - sx * sx <= 0)
+        return false;
+
+    *growth = (n * sxy - sx * sy) / (n * sxx - sx * sx) * (t1 - t0);
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, ret = 0;
+    pid_t pid;
+    uint64_t start, now, next_session, next_sample;
+    char metrics_env[64];
+    char *env[] = {metrics_env, NULL};
+
+    while ((opt = getopt(argc, argv, "x:EH:p:P:M:d:i:W:c:r:T:R:G:jh")) != -1)
+        switch (opt)
+        {
+        case 'x':
+            opts.exe = optarg;
+            break;
+        case 'E':
+            opts.external = true;
+            break;
+        case 'H':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = atoi(optarg);
+            break;
+        case 'P':
+            opts.pid = atoi(optarg);
+            break;
+        case 'M':
+            opts.metrics_port = atoi(optarg);
+            break;
+        case 'd':
+            opts.duration = parse_time(optarg);
+            break;
+        case 'i':
+            opts.interval = atof(optarg);
+            break;
+        case 'W':
+            opts.warmup = parse_time(optarg);
+            break;
+        case 'c':
+            opts.nslots = atoi(optarg);
+            break;
+        case 'r':
+            opts.rate = atof(optarg);
+            break;
+        case 'T':
+            opts.session_timeout = atof(optarg);
+            break;
+        case 'R':
+            opts.max_rss_growth = atof(optarg);
+            break;
+        case 'G':
+            opts.max_count_growth = atof(optarg);
+            break;
+        case 'j':
+            opts.json = true;
+            break;
+        case 'h':
+        default:
+            fprintf(opt == 'h' ? stdout : stderr,
+                    "Usage: chirc-bench-soak [-x EXE] [-E [-H HOST] [-p PORT] [-P PID]] [-M PORT] [-d TIME] [-i SECS]\n"
+                    "                        [-W TIME] [-c SLOTS] [-r RATE] [-T SECS] [-R BYTES] [-G N] [-j]\n");
+            exit(opt == 'h' ? 0 : -1);
+        }
+
+    if (opts.duration <= 0 || opts.interval <= 0 || opts.nslots <= 1 || opts.rate <= 0
+        || opts.session_timeout <= 0 || (opts.warmup >= 0 && opts.warmup >= opts.duration))
+    {
+        fprintf(stderr, "ERROR: Invalid options\n");
+        exit(-1);
+    }
+    if (opts.warmup < 0)
+        opts.warmup = opts.duration / 10;
+    if (opts.max_count_growth < 0)
+        opts.max_count_growth = opts.nslots;
+
+    bench_raise_fd_limit(opts.nslots + 64);
+
+    pid = opts.pid;
+    if (!opts.external)
+    {
+        if (opts.metrics_port < 0)
+            opts.metrics_port = opts.port + 1000;
+        snprintf(metrics_env, sizeof(metrics_env), "CHIRC_METRICS=%d", opts.metrics_port);
+        pid = bench_spawn_server(opts.exe, opts.port, env);
+        if (pid < 0)
+        {
+            fprintf(stderr, "ERROR: Could not start %s\n", opts.exe);
+            exit(-1);
+        }
+    }
+    server_pid = pid;
+
+    if (bench_pool_init(&pool, opts.host, opts.port, 1) < 0)
+    {
+        fprintf(stderr, "ERROR: Invalid address: %s\n", opts.host);
+        exit(-1);
+    }
+    pool.on_connect = on_connect;
+    pool.on_line = on_line;
+    pool.on_close = on_close;
+
+    slots = calloc(opts.nslots, sizeof(bench_conn_t));
+    if (!slots)
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(-1);
+    }
+    for (int i = 0; i < opts.nslots; i++)
+        slots[i].idx = i;
+
+    start = next_session = next_sample = bench_now_ns();
+    while ((now = bench_now_ns()) < start + (uint64_t) (opts.duration * 1e9))
+    {
+        while (next_session <= now)
+        {
+            start_session();
+            next_session += (uint64_t) (1e9 / opts.rate);
+        }
+
+        if (next_sample <= now)
+        {
+            if (server_exited())
+                break;
+            take_sample(pid, (now - start) / 1e9);
+            next_sample += (uint64_t) (opts.interval * 1e9);
+        }
+
+        expire_sessions(now);
+        bench_pool_poll(&pool, 1);
+    }
+
+    /* Let the last sessions finish, and sample the server at rest */
+    now = bench_now_ns();
+    while (pool.open > 0 && bench_now_ns() < now + (uint64_t) (opts.session_timeout * 1e9))
+        bench_pool_poll(&pool, 10);
+    if (!server_exited())
+        take_sample(pid, (bench_now_ns() - start) / 1e9);
+
+    if (opts.json)
+    {
+        bench_json_begin("chirc-bench-soak");
+        bench_json_result("churn");
+        bench_json_param_num("duration", opts.duration);
+        bench_json_param_num("rate", opts.rate);
+        bench_json_param_int("slots", opts.nslots);
+        bench_json_metric("sessions_started", sessions_started, "sessions", BENCH_BETTER_NONE);
+        bench_json_metric("sessions_completed", sessions_completed, "sessions", BENCH_BETTER_HIGHER);
+        bench_json_metric("sessions_failed", sessions_failed, "sessions", BENCH_BETTER_LOWER);
+        bench_json_metric("sessions_timed_out", sessions_timed_out, "sessions", BENCH_BETTER_LOWER);
+        bench_json_metric("sessions_skipped", sessions_skipped, "sessions", BENCH_BETTER_LOWER);
+        bench_json_metric("nick_collisions", nick_collisions, "sessions", BENCH_BETTER_LOWER);
+    }
+    else
+        printf("Sessions: %lu started, %lu completed, %lu failed, %lu timed out, %lu skipped, %lu nick collisions\n",
+               sessions_started, sessions_completed, sessions_failed, sessions_timed_out,
+               sessions_skipped, nick_collisions);
+
+    for (int s = 0; s < NSERIES; s++)
+    {
+        double growth, limit = s == SERIES_RSS ? opts.max_rss_growth : opts.max_count_growth;
+        bool known = fit_growth(s, &growth), ok = !known || growth <= limit;
+
+        if (!ok)
+            ret = 1;
+
+        if (opts.json)
+        {
+            char name[64];
+
+            snprintf(name, sizeof(name), "growth_%s", series_names[s]);
+            bench_json_metric(name, known ? growth : NAN, s == SERIES_RSS ? "bytes" : "entries",
+                              BENCH_BETTER_LOWER);
+            snprintf(name, sizeof(name), "limit_%s", series_names[s]);
+            bench_json_metric(name, limit, s == SERIES_RSS ? "bytes" : "entries", BENCH_BETTER_NONE);
+        }
+        else if (known)
+            printf("%-12s growth %14.1f (limit %.0f)%s\n", series_names[s], growth, limit, ok ? "" : "  FAIL");
+        else
+            printf("%-12s not enough samples\n", series_names[s]);
+    }
+
+    if (server_gone)
+    {
+        fprintf(stderr, "ERROR: The server exited during the run\n");
+        ret = 1;
+    }
+    if (nick_collisions > 0)
+    {
+        fprintf(stderr, "FAIL: %lu sessions found their nick still in use\n", nick_collisions);
+        ret = 1;
+    }
+
+    if (opts.json)
+    {
+        double *series = malloc((nsamples + 1) * sizeof(double));
+
+        bench_json_metric("ok", ret == 0, "bool", BENCH_BETTER_HIGHER);
+
+        /* The samples themselves, for plotting */
+        for (int i = 0; i < nsamples; i++)
+            series[i] = samples[i].t;
+        bench_json_samples("series.t", series, nsamples);
+        for (int s = 0; s < NSERIES; s++)
+        {
+            char path[64];
+
+            for (int i = 0; i < nsamples; i++)
+                series[i] = samples[i].values[s];
+            snprintf(path, sizeof(path), "series.%s", series_names[s]);
+            bench_json_samples(path, series, nsamples);
+        }
+        free(series);
+
+        bench_json_end();
+    }
+    else
+        printf("%s\n", ret == 0 ? "PASS" : "FAIL");
+
+    for (int i = 0; i < opts.nslots; i++)
+        bench_conn_close(&pool, &slots[i]);
+    close(pool.epfd);
+    free(slots);
+    free(samples);
+
+    if (!opts.external && !server_gone)
+        bench_stop_server(pid);
+
+    return ret;
+}
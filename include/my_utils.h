@@ -8,10 +8,11 @@
 #include "uthash.h"
 #include "log.h"
 #include "chirc.h"
+#include "message.h"
 
-pthread_mutex_t user_node_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t connection_node_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t sockfd_nick_node_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t user_node_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t connection_node_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sockfd_nick_node_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct user_node
 {
@@ -37,55 +38,63 @@ typedef struct sockfd_nick_map
     UT_hash_handle hh;
 }sockfd_nick_map_t;
 
-void add_user_node(user_node_t* head, user_node_t* node)
+static void free_node_msg(chirc_message_t *msg)
+{
+    if(NULL != msg)
+    {
+        chirc_message_free(msg);
+        free(msg);
+    }
+}
+
+/* Appends a node to a list, which may be empty */
+static void add_user_node(user_node_t** head, user_node_t* node)
 {
     pthread_mutex_lock(&user_node_mutex);
 
-    while (head != NULL && head->next != NULL)
+    user_node_t **tail = head;
+    while (*tail != NULL)
     {
-        head = head->next;
+        tail = &(*tail)->next;
     }
 
-    head->next = node;
+    node->next = NULL;
+    *tail = node;
 
     pthread_mutex_unlock(&user_node_mutex);
 }
 
-void del_user_node(user_node_t* head, char *name)
+/* Unlinks and frees the node with the given name. Returns 1 if there
+ * was one, and 0 otherwise */
+static int del_user_node(user_node_t** head, char *name)
 {
     pthread_mutex_lock(&user_node_mutex);
     int len = strlen(name);
-    user_node_t *prev = NULL;
+    user_node_t **link = head;
+    int found = 0;
 
-    while (head != NULL)
+    while (*link != NULL)
     {
-        if(strlen(head->name) == len)
+        user_node_t *node = *link;
+        if(strlen(node->name) == len && 0 == strncmp(node->name, name, len))
         {
-            if(0 == strncmp(head->name, name, len))
-            {
-                if(NULL != prev)
-                {
-                    prev->next = head->next;
-                    free(head);
-                    break;
-                }
-                else
-                {
-                    free(head);
-                    break;
-                }
-            }
+            *link = node->next;
+            free_node_msg(node->msg);
+            free(node);
+            found = 1;
+            break;
         }
 
-        prev = head;
-        head = head->next;
+        link = &node->next;
     }
 
     pthread_mutex_unlock(&user_node_mutex);
+
+    return found;
 }
 
 
-user_node_t* find_user_node(user_node_t* head, char *name)
+static user_node_t* find_user_node(user_node_t* head, char *name)
 {
     pthread_mutex_lock(&user_node_mutex);
 
@@ -110,7 +119,7 @@ user_node_t* find_user_node(user_node_t* head, char *name)
     return node;
 }
 
-user_node_t* fuzzy_find_user_node(user_node_t* head, char *name)
+static user_node_t* fuzzy_find_user_node(user_node_t* head, char *name)
 {
     int len = strlen(name);
     user_node_t *node = NULL;
@@ -144,7 +153,7 @@ user_node_t* fuzzy_find_user_node(user_node_t* head, char *name)
     return node;
 }
 
-user_node_t* get_least_user_node(user_node_t* head)
+static user_node_t* get_least_user_node(user_node_t* head)
 {
     pthread_mutex_lock(&user_node_mutex);
 
@@ -158,7 +167,7 @@ user_node_t* get_least_user_node(user_node_t* head)
     return head;
 }
 
-void print_user_node(user_node_t* head)
+static void print_user_node(user_node_t* head)
 {
     while(NULL != head)
     {
@@ -167,7 +176,7 @@ void print_user_node(user_node_t* head)
     }
 }
 
-void free_user_node(user_node_t* node)
+static void free_user_node(user_node_t* node)
 {
     if(NULL == node)
     {
@@ -176,10 +185,11 @@ void free_user_node(user_node_t* node)
 
     free_user_node(node->next);
 
+    free_node_msg(node->msg);
     free(node);
 }
 
-void add_connection_map_node(connection_map_t** connection_hash, connection_map_t* node)
+static void add_connection_map_node(connection_map_t** connection_hash, connection_map_t* node)
 {
     pthread_mutex_lock(&connection_node_mutex);
 
@@ -188,7 +198,7 @@ void add_connection_map_node(connection_map_t** connection_hash, connection_map_
     pthread_mutex_unlock(&connection_node_mutex);
 }
 
-connection_map_t* find_connection_map_node(connection_map_t* connection_hash, char* name)
+static connection_map_t* find_connection_map_node(connection_map_t* connection_hash, char* name)
 {
     pthread_mutex_lock(&connection_node_mutex);
 
@@ -200,25 +210,31 @@ connection_map_t* find_connection_map_node(connection_map_t* connection_hash, ch
     return node;
 }
 
-void del_connection_map_node(connection_map_t** connection_hash, connection_map_t* node)
+static void del_connection_map_node(connection_map_t** connection_hash, connection_map_t* node)
 {
+    if(NULL == node) return;
+
     pthread_mutex_lock(&connection_node_mutex);
 
     HASH_DEL(*connection_hash, node);
+    free_node_msg(node->msg);
+    free(node);
 
     pthread_mutex_unlock(&connection_node_mutex);
 }
 
-void free_connection_map_node(connection_map_t** connection_hash)
+static void free_connection_map_node(connection_map_t** connection_hash)
 {
     connection_map_t* node = NULL, *tmp = NULL;
     HASH_ITER(hh, *connection_hash, node, tmp) 
     {
-        HASH_DEL(*connection_hash, node);  
+        HASH_DEL(*connection_hash, node);
+        free_node_msg(node->msg);
+        free(node);
     }
 }
 
-void print_connection_map_node(connection_map_t* connection_hash)
+static void print_connection_map_node(connection_map_t* connection_hash)
 {
     connection_map_t* node = NULL, *tmp = NULL;
     HASH_ITER(hh, connection_hash, node, tmp) 
@@ -227,7 +243,7 @@ void print_connection_map_node(connection_map_t* connection_hash)
     }   
 }
 
-int get_connection_map_node_size(connection_map_t* connection_hash)
+static int get_connection_map_node_size(connection_map_t* connection_hash)
 {
     connection_map_t* node = NULL, *tmp = NULL;
     int size = 0;
@@ -240,7 +256,7 @@ int get_connection_map_node_size(connection_map_t* connection_hash)
 }
 
 
-void add_sockfd_nick_map_node(sockfd_nick_map_t** sockfd_nick_hash, sockfd_nick_map_t* node)
+static void add_sockfd_nick_map_node(sockfd_nick_map_t** sockfd_nick_hash, sockfd_nick_map_t* node)
 {
     pthread_mutex_lock(&sockfd_nick_node_mutex);
 
@@ -249,7 +265,7 @@ void add_sockfd_nick_map_node(sockfd_nick_map_t** sockfd_nick_hash, sockfd_nick_
     pthread_mutex_unlock(&sockfd_nick_node_mutex);
 }
 
-sockfd_nick_map_t* find_sockfd_nick_map_node(sockfd_nick_map_t* sockfd_nick_hash, int fd)
+static sockfd_nick_map_t* find_sockfd_nick_map_node(sockfd_nick_map_t* sockfd_nick_hash, int fd)
 {
     pthread_mutex_lock(&sockfd_nick_node_mutex);
 
@@ -261,7 +277,7 @@ sockfd_nick_map_t* find_sockfd_nick_map_node(sockfd_nick_map_t* sockfd_nick_hash
     return node;
 }
 
-void del_sockfd_nick_map_node(sockfd_nick_map_t** sockfd_nick_hash, sockfd_nick_map_t* node)
+static void del_sockfd_nick_map_node(sockfd_nick_map_t** sockfd_nick_hash, sockfd_nick_map_t* node)
 {
     if(NULL == node) return;
 
@@ -273,16 +289,17 @@ void del_sockfd_nick_map_node(sockfd_nick_map_t** sockfd_nick_hash, sockfd_nick_
     pthread_mutex_unlock(&sockfd_nick_node_mutex);
 }
 
-void free_sockfd_nick_map_node(sockfd_nick_map_t** sockfd_nick_hash)
+static void free_sockfd_nick_map_node(sockfd_nick_map_t** sockfd_nick_hash)
 {
     sockfd_nick_map_t* node = NULL, *tmp = NULL;
     HASH_ITER(hh, *sockfd_nick_hash, node, tmp) 
     {
-        HASH_DEL(*sockfd_nick_hash, node);  
+        HASH_DEL(*sockfd_nick_hash, node);
+        free(node);
     }
 }
 
-void print_sockfd_nick_map_node(sockfd_nick_map_t* sockfd_nick_hash)
+static void print_sockfd_nick_map_node(sockfd_nick_map_t* sockfd_nick_hash)
 {
     sockfd_nick_map_t* node = NULL, *tmp = NULL;
     HASH_ITER(hh, sockfd_nick_hash, node, tmp) 
@@ -291,7 +308,7 @@ void print_sockfd_nick_map_node(sockfd_nick_map_t* sockfd_nick_hash)
     }   
 }
 
-int get_sockfd_nick_map_node_size(sockfd_nick_map_t* sockfd_nick_hash)
+static int get_sockfd_nick_map_node_size(sockfd_nick_map_t* sockfd_nick_hash)
 {
     sockfd_nick_map_t* node = NULL, *tmp = NULL;
     int size = 0;
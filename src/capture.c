@@ -0,0 +1,151 @@
+/* See capture.h for details about the functions in this module */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "capture.h"
+#include "varint.h"
+#include "log.h"
+#include "chirc.h"
+
+/* Size of the stdio buffer of the capture file */
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+
+/* Checked without the lock, so disabled captures cost one load */
+static atomic_bool capturing = false;
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file = NULL;
+static char *capture_buf = NULL;
+static uint64_t last_us = 0;
+
+
+static uint64_t monotonic_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void write_record(chirc_capture_type_t type, unsigned long conn_id, const char *line, size_t len)
+{
+    unsigned char hdr[1 + 3 * VARINT_MAX];
+    size_t n = 0;
+    uint64_t now;
+
+    pthread_mutex_lock(&capture_lock);
+
+    if (!capture_file)
+    {
+        pthread_mutex_unlock(&capture_lock);
+        return;
+    }
+
+    /* Reading the clock under the lock keeps the records in order */
+    now = monotonic_us();
+    if (now < last_us)
+        now = last_us;
+
+    hdr[n++] = (unsigned char) type;
+    n += varint_encode(hdr + n, now - last_us);
+    n += varint_encode(hdr + n, conn_id);
+    if (type == CHIRC_CAPTURE_LINE)
+        n += varint_encode(hdr + n, len);
+
+    fwrite(hdr, 1, n, capture_file);
+    if (type == CHIRC_CAPTURE_LINE)
+        fwrite(line, 1, len, capture_file);
+
+    last_us = now;
+
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/* See capture.h */
+int chirc_capture_start(const char *path)
+{
+    unsigned char hdr[CHIRC_CAPTURE_HEADER_SIZE];
+    struct timeval tv;
+    uint64_t start_ms;
+
+    pthread_mutex_lock(&capture_lock);
+
+    if (capture_file)
+        goto _error;
+
+    capture_file = fopen(path, "wb");
+    if (!capture_file)
+    {
+        chilog(ERROR, "Could not open capture file %s", path);
+        goto _error;
+    }
+
+    capture_buf = malloc(CAPTURE_BUFFER_SIZE);
+    if (capture_buf)
+        setvbuf(capture_file, capture_buf, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    gettimeofday(&tv, NULL);
+    start_ms = (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    memcpy(hdr, CHIRC_CAPTURE_MAGIC, 8);
+    for (int i = 0; i < 8; i++)
+        hdr[8 + i] = (unsigned char) (start_ms >> (8 * i));
+    fwrite(hdr, 1, sizeof(hdr), capture_file);
+
+    last_us = monotonic_us();
+    atomic_store(&capturing, true);
+
+    pthread_mutex_unlock(&capture_lock);
+
+    return CHIRC_OK;
+
+_error:
+    pthread_mutex_unlock(&capture_lock);
+    return CHIRC_FAIL;
+}
+
+/* See capture.h */
+void chirc_capture_stop(void)
+{
+    pthread_mutex_lock(&capture_lock);
+
+    atomic_store(&capturing, false);
+    if (capture_file)
+    {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    free(capture_buf);
+    capture_buf = NULL;
+
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/* See capture.h */
+void chirc_capture_conn_open(unsigned long conn_id)
+{
+    if (atomic_load_explicit(&capturing, memory_order_relaxed))
+        write_record(CHIRC_CAPTURE_OPEN, conn_id, NULL, 0);
+}
+
+/* See capture.h */
+void chirc_capture_line(unsigned long conn_id, const char *line, size_t len)
+{
+    if (atomic_load_explicit(&capturing, memory_order_relaxed))
+        write_record(CHIRC_CAPTURE_LINE, conn_id, line, len);
+}
+
+/* See capture.h */
+void chirc_capture_conn_close(unsigned long conn_id)
+{
+    if (atomic_load_explicit(&capturing, memory_order_relaxed))
+        write_record(CHIRC_CAPTURE_CLOSE, conn_id, NULL, 0);
+}
@@ -0,0 +1,85 @@
+/*! \file capture.h
+ *  \brief Traffic capture
+ *
+ *  When enabled, every line received from a client is recorded,
+ *  together with the id of its connection and a monotonic timestamp,
+ *  so the workload can be replayed later against any build (see the
+ *  chirc-replay tool). Connection opens and closes are recorded too,
+ *  so reconnect storms replay as such.
+ *
+ *  Capturing is off unless chirc_capture_start is called; while it is
+ *  off, the recording functions return right away. While it is on,
+ *  records are appended to a buffered file under a mutex, which keeps
+ *  them in timestamp order. The buffer is flushed by
+ *  chirc_capture_stop, so a server that is killed with SIGKILL can
+ *  lose the last few KB of the capture.
+ *
+ *  File format (all multi-byte fixed-size fields are little-endian):
+ *
+ *      File header:  "CHIRCCP1" (8 bytes)
+ *                    start time, ms since the epoch (8 bytes)
+ *
+ *      Record:       type (1 byte)
+ *                    varint microseconds since the previous record
+ *                    (or since the start, for the first record)
+ *                    varint connection id
+ *                    for CHIRC_CAPTURE_LINE only: varint length,
+ *                    followed by the line (without the CRLF)
+ *
+ *  Varints are encoded as described in varint.h.
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stddef.h>
+
+/*! Magic bytes at the start of a capture file */
+#define CHIRC_CAPTURE_MAGIC "CHIRCCP1"
+
+/*! Size of the file header */
+#define CHIRC_CAPTURE_HEADER_SIZE (16)
+
+/*! \brief Record types */
+typedef enum {
+    /*! A client connected */
+    CHIRC_CAPTURE_OPEN  = 0x01,
+    /*! A client sent a line */
+    CHIRC_CAPTURE_LINE  = 0x02,
+    /*! A connection was closed (by either side) */
+    CHIRC_CAPTURE_CLOSE = 0x03
+} chirc_capture_type_t;
+
+/*! \brief Starts capturing traffic
+ *
+ * The file is truncated if it already exists.
+ *
+ * \param path Path of the capture file
+ * \return 0 on success, non-zero on failure
+ */
+int chirc_capture_start(const char *path);
+
+/*! \brief Stops capturing traffic, and flushes and closes the file */
+void chirc_capture_stop(void);
+
+/*! \brief Records a new connection
+ *
+ * \param conn_id Connection id
+ */
+void chirc_capture_conn_open(unsigned long conn_id);
+
+/*! \brief Records a line received on a connection
+ *
+ * \param conn_id Connection id
+ * \param line Line (does not need to be NUL-terminated)
+ * \param len Length of the line, without the CRLF
+ */
+void chirc_capture_line(unsigned long conn_id, const char *line, size_t len);
+
+/*! \brief Records that a connection was closed
+ *
+ * \param conn_id Connection id
+ */
+void chirc_capture_conn_close(unsigned long conn_id);
+
+#endif /* CAPTURE_H_ */
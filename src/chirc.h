@@ -28,6 +28,8 @@
 #include <stdbool.h>
 #include <pthread.h>
 
+#include "coro.h"
+
 /*! Maximum size of an IRC message */
 #define MSG_MAX (512)
 
@@ -51,6 +53,7 @@
 
 /* Forward declarations */
 typedef struct chirc_connection chirc_connection_t;
+typedef struct chirc_transport chirc_transport_t;
 typedef struct chirc_channeluser chirc_channeluser_t;
 
 /*! \struct chirc_message_t
@@ -251,9 +254,42 @@ typedef struct chirc_connection
     /*! \brief Peer's port */
     sds port;
 
-    /*! \brief Socket for the connection */
+    /*! \brief Socket for the connection
+     *
+     * Connections that are not backed by a socket (see duplex.h) get
+     * a unique negative number instead, so this can always be used to
+     * identify the connection. */
     int socket;
 
+    /*! \brief How bytes are moved to and from the peer (see connection.h) */
+    const chirc_transport_t *transport;
+
+    /*! \brief Transport-specific state (e.g., the chirc_duplex_t) */
+    void *transport_data;
+
+    /*! \brief Called when the connection may have become readable
+     *
+     * See chirc_connection_set_ready and chirc_connection_arm. */
+    void (*ready)(struct chirc_connection *conn, void *arg);
+
+    /*! \brief Argument for the ready function */
+    void *ready_arg;
+
+    /*! \brief Bytes waiting to be written (see mailbox.h)
+     *
+     * Set by whoever serves the connection (e.g., the server, when the
+     * connection is accepted or injected). */
+    struct chirc_mailbox *mailbox;
+
+    /*! \brief Where the command handler running on this connection
+     *         left off (see handlers.h) */
+    chirc_coro_t handler;
+
+    /*! \brief Command whose handler is waiting for I/O, if any
+     *
+     * The commands that came after it wait for it to be done. */
+    struct chirc_handler_wait *waiting;
+
     /*! \brief uthash handle
      *
      * Used by the connections hash table in chirc_ctx_t */
@@ -0,0 +1,299 @@
+/* See cmdstats.h for details about the functions in this module */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "cmdstats.h"
+#include "log.h"
+
+/* Command names, in the same order as chirc_cmd_t */
+static const char *cmd_names[CHIRC_CMD_COUNT] = {
+    "PASS", "SERVER", "NICK", "USER", "QUIT", "PRIVMSG", "NOTICE",
+    "PING", "PONG", "MOTD", "LUSERS", "WHOIS", "JOIN", "PART",
+    "TOPIC", "MODE", "NAMES", "LIST", "WHO", "AWAY", "OPER",
+    "CONNECT", "UNKNOWN"
+};
+
+/* A histogram that is written by one thread and read by others */
+typedef struct
+{
+    _Atomic uint64_t counts[CHIRC_HIST_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+} shard_hist_t;
+
+/* Per-thread statistics. Histograms are only allocated for commands
+ * the thread has actually processed. Like the log rings, shards are
+ * released when their thread exits and reused by new threads, so
+ * their counts are never lost. */
+typedef struct cmd_shard
+{
+    atomic_bool in_use;
+    struct
+    {
+        _Atomic uint64_t calls;
+        _Atomic uint64_t errors;
+        _Atomic(shard_hist_t *) hist;
+    } cmds[CHIRC_CMD_COUNT];
+    struct cmd_shard *next;
+} cmd_shard_t;
+
+static _Atomic(cmd_shard_t *) shards = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread cmd_shard_t *thread_shard = NULL;
+
+
+/* Only the owner of a counter writes to it, so there is no need for
+ * an atomic read-modify-write (the atomics are there for readers) */
+static inline void add(_Atomic uint64_t *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline int bucket_index(uint64_t v)
+{
+    int e, sub;
+
+    if (v < 16)
+        return (int) v;
+
+    e = 63 - __builtin_clzll(v);
+    if (e > 39)
+        return CHIRC_HIST_BUCKETS - 1;
+
+    sub = (int) ((v >> (e - CHIRC_HIST_SUB_BITS)) & ((1 << CHIRC_HIST_SUB_BITS) - 1));
+
+    return 16 + (e - 4) * (1 << CHIRC_HIST_SUB_BITS) + sub;
+}
+
+/* Largest value that falls in a bucket */
+static uint64_t bucket_upper(int b)
+{
+    int e, sub;
+
+    if (b < 16)
+        return b;
+
+    e = 4 + (b - 16) / (1 << CHIRC_HIST_SUB_BITS);
+    sub = (b - 16) % (1 << CHIRC_HIST_SUB_BITS);
+
+    return (((uint64_t) ((1 << CHIRC_HIST_SUB_BITS) + sub + 1)) << (e - CHIRC_HIST_SUB_BITS)) - 1;
+}
+
+static void release_shard(void *arg)
+{
+    cmd_shard_t *shard = arg;
+
+    atomic_store_explicit(&shard->in_use, false, memory_order_release);
+}
+
+static void create_shard_key()
+{
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static cmd_shard_t *get_shard()
+{
+    cmd_shard_t *shard;
+
+    if (thread_shard)
+        return thread_shard;
+
+    pthread_once(&shard_key_once, create_shard_key);
+
+    for (shard = atomic_load(&shards); shard != NULL; shard = shard->next)
+    {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&shard->in_use, &expected, true))
+            break;
+    }
+
+    if (!shard)
+    {
+        shard = calloc(1, sizeof(cmd_shard_t));
+        if (!shard)
+            return NULL;
+        atomic_init(&shard->in_use, true);
+
+        shard->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &shard->next, shard))
+            ;
+    }
+
+    pthread_setspecific(shard_key, shard);
+    thread_shard = shard;
+
+    return shard;
+}
+
+
+/* See cmdstats.h */
+chirc_cmd_t chirc_cmdstats_lookup(const char *cmd)
+{
+    for (int i = 0; i < CHIRC_CMD_UNKNOWN; i++)
+        if (strcmp(cmd, cmd_names[i]) == 0)
+            return (chirc_cmd_t) i;
+
+    return CHIRC_CMD_UNKNOWN;
+}
+
+/* See cmdstats.h */
+const char *chirc_cmdstats_name(chirc_cmd_t cmd)
+{
+    if (cmd < 0 || cmd >= CHIRC_CMD_COUNT)
+        return cmd_names[CHIRC_CMD_UNKNOWN];
+
+    return cmd_names[cmd];
+}
+
+/* See cmdstats.h */
+uint64_t chirc_cmdstats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* See cmdstats.h */
+void chirc_cmdstats_record(chirc_cmd_t cmd, uint64_t start_ns, bool error)
+{
+    cmd_shard_t *shard = get_shard();
+    shard_hist_t *hist;
+    uint64_t elapsed = chirc_cmdstats_now() - start_ns;
+
+    if (!shard)
+        return;
+
+    if (cmd < 0 || cmd >= CHIRC_CMD_COUNT)
+        cmd = CHIRC_CMD_UNKNOWN;
+
+    add(&shard->cmds[cmd].calls, 1);
+    if (error)
+        add(&shard->cmds[cmd].errors, 1);
+
+    hist = atomic_load_explicit(&shard->cmds[cmd].hist, memory_order_relaxed);
+    if (!hist)
+    {
+        hist = calloc(1, sizeof(shard_hist_t));
+        if (!hist)
+            return;
+        atomic_store_explicit(&shard->cmds[cmd].hist, hist, memory_order_release);
+    }
+
+    add(&hist->counts[bucket_index(elapsed)], 1);
+    add(&hist->total, 1);
+    add(&hist->sum_ns, elapsed);
+    if (elapsed > atomic_load_explicit(&hist->max_ns, memory_order_relaxed))
+        atomic_store_explicit(&hist->max_ns, elapsed, memory_order_relaxed);
+}
+
+/* See cmdstats.h */
+void chirc_cmdstats_snapshot(chirc_cmdstats_t *stats)
+{
+    memset(stats, 0, sizeof(chirc_cmdstats_t));
+
+    for (cmd_shard_t *shard = atomic_load(&shards); shard != NULL; shard = shard->next)
+    {
+        for (int c = 0; c < CHIRC_CMD_COUNT; c++)
+        {
+            chirc_cmdstat_t *out = &stats->cmds[c];
+            shard_hist_t *hist = atomic_load_explicit(&shard->cmds[c].hist, memory_order_acquire);
+            uint64_t max_ns;
+
+            out->calls += atomic_load_explicit(&shard->cmds[c].calls, memory_order_relaxed);
+            out->errors += atomic_load_explicit(&shard->cmds[c].errors, memory_order_relaxed);
+
+            if (!hist)
+                continue;
+
+            for (int b = 0; b < CHIRC_HIST_BUCKETS; b++)
+                out->latency.counts[b] += atomic_load_explicit(&hist->counts[b], memory_order_relaxed);
+            out->latency.total += atomic_load_explicit(&hist->total, memory_order_relaxed);
+            out->latency.sum_ns += atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+            max_ns = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+            if (max_ns > out->latency.max_ns)
+                out->latency.max_ns = max_ns;
+        }
+    }
+}
+
+/* See cmdstats.h */
+void chirc_histogram_add(chirc_histogram_t *hist, uint64_t value_ns)
+{
+    hist->counts[bucket_index(value_ns)]++;
+    hist->total++;
+    hist->sum_ns += value_ns;
+    if (value_ns > hist->max_ns)
+        hist->max_ns = value_ns;
+}
+
+/* See cmdstats.h */
+uint64_t chirc_histogram_quantile(const chirc_histogram_t *hist, double q)
+{
+    uint64_t total = 0, rank, seen = 0;
+
+    /* We add up the buckets instead of trusting hist->total, because
+     * a snapshot can catch a shard between updating the two */
+    for (int b = 0; b < CHIRC_HIST_BUCKETS; b++)
+        total += hist->counts[b];
+
+    if (total == 0)
+        return 0;
+
+    rank = (uint64_t) (q * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    for (int b = 0; b < CHIRC_HIST_BUCKETS; b++)
+    {
+        seen += hist->counts[b];
+        if (seen >= rank)
+        {
+            uint64_t upper = bucket_upper(b);
+            return (hist->max_ns && upper > hist->max_ns) ? hist->max_ns : upper;
+        }
+    }
+
+    return hist->max_ns;
+}
+
+/* See cmdstats.h */
+void chirc_cmdstats_log(void)
+{
+    chirc_cmdstats_t *stats;
+
+    if (!chilog_enabled(INFO))
+        return;
+
+    stats = malloc(sizeof(chirc_cmdstats_t));
+    if (!stats)
+        return;
+
+    chirc_cmdstats_snapshot(stats);
+
+    for (int c = 0; c < CHIRC_CMD_COUNT; c++)
+    {
+        chirc_cmdstat_t *s = &stats->cmds[c];
+
+        if (s->calls == 0)
+            continue;
+
+        chilog(INFO, "%-8s calls=%llu errors=%llu p50=%lluus p99=%lluus max=%lluus",
+               cmd_names[c], (unsigned long long) s->calls, (unsigned long long) s->errors,
+               (unsigned long long) chirc_histogram_quantile(&s->latency, 0.50) / 1000,
+               (unsigned long long) chirc_histogram_quantile(&s->latency, 0.99) / 1000,
+               (unsigned long long) s->latency.max_ns / 1000);
+    }
+
+    free(stats);
+}
@@ -0,0 +1,135 @@
+/*! \file cmdstats.h
+ *  \brief Per-command latency histograms and counters
+ *
+ *  For every command the server processes, we record how long it took
+ *  (from the moment the line was parsed to the moment its output was
+ *  handed to the socket) and whether it resulted in an error.
+ *
+ *  Latencies are kept in HDR-style histograms: values are bucketed with
+ *  a fixed relative precision (eight buckets per power of two, so any
+ *  value is within 12.5% of its bucket's bounds), which covers
+ *  nanoseconds to minutes in a few hundred buckets.
+ *
+ *  To keep recording cheap, each thread records into its own shard
+ *  (no locks and no atomic read-modify-write operations). Readers call
+ *  chirc_cmdstats_snapshot, which merges all the shards.
+ */
+
+#ifndef CMDSTATS_H_
+#define CMDSTATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*! Number of sub-buckets per power of two (as a power of two) */
+#define CHIRC_HIST_SUB_BITS (3)
+
+/*! Number of buckets in a histogram */
+#define CHIRC_HIST_BUCKETS (16 + 36 * (1 << CHIRC_HIST_SUB_BITS))
+
+/*! \brief Commands we keep statistics for
+ *
+ * Anything else is counted as CHIRC_CMD_UNKNOWN.
+ */
+typedef enum {
+    CHIRC_CMD_PASS = 0,
+    CHIRC_CMD_SERVER,
+    CHIRC_CMD_NICK,
+    CHIRC_CMD_USER,
+    CHIRC_CMD_QUIT,
+    CHIRC_CMD_PRIVMSG,
+    CHIRC_CMD_NOTICE,
+    CHIRC_CMD_PING,
+    CHIRC_CMD_PONG,
+    CHIRC_CMD_MOTD,
+    CHIRC_CMD_LUSERS,
+    CHIRC_CMD_WHOIS,
+    CHIRC_CMD_JOIN,
+    CHIRC_CMD_PART,
+    CHIRC_CMD_TOPIC,
+    CHIRC_CMD_MODE,
+    CHIRC_CMD_NAMES,
+    CHIRC_CMD_LIST,
+    CHIRC_CMD_WHO,
+    CHIRC_CMD_AWAY,
+    CHIRC_CMD_OPER,
+    CHIRC_CMD_CONNECT,
+    CHIRC_CMD_UNKNOWN,
+    CHIRC_CMD_COUNT
+} chirc_cmd_t;
+
+/*! \brief A latency histogram (values in nanoseconds) */
+typedef struct {
+    uint64_t counts[CHIRC_HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} chirc_histogram_t;
+
+/*! \brief Statistics for a single command */
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    chirc_histogram_t latency;
+} chirc_cmdstat_t;
+
+/*! \brief Merged statistics for all commands */
+typedef struct {
+    chirc_cmdstat_t cmds[CHIRC_CMD_COUNT];
+} chirc_cmdstats_t;
+
+/*! \brief Maps a command name to a chirc_cmd_t
+ *
+ * \param cmd Command name (in uppercase, as produced by the parser)
+ * \return The command, or CHIRC_CMD_UNKNOWN
+ */
+chirc_cmd_t chirc_cmdstats_lookup(const char *cmd);
+
+/*! \brief Returns the name of a command
+ *
+ * \param cmd Command
+ * \return Command name (e.g., "PRIVMSG"), or "UNKNOWN"
+ */
+const char *chirc_cmdstats_name(chirc_cmd_t cmd);
+
+/*! \brief Returns a monotonic timestamp, in nanoseconds
+ *
+ * Use this to take the start time passed to chirc_cmdstats_record.
+ */
+uint64_t chirc_cmdstats_now(void);
+
+/*! \brief Records one processed command
+ *
+ * \param cmd Command
+ * \param start_ns When processing started (see chirc_cmdstats_now)
+ * \param error Whether the command resulted in an error
+ */
+void chirc_cmdstats_record(chirc_cmd_t cmd, uint64_t start_ns, bool error);
+
+/*! \brief Merges the statistics of all the threads
+ *
+ * \param stats (Output parameter) Merged statistics. Must point to
+ *              allocated memory.
+ */
+void chirc_cmdstats_snapshot(chirc_cmdstats_t *stats);
+
+/*! \brief Adds a value to a histogram
+ *
+ * \param hist Histogram
+ * \param value_ns Value
+ */
+void chirc_histogram_add(chirc_histogram_t *hist, uint64_t value_ns);
+
+/*! \brief Estimates a quantile of a histogram
+ *
+ * \param hist Histogram
+ * \param q Quantile (between 0 and 1)
+ * \return The upper bound of the bucket containing the quantile,
+ *         in nanoseconds (0 if the histogram is empty)
+ */
+uint64_t chirc_histogram_quantile(const chirc_histogram_t *hist, double q);
+
+/*! \brief Logs a summary of the statistics (one line per command used) */
+void chirc_cmdstats_log(void);
+
+#endif /* CMDSTATS_H_ */
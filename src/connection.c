@@ -5,7 +5,10 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "ctx.h"
 #include "connection.h"
@@ -14,15 +17,95 @@
 #include "handlers.h"
 #include "chirc.h"
 #include "log.h"
+#include "poller.h"
+#include "mailbox.h"
+#include "metrics.h"
+
+/* Socket numbers of connections that are not backed by a socket */
+static atomic_int next_virtual_socket = ATOMIC_VAR_INIT(-1);
+
+/* Connection owned by the current thread (see chirc_connection_own) */
+static __thread chirc_connection_t *owned = NULL;
+
+
+static ssize_t socket_read(chirc_connection_t *conn, void *buf, size_t len)
+{
+    return recv(conn->socket, buf, len, MSG_DONTWAIT);
+}
+
+static ssize_t socket_writev(chirc_connection_t *conn, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {.msg_iov = (struct iovec *) iov, .msg_iovlen = iovcnt};
+
+    /* A client that disconnected must not kill the process (which may
+     * not be ours to set SIGPIPE for); the write fails with EPIPE */
+    return sendmsg(conn->socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void socket_close(chirc_connection_t *conn)
+{
+    close(conn->socket);
+}
+
+static void socket_shutdown(chirc_connection_t *conn)
+{
+    shutdown(conn->socket, SHUT_RDWR);
+}
+
+/* See connection.h */
+const chirc_transport_t chirc_socket_transport = {
+    .name = "socket",
+    .read = socket_read,
+    .writev = socket_writev,
+    .close = socket_close,
+    .shutdown = socket_shutdown,
+    .arm = chirc_poller_arm
+};
+
 
 /* See connection.h */
 void chirc_connection_init(chirc_connection_t *conn)
 {
     conn->type = CONN_TYPE_UNKNOWN;
+    conn->peer.user = NULL;
 
     conn->hostname = NULL;
     conn->port = 0;
 
+    conn->socket = -1;
+    conn->transport = &chirc_socket_transport;
+    conn->transport_data = NULL;
+
+    conn->ready = NULL;
+    conn->ready_arg = NULL;
+    conn->mailbox = NULL;
+
+    conn->handler = (chirc_coro_t) CHIRC_CORO_INIT;
+    conn->waiting = NULL;
+}
+
+
+/* See connection.h */
+void chirc_connection_init_socket(chirc_connection_t *conn, int fd)
+{
+    int one = 1;
+
+    chirc_connection_init(conn);
+
+    conn->socket = fd;
+    /* Fails (harmlessly) if the socket is not a TCP one */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+
+/* See connection.h */
+void chirc_connection_init_duplex(chirc_connection_t *conn, chirc_duplex_t *duplex)
+{
+    chirc_connection_init(conn);
+
+    conn->socket = atomic_fetch_sub(&next_virtual_socket, 1);
+    conn->transport = &chirc_duplex_transport;
+    conn->transport_data = duplex;
 }
 
 
@@ -35,18 +118,158 @@ void chirc_connection_free(chirc_connection_t *conn)
 
 
 /* See connection.h */
-int chirc_connection_send_message(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg)
+ssize_t chirc_connection_read(chirc_connection_t *conn, void *buf, size_t len)
 {
-    /* Your code here */
-    return CHIRC_OK;
+    ssize_t n;
+
+    do
+    {
+        n = conn->transport->read(conn, buf, len);
+    } while (n < 0 && errno == EINTR);
+
+    return n;
+}
+
+
+/* Checks whether a line (with or without a prefix) is a command */
+static bool line_is(const char *line, size_t len, const char *cmd)
+{
+    const char *end = line + len, *space;
+    size_t cmdlen = strlen(cmd);
+
+    if (len > 0 && line[0] == ':')
+    {
+        space = memchr(line, ' ', len);
+        if (!space)
+            return false;
+        line = space + 1;
+    }
+
+    return (size_t) (end - line) > cmdlen && memcmp(line, cmd, cmdlen) == 0 && line[cmdlen] == ' ';
 }
 
+/* Priority of what is sent to a connection (see mailbox.h). What the
+ * connection's owner sends it is a reply to its own commands (a PONG
+ * too, so that a PING still tells a client that its earlier commands
+ * have been answered); anything else was sent by another client. */
+static chirc_prio_t send_prio(chirc_connection_t *conn, const char *line, size_t len)
+{
+    if (conn->type == CONN_TYPE_SERVER || line_is(line, len, "PING") || line_is(line, len, "ERROR"))
+        return CHIRC_PRIO_HIGH;
+    if (conn == owned)
+        return CHIRC_PRIO_REPLY;
+
+    return CHIRC_PRIO_BULK;
+}
 
 /* See connection.h */
-int chirc_connection_create_thread(chirc_ctx_t *ctx, chirc_connection_t *connection)
+int chirc_connection_send(chirc_connection_t *conn, const void *buf, size_t len)
 {
-    /* Your code here */
+    if (chirc_mailbox_put(conn->mailbox, send_prio(conn, buf, len), buf, len) != CHIRC_OK)
+        return CHIRC_FAIL;
+
+    if (conn != owned)
+        chirc_connection_wake(conn);
 
     return CHIRC_OK;
 }
 
+
+/* See connection.h */
+void chirc_connection_wake(chirc_connection_t *conn)
+{
+    if (conn->ready)
+        conn->ready(conn, conn->ready_arg);
+}
+
+
+/* See connection.h */
+int chirc_connection_flush(chirc_connection_t *conn)
+{
+    struct iovec iov[CHIRC_FLUSH_IOV];
+    int iovcnt, ret = CHIRC_FLUSH_DONE;
+    uint64_t writes = 0;
+    ssize_t n;
+
+    while ((iovcnt = chirc_mailbox_peekv(conn->mailbox, iov, CHIRC_FLUSH_IOV)) > 0)
+    {
+        n = conn->transport->writev(conn, iov, iovcnt);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+        {
+            ret = CHIRC_FLUSH_BLOCKED;
+            break;
+        }
+        if (n <= 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        chirc_mailbox_consume(conn->mailbox, n);
+        writes++;
+    }
+
+    if (writes > 0)
+    {
+        chirc_metrics_count(CHIRC_METRIC_FLUSHES, 1);
+        chirc_metrics_count(CHIRC_METRIC_WRITES, writes);
+    }
+
+    return ret;
+}
+
+
+/* See connection.h */
+void chirc_connection_own(chirc_connection_t *conn)
+{
+    owned = conn;
+}
+
+
+/* See connection.h */
+void chirc_connection_close(chirc_connection_t *conn)
+{
+    conn->transport->close(conn);
+}
+
+
+/* See connection.h */
+void chirc_connection_shutdown(chirc_connection_t *conn)
+{
+    conn->transport->shutdown(conn);
+}
+
+
+/* See connection.h */
+void chirc_connection_set_ready(chirc_connection_t *conn,
+                                void (*fn)(chirc_connection_t *conn, void *arg), void *arg)
+{
+    conn->ready = fn;
+    conn->ready_arg = arg;
+}
+
+
+/* See connection.h */
+int chirc_connection_arm(chirc_connection_t *conn, int events)
+{
+    return conn->transport->arm(conn, events);
+}
+
+
+/* See connection.h */
+int chirc_connection_send_message(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg)
+{
+    char *s;
+    int ret;
+
+    if (chirc_message_to_string(msg, &s) != 0)
+        return CHIRC_FAIL;
+
+    ret = chirc_connection_send(conn, s, strlen(s));
+    free(s);
+
+    return ret;
+}
+
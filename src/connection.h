@@ -13,7 +13,77 @@
 #ifndef CONNECTION_H_
 #define CONNECTION_H_
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include "chirc.h"
+#include "duplex.h"
+
+/*! \brief How a connection moves bytes to and from its peer
+ *
+ * Connections to real clients use chirc_socket_transport. A connection
+ * can also be backed by an in-memory duplex buffer (see duplex.h), so
+ * the server can be driven by clients in the same process without any
+ * kernel involvement.
+ *
+ * Connections are not handled by a thread of their own (see
+ * workers.h), so reads and writes never wait: a worker reads whatever
+ * is available and writes whatever fits, and then arms the connection
+ * to be told when it can do more.
+ */
+struct chirc_transport
+{
+    /*! \brief Name of the transport (for logging) */
+    const char *name;
+
+    /*! \brief Reads up to len bytes that are available, without waiting
+     *
+     * Returns the number of bytes read, 0 if the peer has closed its
+     * end, or -1 on error (with errno set; EAGAIN if there is nothing
+     * to read yet). */
+    ssize_t (*read)(chirc_connection_t *conn, void *buf, size_t len);
+
+    /*! \brief Writes as many of the bytes of iovcnt buffers, in order,
+     *         as fit, without waiting
+     *
+     * Returns the number of bytes written, or -1 on error (with errno
+     * set; EAGAIN if there is no room yet, EPIPE if the peer has closed
+     * its end). */
+    ssize_t (*writev)(chirc_connection_t *conn, const struct iovec *iov, int iovcnt);
+
+    /*! \brief Closes the server's end of the connection */
+    void (*close)(chirc_connection_t *conn);
+
+    /*! \brief Makes pending and future reads return end of stream
+     *
+     * Used to disconnect a client from another thread; the thread
+     * handling the connection still closes it. */
+    void (*shutdown)(chirc_connection_t *conn);
+
+    /*! \brief Arms the connection for a single call to its ready function
+     *
+     * The function is called (from any thread) once the connection is
+     * ready for one of the events (CHIRC_ARM_READ and CHIRC_ARM_WRITE),
+     * the peer has closed its end, or the connection was shut down;
+     * right away if that is already the case. */
+    int (*arm)(chirc_connection_t *conn, int events);
+};
+
+/*! Arm a connection until there is something to read */
+#define CHIRC_ARM_READ  (1)
+/*! Arm a connection until there is room to write */
+#define CHIRC_ARM_WRITE (2)
+
+/*! Most buffers written at once (see chirc_connection_flush) */
+#define CHIRC_FLUSH_IOV (64)
+
+/*! Everything in the mailbox was written (see chirc_connection_flush) */
+#define CHIRC_FLUSH_DONE    (0)
+/*! The peer cannot take more yet (see chirc_connection_flush) */
+#define CHIRC_FLUSH_BLOCKED (1)
+
+/*! \brief Transport for connections backed by a socket */
+extern const chirc_transport_t chirc_socket_transport;
 
 /*! \brief Initializes a chirc_connection_t struct
  *
@@ -25,6 +95,27 @@
 void chirc_connection_init(chirc_connection_t *conn);
 
 
+/*! \brief Initializes a connection backed by a socket
+ *
+ * Replies are written in bursts (see chirc_connection_flush), so the
+ * socket does not need Nagle's algorithm to batch them: TCP_NODELAY is
+ * set, and a single reply goes out without waiting.
+ *
+ * \param conn The connection to initialize
+ * \param fd Connected socket (owned by the connection from now on)
+ */
+void chirc_connection_init_socket(chirc_connection_t *conn, int fd);
+
+/*! \brief Initializes a connection backed by an in-memory duplex
+ *
+ * The connection gets a unique negative number as its socket.
+ *
+ * \param conn The connection to initialize
+ * \param duplex Duplex (see duplex.h); the connection owns the
+ *               server's end from now on
+ */
+void chirc_connection_init_duplex(chirc_connection_t *conn, chirc_duplex_t *duplex);
+
 /*! \brief Frees a chirc_connection_t struct
  *
  * This function frees memory allocated to the fields of a
@@ -36,7 +127,124 @@ void chirc_connection_init(chirc_connection_t *conn);
  */
 void chirc_connection_free(chirc_connection_t *conn);
 
+/*! \brief Reads from a connection
+ *
+ * \param conn The connection to read from
+ * \param buf Buffer
+ * \param len Size of the buffer
+ * \return Number of bytes read, 0 if the peer closed the connection,
+ *         or -1 on error (with errno set to EAGAIN if there is nothing
+ *         to read yet)
+ */
+ssize_t chirc_connection_read(chirc_connection_t *conn, void *buf, size_t len);
+
+/*! \brief Sends bytes to the peer of a connection (from any thread)
+ *
+ * The bytes are put in the connection's mailbox (see mailbox.h), and
+ * written by the thread that owns the connection, which is woken up
+ * (through the connection's ready function) unless it is the calling
+ * thread. They go ahead of what is already waiting if they have a
+ * higher priority: PINGs, ERRORs and anything sent to a server link go
+ * first, then what the owner sends (replies to the client's own
+ * commands), and then what other threads send (e.g., messages relayed
+ * from other clients). So the bytes should be whole lines.
+ *
+ * Whoever calls this for a connection it does not own must make sure
+ * the connection is not freed meanwhile (e.g., by holding the lock of
+ * the table it found the connection in).
+ *
+ * \param conn The connection to send to (with a mailbox)
+ * \param buf Bytes to send
+ * \param len Number of bytes
+ * \return CHIRC_OK on success, CHIRC_FAIL if out of memory
+ */
+int chirc_connection_send(chirc_connection_t *conn, const void *buf, size_t len);
+
+/*! \brief Writes what is in a connection's mailbox
+ *
+ * Must only be called by the thread that owns the connection. Writes
+ * as much as the peer can take without waiting; if it cannot take
+ * everything, the connection should be armed with CHIRC_ARM_WRITE.
+ *
+ * Up to CHIRC_FLUSH_IOV buffers are written with each system call, so
+ * the replies to the commands a client sent together (e.g., the
+ * numerics that welcome it) leave in as few TCP segments as they fit
+ * in, rather than one segment each.
+ *
+ * \param conn The connection
+ * \return CHIRC_FLUSH_DONE if the mailbox is empty (for now),
+ *         CHIRC_FLUSH_BLOCKED if the peer cannot take more yet, or -1
+ *         on error (e.g., if the peer closed the connection)
+ */
+int chirc_connection_flush(chirc_connection_t *conn);
+
+/*! \brief Wakes up whoever serves a connection
+ *
+ * Calls the connection's ready function (see
+ * chirc_connection_set_ready) from the calling thread. Used to tell the
+ * owner that something it was waiting for (other than the connection
+ * becoming readable or writable) has happened, e.g., by a command
+ * handler waiting for I/O (see handlers.h).
+ *
+ * \param conn The connection
+ */
+void chirc_connection_wake(chirc_connection_t *conn);
+
+/*! \brief Makes the calling thread the owner of a connection
+ *
+ * What the owner sends to the connection does not wake it up, since
+ * it flushes the connection before it is done with it.
+ *
+ * \param conn The connection (NULL when the thread is done with it)
+ */
+void chirc_connection_own(chirc_connection_t *conn);
+
+/*! \brief Closes the server's end of a connection
+ *
+ * \param conn The connection to close
+ */
+void chirc_connection_close(chirc_connection_t *conn);
+
+/*! \brief Disconnects the peer of a connection
+ *
+ * Can be called from any thread. The thread reading from the
+ * connection sees end of stream, and must still close it.
+ *
+ * \param conn The connection to shut down
+ */
+void chirc_connection_shutdown(chirc_connection_t *conn);
+
+/*! \brief Sets the function to call when a connection may have
+ *         something to do
+ *
+ * The function is called once each time the connection is armed (see
+ * chirc_connection_arm) and becomes ready, whenever another thread
+ * sends something to the connection (see chirc_connection_send), and
+ * whenever it is woken up (see chirc_connection_wake).
+ *
+ * \param conn The connection
+ * \param fn Function
+ * \param arg Argument for the function
+ */
+void chirc_connection_set_ready(chirc_connection_t *conn,
+                                void (*fn)(chirc_connection_t *conn, void *arg), void *arg);
+
+/*! \brief Arms a connection for a single call to its ready function
+ *
+ * Reads and writes do not wait, so the thread handling a connection
+ * reads until it gets EAGAIN (or writes until the peer cannot take
+ * more), and then arms the connection to be told, from any thread,
+ * when it can go on.
+ *
+ * \param conn The connection
+ * \param events CHIRC_ARM_READ, CHIRC_ARM_WRITE, or both
+ * \return CHIRC_OK on success, CHIRC_FAIL on failure
+ */
+int chirc_connection_arm(chirc_connection_t *conn, int events);
+
 /*! \brief Send a message through a connection
+ *
+ * The message is sent with chirc_connection_send.
  *
  * \param ctx Server context
  * \param conn The connection to send the message through
@@ -45,13 +253,5 @@ void chirc_connection_free(chirc_connection_t *conn);
  */
 int chirc_connection_send_message(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg);
 
-/*! \brief Creates a thread to handle a connection
- *
- * \param ctx Server context
- * \param conn The connection that will be handled by the thread
- * \return 0 on success, non-zero on failure
- */
-int chirc_connection_create_thread(chirc_ctx_t *ctx, chirc_connection_t *conn);
-
 
-#endif /* USER_H_ */
+#endif /* CONNECTION_H_ */
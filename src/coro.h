@@ -0,0 +1,80 @@
+/*! \file coro.h
+ *  \brief Stackless coroutines
+ *
+ *  A coroutine is a function that can return in the middle of its work
+ *  (e.g., to wait for a reply from another server) and, the next time
+ *  it is called, go on from where it left off. Coroutines do not have
+ *  a stack of their own: where to go on from is a line number kept in
+ *  a chirc_coro_t, and the function jumps back there with a switch
+ *  statement. So suspending one costs nothing, and does not tie up a
+ *  thread, but its local variables do not survive a suspension; what
+ *  it needs afterwards must be kept in the chirc_coro_t's state.
+ *
+ *  A coroutine looks like this:
+ *
+ *      int my_coroutine(chirc_coro_t *co, ...)
+ *      {
+ *          CHIRC_CORO_BEGIN(co);
+ *
+ *          start_something(co);
+ *          CHIRC_CORO_AWAIT(co, something_done(co), WAITING);
+ *          if (CHIRC_CORO_CANCELLED(co))
+ *              stop_something(co);
+ *
+ *          CHIRC_CORO_END(co);
+ *          return DONE;
+ *      }
+ *
+ *  A switch statement cannot be used between CHIRC_CORO_BEGIN and
+ *  CHIRC_CORO_END (the cases would be mixed up with the coroutine's).
+ *
+ *  Command handlers run as coroutines (see handlers.h).
+ */
+
+#ifndef CORO_H_
+#define CORO_H_
+
+#include <stdbool.h>
+
+/*! \brief Where a coroutine left off */
+typedef struct
+{
+    /*! \brief Line to go on from (0 if the coroutine is not running) */
+    int line;
+
+    /*! \brief Whatever the coroutine keeps across suspensions */
+    void *state;
+
+    /*! \brief The coroutine must stop waiting and clean up */
+    bool cancelled;
+} chirc_coro_t;
+
+/*! \brief Initial value of a chirc_coro_t */
+#define CHIRC_CORO_INIT { 0, NULL, false }
+
+/*! \brief Starts (or resumes) the body of a coroutine */
+#define CHIRC_CORO_BEGIN(co) switch ((co)->line) { case 0:
+
+/*! \brief Ends the body of a coroutine, which can be started anew */
+#define CHIRC_CORO_END(co) } (co)->line = 0; (co)->state = NULL; (co)->cancelled = false
+
+/*! \brief Suspends a coroutine, which returns ret, until it is resumed */
+#define CHIRC_CORO_YIELD(co, ret)                                       \
+    do { (co)->line = __LINE__; return (ret); case __LINE__:; } while (0)
+
+/*! \brief Suspends a coroutine, which returns ret, until cond holds
+ *
+ * cond is checked every time the coroutine is resumed (so it can be
+ * resumed spuriously). It is not waited for if the coroutine is
+ * cancelled; use CHIRC_CORO_CANCELLED after waiting to tell. */
+#define CHIRC_CORO_AWAIT(co, cond, ret)                                 \
+    do { (co)->line = __LINE__; case __LINE__:                          \
+         if (!(cond) && !(co)->cancelled) return (ret); } while (0)
+
+/*! \brief Whether a coroutine was cancelled while it was suspended */
+#define CHIRC_CORO_CANCELLED(co) ((co)->cancelled)
+
+/*! \brief Whether a coroutine is suspended (somewhere past its start) */
+#define CHIRC_CORO_SUSPENDED(co) ((co)->line != 0)
+
+#endif /* CORO_H_ */
@@ -12,6 +12,7 @@
 #include "channeluser.h"
 #include "server.h"
 #include "log.h"
+#include "metrics.h"
 #include "chirc.h"
 
 /* See ctx.h */
@@ -169,6 +170,7 @@ chirc_channel_t* chirc_ctx_get_channel(chirc_ctx_t *ctx, char *channelname)
 int chirc_ctx_add_channel(chirc_ctx_t *ctx, chirc_channel_t *channel)
 {
     HASH_ADD_KEYPTR(hh, ctx->channels, channel->name, sdslen(channel->name), channel);
+    chirc_metrics_channels(1);
 
     return CHIRC_OK;
 }
@@ -193,6 +195,7 @@ bool chirc_ctx_get_or_create_channel(chirc_ctx_t *ctx, char *channelname, chirc_
         chirc_channel_init(*channel);
         (*channel)->name = sdsnew(channelname);
         HASH_ADD_KEYPTR(hh, ctx->channels, (*channel)->name, sdslen((*channel)->name), *channel);
+        chirc_metrics_channels(1);
     }
 
     return created;
@@ -203,6 +206,7 @@ bool chirc_ctx_get_or_create_channel(chirc_ctx_t *ctx, char *channelname, chirc_
 int chirc_ctx_remove_channel(chirc_ctx_t *ctx, chirc_channel_t *channel)
 {
     HASH_DEL(ctx->channels, channel);
+    chirc_metrics_channels(-1);
 
     return CHIRC_OK;
 }
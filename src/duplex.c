@@ -0,0 +1,390 @@
+/* See duplex.h for details about the functions in this module */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "duplex.h"
+#include "connection.h"
+
+/* A bounded byte buffer in one direction */
+typedef struct {
+    char *data;
+    size_t cap;
+    size_t head;
+    size_t len;
+    /* The writing side has closed its end */
+    bool closed;
+} duplex_pipe_t;
+
+struct chirc_duplex {
+    pthread_mutex_t lock;
+    /* Broadcast whenever either buffer changes */
+    pthread_cond_t changed;
+    /* Client to server */
+    duplex_pipe_t in;
+    /* Server to client */
+    duplex_pipe_t out;
+    /* Ends still open */
+    int refs;
+    void (*notify)(chirc_duplex_t *duplex, void *arg);
+    void *notify_arg;
+    /* Server's connection, while it is armed (see chirc_connection_arm) */
+    chirc_connection_t *armed;
+    /* What the server is armed for */
+    int armed_events;
+};
+
+
+static size_t pipe_put(duplex_pipe_t *p, const char *buf, size_t len)
+{
+    size_t n = 0;
+
+    while (n < len && p->len < p->cap)
+    {
+        size_t tail = (p->head + p->len) % p->cap;
+        /* Contiguous room after the tail: up to the end of the buffer,
+         * or up to the head if the free space does not wrap around */
+        size_t chunk = tail >= p->head ? p->cap - tail : p->head - tail;
+
+        if (chunk > len - n)
+            chunk = len - n;
+
+        memcpy(p->data + tail, buf + n, chunk);
+        p->len += chunk;
+        n += chunk;
+    }
+
+    return n;
+}
+
+static size_t pipe_get(duplex_pipe_t *p, char *buf, size_t len)
+{
+    size_t n = 0;
+
+    while (n < len && p->len > 0)
+    {
+        size_t chunk = p->cap - p->head;
+
+        if (chunk > p->len)
+            chunk = p->len;
+        if (chunk > len - n)
+            chunk = len - n;
+
+        memcpy(buf + n, p->data + p->head, chunk);
+        p->head = (p->head + chunk) % p->cap;
+        p->len -= chunk;
+        n += chunk;
+    }
+
+    return n;
+}
+
+/* Waits for a change to the duplex. Returns false if the timeout
+ * expired (timeout_ms < 0 waits forever). */
+static bool wait_change(chirc_duplex_t *d, int timeout_ms, const struct timespec *deadline)
+{
+    if (timeout_ms < 0)
+        return pthread_cond_wait(&d->changed, &d->lock) == 0;
+    else
+        return pthread_cond_timedwait(&d->changed, &d->lock, deadline) != ETIMEDOUT;
+}
+
+static void deadline_after(struct timespec *ts, int timeout_ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Tells the server it can go on, if it is armed and there is something
+ * to read or room to write. Called with the lock held, so the server
+ * cannot close its end (and free its connection) while it is told. */
+static void server_ready(chirc_duplex_t *d)
+{
+    chirc_connection_t *conn = d->armed;
+
+    if (!conn)
+        return;
+
+    if (d->in.closed
+        || ((d->armed_events & CHIRC_ARM_READ) && d->in.len > 0)
+        || ((d->armed_events & CHIRC_ARM_WRITE) && d->out.len < d->out.cap))
+    {
+        d->armed = NULL;
+        conn->ready(conn, conn->ready_arg);
+    }
+}
+
+/* Drops a reference, and frees the duplex if it was the last one.
+ * Called with the lock held; returns with it released. */
+static void release(chirc_duplex_t *d)
+{
+    bool last = --d->refs == 0;
+
+    pthread_mutex_unlock(&d->lock);
+
+    if (last)
+    {
+        pthread_mutex_destroy(&d->lock);
+        pthread_cond_destroy(&d->changed);
+        free(d->in.data);
+        free(d->out.data);
+        free(d);
+    }
+}
+
+/* See duplex.h */
+chirc_duplex_t *chirc_duplex_new(size_t capacity)
+{
+    chirc_duplex_t *d = calloc(1, sizeof(chirc_duplex_t));
+
+    if (!d)
+        return NULL;
+
+    if (capacity == 0)
+        capacity = CHIRC_DUPLEX_DEFAULT_CAPACITY;
+
+    d->in.data = malloc(capacity);
+    d->out.data = malloc(capacity);
+    if (!d->in.data || !d->out.data)
+    {
+        free(d->in.data);
+        free(d->out.data);
+        free(d);
+        return NULL;
+    }
+    d->in.cap = d->out.cap = capacity;
+    d->refs = 2;
+
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->changed, NULL);
+
+    return d;
+}
+
+/* See duplex.h */
+void chirc_duplex_set_notify(chirc_duplex_t *d, void (*fn)(chirc_duplex_t *duplex, void *arg), void *arg)
+{
+    pthread_mutex_lock(&d->lock);
+    d->notify = fn;
+    d->notify_arg = arg;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* See duplex.h */
+ssize_t chirc_duplex_client_write(chirc_duplex_t *d, const void *buf, size_t len, int timeout_ms)
+{
+    struct timespec deadline;
+    size_t n = 0;
+
+    if (timeout_ms > 0)
+        deadline_after(&deadline, timeout_ms);
+
+    pthread_mutex_lock(&d->lock);
+
+    while (!d->out.closed && d->in.len == d->in.cap && timeout_ms != 0)
+        if (!wait_change(d, timeout_ms, &deadline))
+            break;
+
+    if (d->out.closed)
+        errno = EPIPE;
+    else if ((n = pipe_put(&d->in, buf, len)) > 0)
+    {
+        pthread_cond_broadcast(&d->changed);
+        server_ready(d);
+    }
+    else
+        errno = EAGAIN;
+
+    pthread_mutex_unlock(&d->lock);
+
+    return n > 0 ? (ssize_t) n : -1;
+}
+
+/* See duplex.h */
+ssize_t chirc_duplex_client_read(chirc_duplex_t *d, void *buf, size_t len, int timeout_ms)
+{
+    struct timespec deadline;
+    ssize_t n;
+
+    if (timeout_ms > 0)
+        deadline_after(&deadline, timeout_ms);
+
+    pthread_mutex_lock(&d->lock);
+
+    while (d->out.len == 0 && !d->out.closed && timeout_ms != 0)
+        if (!wait_change(d, timeout_ms, &deadline))
+            break;
+
+    if (d->out.len > 0)
+    {
+        n = pipe_get(&d->out, buf, len);
+        pthread_cond_broadcast(&d->changed);
+        server_ready(d);
+    }
+    else if (d->out.closed)
+        n = 0;
+    else
+    {
+        errno = EAGAIN;
+        n = -1;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    return n;
+}
+
+/* See duplex.h */
+void chirc_duplex_client_close(chirc_duplex_t *d)
+{
+    pthread_mutex_lock(&d->lock);
+
+    d->in.closed = true;
+    d->notify = NULL;
+    pthread_cond_broadcast(&d->changed);
+    server_ready(d);
+
+    release(d);
+}
+
+
+static ssize_t duplex_read(chirc_connection_t *conn, void *buf, size_t len)
+{
+    chirc_duplex_t *d = conn->transport_data;
+    ssize_t n;
+
+    pthread_mutex_lock(&d->lock);
+
+    n = pipe_get(&d->in, buf, len);
+    if (n > 0)
+        pthread_cond_broadcast(&d->changed);
+    else if (!d->in.closed && len > 0)
+    {
+        errno = EAGAIN;
+        n = -1;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    return n;
+}
+
+static ssize_t duplex_writev(chirc_connection_t *conn, const struct iovec *iov, int iovcnt)
+{
+    chirc_duplex_t *d = conn->transport_data;
+    void (*fn)(chirc_duplex_t *duplex, void *arg);
+    void *arg;
+    ssize_t n;
+
+    pthread_mutex_lock(&d->lock);
+
+    if (d->in.closed)
+    {
+        errno = EPIPE;
+        n = -1;
+    }
+    else if (d->out.len == d->out.cap)
+    {
+        errno = EAGAIN;
+        n = -1;
+    }
+    else
+    {
+        n = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            size_t put = pipe_put(&d->out, iov[i].iov_base, iov[i].iov_len);
+
+            n += put;
+            if (put < iov[i].iov_len)
+                break;
+        }
+        pthread_cond_broadcast(&d->changed);
+    }
+    fn = d->notify;
+    arg = d->notify_arg;
+
+    pthread_mutex_unlock(&d->lock);
+
+    if (n > 0 && fn)
+        fn(d, arg);
+
+    return n;
+}
+
+static void duplex_close(chirc_connection_t *conn)
+{
+    chirc_duplex_t *d = conn->transport_data;
+    void (*fn)(chirc_duplex_t *duplex, void *arg);
+    void *arg;
+
+    pthread_mutex_lock(&d->lock);
+
+    d->out.closed = true;
+    d->armed = NULL;
+    pthread_cond_broadcast(&d->changed);
+    fn = d->notify;
+    arg = d->notify_arg;
+
+    /* The client may be waiting for the end of the stream. Our
+     * reference keeps the duplex alive while the lock is released. */
+    if (fn)
+    {
+        pthread_mutex_unlock(&d->lock);
+        fn(d, arg);
+        pthread_mutex_lock(&d->lock);
+    }
+
+    release(d);
+    conn->transport_data = NULL;
+}
+
+/* Acts as if the client had closed its end, without giving up the
+ * client's reference (the client still has to close it) */
+static void duplex_shutdown(chirc_connection_t *conn)
+{
+    chirc_duplex_t *d = conn->transport_data;
+
+    pthread_mutex_lock(&d->lock);
+
+    d->in.closed = true;
+    pthread_cond_broadcast(&d->changed);
+    server_ready(d);
+
+    pthread_mutex_unlock(&d->lock);
+}
+
+static int duplex_arm(chirc_connection_t *conn, int events)
+{
+    chirc_duplex_t *d = conn->transport_data;
+
+    pthread_mutex_lock(&d->lock);
+
+    d->armed = conn;
+    d->armed_events = events;
+    server_ready(d);
+
+    pthread_mutex_unlock(&d->lock);
+
+    return CHIRC_OK;
+}
+
+/* See duplex.h */
+const chirc_transport_t chirc_duplex_transport = {
+    .name = "duplex",
+    .read = duplex_read,
+    .writev = duplex_writev,
+    .close = duplex_close,
+    .shutdown = duplex_shutdown,
+    .arm = duplex_arm
+};
@@ -0,0 +1,98 @@
+/*! \file duplex.h
+ *  \brief In-memory duplex byte streams
+ *
+ *  A duplex is a pair of bounded byte buffers, one in each direction,
+ *  that can stand in for a TCP connection between a client and the
+ *  server. The server's end is used through a chirc_connection_t (see
+ *  chirc_connection_init_duplex and chirc_duplex_transport), and
+ *  behaves like a socket watched by the poller: reads and writes do
+ *  not wait, and an armed connection is told when the client writes,
+ *  reads or closes its end. The client's end is used with the
+ *  chirc_duplex_client_* functions, which can wait or not, so a single
+ *  thread can drive thousands of clients.
+ *
+ *  Nothing goes through the kernel (except, when a side has to wait,
+ *  the futex behind a condition variable), so benchmarks on top of a
+ *  duplex measure the server's parsing, dispatch and reply costs
+ *  rather than those of the TCP stack.
+ *
+ *  Each side closes its end when it is done with it. The other side
+ *  then reads the remaining bytes followed by end of stream, and its
+ *  writes fail with EPIPE. The duplex is freed once both ends are
+ *  closed.
+ */
+
+#ifndef DUPLEX_H_
+#define DUPLEX_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "chirc.h"
+
+/*! Default size of the buffer in each direction */
+#define CHIRC_DUPLEX_DEFAULT_CAPACITY (64 * 1024)
+
+typedef struct chirc_duplex chirc_duplex_t;
+
+/*! \brief Transport for connections backed by a duplex */
+extern const chirc_transport_t chirc_duplex_transport;
+
+/*! \brief Creates a duplex
+ *
+ * \param capacity Size of the buffer in each direction (0 for
+ *                 CHIRC_DUPLEX_DEFAULT_CAPACITY)
+ * \return The duplex, or NULL if out of memory
+ */
+chirc_duplex_t *chirc_duplex_new(size_t capacity);
+
+/*! \brief Sets a function to call whenever the server writes to, or
+ *         closes, its end of a duplex
+ *
+ * The function is called from the server's thread, without any lock
+ * held, so it must be thread-safe (e.g., it can signal the thread
+ * driving the clients). It can still be called while, or shortly
+ * after, the client closes its end, so arg must stay valid until the
+ * server has closed its end too.
+ *
+ * \param duplex Duplex
+ * \param fn Function (NULL for none)
+ * \param arg Argument for the function
+ */
+void chirc_duplex_set_notify(chirc_duplex_t *duplex, void (*fn)(chirc_duplex_t *duplex, void *arg), void *arg);
+
+/*! \brief Sends bytes from the client to the server
+ *
+ * \param duplex Duplex
+ * \param buf Bytes to send
+ * \param len Number of bytes
+ * \param timeout_ms How long to wait for room in the buffer (0 to
+ *                   return right away, -1 to wait as long as needed)
+ * \return Number of bytes written (which can be fewer than len), or -1
+ *         with errno set to EAGAIN if the buffer is full, or EPIPE if
+ *         the server has closed its end
+ */
+ssize_t chirc_duplex_client_write(chirc_duplex_t *duplex, const void *buf, size_t len, int timeout_ms);
+
+/*! \brief Receives bytes sent by the server to the client
+ *
+ * \param duplex Duplex
+ * \param buf Buffer
+ * \param len Size of the buffer
+ * \param timeout_ms How long to wait for data (0 to return right away,
+ *                   -1 to wait as long as needed)
+ * \return Number of bytes read, 0 if the server has closed its end and
+ *         everything it sent has been read, or -1 with errno set to
+ *         EAGAIN if there is nothing to read
+ */
+ssize_t chirc_duplex_client_read(chirc_duplex_t *duplex, void *buf, size_t len, int timeout_ms);
+
+/*! \brief Closes the client's end of a duplex
+ *
+ * The duplex must not be used by the client afterwards.
+ *
+ * \param duplex Duplex
+ */
+void chirc_duplex_client_close(chirc_duplex_t *duplex);
+
+#endif /* DUPLEX_H_ */
@@ -0,0 +1,251 @@
+/* See eventlog.h for details about the functions in this module */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <uthash.h>
+
+#include "eventlog.h"
+#include "varint.h"
+#include "chirc.h"
+
+/* When the string table reaches this size, it is reset (and a
+ * CHIRC_EV_STRINGS_RESET record is written) so it can't grow forever */
+#define MAX_INTERNED_STRINGS (65536)
+
+/* Largest payload we will ever write (the length field is 16 bits) */
+#define MAX_PAYLOAD (0xffff)
+
+/* Level of the events that are written */
+int chirc_eventlog_level = QUIET;
+
+/* An interned string */
+typedef struct
+{
+    uint64_t id;
+    UT_hash_handle hh;
+    char str[];
+} interned_t;
+
+/* The state below is only touched by the event sink, which
+ * the logger never calls concurrently */
+static FILE *eventlog_file = NULL;
+static uint64_t last_ms = 0;
+static bool dirty = false;
+static interned_t *strings = NULL;
+static uint64_t next_string_id = 1;
+
+
+static void put_u64(unsigned char *buf, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        buf[i] = (unsigned char) (value >> (8 * i));
+}
+
+static void write_record(int type, loglevel_t level, uint64_t time_ms,
+                         unsigned char *fields, size_t fields_len)
+{
+    unsigned char hdr[CHIRC_EVENTLOG_RECORD_HEADER_SIZE + VARINT_MAX];
+    size_t delta_len;
+
+    /* The cached clock can be a few ms behind for records that were
+     * queued by different threads, so we clamp negative deltas */
+    if (time_ms < last_ms)
+        time_ms = last_ms;
+
+    delta_len = varint_encode(hdr + CHIRC_EVENTLOG_RECORD_HEADER_SIZE, time_ms - last_ms);
+    if (fields_len + delta_len > MAX_PAYLOAD)
+        fields_len = MAX_PAYLOAD - delta_len;
+
+    hdr[0] = (unsigned char) type;
+    hdr[1] = (unsigned char) level;
+    hdr[2] = (unsigned char) ((fields_len + delta_len) & 0xff);
+    hdr[3] = (unsigned char) ((fields_len + delta_len) >> 8);
+
+    fwrite(hdr, 1, CHIRC_EVENTLOG_RECORD_HEADER_SIZE + delta_len, eventlog_file);
+    fwrite(fields, 1, fields_len, eventlog_file);
+
+    last_ms = time_ms;
+    dirty = true;
+}
+
+static void reset_strings(uint64_t time_ms)
+{
+    interned_t *s, *tmp;
+
+    HASH_ITER(hh, strings, s, tmp)
+    {
+        HASH_DEL(strings, s);
+        free(s);
+    }
+    next_string_id = 1;
+
+    write_record(CHIRC_EV_STRINGS_RESET, QUIET, time_ms, NULL, 0);
+}
+
+/* Returns the id of a string, writing a CHIRC_EV_STRING record the
+ * first time the string is seen. The caller makes room for it (see
+ * eventlog_sink). */
+static uint64_t intern(const char *str, unsigned int len, uint64_t time_ms)
+{
+    interned_t *s;
+    unsigned char *fields;
+    size_t n;
+
+    if (!str)
+        return 0;
+
+    HASH_FIND(hh, strings, str, len, s);
+    if (s)
+        return s->id;
+
+    s = malloc(sizeof(interned_t) + len + 1);
+    fields = malloc(VARINT_MAX + len);
+    if (!s || !fields)
+    {
+        free(s);
+        free(fields);
+        return 0;
+    }
+
+    s->id = next_string_id++;
+    memcpy(s->str, str, len);
+    s->str[len] = '\0';
+    HASH_ADD_KEYPTR(hh, strings, s->str, len, s);
+
+    n = varint_encode(fields, s->id);
+    memcpy(fields + n, str, len);
+    write_record(CHIRC_EV_STRING, QUIET, time_ms, fields, n + len);
+    free(fields);
+
+    return s->id;
+}
+
+/* Event sink (see log.h) */
+static void eventlog_sink(chirc_log_event_t *ev)
+{
+    unsigned char fields[4 * VARINT_MAX];
+    uint64_t subject, target;
+    size_t n = 0;
+
+    if (!eventlog_file)
+        return;
+
+    if (!ev)
+    {
+        if (dirty)
+        {
+            fflush(eventlog_file);
+            dirty = false;
+        }
+        return;
+    }
+
+    /* Both strings of an event are interned after any reset, or the
+     * subject's id could refer to a table the decoder has dropped */
+    if (HASH_COUNT(strings) > MAX_INTERNED_STRINGS - 2)
+        reset_strings(ev->time_ms);
+
+    subject = intern(ev->subject, ev->subject_len, ev->time_ms);
+    target = intern(ev->target, ev->target_len, ev->time_ms);
+
+    n += varint_encode(fields + n, ev->conn_id);
+    n += varint_encode(fields + n, subject);
+    n += varint_encode(fields + n, target);
+    n += varint_encode(fields + n, ev->value);
+
+    write_record(ev->type, ev->level, ev->time_ms, fields, n);
+}
+
+/* See eventlog.h */
+void chirc_event_write(loglevel_t level, chirc_event_type_t type, unsigned long conn_id,
+                       const char *subject, const char *target, unsigned long value)
+{
+    chirc_log_event_t ev = {
+        .level = level,
+        .type = type,
+        .conn_id = conn_id,
+        .subject = subject,
+        .subject_len = subject ? strlen(subject) : 0,
+        .target = target,
+        .target_len = target ? strlen(target) : 0,
+        .value = value
+    };
+
+    chirc_log_event(&ev);
+}
+
+/* See eventlog.h */
+int chirc_eventlog_open(const char *path, loglevel_t level)
+{
+    unsigned char hdr[CHIRC_EVENTLOG_HEADER_SIZE];
+
+    if (eventlog_file)
+        return CHIRC_FAIL;
+
+    eventlog_file = fopen(path, "wb");
+    if (!eventlog_file)
+    {
+        chilog(ERROR, "Could not open event log %s", path);
+        return CHIRC_FAIL;
+    }
+
+    last_ms = chirc_log_clock_ms();
+    memcpy(hdr, CHIRC_EVENTLOG_MAGIC, 8);
+    put_u64(hdr + 8, last_ms);
+    fwrite(hdr, 1, sizeof(hdr), eventlog_file);
+
+    chirc_log_set_event_sink(eventlog_sink);
+    chirc_eventlog_level = level;
+
+    return CHIRC_OK;
+}
+
+/* See eventlog.h */
+void chirc_eventlog_close(void)
+{
+    interned_t *s, *tmp;
+
+    if (!eventlog_file)
+        return;
+
+    chirc_eventlog_level = QUIET;
+    chirc_log_set_event_sink(NULL);
+
+    fclose(eventlog_file);
+    eventlog_file = NULL;
+
+    HASH_ITER(hh, strings, s, tmp)
+    {
+        HASH_DEL(strings, s);
+        free(s);
+    }
+    next_string_id = 1;
+}
+
+/* See eventlog.h */
+const char *chirc_event_type_name(int type)
+{
+    switch (type)
+    {
+    case CHIRC_EV_STRING:
+        return "STRING";
+    case CHIRC_EV_STRINGS_RESET:
+        return "STRINGS_RESET";
+    case CHIRC_EV_CONNECT:
+        return "CONNECT";
+    case CHIRC_EV_REGISTER:
+        return "REGISTER";
+    case CHIRC_EV_JOIN:
+        return "JOIN";
+    case CHIRC_EV_PART:
+        return "PART";
+    case CHIRC_EV_PRIVMSG:
+        return "PRIVMSG";
+    case CHIRC_EV_DISCONNECT:
+        return "DISCONNECT";
+    default:
+        return NULL;
+    }
+}
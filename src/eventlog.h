@@ -0,0 +1,139 @@
+/*! \file eventlog.h
+ *  \brief Binary structured event log
+ *
+ *  The event log records what happens on the server (connections,
+ *  registrations, channel joins/parts, message metadata, disconnects)
+ *  in a compact binary format, for later forensic analysis. Events go
+ *  through the same per-thread rings as log messages (see log.h), so
+ *  logging an event costs a few stores and no formatting.
+ *
+ *  Use the chirc_event macro to log an event. Like chilog, it checks
+ *  the level before evaluating its arguments; events are only written
+ *  if an event log was opened with chirc_eventlog_open.
+ *
+ *  File format (all multi-byte fixed-size fields are little-endian):
+ *
+ *      File header:  "CHIRCEV1" (8 bytes)
+ *                    start time, ms since the epoch (8 bytes)
+ *
+ *      Record:       type (1 byte)
+ *                    level (1 byte)
+ *                    payload length (2 bytes)
+ *                    payload
+ *
+ *  Every payload starts with a varint (see varint.h) with the number
+ *  of milliseconds since the previous record (or since the start
+ *  time, for the first record). Then, depending on the type:
+ *
+ *      CHIRC_EV_STRING:        varint id, followed by the string bytes
+ *                              (the rest of the payload)
+ *      CHIRC_EV_STRINGS_RESET: nothing. All string ids are forgotten.
+ *      Any other type:         varint connection id, varint subject
+ *                              string id, varint target string id,
+ *                              varint value. A string id of 0 means
+ *                              "no string".
+ *
+ *  Strings (nicks, channels, addresses) are interned: the first time
+ *  a string is used, a CHIRC_EV_STRING record assigns it an id, and
+ *  events refer to it by id after that.
+ *
+ *  The chirc-eventlog-decode tool renders an event log as text or JSON.
+ */
+
+#ifndef EVENTLOG_H_
+#define EVENTLOG_H_
+
+#include "log.h"
+
+/*! Magic bytes at the start of an event log */
+#define CHIRC_EVENTLOG_MAGIC "CHIRCEV1"
+
+/*! Size of the file header */
+#define CHIRC_EVENTLOG_HEADER_SIZE (16)
+
+/*! Size of a record header */
+#define CHIRC_EVENTLOG_RECORD_HEADER_SIZE (4)
+
+/*! \brief Event types */
+typedef enum {
+    CHIRC_EV_STRING         = 0x01,
+    CHIRC_EV_STRINGS_RESET  = 0x02,
+
+    /*! A peer connected. Subject: peer address. Value: peer port. */
+    CHIRC_EV_CONNECT        = 0x10,
+    /*! A user registered. Subject: nick. Target: username. */
+    CHIRC_EV_REGISTER       = 0x11,
+    /*! A user joined a channel. Subject: nick. Target: channel. */
+    CHIRC_EV_JOIN           = 0x12,
+    /*! A user left a channel. Subject: nick. Target: channel. */
+    CHIRC_EV_PART           = 0x13,
+    /*! A message was sent. Subject: sender. Target: recipient.
+     *  Value: length of the message text. */
+    CHIRC_EV_PRIVMSG        = 0x14,
+    /*! A peer disconnected. Subject: nick (if registered).
+     *  Value: one of the CHIRC_EV_DISCONNECT_* reasons. */
+    CHIRC_EV_DISCONNECT     = 0x15
+} chirc_event_type_t;
+
+/*! Disconnect reasons (value of a CHIRC_EV_DISCONNECT event) */
+#define CHIRC_EV_DISCONNECT_QUIT  (0)
+#define CHIRC_EV_DISCONNECT_EOF   (1)
+#define CHIRC_EV_DISCONNECT_ERROR (2)
+#define CHIRC_EV_DISCONNECT_SENDQ (3)
+#define CHIRC_EV_DISCONNECT_TIMEOUT (4)
+#define CHIRC_EV_DISCONNECT_FLOOD (5)
+
+/*! \brief Level of the events that are written to the event log
+ *
+ * QUIET (i.e., nothing is written) unless an event log is open.
+ */
+extern int chirc_eventlog_level;
+
+/*! \brief Checks whether an event at the given level would be written */
+#define chirc_event_enabled(level) ((level) <= chirc_eventlog_level)
+
+/*! \brief Log an event
+ *
+ * \param level Logging level of the event
+ * \param type Event type (chirc_event_type_t)
+ * \param conn_id Connection the event relates to
+ * \param subject Subject string (can be NULL)
+ * \param target Target string (can be NULL)
+ * \param value Event-specific value
+ */
+#define chirc_event(level, type, conn_id, subject, target, value) \
+    do { if (chirc_event_enabled(level)) \
+             chirc_event_write(level, type, conn_id, subject, target, value); } while (0)
+
+/*! \brief Log an event (without checking the level first)
+ *
+ * Use the chirc_event macro instead of calling this function directly.
+ */
+void chirc_event_write(loglevel_t level, chirc_event_type_t type, unsigned long conn_id,
+                       const char *subject, const char *target, unsigned long value);
+
+/*! \brief Opens the event log
+ *
+ * The file is truncated if it already exists.
+ *
+ * \param path Path of the event log
+ * \param level Events at this level or "worse" are written
+ * \return 0 on success, non-zero on failure
+ */
+int chirc_eventlog_open(const char *path, loglevel_t level);
+
+/*! \brief Closes the event log
+ *
+ * Events still queued in the log rings are lost unless chirc_log_stop
+ * is called first.
+ */
+void chirc_eventlog_close(void);
+
+/*! \brief Returns a printable name for an event type
+ *
+ * \param type Event type
+ * \return Name of the event type (e.g., "JOIN"), or NULL if unknown
+ */
+const char *chirc_event_type_name(int type);
+
+#endif /* EVENTLOG_H_ */
@@ -0,0 +1,98 @@
+/* See flood.h for details about the functions in this module */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flood.h"
+
+/* Tokens a message to a channel costs on top of a message to a user.
+ * This is flat: the channel table is not safe to read from the workers
+ * (nothing locks it), so the number of members is not looked at */
+#define CHANNEL_TOKENS 1
+
+/* Tokens each command costs, in the same order as chirc_cmd_t. The
+ * commands that send back a long reply, or look at every user or
+ * channel, cost the most. */
+static const int cmd_costs[CHIRC_CMD_COUNT] = {
+    1,  /* PASS */
+    1,  /* SERVER */
+    1,  /* NICK */
+    1,  /* USER */
+    1,  /* QUIT */
+    2,  /* PRIVMSG (and more for each target, see target_cost) */
+    2,  /* NOTICE (likewise) */
+    1,  /* PING */
+    1,  /* PONG */
+    3,  /* MOTD */
+    3,  /* LUSERS */
+    2,  /* WHOIS */
+    2,  /* JOIN */
+    1,  /* PART */
+    1,  /* TOPIC */
+    1,  /* MODE */
+    3,  /* NAMES */
+    5,  /* LIST */
+    5,  /* WHO */
+    1,  /* AWAY */
+    1,  /* OPER */
+    5,  /* CONNECT */
+    2   /* UNKNOWN */
+};
+
+/* Tokens a message to a target costs, on top of the command's own */
+static int target_cost(const char *target)
+{
+    return target[0] == '#' || target[0] == '&' ? CHANNEL_TOKENS : 0;
+}
+
+
+/* See flood.h */
+int chirc_flood_cost(chirc_cmd_t cmd, chirc_message_t *msg)
+{
+    char targets[MSG_MAX], *target, *saveptr;
+    int cost = cmd_costs[cmd >= 0 && cmd < CHIRC_CMD_COUNT ? cmd : CHIRC_CMD_UNKNOWN];
+    bool first = true;
+
+    if ((cmd != CHIRC_CMD_PRIVMSG && cmd != CHIRC_CMD_NOTICE) || msg->nparams == 0)
+        return cost;
+
+    /* Every target after the first one costs a token, and channels cost
+     * more than users */
+    snprintf(targets, sizeof(targets), "%s", msg->params[0]);
+    for (target = strtok_r(targets, ",", &saveptr); target; target = strtok_r(NULL, ",", &saveptr))
+    {
+        cost += (first ? 0 : 1) + target_cost(target);
+        first = false;
+    }
+
+    return cost;
+}
+
+/* See flood.h */
+uint64_t chirc_flood_delay(chirc_flood_t *bucket, const chirc_flood_limit_t *limit, uint64_t now)
+{
+    uint64_t window;
+
+    if (limit->rate <= 0 || bucket->full_at <= now)
+        return 0;
+
+    /* Time the whole bucket takes to fill up: a command can run as long
+     * as the bucket is not more than that behind */
+    window = (uint64_t) limit->burst * 1000 / limit->rate;
+    if (bucket->full_at - now < window)
+        return 0;
+
+    return bucket->full_at - now - window + 1;
+}
+
+/* See flood.h */
+void chirc_flood_charge(chirc_flood_t *bucket, const chirc_flood_limit_t *limit, int cost, uint64_t now)
+{
+    if (limit->rate <= 0)
+        return;
+
+    if (bucket->full_at < now)
+        bucket->full_at = now;
+    bucket->full_at += (uint64_t) cost * 1000 / limit->rate;
+}
@@ -0,0 +1,75 @@
+/*! \file flood.h
+ *  \brief Flood control
+ *
+ *  Every connection has a token bucket. Running a command costs tokens,
+ *  which come back at a steady rate, up to the size of the bucket; a
+ *  client whose bucket is empty must wait for them before its next
+ *  command runs. So a client can send a burst of commands (e.g., while
+ *  registering), but not keep sending them faster than the rate.
+ *
+ *  Commands cost more the more work they make for the server: a PING
+ *  costs one token, a PRIVMSG to several targets or to a channel costs
+ *  more (see chirc_flood_cost).
+ *
+ *  The bucket is kept as the time at which it will be full again: a
+ *  command pushes that time forward by its cost, and the client may go
+ *  on as long as it is not more than a bucket's worth ahead of now. So
+ *  the bucket does not have to be refilled as time goes by.
+ *
+ *  Connections are limited by class (see chirc_set_flood in
+ *  libchirc.h); a class without limits, such as server links, is not
+ *  limited at all.
+ */
+
+#ifndef FLOOD_H_
+#define FLOOD_H_
+
+#include <stdint.h>
+
+#include "chirc.h"
+#include "cmdstats.h"
+
+/*! \brief Flood limits of a class of connections */
+typedef struct
+{
+    /*! \brief Tokens that come back each second (0 for no limit) */
+    int rate;
+    /*! \brief Tokens a bucket holds */
+    int burst;
+} chirc_flood_limit_t;
+
+/*! \brief A connection's token bucket */
+typedef struct
+{
+    /*! \brief Time at which the bucket is full again (see
+     *         chirc_timers_now); it is full if this has gone by */
+    uint64_t full_at;
+} chirc_flood_t;
+
+/*! \brief Tokens a command costs
+ *
+ * \param cmd Command (see chirc_cmdstats_lookup)
+ * \param msg Command's message
+ * \return Tokens (at least one)
+ */
+int chirc_flood_cost(chirc_cmd_t cmd, chirc_message_t *msg);
+
+/*! \brief Checks how long a connection must wait before its next command
+ *
+ * \param bucket Connection's bucket
+ * \param limit Limits of its class
+ * \param now Current time (see chirc_timers_now)
+ * \return Milliseconds to wait (0 if the command can run now)
+ */
+uint64_t chirc_flood_delay(chirc_flood_t *bucket, const chirc_flood_limit_t *limit, uint64_t now);
+
+/*! \brief Takes the cost of a command that was run from a bucket
+ *
+ * \param bucket Connection's bucket
+ * \param limit Limits of its class
+ * \param cost Tokens (see chirc_flood_cost)
+ * \param now Current time (see chirc_timers_now)
+ */
+void chirc_flood_charge(chirc_flood_t *bucket, const chirc_flood_limit_t *limit, int cost, uint64_t now);
+
+#endif /* FLOOD_H_ */
@@ -24,6 +24,10 @@
  * array to add an entry for the new command. See the code
  * below for more details.
  *
+ * Handler functions are coroutines: one that has to wait for I/O
+ * returns CHIRC_HANDLER_SUSPEND, and is called again (with the same
+ * message) until it is done. See handlers.h and coro.h.
+ *
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,8 +35,10 @@
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 #include "ctx.h"
 #include "channel.h"
 #include "channeluser.h"
@@ -44,6 +50,9 @@
 #include "message.h"
 #include "user.h"
 #include "server.h"
+#include "cmdstats.h"
+#include "resolver.h"
+#include "timers.h"
 
 
 /* The following typedef defines a type called "handler_function"
@@ -57,6 +66,9 @@ typedef int (*handler_function_t)(chirc_ctx_t *ctx, chirc_connection_t *conn, ch
 int chirc_handle_PING(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg);
 int chirc_handle_PONG(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg);
 
+// The server's own work (see chirc_handle_lookup)
+int chirc_handle_LOOKUP(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg);
+
 
 
 /*! \struct handler_entry
@@ -64,19 +76,23 @@ int chirc_handle_PONG(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_
  *
  * This struct represents one entry in the dispatch table:
  * a command name and a function pointer to a handler function
- * (using the handler_function_t type we defined earlier) */
+ * (using the handler_function_t type we defined earlier).
+ * Internal entries are the server's own work, which clients cannot
+ * send as commands (and which is not counted in the command stats) */
 struct handler_entry
 {
     char *name;
     handler_function_t func;
+    bool internal;
 };
 
-/* Convenience macro for specifying entries in the dispatch table */
-#define HANDLER_ENTRY(NAME) { #NAME, chirc_handle_ ## NAME}
+/* Convenience macros for specifying entries in the dispatch table */
+#define HANDLER_ENTRY(NAME) { #NAME, chirc_handle_ ## NAME, false}
+#define INTERNAL_ENTRY(NAME) { #NAME, chirc_handle_ ## NAME, true}
 
 /* Null entry in the dispatch table. This must always be the last
  * entry in the dispatch table */
-#define NULL_ENTRY			{ NULL, NULL }
+#define NULL_ENTRY			{ NULL, NULL, false }
 
 
 /* The dispatch table (an array of handler_entry structs).
@@ -93,15 +109,71 @@ struct handler_entry handlers[] =
     HANDLER_ENTRY (PING),
     HANDLER_ENTRY (PONG),
 
+    INTERNAL_ENTRY (LOOKUP),
+
     NULL_ENTRY
 };
 
 
+/* Finishes the command a connection was waiting on */
+static int finish_waiting(chirc_connection_t *conn, int rc)
+{
+    chirc_handler_wait_t *wait = conn->waiting;
+
+    if (!handlers[wait->handler].internal)
+        chirc_cmdstats_record(chirc_cmdstats_lookup(wait->msg.cmd), wait->start, rc != 0);
+
+    conn->waiting = NULL;
+    chirc_message_free(&wait->msg);
+    free(wait);
+
+    return rc;
+}
+
+
+/* Runs a message's handler (the h-th entry, which is the NULL entry if
+ * there is none), keeping the message if the handler suspends */
+static int dispatch(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg, int h)
+{
+    int rc = 0;
+    uint64_t start = chirc_cmdstats_now();
+    chirc_handler_wait_t *wait;
+
+    if (handlers[h].func)
+        rc = handlers[h].func(ctx, conn, msg);
+
+    if (rc == CHIRC_HANDLER_SUSPEND)
+    {
+        /* The message is kept until the handler is done with it */
+        wait = malloc(sizeof(chirc_handler_wait_t));
+        if (wait)
+        {
+            wait->msg = *msg;
+            wait->handler = h;
+            wait->start = start;
+            memset(msg, 0, sizeof(chirc_message_t));
+            conn->waiting = wait;
+            return rc;
+        }
+
+        /* Without it, the handler cannot go on */
+        conn->handler.cancelled = true;
+        handlers[h].func(ctx, conn, msg);
+        conn->handler = (chirc_coro_t) CHIRC_CORO_INIT;
+        rc = CHIRC_FAIL;
+    }
+
+    if (!handlers[h].internal)
+        chirc_cmdstats_record(chirc_cmdstats_lookup(msg->cmd), start, rc != 0 || handlers[h].name == NULL);
+
+    return rc;
+}
+
+
 /* See handlers.h */
 int chirc_handle(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg)
 {
-    chirc_message_t reply;
-    int rc=0, h;
+    int h;
 
     /* Print message to the server log */
     serverlog(DEBUG, conn, "Handling command %s", msg->cmd);
@@ -111,18 +183,86 @@ int chirc_handle(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *ms
     /* Search the dispatch table for an entry corresponding to the
      * message we are processing */
     for(h=0; handlers[h].name != NULL; h++)
-        if (!strcmp(msg->cmd, handlers[h].name))
-        {
+        if (!handlers[h].internal && !strcmp(msg->cmd, handlers[h].name))
+            break;
+
+    return dispatch(ctx, conn, msg, h);
+}
+
+
+/* See handlers.h */
+int chirc_handle_lookup(chirc_ctx_t *ctx, chirc_connection_t *conn, int timeout_ms)
+{
+    chirc_message_t msg;
+    char timeout[16];
+    int h, rc;
 
-            rc = handlers[h].func(ctx, conn, msg);
+    for(h=0; handlers[h].name != NULL; h++)
+        if (handlers[h].func == chirc_handle_LOOKUP)
             break;
-        }
 
+    snprintf(timeout, sizeof(timeout), "%d", timeout_ms);
+    chirc_message_construct(&msg, NULL, "LOOKUP");
+    chirc_message_add_parameter(&msg, timeout, false);
+
+    rc = dispatch(ctx, conn, &msg, h);
+    chirc_message_free(&msg);
 
     return rc;
 }
 
 
+/* See handlers.h */
+int chirc_handle_resume(chirc_ctx_t *ctx, chirc_connection_t *conn)
+{
+    chirc_handler_wait_t *wait = conn->waiting;
+    int rc;
+
+    if (!wait)
+        return CHIRC_OK;
+
+    rc = handlers[wait->handler].func(ctx, conn, &wait->msg);
+    if (rc == CHIRC_HANDLER_SUSPEND)
+        return rc;
+
+    return finish_waiting(conn, rc);
+}
+
+
+/* See handlers.h */
+void chirc_handle_cancel(chirc_ctx_t *ctx, chirc_connection_t *conn)
+{
+    chirc_handler_wait_t *wait = conn->waiting;
+
+    if (!wait)
+        return;
+
+    conn->handler.cancelled = true;
+    handlers[wait->handler].func(ctx, conn, &wait->msg);
+    conn->handler = (chirc_coro_t) CHIRC_CORO_INIT;
+
+    finish_waiting(conn, CHIRC_FAIL);
+}
+
+
+/* See handlers.h */
+bool chirc_handle_waiting(chirc_connection_t *conn)
+{
+    return conn->waiting != NULL;
+}
+
+
+/* See handlers.h */
+bool chirc_handle_has(const char *cmd)
+{
+    for(int h=0; handlers[h].name != NULL; h++)
+        if (!handlers[h].internal && !strcmp(cmd, handlers[h].name))
+            return true;
+
+    return false;
+}
+
+
 int chirc_handle_PING(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg)
 {
     /* Construct a reply to the PING */
@@ -151,3 +291,77 @@ int chirc_handle_PONG(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_
 }
 
 
+
+
+/* What the LOOKUP handler keeps while it waits */
+typedef struct
+{
+    chirc_connection_t *conn;
+    chirc_lookup_t lookup;
+    /* Gives up on the lookup */
+    chirc_timer_t timer;
+    /* The lookup is done, or was given up on */
+    atomic_bool over;
+} host_lookup_t;
+
+/* Called (on a resolver thread) when the lookup is done */
+static void host_lookup_done(chirc_lookup_t *lookup)
+{
+    host_lookup_t *hl = (host_lookup_t *)((char *)lookup - offsetof(host_lookup_t, lookup));
+
+    atomic_store(&hl->over, true);
+    chirc_connection_wake(hl->conn);
+}
+
+/* Called (on the poller thread) when the lookup takes too long */
+static void host_lookup_expired(chirc_timer_t *timer)
+{
+    host_lookup_t *hl = (host_lookup_t *)((char *)timer - offsetof(host_lookup_t, timer));
+
+    atomic_store(&hl->over, true);
+    chirc_connection_wake(hl->conn);
+}
+
+/* Looks up the name of the client's host (see chirc_handle_lookup).
+ * The only parameter is how long to wait for it, in milliseconds. */
+int chirc_handle_LOOKUP(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg)
+{
+    host_lookup_t *hl = conn->handler.state;
+    struct in_addr addr;
+
+    (void) ctx;
+
+    CHIRC_CORO_BEGIN(&conn->handler);
+
+    if (!conn->hostname || inet_pton(AF_INET, conn->hostname, &addr) != 1)
+        return CHIRC_OK;
+
+    /* Out of memory: the client keeps its numeric address */
+    hl = calloc(1, sizeof(host_lookup_t));
+    if (!hl)
+        return CHIRC_OK;
+    hl->conn = conn;
+    chirc_lookup_init(&hl->lookup, host_lookup_done);
+    chirc_timer_init(&hl->timer, host_lookup_expired);
+    conn->handler.state = hl;
+
+    chirc_timer_set(&hl->timer, atoi(msg->params[0]));
+    if (!chirc_resolver_lookup(&hl->lookup, addr))
+        CHIRC_CORO_AWAIT(&conn->handler, atomic_load(&hl->over), CHIRC_HANDLER_SUSPEND);
+
+    /* Once they are cancelled, neither wakes the connection up anymore,
+     * and the lookup's host is not written anymore */
+    chirc_resolver_cancel(&hl->lookup);
+    chirc_timer_cancel(&hl->timer);
+
+    if (!CHIRC_CORO_CANCELLED(&conn->handler) && '\0' != hl->lookup.host[0])
+    {
+        sdsfree(conn->hostname);
+        conn->hostname = sdsnew(hl->lookup.host);
+    }
+    serverlog(DEBUG, conn, "host looked up");
+    free(hl);
+
+    CHIRC_CORO_END(&conn->handler);
+    return CHIRC_OK;
+}
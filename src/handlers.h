@@ -10,20 +10,67 @@
  *
  *  See handler.c for details on how the dispatch table is implemented
  *  (and how to implement new commands)
+ *
+ *  Handlers run as coroutines (see coro.h), so a handler that has to
+ *  wait for I/O (e.g., a reply from another server) does not have to
+ *  block its thread. Instead, it starts the I/O, arranges to have the
+ *  connection woken up (see chirc_connection_wake) when it is done,
+ *  and returns CHIRC_HANDLER_SUSPEND. The message is then kept with
+ *  the connection, and the handler is run again (with
+ *  chirc_handle_resume) every time the connection is woken up, until
+ *  it finishes. A handler's coroutine state is the connection's
+ *  handler field:
+ *
+ *      int chirc_handle_FOO(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg)
+ *      {
+ *          CHIRC_CORO_BEGIN(&conn->handler);
+ *          ...
+ *          CHIRC_CORO_AWAIT(&conn->handler, reply_arrived(conn), CHIRC_HANDLER_SUSPEND);
+ *          ...
+ *          CHIRC_CORO_END(&conn->handler);
+ *          return CHIRC_OK;
+ *      }
+ *
+ *  Handlers that never wait do not need any of this.
+ *
+ *  The server's own work on a connection can be a handler too, so it
+ *  waits the same way: e.g., the lookup of the client's host (see
+ *  chirc_handle_lookup), which clients cannot send as a command.
  */
 
 #ifndef HANDLERS_H_
 #define HANDLERS_H_
 
+#include <stdint.h>
+
 #include "ctx.h"
 #include "connection.h"
 #include "message.h"
+#include "coro.h"
 
 /*! Return code that indicates that the outcome of processing
  *  the message is that the server must close the connection
  *  (e.g., when receiving a QUIT message) */
 #define CHIRC_HANDLER_DISCONNECT	(-42)
 
+/*! Return code that indicates that the handler is waiting for I/O,
+ *  and must be resumed (with chirc_handle_resume) once the connection
+ *  is woken up */
+#define CHIRC_HANDLER_SUSPEND	(-43)
+
+/*! \brief A command whose handler is waiting for I/O */
+typedef struct chirc_handler_wait
+{
+    /*! \brief The command (the handler's msg parameter from now on) */
+    chirc_message_t msg;
+
+    /*! \brief Index of the handler in the dispatch table */
+    int handler;
+
+    /*! \brief When the command started (see chirc_cmdstats_now) */
+    uint64_t start;
+} chirc_handler_wait_t;
+
 /*! \brief Process (handle) a message received by the server
  *
  * \param ctx Server context
@@ -33,9 +80,68 @@
  *         In some commands, the expected outcome of the command is
  *         for the connection to be closed (e.g., the QUIT command)
  *         In those cases, chirc_handle will return -42 (CHIRC_HANDLER_DISCONNECT).
+ *         If the handler is waiting for I/O, returns -43
+ *         (CHIRC_HANDLER_SUSPEND): the contents of msg have then been
+ *         moved to the connection (msg is left empty, and can still be
+ *         freed), and no other message must be handled on the
+ *         connection until chirc_handle_resume returns something else.
  *         If the handling of the message fails,  a non-zero value
- *         (other than -42) will be returned.
+ *         (other than -42 and -43) will be returned.
  */
 int chirc_handle(chirc_ctx_t *ctx, chirc_connection_t *conn, chirc_message_t *msg);
 
+/*! \brief Looks up the name of a client's host, as a handler
+ *
+ * The connection's hostname must be its numeric address; it is
+ * replaced by the address's name once that is found (see resolver.h).
+ * Like any handler, the lookup can suspend the connection, which is
+ * woken up when it is done, or after timeout_ms milliseconds: then the
+ * client goes on with its numeric address. Runs before the client's
+ * first command.
+ *
+ * \param ctx Server context
+ * \param conn Connection
+ * \param timeout_ms Longest the connection waits for the name
+ * \return CHIRC_OK, or CHIRC_HANDLER_SUSPEND (see chirc_handle)
+ */
+int chirc_handle_lookup(chirc_ctx_t *ctx, chirc_connection_t *conn, int timeout_ms);
+
+/*! \brief Resumes the handler that a connection is waiting on
+ *
+ * Must be called by the thread that owns the connection, after it is
+ * woken up. It is fine to call it when what the handler waits for has
+ * not happened yet; the handler just suspends again.
+ *
+ * \param ctx Server context
+ * \param conn Connection
+ * \return Same as chirc_handle (CHIRC_OK if no handler was waiting)
+ */
+int chirc_handle_resume(chirc_ctx_t *ctx, chirc_connection_t *conn);
+
+/*! \brief Cancels the handler that a connection is waiting on
+ *
+ * The handler is run one last time with its coroutine cancelled (see
+ * CHIRC_CORO_CANCELLED), so it can stop whatever it was waiting for
+ * (which must not wake the connection up afterwards), and the message
+ * is freed. Used when a connection closes.
+ *
+ * \param ctx Server context
+ * \param conn Connection
+ */
+void chirc_handle_cancel(chirc_ctx_t *ctx, chirc_connection_t *conn);
+
+/*! \brief Checks whether a connection is waiting for a handler
+ *
+ * \param conn Connection
+ * \return true if a handler is suspended on the connection
+ */
+bool chirc_handle_waiting(chirc_connection_t *conn);
+
+/*! \brief Checks whether there is a handler for a command
+ *
+ * \param cmd Command
+ * \return true if chirc_handle has a handler for the command
+ */
+bool chirc_handle_has(const char *cmd);
+
 #endif /* HANDLERS_H_ */
@@ -0,0 +1,130 @@
+/* See iplimit.h for details about the functions in this module */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <uthash.h>
+
+#include "iplimit.h"
+#include "timers.h"
+
+/* Connections accepted between two sweeps of the idle entries */
+#define SWEEP_EVERY 1024
+
+typedef struct
+{
+    /* Address (in network order) */
+    uint32_t addr;
+    /* Connections open */
+    int conns;
+    /* Connections made (see flood.h) */
+    chirc_flood_t bucket;
+    UT_hash_handle hh;
+} ip_entry_t;
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static ip_entry_t *table = NULL;
+static unsigned long acquired = 0;
+
+
+/* Removes the entries of the addresses that have no connection open
+ * and whose bucket is full again (table locked) */
+static void sweep(uint64_t now)
+{
+    ip_entry_t *entry, *tmp;
+
+    HASH_ITER(hh, table, entry, tmp)
+    {
+        if (entry->conns == 0 && entry->bucket.full_at <= now)
+        {
+            HASH_DEL(table, entry);
+            free(entry);
+        }
+    }
+}
+
+
+/* See iplimit.h */
+chirc_iplimit_t chirc_iplimit_acquire(struct in_addr addr, int max_conns, const chirc_flood_limit_t *rate)
+{
+    uint64_t now = chirc_timers_now();
+    chirc_iplimit_t ret = CHIRC_IPLIMIT_OK;
+    ip_entry_t *entry;
+
+    pthread_mutex_lock(&table_lock);
+
+    if (++acquired % SWEEP_EVERY == 0)
+        sweep(now);
+
+    HASH_FIND(hh, table, &addr.s_addr, sizeof(uint32_t), entry);
+    if (!entry)
+    {
+        entry = calloc(1, sizeof(ip_entry_t));
+        /* Out of memory: the address is not limited */
+        if (!entry)
+            goto _done;
+        entry->addr = addr.s_addr;
+        HASH_ADD(hh, table, addr, sizeof(uint32_t), entry);
+    }
+
+    if (max_conns > 0 && entry->conns >= max_conns)
+    {
+        /* Not a matter of rate: the address keeps its tokens for when
+         * one of its connections is closed */
+        ret = CHIRC_IPLIMIT_CONNS;
+        goto _done;
+    }
+
+    if (chirc_flood_delay(&entry->bucket, rate, now) > 0)
+        ret = CHIRC_IPLIMIT_RATE;
+    else
+        entry->conns++;
+
+    /* Connections refused for the rate count too, so a client that
+     * keeps retrying does not get in any sooner. But its debt is capped
+     * at one token, so it gets in as soon as it slows down to the rate */
+    chirc_flood_charge(&entry->bucket, rate, 1, now);
+    if (rate->rate > 0)
+    {
+        uint64_t window = (uint64_t) rate->burst * 1000 / rate->rate;
+        uint64_t cap = now + window + 1000 / rate->rate;
+
+        if (entry->bucket.full_at > cap)
+            entry->bucket.full_at = cap;
+    }
+
+_done:
+    pthread_mutex_unlock(&table_lock);
+
+    return ret;
+}
+
+/* See iplimit.h */
+void chirc_iplimit_release(struct in_addr addr)
+{
+    ip_entry_t *entry;
+
+    pthread_mutex_lock(&table_lock);
+
+    HASH_FIND(hh, table, &addr.s_addr, sizeof(uint32_t), entry);
+    if (entry && entry->conns > 0)
+        entry->conns--;
+
+    pthread_mutex_unlock(&table_lock);
+}
+
+/* See iplimit.h */
+void chirc_iplimit_clear(void)
+{
+    ip_entry_t *entry, *tmp;
+
+    pthread_mutex_lock(&table_lock);
+
+    HASH_ITER(hh, table, entry, tmp)
+    {
+        HASH_DEL(table, entry);
+        free(entry);
+    }
+
+    pthread_mutex_unlock(&table_lock);
+}
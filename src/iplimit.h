@@ -0,0 +1,67 @@
+/*! \file iplimit.h
+ *  \brief Per-address connection limits
+ *
+ *  A table, keyed by the client's IPv4 address, of how many connections
+ *  each address has open and how fast it has been connecting. The
+ *  connect rate is a token bucket (see flood.h): each connection costs
+ *  a token, and the tokens come back at a steady rate, so the count of
+ *  recent connections decays by itself. An address that is over either
+ *  limit is refused. Connections refused for the rate are charged too,
+ *  but an address never owes more than one token past its burst, so it
+ *  gets back in as soon as it connects no faster than the rate;
+ *  connections refused because the address has too many open are not
+ *  charged.
+ *
+ *  Entries are removed once the address has no connections open and
+ *  its bucket is full again, so the table only holds addresses that
+ *  are connected or have connected recently.
+ *
+ *  The table is a global, like the server's other tables, and can be
+ *  used from any thread.
+ */
+
+#ifndef IPLIMIT_H_
+#define IPLIMIT_H_
+
+#include <netinet/in.h>
+
+#include "flood.h"
+
+/*! \brief Outcome of chirc_iplimit_acquire */
+typedef enum
+{
+    /*! \brief The connection is allowed */
+    CHIRC_IPLIMIT_OK = 0,
+    /*! \brief The address has too many connections open */
+    CHIRC_IPLIMIT_CONNS,
+    /*! \brief The address is connecting too fast */
+    CHIRC_IPLIMIT_RATE
+} chirc_iplimit_t;
+
+/*! \brief Counts a new connection from an address, if it is allowed
+ *
+ * A connection that is allowed must be released with
+ * chirc_iplimit_release once it is closed.
+ *
+ * \param addr Address
+ * \param max_conns Most connections the address can have open (0 for
+ *                  no limit)
+ * \param rate Limit on the connections it makes (a rate of 0 for no
+ *             limit)
+ * \return CHIRC_IPLIMIT_OK, or why the connection is refused
+ */
+chirc_iplimit_t chirc_iplimit_acquire(struct in_addr addr, int max_conns, const chirc_flood_limit_t *rate);
+
+/*! \brief Counts a connection from an address as closed
+ *
+ * \param addr Address
+ */
+void chirc_iplimit_release(struct in_addr addr);
+
+/*! \brief Removes every entry from the table
+ *
+ * Used once no connection is open anymore (see chirc_stop).
+ */
+void chirc_iplimit_clear(void);
+
+#endif /* IPLIMIT_H_ */
@@ -0,0 +1,2052 @@
+/* See libchirc.h for details about the functions in this module
+ *
+ * This module has the server itself: the thread that accepts
+ * connections, and the code that handles them. Connections do not get
+ * a thread of their own: when one has something to read, the poller
+ * (or, for a duplex, the client writing to it) wakes it up, and a
+ * worker from the pool (see workers.h) reads and runs its commands.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <utlist.h>
+
+#include "libchirc.h"
+#include "ctx.h"
+#include "log.h"
+#include "eventlog.h"
+#include "capture.h"
+#include "cmdstats.h"
+#include "metrics.h"
+#include "connection.h"
+#include "duplex.h"
+#include "handlers.h"
+#include "flood.h"
+#include "iplimit.h"
+#include "poller.h"
+#include "resolver.h"
+#include "timers.h"
+#include "mailbox.h"
+#include "workers.h"
+#include "utils.h"
+#include "utils_list.h"
+#include "my_utils.h"
+#include "reply.h"
+
+#define IP_SIZE 20
+#define HOST_SIZE 256
+
+#define MOTD_FILE "/home/wurusai/irc/chirc/motd.txt"
+
+atomic_int connection_count = ATOMIC_VAR_INIT(0);
+atomic_int registered_connection_count = ATOMIC_VAR_INIT(0);
+
+/* What a connection's timer is for (see check_timeouts) */
+typedef enum
+{
+    /* Closing it if it does not register in time */
+    TIMEOUT_REGISTER,
+    /* Sending it a PING once it has been idle for a while */
+    TIMEOUT_IDLE,
+    /* Closing it if it does not answer the PING */
+    TIMEOUT_PING,
+    /* Closing it even if it has not taken its last replies yet */
+    TIMEOUT_CLOSE
+} conn_timeout_t;
+
+typedef struct conn_data
+{
+    chirc_connection_t conn;
+    unsigned long conn_id;
+    struct sockaddr_in addr;
+    chirc_ctx_t *ctx;
+
+    /* Runs the connection on a worker (see run_connection), and then
+     * frees it on the poller thread (see finish_connection) */
+    chirc_task_t task;
+    /* Wakeups since the connection last ran. The connection is queued
+     * or running while this is not zero, and is never queued twice, so
+     * its commands run in order, one at a time. Once it is closed,
+     * CONN_CLOSED is added, so late wakeups do not queue it again. */
+    atomic_int pending;
+    /* What the connection's peer is sent (see chirc_connection_send) */
+    chirc_mailbox_t mailbox;
+
+    /* Wakes the connection up when something may have timed out. It is
+     * not moved when the client sends something (which only updates
+     * last_active), but checked when it fires. */
+    chirc_timer_t timer;
+    atomic_bool timer_fired;
+    conn_timeout_t timeout;
+    /* When the client last sent something, and when it was last sent a
+     * PING (see chirc_timers_now) */
+    uint64_t last_active, ping_sent;
+
+    /* Flood control (see flood.h). A client that has run out of tokens
+     * is throttled: its commands wait, and it is not read from, until
+     * flood_timer wakes it up. throttled_since is when it fell behind
+     * (0 once it has caught up, i.e., all it sent has been run). */
+    chirc_flood_t flood;
+    chirc_timer_t flood_timer;
+    bool throttled;
+    uint64_t throttled_since;
+
+    /* The name of the client's host has to be looked up (see
+     * chirc_handle_lookup) before its first command runs */
+    bool resolve;
+
+    /* Commands the connection can still run before it lets the others
+     * run (see serve_connection). One that runs out yields: the rest of
+     * its commands wait in buf, and it is queued again behind the other
+     * connections (requeue, see run_connection). */
+    int budget;
+    bool yielded, requeue;
+
+    /* Bytes received that do not make a whole command yet */
+    char buf[1024];
+    int pos;
+    conn_type_t conn_type;
+    /* The connection counts towards its address's limits (see
+     * iplimit.h), until it is closed */
+    bool ip_counted;
+    /* The nick and user this connection created, removed when it closes */
+    char nick[128], username[128];
+
+    /* Live connections (see close_connection) */
+    struct conn_data *prev, *next;
+} conn_data_t;
+
+/* Added to conn_data_t.pending once a connection is closed */
+#define CONN_CLOSED (1 << 30)
+
+/* Longest a connection that is being closed waits for its peer to take
+ * the last replies (e.g., the ERROR that answers a QUIT) */
+#define CLOSE_DELAY_MS (5 * 1000)
+
+/* Most reads a connection that is being closed discards its input with
+ * (see close_connection) */
+#define CLOSE_DRAIN_READS 64
+
+/* Longest a client can stay throttled (see conn_data_t.throttled_since)
+ * before it is disconnected for flooding */
+#define EXCESS_FLOOD_MS (10 * 1000)
+
+/* Most connections taken from the listening socket at once (see
+ * accept_work) */
+#define ACCEPT_BATCH 64
+
+/* Connection ids are never reused (unlike socket descriptors), so
+ * they can be used to follow a connection through the event log */
+static atomic_ulong next_conn_id = ATOMIC_VAR_INIT(1);
+
+static sockfd_nick_map_t *sockfd_nick_hash = NULL;
+static connection_map_t *connection_hash = NULL;
+static user_node_t *nick_head = NULL;
+static user_node_t *user_head = NULL;
+
+/* The running server. The tables above are globals, so there can only
+ * be one server per process. */
+static struct
+{
+    /* Protects conns and active */
+    pthread_mutex_t lock;
+    /* Signaled when a connection is done with */
+    pthread_cond_t conns_done;
+    /* Connections that have not been closed yet */
+    conn_data_t *conns;
+    /* Connections whose data has not been freed yet */
+    int active;
+
+    /* Handle the connections */
+    chirc_workers_t *workers;
+    int nworkers;
+    size_t worker_stack;
+    /* Most bytes a connection's mailbox can hold (see chirc_set_sendq) */
+    size_t sendq;
+    /* Timeouts, in seconds (see chirc_set_timeouts) */
+    int register_timeout, ping_interval, ping_timeout;
+    /* Flood limits of unregistered clients and of users (see
+     * chirc_set_flood) */
+    chirc_flood_limit_t flood[2];
+    /* Commands a connection runs each time it is served (see
+     * chirc_set_input_budget) */
+    int input_budget;
+    /* Connections an address can have open, and how fast it can make
+     * them (see chirc_set_ip_limits) */
+    int ip_conns;
+    chirc_flood_limit_t ip_connect;
+    /* Resolver threads (none to not look hosts up), seconds names are
+     * cached for, and milliseconds a client waits for its lookup (see
+     * chirc_set_resolver) */
+    int resolver_threads, dns_ttl, lookup_timeout;
+
+    /* chirc_start was called, and chirc_stop was not */
+    bool started;
+    /* Accepting (or taking injected) connections */
+    atomic_bool running;
+    int listenfd;
+    pthread_t accept_thread;
+
+    atomic_ulong connections_total;
+    /* Traffic counters when the server started */
+    uint64_t base[CHIRC_METRIC_COUNT];
+} server = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, NULL, 0, 0, CHIRC_DEFAULT_SENDQ,
+             CHIRC_DEFAULT_REGISTER_TIMEOUT, CHIRC_DEFAULT_PING_INTERVAL, CHIRC_DEFAULT_PING_TIMEOUT,
+             {{CHIRC_DEFAULT_UNREG_FLOOD_RATE, CHIRC_DEFAULT_UNREG_FLOOD_BURST},
+              {CHIRC_DEFAULT_FLOOD_RATE, CHIRC_DEFAULT_FLOOD_BURST}},
+             CHIRC_DEFAULT_INPUT_BUDGET,
+             CHIRC_DEFAULT_IP_CONNS, {CHIRC_DEFAULT_IP_CONNECT_RATE, CHIRC_DEFAULT_IP_CONNECT_BURST},
+             CHIRC_DEFAULT_RESOLVER_THREADS, CHIRC_DEFAULT_DNS_TTL, CHIRC_DEFAULT_LOOKUP_TIMEOUT,
+             false, false, -1};
+
+/* Reply helpers (defined after the commands that use them) */
+void my_construct_user_WHOIS_ENDOFWHOIS_reply(chirc_ctx_t *ctx, char *code, char *nickname, char* cmd,  char* extra, chirc_connection_t *conn);
+void my_construct_user_WHOIS_WHOISSERVER_reply(chirc_ctx_t *ctx, char *code, char *nickname, char* extra, chirc_connection_t *conn);
+void my_construct_user_WHOIS_reply(chirc_ctx_t *ctx, char *code, chirc_message_t *user_msg, char *long_param_re, char *nickname, char *extra, chirc_connection_t *conn);
+void my_construct_user_WHOIS_NOSUCHNICK_reply(chirc_ctx_t *ctx, char *code, char *long_param_re, char *nickname, char *extra, chirc_connection_t *conn);
+void my_construct_user_QUIT_reply(chirc_ctx_t *ctx, char *cmd, char *long_param_re, char *nickname, chirc_connection_t *conn);
+void my_construct_user_MOTD_reply(chirc_ctx_t *ctx, char *code, char *long_param_re, char *nickname, chirc_connection_t *conn);
+void my_construct_user_LUSERS_reply(chirc_ctx_t *ctx, char *code, char *long_param_re, char *nickname, char *extra, chirc_connection_t *conn);
+void my_construct_user_reply(chirc_ctx_t *ctx, char *code, char *response_msg, char *extra, char *nickname, chirc_connection_t *conn);
+
+/* Sends a reply to a client, accounting for it in the metrics */
+static int send_reply(chirc_connection_t *conn, const char *reply, size_t len)
+{
+    if (chirc_connection_send(conn, reply, len) != CHIRC_OK)
+        return CHIRC_FAIL;
+
+    chirc_metrics_count(CHIRC_METRIC_BYTES_OUT, len);
+    chirc_metrics_count(CHIRC_METRIC_LINES_OUT, 1);
+
+    return CHIRC_OK;
+}
+
+void response_PING(chirc_ctx_t *ctx, char *nickname, chirc_connection_t *conn)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_QUIT;
+
+    chirc_message_construct_reply(msg, ctx, connection, "PONG");
+    chirc_message_add_parameter(msg, "xixi", false);
+
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+/* Returns false if the nick does not exist */
+bool response_WHOIS(chirc_ctx_t *ctx, char *nickname, chirc_connection_t *conn)
+{
+    connection_map_t *connection_node = NULL;
+    sockfd_nick_map_t *sockfd_nick_node = find_sockfd_nick_map_node(sockfd_nick_hash, conn->socket);
+
+    /* The replies are addressed to the sender, so it must be registered */
+    if (NULL == sockfd_nick_node)
+    {
+        return false;
+    }
+
+    /* The target can disconnect (and its node be freed) at any time, so
+     * the table stays locked while its USER message is being used */
+    pthread_mutex_lock(&connection_node_mutex);
+    HASH_FIND_STR(connection_hash, nickname, connection_node);
+    if (NULL != connection_node)
+    {
+        my_construct_user_WHOIS_reply(ctx, RPL_WHOISUSER, connection_node->msg, NULL, sockfd_nick_node->name, nickname, conn);
+    }
+    pthread_mutex_unlock(&connection_node_mutex);
+
+    if (NULL == connection_node)
+    {
+        my_construct_user_WHOIS_NOSUCHNICK_reply(ctx, ERR_NOSUCHNICK, "No such nick/channel", sockfd_nick_node->name, nickname, conn);
+        return false;
+    }
+    else
+    {
+        my_construct_user_WHOIS_WHOISSERVER_reply(ctx, RPL_WHOISSERVER, sockfd_nick_node->name, nickname, conn);
+        my_construct_user_WHOIS_ENDOFWHOIS_reply(ctx, RPL_ENDOFWHOIS, sockfd_nick_node->name, sockfd_nick_node->name, "End of WHOIS list", conn);
+        return true;
+    }
+}
+
+void my_construct_user_WHOIS_ENDOFWHOIS_reply(chirc_ctx_t *ctx, char *code, char *nickname, char* cmd,  char* extra, chirc_connection_t *conn)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_USER;
+
+    chirc_message_construct_reply(msg, ctx, connection, code);
+    chirc_message_add_parameter(msg, cmd, true);
+    chirc_message_add_parameter(msg, extra, true);
+
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+void my_construct_user_WHOIS_WHOISSERVER_reply(chirc_ctx_t *ctx, char *code, char *nickname, char* extra, chirc_connection_t *conn)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_USER;
+
+    chirc_message_construct_reply(msg, ctx, connection, code);
+    chirc_message_add_parameter(msg, extra, false);
+    chirc_message_add_parameter(msg, ctx->network.this_server->servername, false);
+    chirc_message_add_parameter(msg, "Ubuntu", true);
+
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+void my_construct_user_WHOIS_reply(chirc_ctx_t *ctx, char *code, chirc_message_t *user_msg, char *long_param_re, char *nickname, char *extra, chirc_connection_t *conn)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_USER;
+
+    chirc_message_construct_reply(msg, ctx, connection, code);
+
+    if (NULL != user_msg)
+    {
+        chirc_message_add_parameter(msg, user_msg->cmd, false);
+        
+        for (int i = 0; i < user_msg->nparams; ++i)
+        {
+            
+            if (i != user_msg->nparams - 1)
+            {
+                chirc_message_add_parameter(msg, user_msg->params[i], false);
+            }
+            else
+            {
+                chirc_message_add_parameter(msg, user_msg->params[i], true);
+            }
+        }
+    }
+    else if (long_param_re != NULL)
+    {
+        chirc_message_add_parameter(msg, long_param_re, true);
+    }
+    else
+    {
+        chirc_message_add_parameter(msg, ctx->network.this_server->servername, false);
+    }
+
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+void my_construct_user_WHOIS_NOSUCHNICK_reply(chirc_ctx_t *ctx, char *code, char *long_param_re, char *nickname, char *extra, chirc_connection_t *conn)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_USER;
+
+    chirc_message_construct_reply(msg, ctx, connection, code);
+
+    if(extra != NULL)
+    {
+        chirc_message_add_parameter(msg, extra, false);
+    }
+
+    if (long_param_re != NULL)
+    {
+        chirc_message_add_parameter(msg, long_param_re, true);
+    }
+
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+void my_construct_user_UNKNOWN_reply(chirc_ctx_t *ctx, char *code, char *nickname, char *cmd, char *long_param_re, chirc_connection_t *conn)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_USER;
+    chirc_message_construct_reply(msg, ctx, connection, code);
+
+    if (NULL != cmd)
+    {
+        chirc_message_add_parameter(msg, cmd, true);
+    }
+
+    if (NULL != long_param_re)
+    {
+        chirc_message_add_parameter(msg, long_param_re, true);
+    }
+
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+void response_QUIT(chirc_ctx_t *ctx, char *long_param_re, chirc_connection_t *conn, char *extra)
+{
+    my_construct_user_QUIT_reply(ctx, "ERROR", long_param_re, "", conn);
+}
+
+void my_construct_user_QUIT_reply(chirc_ctx_t *ctx, char *cmd, char *long_param_re, char *nickname, chirc_connection_t *conn)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_QUIT;
+
+    chirc_message_construct_reply(msg, ctx, connection, cmd);
+
+    if (NULL != long_param_re)
+    {
+        chirc_message_add_parameter(msg, long_param_re, true);
+    }
+
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+void response_MOTD(chirc_ctx_t *ctx, char *nickname, chirc_connection_t *conn, bool expect_motd)
+{
+    char buf[1024] = {0}, line[256] = {0};
+    FILE *file = NULL;
+
+    if (!expect_motd)
+    {
+        sprintf(line, "MOTD File is missing");
+        my_construct_user_MOTD_reply(ctx, ERR_NOMOTD, line, nickname, conn);
+        return;
+    }
+
+    // open file
+    file = fopen(MOTD_FILE, "r");
+    if (file == NULL)
+    {
+        chilog(ERROR, "cannot open file: %s", MOTD_FILE);
+        sprintf(line, "MOTD File is missing");
+        my_construct_user_MOTD_reply(ctx, ERR_NOMOTD, line, nickname, conn);
+        return;
+    }
+
+    sprintf(line, "- .* Message of the day - ");
+    my_construct_user_reply(ctx, RPL_MOTDSTART, line, NULL, nickname, conn);
+
+    while (fgets(line, sizeof(line), file))
+    {
+        int n = strlen(line);
+        if (line[n] == '\n')
+        {
+            line[n] = '\0';
+        }
+
+        memset(buf, 0, sizeof buf);
+        sprintf(buf, "- %s", line);
+        my_construct_user_MOTD_reply(ctx, RPL_MOTD, buf, nickname, conn);
+        memset(line, 0, sizeof line);
+    }
+
+    // close file
+    fclose(file);
+    memset(line, 0, sizeof line);
+    sprintf(line, "End of MOTD command");
+    my_construct_user_MOTD_reply(ctx, RPL_ENDOFMOTD, line, nickname, conn);
+}
+
+void my_construct_user_MOTD_reply(chirc_ctx_t *ctx, char *code, char *long_param_re, char *nickname, chirc_connection_t *conn)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_USER;
+
+    chirc_message_construct_reply(msg, ctx, connection, code);
+
+    if (NULL != long_param_re)
+    {
+        chirc_message_add_parameter(msg, long_param_re, true);
+    }
+
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+void response_LUSERS(chirc_ctx_t *ctx, char *nickname, chirc_connection_t *conn)
+{
+    char buf[1024] = {0}, extra[48] = {0};
+    sprintf(buf, "There are %d users and 0 services on 1 servers", get_connection_map_node_size(connection_hash));
+    my_construct_user_LUSERS_reply(ctx, RPL_LUSERCLIENT, buf, nickname, NULL, conn);
+
+    memset(buf, 0, sizeof buf);
+    sprintf(buf, "operator(s) online");
+    sprintf(extra, "0");
+    my_construct_user_LUSERS_reply(ctx, RPL_LUSEROP, buf, nickname, extra, conn);
+
+    memset(buf, 0, sizeof buf);
+    memset(extra, 0, sizeof extra);
+    sprintf(buf, "unknown connection(s)");
+    int unknown_cnt = atomic_load(&connection_count) - get_connection_map_node_size(connection_hash);
+    sprintf(extra, "%d", unknown_cnt);
+    my_construct_user_LUSERS_reply(ctx, RPL_LUSERUNKNOWN, buf, nickname, extra, conn);
+
+    memset(buf, 0, sizeof buf);
+    memset(extra, 0, sizeof extra);
+    sprintf(buf, "channels formed");
+    sprintf(extra, "0");
+    my_construct_user_LUSERS_reply(ctx, RPL_LUSERCHANNELS, buf, nickname, extra, conn);
+
+    memset(buf, 0, sizeof buf);
+    sprintf(buf, "I have %d clients and 1 servers", get_connection_map_node_size(connection_hash));
+    my_construct_user_LUSERS_reply(ctx, RPL_LUSERME, buf, nickname, NULL, conn);
+}
+
+void my_construct_user_LUSERS_reply(chirc_ctx_t *ctx, char *code, char *long_param_re, char *nickname, char *extra, chirc_connection_t *conn)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_USER;
+
+    chirc_message_construct_reply(msg, ctx, connection, code);
+
+    if (NULL != extra)
+    {
+        chirc_message_add_parameter(msg, extra, false);
+    }
+
+    if (NULL != long_param_re)
+    {
+        chirc_message_add_parameter(msg, long_param_re, true);
+    }
+
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+void my_construct_user_RPL_MYINFO_reply(chirc_ctx_t *ctx, char *code, char *response_msg, char *nickname,
+                                        chirc_connection_t *conn, char *version, char *user_mode, char *channel_mode)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_USER;
+
+    chirc_message_construct_reply(msg, ctx, connection, code);
+    if (NULL != response_msg)
+        chirc_message_add_parameter(msg, response_msg, true);
+    chirc_message_add_parameter(msg, ctx->network.this_server->servername, false);
+    chirc_message_add_parameter(msg, version, false);
+    chirc_message_add_parameter(msg, user_mode, false);
+    chirc_message_add_parameter(msg, channel_mode, false);
+
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+void my_construct_user_reply(chirc_ctx_t *ctx, char *code, char *response_msg, char *extra, char *nickname, chirc_connection_t *conn)
+{
+    char *response_str;
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    chirc_connection_t *connection = (chirc_connection_t *)malloc(sizeof(chirc_connection_t));
+    chirc_user_t *user = (chirc_user_t *)malloc(sizeof(chirc_user_t));
+
+    user->nick = strdup(nickname);
+    connection->peer.user = user;
+    connection->type = CONN_TYPE_USER;
+
+    chirc_message_construct_reply(msg, ctx, connection, code);
+    if (NULL != extra)
+    {
+        chirc_message_add_parameter(msg, extra, false);
+    }
+
+    chirc_message_add_parameter(msg, response_msg, true);
+    chirc_message_to_string(msg, &response_str);
+
+    chilog(TRACE, "response_msg is %s", response_str);
+
+    char *p = strstr(response_str, "\r\n");
+    int len = (p - response_str) + 2;
+
+    send_reply(conn, response_str, len);
+    free(response_str);
+
+    chirc_message_free(msg);
+    free(msg);
+    free(user->nick);
+    free(user);
+    free(connection);
+}
+
+/* Removes everything a connection added to the tables: its socket
+ * entry, its registration, and the nick and user it created (if any).
+ * Must be called before the socket is closed, since the descriptor can
+ * be reused as soon as it is. */
+static void forget_connection(int sockfd, char *nick, char *username)
+{
+    sockfd_nick_map_t *sockfd_nick_node = find_sockfd_nick_map_node(sockfd_nick_hash, sockfd);
+    if (NULL != sockfd_nick_node)
+    {
+        del_sockfd_nick_map_node(&sockfd_nick_hash, sockfd_nick_node);
+        chirc_metrics_table(CHIRC_TABLE_SOCKETS, -1);
+    }
+
+    if ('\0' != nick[0])
+    {
+        /* The nick may have been registered by another connection */
+        connection_map_t *connection_node = find_connection_map_node(connection_hash, nick);
+        if (NULL != connection_node && connection_node->fd == sockfd)
+        {
+            del_connection_map_node(&connection_hash, connection_node);
+            chirc_metrics_table(CHIRC_TABLE_CONNECTIONS, -1);
+        }
+
+        if (del_user_node(&nick_head, nick))
+        {
+            chirc_metrics_table(CHIRC_TABLE_NICKS, -1);
+        }
+    }
+
+    if ('\0' != username[0] && del_user_node(&user_head, username))
+    {
+        chirc_metrics_table(CHIRC_TABLE_USERS, -1);
+    }
+}
+
+/* Closes a connection, after taking it off the list of live
+ * connections (so chirc_stop cannot shut down a closed connection).
+ * Whatever the peer can still take of its mailbox (e.g., the reply to
+ * QUIT) is written first. */
+static void close_connection(conn_data_t *data)
+{
+    char discard[1024];
+    int reads = 0;
+
+    pthread_mutex_lock(&server.lock);
+    DL_DELETE(server.conns, data);
+    pthread_mutex_unlock(&server.lock);
+
+    chirc_connection_flush(&data->conn);
+    /* Closing a socket with input left unread resets the connection,
+     * and throws away the replies that have not been sent yet (e.g., to
+     * a client that is dropped for flooding) */
+    while (reads++ < CLOSE_DRAIN_READS && chirc_connection_read(&data->conn, discard, sizeof(discard)) > 0)
+        ;
+    chirc_connection_close(&data->conn);
+}
+
+static void lose_connection(conn_data_t *data, int reason);
+static bool linger_connection(conn_data_t *data);
+static bool drop_connection(conn_data_t *data, const char *why, int reason);
+static void wake_connection(chirc_connection_t *conn, void *arg);
+
+/* Changes the class of a connection. The connection's own type changes
+ * too, since other code looks at it (e.g., chirc_connection_send, to
+ * send to server links first) */
+static void set_conn_type(conn_data_t *data, conn_type_t type)
+{
+    chirc_metrics_conn_type(data->conn_type, type);
+    data->conn_type = type;
+    data->conn.type = type;
+}
+
+/* Flood limits of a connection's class, or NULL if it is not limited
+ * (server links are not) */
+static const chirc_flood_limit_t *flood_limit(conn_data_t *data)
+{
+    if (data->conn_type == CONN_TYPE_UNKNOWN || data->conn_type == CONN_TYPE_USER)
+        return &server.flood[data->conn_type];
+
+    return NULL;
+}
+
+/* Checks whether a connection has the tokens to run its next command.
+ * If it does not, it is throttled until it does (see flood.h). */
+static bool flood_allows(conn_data_t *data)
+{
+    const chirc_flood_limit_t *limit = flood_limit(data);
+    uint64_t now, delay;
+
+    if (!limit)
+        return true;
+
+    now = chirc_timers_now();
+    delay = chirc_flood_delay(&data->flood, limit, now);
+    if (delay == 0)
+        return true;
+
+    if (data->throttled_since == 0)
+        data->throttled_since = now;
+    data->throttled = true;
+    chirc_timer_set(&data->flood_timer, delay);
+
+    return false;
+}
+
+/* Host a client is shown as coming from: the name of its address, or
+ * the address itself (see chirc_handle_lookup). Connections without an
+ * address (see chirc_inject) come from the server itself. */
+static const char *client_host(chirc_ctx_t *ctx, chirc_connection_t *conn)
+{
+    return conn->hostname ? conn->hostname : ctx->network.this_server->servername;
+}
+
+/* Runs every complete command in a connection's buffer, unless one of
+ * them has to wait for I/O (see handlers.h), the client runs out of
+ * tokens (see flood_allows), or the connection runs out of budget (see
+ * serve_connection). Returns false if the connection was closed, or is
+ * being closed (by QUIT, or for flooding). */
+static bool handle_commands(conn_data_t *data)
+{
+    chirc_message_t *msg = NULL;
+    chirc_connection_t *conn = &data->conn;
+    /* Identifies the connection in the tables */
+    int sockfd = conn->socket;
+    unsigned long conn_id = data->conn_id;
+    chirc_ctx_t *ctx = data->ctx;
+    bool quit = false;
+    char temp_command[1024] = {0}, full_command[1024] = {0}, bak[1024] = {0};
+    /* Text of the replies. Kept apart from buf, which can still hold
+     * the next commands when several arrive together */
+    char reply[1024] = {0};
+    char *p = NULL;
+    const chirc_flood_limit_t *limit;
+
+    data->throttled = false;
+    data->yielded = false;
+
+    while (!quit && !chirc_handle_waiting(conn) && NULL != (p = strstr(data->buf, "\r\n")))
+    {
+        int len = (p - data->buf) + 2;
+        uint64_t cmd_start;
+        chirc_cmd_t cmd_id;
+        bool cmd_error = false;
+
+        if (data->budget <= 0)
+        {
+            data->yielded = true;
+            break;
+        }
+
+        if (!flood_allows(data))
+        {
+            /* A client that keeps sending faster than its limit never
+             * catches up */
+            if (chirc_timers_now() - data->throttled_since > EXCESS_FLOOD_MS)
+            {
+                drop_connection(data, "Excess Flood", CHIRC_EV_DISCONNECT_FLOOD);
+                quit = true;
+            }
+            break;
+        }
+
+        cmd_start = chirc_cmdstats_now();
+
+        memset(temp_command, 0, sizeof(temp_command));
+        memcpy(temp_command, data->buf, len);
+        chirc_capture_line(conn_id, temp_command, len - 2);
+
+        memset(full_command, 0, sizeof(full_command));
+        trim_space(temp_command, len, full_command);
+
+        memset(bak, 0, sizeof bak);
+        memcpy(bak, data->buf + len, sizeof(data->buf) - len);
+
+        memset(data->buf, 0, sizeof data->buf);
+        memcpy(data->buf, bak, sizeof(bak));
+        data->pos -= len;
+
+        p = strstr(full_command, "\r\n");
+        len = (p - full_command) + 2;
+        if (len <= 2)
+        {
+            continue;
+        }
+
+        msg = (chirc_message_t *)calloc(1, sizeof(chirc_message_t));
+        chirc_message_from_string(msg, full_command);
+        /* Commands without parameters look up no one */
+        char *name = msg->nparams > 0 ? msg->params[0] : "";
+        cmd_id = chirc_cmdstats_lookup(msg->cmd);
+        chirc_metrics_count(CHIRC_METRIC_LINES_IN, 1);
+        if ((limit = flood_limit(data)) != NULL)
+            chirc_flood_charge(&data->flood, limit, chirc_flood_cost(cmd_id, msg), chirc_timers_now());
+        data->budget--;
+
+        chilog(DEBUG, "name: %s", name);
+        if(4 == strlen(msg->cmd) && 0 == strncmp(msg->cmd, "PING", 4))
+        {
+            response_PING(ctx, "", conn);
+        }
+        else if(4 == strlen(msg->cmd) && 0 == strncmp(msg->cmd, "PONG", 4))
+        {
+
+        }
+        else if (4 == strlen(msg->cmd) && 0 == strncmp(msg->cmd, "QUIT", 4))
+        {
+            memset(reply, 0, sizeof reply);
+            if (1 == msg->nparams)
+            {
+                sprintf(reply, "Closing Link: %s (%s)", ('\0' != data->nick[0] ? data->nick : "*"), msg->params[0]);
+            }
+            else
+            {
+                sprintf(reply, "Closing Link: %s (Client Quit)", ('\0' != data->nick[0] ? data->nick : "*"));
+            }
+
+            set_conn_type(data, CONN_TYPE_QUIT);
+            response_QUIT(ctx, reply, conn, NULL);
+            chirc_event(INFO, CHIRC_EV_DISCONNECT, conn_id, '\0' != data->nick[0] ? data->nick : NULL,
+                        NULL, CHIRC_EV_DISCONNECT_QUIT);
+            forget_connection(sockfd, data->nick, data->username);
+            chirc_metrics_conn_close(sockfd, data->conn_type);
+            linger_connection(data);
+            atomic_fetch_sub(&connection_count, 1);
+            atomic_fetch_sub(&registered_connection_count, 1);
+
+            /* The socket is closed (or closing), so we must not read
+             * from it again */
+            quit = true;
+        }
+        else if (6 == strlen(msg->cmd) && 0 == strncmp(msg->cmd, "LUSERS", 6))
+        {
+            sockfd_nick_map_t *sockfd_nick_node = find_sockfd_nick_map_node(sockfd_nick_hash, sockfd);
+            response_LUSERS(ctx, (sockfd_nick_node != NULL ? sockfd_nick_node->name : ""), conn);
+        }
+        else if (4 == strlen(msg->cmd) && 0 == strncmp(msg->cmd, "MOTD", 4))
+        {
+            sockfd_nick_map_t *sockfd_nick_node = find_sockfd_nick_map_node(sockfd_nick_hash, sockfd);
+            response_MOTD(ctx, (sockfd_nick_node != NULL ? sockfd_nick_node->name : ""), conn, true);
+        }
+        else if (5 == strlen(msg->cmd) && 0 == strncmp(msg->cmd, "WHOIS", 5))
+        {
+            if (1 == msg->nparams)
+            {
+                cmd_error = !response_WHOIS(ctx, name, conn);
+            }
+        }
+        else if (7 == strlen(msg->cmd) && 0 == strncmp(msg->cmd, "PRIVMSG", 7))
+        {
+            connection_map_t *node = find_connection_map_node(connection_hash, name);
+            if (chirc_event_enabled(INFO))
+            {
+                sockfd_nick_map_t *sender = find_sockfd_nick_map_node(sockfd_nick_hash, sockfd);
+                chirc_event(INFO, CHIRC_EV_PRIVMSG, conn_id, sender ? sender->name : NULL, name,
+                            msg->nparams > 1 ? strlen(msg->params[msg->nparams - 1]) : 0);
+            }
+            if (NULL == node)
+            {
+                memset(reply, 0, sizeof(reply));
+                sprintf(reply, "You have not registered");
+                my_construct_user_reply(ctx, ERR_NOTREGISTERED, reply, NULL, ('\0' != data->nick[0] ? data->nick : "*"), conn);
+                cmd_error = true;
+            }
+
+            for (int i = 0; i < msg->nparams; ++i)
+            {
+                chilog(TRACE, "msg->params[%d]: %s", i, msg->params[i]);
+            }
+        }
+        else if (0 == strncmp(msg->cmd, "NICK", 4))
+        {
+            atomic_fetch_and(&registered_connection_count, 1);
+            if (0 == msg->nparams)
+            {
+                memset(reply, 0, sizeof(reply));
+                sprintf(reply, "No nickname given");
+                my_construct_user_reply(ctx, ERR_NONICKNAMEGIVEN, reply, NULL, ('\0' != data->nick[0] ? data->nick : "*"), conn);
+                cmd_error = true;
+            }
+            else if (1 == msg->nparams)
+            {
+
+                connection_map_t *connection_node = find_connection_map_node(connection_hash, name);
+                if (NULL != connection_node)
+                {
+                    // data->nick is already in use
+                    memset(reply, 0, sizeof(reply));
+                    sprintf(reply, "Nickname is already in use");
+                    my_construct_user_reply(ctx, ERR_NICKNAMEINUSE, reply, name, "*", conn);
+                    cmd_error = true;
+                    goto _done;
+                }
+
+                user_node_t *nick_node = find_user_node(nick_head, name);
+
+                if (nick_node == NULL)
+                {
+                    nick_node = (user_node_t *)malloc(sizeof(user_node_t));
+                    memset(nick_node->name, 0, sizeof(nick_node->name));
+                    memcpy(nick_node->name, name, strlen(name));
+                    nick_node->msg = NULL;
+                    add_user_node(&nick_head, nick_node);
+                    chirc_metrics_table(CHIRC_TABLE_NICKS, 1);
+                    snprintf(data->nick, sizeof(data->nick), "%s", nick_node->name);
+
+                    user_node_t *user_node = find_user_node(user_head, name);
+
+                    if (user_node != NULL)
+                    {
+                        memset(reply, 0, sizeof(reply));
+                        sprintf(reply, "Welcome to the Internet Relay Network %s!%s@%s", nick_node->name, user_node->name, client_host(ctx, conn));
+                        connection_map_t *connection_node = (connection_map_t *)malloc(sizeof(connection_map_t));
+                        memset(connection_node->name, 0, sizeof(connection_node->name));
+                        memcpy(connection_node->name, nick_node->name, strlen(nick_node->name));
+                        connection_node->msg = NULL;
+                        connection_node->msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+                        chirc_message_construct(connection_node->msg, NULL, user_node->msg->cmd);
+                        for (int i = 0; i < user_node->msg->nparams; ++i)
+                        {
+                            if (i != user_node->msg->nparams - 1)
+                            {
+                                chirc_message_add_parameter(connection_node->msg, user_node->msg->params[i], false);
+                            }
+                            else
+                            {
+                                chirc_message_add_parameter(connection_node->msg, user_node->msg->params[i], true);
+                            }
+                        }
+
+                        connection_node->fd = sockfd;
+                        add_connection_map_node(&connection_hash, connection_node);
+                        chirc_metrics_table(CHIRC_TABLE_CONNECTIONS, 1);
+                        chirc_event(INFO, CHIRC_EV_REGISTER, conn_id, nick_node->name, user_node->name, 0);
+                        set_conn_type(data, CONN_TYPE_USER);
+                        my_construct_user_reply(ctx, RPL_WELCOME, reply, NULL, name, conn);
+
+                        memset(reply, 0, sizeof(reply));
+                        sprintf(reply, "Your host is %s, running version 1.0", ctx->network.this_server->servername);
+                        my_construct_user_reply(ctx, RPL_YOURHOST, reply, NULL, name, conn);
+
+                        memset(reply, 0, sizeof(reply));
+                        sprintf(reply, "This server was created 20240701");
+                        my_construct_user_reply(ctx, RPL_CREATED, reply, NULL, name, conn);
+
+                        my_construct_user_RPL_MYINFO_reply(ctx, RPL_MYINFO, NULL, name, conn, "1.0", "ao", "mtov");
+
+                        response_LUSERS(ctx, name, conn);
+
+                        response_MOTD(ctx, name, conn, false);
+
+                        sockfd_nick_map_t *sockfd_nick_node = (sockfd_nick_map_t *)malloc(sizeof(sockfd_nick_map_t));
+                        memset(sockfd_nick_node->name, 0, sizeof(sockfd_nick_node->name));
+                        memcpy(sockfd_nick_node->name, nick_node->name, strlen(nick_node->name));
+                        sockfd_nick_node->fd = sockfd;
+                        add_sockfd_nick_map_node(&sockfd_nick_hash, sockfd_nick_node);
+                        chirc_metrics_table(CHIRC_TABLE_SOCKETS, 1);
+                    }
+                }
+            }
+        }
+        else if (0 == strncmp(msg->cmd, "USER", 4))
+        {
+            user_node_t *user_node = find_user_node(user_head, name);
+            user_node_t *nick_node = NULL;
+
+            if (msg->nparams < 4)
+            {
+                memset(reply, 0, sizeof(reply));
+                sprintf(reply, "Not enough parameters");
+                my_construct_user_reply(ctx, ERR_NEEDMOREPARAMS, reply, "USER", ('\0' != data->nick[0] ? data->nick : "*"), conn);
+                cmd_error = true;
+                goto _done;
+            }
+
+            if (user_node == NULL)
+            {
+                user_node = (user_node_t *)malloc(sizeof(user_node_t));
+                memset(user_node->name, 0, sizeof(user_node->name));
+                memcpy(user_node->name, name, strlen(name));
+                user_node->msg = NULL;
+                user_node->msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+                chirc_message_construct(user_node->msg, NULL, msg->cmd);
+
+                for (int i = 0; i < msg->nparams; ++i)
+                {
+                    if (i != msg->nparams - 1)
+                    {
+                        chirc_message_add_parameter(user_node->msg, msg->params[i], false);
+                    }
+                    else
+                    {
+                        chirc_message_add_parameter(user_node->msg, msg->params[i], true);
+                    }
+                }
+
+                add_user_node(&user_head, user_node);
+                chirc_metrics_table(CHIRC_TABLE_USERS, 1);
+                snprintf(data->username, sizeof(data->username), "%s", user_node->name);
+
+                nick_node = find_user_node(nick_head, name);
+                if (nick_node != NULL)
+                {
+                    if (4 == msg->nparams)
+                    {
+                        memset(reply, 0, sizeof(reply));
+                        sprintf(reply, "Welcome to the Internet Relay Network %s!%s@%s", nick_node->name, user_node->name, client_host(ctx, conn));
+                        connection_map_t *connection_node = (connection_map_t *)malloc(sizeof(connection_map_t));
+                        memset(connection_node->name, 0, sizeof(connection_node->name));
+                        memcpy(connection_node->name, nick_node->name, strlen(nick_node->name));
+                        connection_node->msg = NULL;
+                        connection_node->msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+                        chirc_message_construct(connection_node->msg, NULL, msg->cmd);
+                        for (int i = 0; i < msg->nparams; ++i)
+                        {
+                            if (i != msg->nparams - 1)
+                            {
+                                chirc_message_add_parameter(connection_node->msg, msg->params[i], false);
+                            }
+                            else
+                            {
+                                chirc_message_add_parameter(connection_node->msg, msg->params[i], true);
+                            }
+                        }
+
+                        connection_node->fd = sockfd;
+                        add_connection_map_node(&connection_hash, connection_node);
+                        chirc_metrics_table(CHIRC_TABLE_CONNECTIONS, 1);
+                        chirc_event(INFO, CHIRC_EV_REGISTER, conn_id, nick_node->name, user_node->name, 0);
+                        set_conn_type(data, CONN_TYPE_USER);
+                        my_construct_user_reply(ctx, RPL_WELCOME, reply, NULL, nick_node->name, conn);
+
+                        memset(reply, 0, sizeof(reply));
+                        sprintf(reply, "Your host is %s, running version 1.0", ctx->network.this_server->servername);
+                        my_construct_user_reply(ctx, RPL_YOURHOST, reply, NULL, name, conn);
+
+                        memset(reply, 0, sizeof(reply));
+                        sprintf(reply, "This server was created 20240701");
+                        my_construct_user_reply(ctx, RPL_CREATED, reply, NULL, name, conn);
+
+                        my_construct_user_RPL_MYINFO_reply(ctx, RPL_MYINFO, NULL, name, conn, "1.0", "ao", "mtov");
+
+                        response_LUSERS(ctx, name, conn);
+
+                        response_MOTD(ctx, name, conn, false);
+
+                        sockfd_nick_map_t *sockfd_nick_node = (sockfd_nick_map_t *)malloc(sizeof(sockfd_nick_map_t));
+                        memset(sockfd_nick_node->name, 0, sizeof(sockfd_nick_node->name));
+                        memcpy(sockfd_nick_node->name, nick_node->name, strlen(nick_node->name));
+                        sockfd_nick_node->fd = sockfd;
+                        add_sockfd_nick_map_node(&sockfd_nick_hash, sockfd_nick_node);
+                        chirc_metrics_table(CHIRC_TABLE_SOCKETS, 1);
+                    }
+                }
+            }
+        }
+        else if (chirc_handle_has(msg->cmd))
+        {
+            /* Commands in the dispatch table (see handlers.c) record
+             * their own stats, and can wait for I/O, in which case the
+             * commands after them wait too (see serve_connection) */
+            if (chirc_handle(ctx, conn, msg) == CHIRC_HANDLER_DISCONNECT)
+            {
+                lose_connection(data, CHIRC_EV_DISCONNECT_QUIT);
+                quit = true;
+            }
+            goto _handled;
+        }
+        else
+        {
+            sockfd_nick_map_t *sockfd_nick_node = find_sockfd_nick_map_node(sockfd_nick_hash, sockfd);
+            if (sockfd_nick_node != NULL)
+            {
+                my_construct_user_UNKNOWN_reply(ctx, ERR_UNKNOWNCOMMAND, sockfd_nick_node->name, msg->cmd, "Unknown command", conn);
+            }
+            cmd_error = true;
+        }
+
+_done:
+        chirc_cmdstats_record(cmd_id, cmd_start, cmd_error);
+
+_handled:
+        chirc_message_free(msg);
+        free(msg);
+        msg = NULL;
+    }
+
+    return !quit;
+}
+
+/* Disconnects a client that closed its end, or whose connection failed */
+static void lose_connection(conn_data_t *data, int reason)
+{
+    int sockfd = data->conn.socket;
+
+    chilog(INFO, "the other side has disconnected!");
+    sockfd_nick_map_t *sockfd_nick_node = find_sockfd_nick_map_node(sockfd_nick_hash, sockfd);
+    chirc_event(INFO, CHIRC_EV_DISCONNECT, data->conn_id, sockfd_nick_node ? sockfd_nick_node->name : NULL,
+                NULL, reason);
+    forget_connection(sockfd, data->nick, data->username);
+
+    chirc_metrics_conn_close(sockfd, data->conn_type);
+    close_connection(data);
+    atomic_fetch_sub(&connection_count, 1);
+    atomic_fetch_sub(&registered_connection_count, 1);
+}
+
+/* Closes a connection once its peer has taken what is left in its
+ * mailbox (e.g., the reply to QUIT), or once CLOSE_DELAY_MS have gone
+ * by. Returns true if the connection stays open until then. */
+static bool linger_connection(conn_data_t *data)
+{
+    if (chirc_connection_flush(&data->conn) == CHIRC_FLUSH_BLOCKED
+        && chirc_connection_arm(&data->conn, CHIRC_ARM_WRITE) == CHIRC_OK)
+    {
+        if (data->timeout != TIMEOUT_CLOSE)
+        {
+            data->timeout = TIMEOUT_CLOSE;
+            chirc_timer_set(&data->timer, CLOSE_DELAY_MS);
+        }
+        return true;
+    }
+
+    close_connection(data);
+    return false;
+}
+
+/* Disconnects a client that timed out (or flooded the server), after
+ * telling it why. reason is the CHIRC_EV_DISCONNECT_* reason for the
+ * event log. Returns true if the connection stays open until it has
+ * been told (see linger_connection). */
+static bool drop_connection(conn_data_t *data, const char *why, int reason)
+{
+    int sockfd = data->conn.socket;
+    char reply[256];
+
+    chilog(INFO, "connection %lu: %s", data->conn_id, why);
+    snprintf(reply, sizeof(reply), "Closing Link: %s (%s)", '\0' != data->nick[0] ? data->nick : "*", why);
+    response_QUIT(data->ctx, reply, &data->conn, NULL);
+    chirc_event(INFO, CHIRC_EV_DISCONNECT, data->conn_id, '\0' != data->nick[0] ? data->nick : NULL,
+                NULL, reason);
+    forget_connection(sockfd, data->nick, data->username);
+
+    chirc_metrics_conn_close(sockfd, data->conn_type);
+    atomic_fetch_sub(&connection_count, 1);
+    atomic_fetch_sub(&registered_connection_count, 1);
+
+    return linger_connection(data);
+}
+
+/* Sends a client a PING once it has been idle for ping_interval, and
+ * drops it if it has not sent anything ping_timeout after that. The
+ * timer only fires when one of these may have happened, so a client
+ * that keeps talking costs nothing more than a timestamp per read. */
+static bool check_timeouts(conn_data_t *data)
+{
+    uint64_t now = chirc_timers_now();
+    uint64_t interval = (uint64_t) server.ping_interval * 1000;
+    char why[64], ping[MSG_MAX];
+    int len;
+
+    switch (data->timeout)
+    {
+    case TIMEOUT_REGISTER:
+        if (data->conn_type == CONN_TYPE_UNKNOWN)
+            return drop_connection(data, "Registration timed out", CHIRC_EV_DISCONNECT_TIMEOUT);
+        data->timeout = TIMEOUT_IDLE;
+        break;
+
+    case TIMEOUT_IDLE:
+        break;
+
+    case TIMEOUT_PING:
+        if (data->last_active < data->ping_sent)
+        {
+            snprintf(why, sizeof(why), "Ping timeout: %d seconds",
+                     (int) ((now - data->last_active) / 1000));
+            return drop_connection(data, why, CHIRC_EV_DISCONNECT_TIMEOUT);
+        }
+        data->timeout = TIMEOUT_IDLE;
+        break;
+
+    case TIMEOUT_CLOSE:
+        close_connection(data);
+        return false;
+    }
+
+    if (now - data->last_active < interval)
+    {
+        chirc_timer_set(&data->timer, interval - (now - data->last_active));
+        return true;
+    }
+
+    len = snprintf(ping, sizeof(ping), "PING :%s\r\n", data->ctx->network.this_server->servername);
+    send_reply(&data->conn, ping, len);
+    data->ping_sent = now;
+    data->timeout = TIMEOUT_PING;
+    chirc_timer_set(&data->timer, (uint64_t) server.ping_timeout * 1000);
+
+    return true;
+}
+
+/* Timer function of every connection: the connection checks what has
+ * timed out once it runs (see check_timeouts) */
+static void connection_timer_fired(chirc_timer_t *timer)
+{
+    conn_data_t *data = (conn_data_t *)((char *)timer - offsetof(conn_data_t, timer));
+
+    atomic_store(&data->timer_fired, true);
+    wake_connection(&data->conn, data);
+}
+
+/* Timer that wakes a throttled connection up once it has the tokens
+ * for its next command */
+static void flood_timer_fired(chirc_timer_t *timer)
+{
+    conn_data_t *data = (conn_data_t *)((char *)timer - offsetof(conn_data_t, flood_timer));
+
+    wake_connection(&data->conn, data);
+}
+
+/* Resumes the command a connection is waiting on and, if it is done,
+ * runs the commands that came after it. Returns false if the
+ * connection was closed. */
+static bool resume_commands(conn_data_t *data)
+{
+    int rc = chirc_handle_resume(data->ctx, &data->conn);
+
+    if (rc == CHIRC_HANDLER_DISCONNECT)
+    {
+        lose_connection(data, CHIRC_EV_DISCONNECT_QUIT);
+        return false;
+    }
+
+    return rc == CHIRC_HANDLER_SUSPEND || handle_commands(data);
+}
+
+/* Writes what the client was sent and reads and runs its commands,
+ * until it has nothing more to say or cannot take more replies, and
+ * then arms the connection to be woken up when it can go on. A client
+ * that does not read its replies is not read from either, so it cannot
+ * make the server queue more of them. Neither is a client whose
+ * command is waiting for I/O, or that is throttled: whatever it waits
+ * for wakes the connection up.
+ *
+ * A connection runs at most input_budget commands each time, so a
+ * client that sends thousands of commands at once does not hold up the
+ * others on its worker: once it has run that many, it is queued again
+ * (behind them) to run the rest. Returns false if the connection was
+ * closed. */
+static bool serve_connection(conn_data_t *data)
+{
+    chirc_connection_t *conn = &data->conn;
+    int flushed;
+    ssize_t ret;
+
+    if (atomic_exchange(&data->timer_fired, false) && !check_timeouts(data))
+        return false;
+
+    /* Once a connection is being closed, it only waits for its peer to
+     * take the last replies */
+    if (data->timeout == TIMEOUT_CLOSE)
+        return linger_connection(data);
+
+    if (chirc_handle_waiting(conn) && !resume_commands(data))
+        return data->timeout == TIMEOUT_CLOSE;
+
+    /* The lookup is a handler of its own: while it waits, the client's
+     * commands wait, and it is not read from, like behind any other
+     * suspended handler */
+    if (data->resolve)
+    {
+        data->resolve = false;
+        chirc_handle_lookup(data->ctx, conn, server.lookup_timeout);
+    }
+
+    data->budget = server.input_budget;
+
+    /* The commands that were held back (by flood control, or for the
+     * other connections) go first */
+    if ((data->throttled || data->yielded) && !chirc_handle_waiting(conn) && !handle_commands(data))
+        return data->timeout == TIMEOUT_CLOSE;
+
+    flushed = chirc_connection_flush(conn);
+
+    while (flushed == CHIRC_FLUSH_DONE && !chirc_handle_waiting(conn) && !data->throttled && !data->yielded)
+    {
+        ret = chirc_connection_read(conn, data->buf + data->pos, sizeof(data->buf) - data->pos);
+        if (ret < 0 && errno == EAGAIN)
+        {
+            /* Everything the client sent has been run */
+            data->throttled_since = 0;
+            break;
+        }
+        if (ret <= 0)
+        {
+            lose_connection(data, ret < 0 ? CHIRC_EV_DISCONNECT_ERROR : CHIRC_EV_DISCONNECT_EOF);
+            return false;
+        }
+
+        data->pos += ret;
+        data->last_active = chirc_timers_now();
+        chirc_metrics_count(CHIRC_METRIC_BYTES_IN, ret);
+
+        if (!handle_commands(data))
+            return data->timeout == TIMEOUT_CLOSE;
+
+        flushed = chirc_connection_flush(conn);
+    }
+
+    if (flushed < 0)
+    {
+        lose_connection(data, CHIRC_EV_DISCONNECT_ERROR);
+        return false;
+    }
+
+    /* Other connections can keep sending to a client that does not
+     * read, up to a point */
+    if (chirc_mailbox_bytes(&data->mailbox) > server.sendq)
+    {
+        chilog(INFO, "send queue of connection %lu exceeded!", data->conn_id);
+        lose_connection(data, CHIRC_EV_DISCONNECT_SENDQ);
+        return false;
+    }
+
+    if (flushed == CHIRC_FLUSH_DONE && (chirc_handle_waiting(conn) || data->throttled))
+        return true;
+
+    /* Only once its replies are out, or it would be queued again and
+     * again while its peer does not read them */
+    if (flushed == CHIRC_FLUSH_DONE && data->yielded)
+    {
+        data->requeue = true;
+        return true;
+    }
+
+    if (chirc_connection_arm(conn, flushed == CHIRC_FLUSH_BLOCKED ? CHIRC_ARM_WRITE : CHIRC_ARM_READ) != CHIRC_OK)
+    {
+        lose_connection(data, CHIRC_EV_DISCONNECT_ERROR);
+        return false;
+    }
+
+    return true;
+}
+
+static void free_connection(chirc_task_t *task)
+{
+    conn_data_t *data = (conn_data_t *)((char *)task - offsetof(conn_data_t, task));
+
+    free(data);
+
+    pthread_mutex_lock(&server.lock);
+    server.active--;
+    pthread_cond_broadcast(&server.conns_done);
+    pthread_mutex_unlock(&server.lock);
+}
+
+/* Frees a connection that was closed. Its struct is freed by the
+ * poller, which may still be about to wake it up. */
+static void finish_connection(conn_data_t *data)
+{
+    chirc_capture_conn_close(data->conn_id);
+    chirc_timer_cancel(&data->timer);
+    chirc_timer_cancel(&data->flood_timer);
+    chirc_handle_cancel(data->ctx, &data->conn);
+    chirc_mailbox_free(&data->mailbox);
+    chirc_connection_free(&data->conn);
+    if (data->ip_counted)
+        chirc_iplimit_release(data->addr.sin_addr);
+
+    data->task.run = free_connection;
+    chirc_poller_defer(&data->task);
+}
+
+/* Task that serves a connection on a worker. It runs again for any
+ * wakeup that came while it was running, so nothing that arrived in the
+ * meantime is missed, unless the connection used up its budget: then
+ * it goes to the back of the queue, and its wakeups wait for it there.
+ * Once the connection is closed, late wakeups (from the poller) only
+ * count, and do not queue it again. */
+static void run_connection(chirc_task_t *task)
+{
+    conn_data_t *data = (conn_data_t *)((char *)task - offsetof(conn_data_t, task));
+    bool open = true;
+    int n;
+
+    chirc_connection_own(&data->conn);
+
+    do
+    {
+        n = atomic_load(&data->pending) & ~CONN_CLOSED;
+        if (open && !serve_connection(data))
+        {
+            open = false;
+            atomic_fetch_or(&data->pending, CONN_CLOSED);
+        }
+        /* Still counted as queued, since pending is not taken down */
+        if (data->requeue)
+            break;
+    } while ((atomic_fetch_sub(&data->pending, n) & ~CONN_CLOSED) != n);
+
+    chirc_connection_own(NULL);
+
+    if (data->requeue)
+    {
+        data->requeue = false;
+        chirc_workers_submit(server.workers, &data->task);
+    }
+    else if (!open)
+        finish_connection(data);
+}
+
+/* Ready function of every connection (see chirc_connection_set_ready):
+ * queues the connection, unless it is queued or running already (or
+ * closed) */
+static void wake_connection(chirc_connection_t *conn, void *arg)
+{
+    conn_data_t *data = arg;
+
+    (void) conn;
+
+    if (atomic_fetch_add(&data->pending, 1) == 0)
+        chirc_workers_submit(server.workers, &data->task);
+}
+
+/* See libchirc.h */
+int chirc_init(chirc_ctx_t *ctx, const char *servername, const char *port, const char *oper_passwd)
+{
+    char hbuf[NI_MAXHOST] = {0};
+
+    chirc_ctx_init(ctx);
+    ctx->oper_passwd = sdsnew(oper_passwd);
+
+    if (!servername)
+    {
+        gethostname(hbuf, sizeof(hbuf));
+        servername = hbuf;
+    }
+
+    ctx->network.this_server = calloc(1, sizeof(chirc_server_t));
+    if (!ctx->network.this_server)
+        return CHIRC_FAIL;
+
+    ctx->network.this_server->servername = sdsnew(servername);
+    ctx->network.this_server->hostname = sdsnew(servername);
+    ctx->network.this_server->passwd = NULL;
+    ctx->network.this_server->conn = NULL;
+    ctx->network.this_server->port = port ? sdsnew(port) : NULL;
+
+    return CHIRC_OK;
+}
+
+/* Starts serving a connection: it is queued to run on a worker, which
+ * reads whatever the client has sent already and arms it. A connection
+ * with an address was counted towards its limits (see admit_connection)
+ * and is released when it is freed. */
+static int start_connection(chirc_ctx_t *ctx, chirc_connection_t *conn, struct sockaddr_in *addr)
+{
+    conn_data_t *data = calloc(1, sizeof(conn_data_t));
+
+    if (!data)
+        goto _error;
+
+    data->ctx = ctx;
+    data->conn = *conn;
+    data->conn_id = atomic_fetch_add(&next_conn_id, 1);
+    if (addr)
+    {
+        data->addr = *addr;
+        data->ip_counted = true;
+    }
+    /* Clients are shown with their numeric address until (and unless)
+     * its name is found */
+    if (addr)
+    {
+        char ip[INET_ADDRSTRLEN];
+
+        inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+        data->conn.hostname = sdsnew(ip);
+        data->resolve = server.resolver_threads > 0;
+    }
+    data->task.run = run_connection;
+    data->conn_type = data->conn.type = CONN_TYPE_UNKNOWN;
+    chirc_connection_set_ready(&data->conn, wake_connection, data);
+    chirc_mailbox_init(&data->mailbox);
+    data->conn.mailbox = &data->mailbox;
+    chirc_timer_init(&data->timer, connection_timer_fired);
+    chirc_timer_init(&data->flood_timer, flood_timer_fired);
+    data->timeout = TIMEOUT_REGISTER;
+    data->last_active = chirc_timers_now();
+
+    pthread_mutex_lock(&server.lock);
+    if (!atomic_load(&server.running))
+    {
+        pthread_mutex_unlock(&server.lock);
+        goto _error;
+    }
+    DL_APPEND(server.conns, data);
+    server.active++;
+    pthread_mutex_unlock(&server.lock);
+
+    atomic_fetch_add(&connection_count, 1);
+    atomic_fetch_add(&server.connections_total, 1);
+    chirc_timer_set(&data->timer, (uint64_t) server.register_timeout * 1000);
+    chirc_metrics_conn_open(conn->socket, &data->mailbox);
+    chirc_capture_conn_open(data->conn_id);
+
+    if (chirc_event_enabled(INFO))
+    {
+        char ip[INET_ADDRSTRLEN] = {0};
+        if (AF_INET == data->addr.sin_family)
+            inet_ntop(AF_INET, &data->addr.sin_addr, ip, sizeof(ip));
+        else
+            snprintf(ip, sizeof(ip), "%s", conn->transport->name);
+        chirc_event(INFO, CHIRC_EV_CONNECT, data->conn_id, ip, NULL, ntohs(data->addr.sin_port));
+    }
+
+    wake_connection(&data->conn, data);
+
+    return CHIRC_OK;
+
+_error:
+    if (data)
+        sdsfree(data->conn.hostname);
+    free(data);
+    if (addr)
+        chirc_iplimit_release(addr->sin_addr);
+    chirc_connection_close(conn);
+    return CHIRC_FAIL;
+}
+
+/* Serves a connection that was accepted, unless its address is over
+ * its limits (see chirc_set_ip_limits). A connection that is refused
+ * is sent an ERROR, if it fits in the socket's buffer right away, and
+ * closed: it costs the server nothing more. */
+static void admit_connection(chirc_ctx_t *ctx, int sockfd, struct sockaddr_in *addr)
+{
+    char ip[INET_ADDRSTRLEN], error[128];
+    chirc_connection_t conn;
+    chirc_iplimit_t limit;
+    int len;
+
+    limit = chirc_iplimit_acquire(addr->sin_addr, server.ip_conns, &server.ip_connect);
+    if (limit == CHIRC_IPLIMIT_OK)
+    {
+        chirc_connection_init_socket(&conn, sockfd);
+        start_connection(ctx, &conn, addr);
+        return;
+    }
+
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+    len = snprintf(error, sizeof(error), "ERROR :Closing Link: %s (%s)\r\n", ip,
+                   limit == CHIRC_IPLIMIT_CONNS ? "Too many connections from your host" : "Connecting too fast");
+    if (send(sockfd, error, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        chilog(DEBUG, "could not tell %s why it was refused", ip);
+    close(sockfd);
+
+    chirc_metrics_count(CHIRC_METRIC_REFUSED, 1);
+    chilog(DEBUG, "refused a connection from %s (%s)", ip,
+           limit == CHIRC_IPLIMIT_CONNS ? "too many connections" : "connecting too fast");
+}
+
+/* Accepts connections. The listening socket does not block: once it is
+ * readable, every connection waiting on it is taken, a batch at a time,
+ * and only then are they started, so a crowd of clients reconnecting at
+ * once (e.g., after a restart) drains the backlog quickly. */
+static void *accept_work(void *args)
+{
+    chirc_ctx_t *ctx = args;
+    struct sockaddr_in addrs[ACCEPT_BATCH];
+    int sockfds[ACCEPT_BATCH];
+    struct pollfd pfd = {.fd = server.listenfd, .events = POLLIN};
+    socklen_t addr_len;
+    int n;
+
+    while (atomic_load(&server.running))
+    {
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (atomic_exchange(&server.running, false))
+                chilog(ERROR, "failed to poll the listening socket!");
+            break;
+        }
+
+        do
+        {
+            for (n = 0; n < ACCEPT_BATCH; )
+            {
+                addr_len = sizeof(addrs[n]);
+                sockfds[n] = accept4(server.listenfd, (struct sockaddr *)&addrs[n], &addr_len,
+                                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (sockfds[n] >= 0)
+                {
+                    n++;
+                    continue;
+                }
+                /* The client gave up while it waited: go on with the
+                 * next one */
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                /* chirc_stop shuts down the listening socket */
+                if (atomic_exchange(&server.running, false))
+                    chilog(ERROR, "failed to accept!");
+                break;
+            }
+
+            for (int i = 0; i < n; i++)
+                admit_connection(ctx, sockfds[i], &addrs[i]);
+        } while (n == ACCEPT_BATCH && atomic_load(&server.running));
+    }
+
+    return NULL;
+}
+
+static int start_listening(chirc_ctx_t *ctx)
+{
+    int port = atoi(ctx->network.this_server->port);
+    int on = 1;
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    server.listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server.listenfd < 0)
+    {
+        chilog(ERROR, "failed to create listenfd: %d!", server.listenfd);
+        return CHIRC_FAIL;
+    }
+
+    setsockopt(server.listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(server.listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        chilog(ERROR, "failed to bind!");
+        goto _error;
+    }
+
+    /* As long a backlog as the system allows, for reconnection storms */
+    if (listen(server.listenfd, SOMAXCONN) < 0)
+    {
+        chilog(ERROR, "failed to listen!");
+        goto _error;
+    }
+
+    if (pthread_create(&server.accept_thread, NULL, accept_work, ctx) != 0)
+    {
+        chilog(ERROR, "failed to create the accept thread!");
+        goto _error;
+    }
+
+    return CHIRC_OK;
+
+_error:
+    close(server.listenfd);
+    server.listenfd = -1;
+    return CHIRC_FAIL;
+}
+
+/* Number of workers when chirc_set_workers was not called: one per CPU.
+ * A worker never waits for a client (replies wait in mailboxes and are
+ * written without blocking, and host lookups suspend the connection),
+ * but it can wait for a lock or run a long command, so small machines
+ * still get a few. */
+static int default_workers(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return cpus > 4 ? cpus : 4;
+}
+
+/* See libchirc.h */
+void chirc_set_workers(chirc_ctx_t *ctx, int nthreads, size_t stack_size)
+{
+    (void) ctx;
+
+    server.nworkers = nthreads;
+    server.worker_stack = stack_size;
+}
+
+/* See libchirc.h */
+void chirc_set_sendq(chirc_ctx_t *ctx, size_t bytes)
+{
+    (void) ctx;
+
+    server.sendq = bytes > 0 ? bytes : CHIRC_DEFAULT_SENDQ;
+}
+
+/* See libchirc.h */
+void chirc_set_timeouts(chirc_ctx_t *ctx, int register_timeout, int ping_interval, int ping_timeout)
+{
+    (void) ctx;
+
+    server.register_timeout = register_timeout > 0 ? register_timeout : CHIRC_DEFAULT_REGISTER_TIMEOUT;
+    server.ping_interval = ping_interval > 0 ? ping_interval : CHIRC_DEFAULT_PING_INTERVAL;
+    server.ping_timeout = ping_timeout > 0 ? ping_timeout : CHIRC_DEFAULT_PING_TIMEOUT;
+}
+
+/* See libchirc.h */
+void chirc_set_input_budget(chirc_ctx_t *ctx, int commands)
+{
+    (void) ctx;
+
+    server.input_budget = commands > 0 ? commands : CHIRC_DEFAULT_INPUT_BUDGET;
+}
+
+/* See libchirc.h */
+void chirc_set_flood(chirc_ctx_t *ctx, conn_type_t type, int rate, int burst)
+{
+    static const chirc_flood_limit_t defaults[] = {
+        {CHIRC_DEFAULT_UNREG_FLOOD_RATE, CHIRC_DEFAULT_UNREG_FLOOD_BURST},
+        {CHIRC_DEFAULT_FLOOD_RATE, CHIRC_DEFAULT_FLOOD_BURST}
+    };
+
+    (void) ctx;
+
+    /* Server links are never limited */
+    if (type != CONN_TYPE_UNKNOWN && type != CONN_TYPE_USER)
+        return;
+
+    server.flood[type].rate = rate != 0 ? rate : defaults[type].rate;
+    server.flood[type].burst = burst > 0 ? burst : defaults[type].burst;
+}
+
+/* See libchirc.h */
+void chirc_set_ip_limits(chirc_ctx_t *ctx, int max_conns, int rate, int burst)
+{
+    (void) ctx;
+
+    server.ip_conns = max_conns != 0 ? max_conns : CHIRC_DEFAULT_IP_CONNS;
+    server.ip_connect.rate = rate != 0 ? rate : CHIRC_DEFAULT_IP_CONNECT_RATE;
+    server.ip_connect.burst = burst > 0 ? burst : CHIRC_DEFAULT_IP_CONNECT_BURST;
+}
+
+/* See libchirc.h */
+void chirc_set_resolver(chirc_ctx_t *ctx, int nthreads, int ttl, int timeout_ms)
+{
+    (void) ctx;
+
+    server.resolver_threads = nthreads != 0 ? nthreads : CHIRC_DEFAULT_RESOLVER_THREADS;
+    server.dns_ttl = ttl > 0 ? ttl : CHIRC_DEFAULT_DNS_TTL;
+    server.lookup_timeout = timeout_ms > 0 ? timeout_ms : CHIRC_DEFAULT_LOOKUP_TIMEOUT;
+}
+
+/* See libchirc.h */
+int chirc_start(chirc_ctx_t *ctx)
+{
+    if (server.started)
+    {
+        chilog(ERROR, "the server is already running!");
+        return CHIRC_FAIL;
+    }
+
+    for (int c = 0; c < CHIRC_METRIC_COUNT; c++)
+        server.base[c] = chirc_metrics_total(c);
+    atomic_store(&server.connections_total, 0);
+
+    server.workers = chirc_workers_start(server.nworkers > 0 ? server.nworkers : default_workers(),
+                                         server.worker_stack);
+    if (!server.workers)
+        return CHIRC_FAIL;
+
+    if (chirc_poller_start() != CHIRC_OK)
+        goto _error;
+
+    if (server.resolver_threads > 0 && chirc_resolver_start(server.resolver_threads, server.dns_ttl) != CHIRC_OK)
+    {
+        chirc_poller_stop();
+        goto _error;
+    }
+
+    atomic_store(&server.running, true);
+
+    if (ctx->network.this_server->port && start_listening(ctx) != CHIRC_OK)
+    {
+        atomic_store(&server.running, false);
+        chirc_resolver_stop();
+        chirc_poller_stop();
+        goto _error;
+    }
+
+    server.started = true;
+
+    return CHIRC_OK;
+
+_error:
+    chirc_workers_stop(server.workers);
+    server.workers = NULL;
+    return CHIRC_FAIL;
+}
+
+/* See libchirc.h */
+bool chirc_is_running(chirc_ctx_t *ctx)
+{
+    (void) ctx;
+
+    return atomic_load(&server.running);
+}
+
+/* See libchirc.h */
+void chirc_stop(chirc_ctx_t *ctx)
+{
+    conn_data_t *data;
+
+    (void) ctx;
+
+    if (!server.started)
+        return;
+
+    pthread_mutex_lock(&server.lock);
+    atomic_store(&server.running, false);
+    pthread_mutex_unlock(&server.lock);
+
+    if (server.listenfd >= 0)
+    {
+        /* Wakes the accept thread up, and makes accept4() fail */
+        shutdown(server.listenfd, SHUT_RDWR);
+        pthread_join(server.accept_thread, NULL);
+        close(server.listenfd);
+        server.listenfd = -1;
+    }
+
+    pthread_mutex_lock(&server.lock);
+    DL_FOREACH(server.conns, data)
+        chirc_connection_shutdown(&data->conn);
+    while (server.active > 0)
+        pthread_cond_wait(&server.conns_done, &server.lock);
+    pthread_mutex_unlock(&server.lock);
+
+    chirc_iplimit_clear();
+    chirc_resolver_stop();
+
+    chirc_poller_stop();
+    chirc_workers_stop(server.workers);
+    server.workers = NULL;
+
+    chilog(INFO, "program is exited!");
+
+    /* Every connection removed its own entries, but the tables can
+     * still hold nicks and users from connections that left without
+     * registering under them */
+    free_connection_map_node(&connection_hash);
+    free_sockfd_nick_map_node(&sockfd_nick_hash);
+    free_user_node(nick_head);
+    free_user_node(user_head);
+    nick_head = NULL;
+    user_head = NULL;
+    for (int t = 0; t < CHIRC_TABLE_COUNT; t++)
+        chirc_metrics_table(t, -chirc_metrics_table_size(t));
+
+    server.started = false;
+}
+
+/* See libchirc.h */
+int chirc_inject_connection(chirc_ctx_t *ctx, chirc_connection_t *conn)
+{
+    return start_connection(ctx, conn, NULL);
+}
+
+/* See libchirc.h */
+chirc_duplex_t *chirc_connect_duplex(chirc_ctx_t *ctx)
+{
+    chirc_connection_t conn;
+    chirc_duplex_t *duplex = chirc_duplex_new(0);
+
+    if (!duplex)
+        return NULL;
+
+    chirc_connection_init_duplex(&conn, duplex);
+    if (chirc_inject_connection(ctx, &conn) != CHIRC_OK)
+    {
+        /* The server's end was closed already */
+        chirc_duplex_client_close(duplex);
+        return NULL;
+    }
+
+    return duplex;
+}
+
+/* See libchirc.h */
+void chirc_get_stats(chirc_ctx_t *ctx, chirc_stats_t *stats)
+{
+    (void) ctx;
+
+    stats->connections = atomic_load(&connection_count);
+    stats->users = chirc_metrics_table_size(CHIRC_TABLE_CONNECTIONS);
+    stats->connections_total = atomic_load(&server.connections_total);
+    stats->workers = chirc_workers_count(server.workers);
+    stats->bytes_in = chirc_metrics_total(CHIRC_METRIC_BYTES_IN) - server.base[CHIRC_METRIC_BYTES_IN];
+    stats->bytes_out = chirc_metrics_total(CHIRC_METRIC_BYTES_OUT) - server.base[CHIRC_METRIC_BYTES_OUT];
+    stats->lines_in = chirc_metrics_total(CHIRC_METRIC_LINES_IN) - server.base[CHIRC_METRIC_LINES_IN];
+    stats->lines_out = chirc_metrics_total(CHIRC_METRIC_LINES_OUT) - server.base[CHIRC_METRIC_LINES_OUT];
+}
@@ -0,0 +1,285 @@
+/*! \file libchirc.h
+ *  \brief Embedding API for the chirc server
+ *
+ *  The server core is built as a static library (libchirc.a), which
+ *  the chirc executable, the benchmarks and other programs link
+ *  against. This module is the library's entry point: it initializes
+ *  a server context, starts and stops the server, hands it connections
+ *  that did not come from its listening socket, and reports statistics.
+ *
+ *  A typical embedding:
+ *
+ *      chirc_ctx_t ctx;
+ *      chirc_init(&ctx, NULL, "6667", "operpasswd");
+ *      chirc_start(&ctx);
+ *      ...
+ *      chirc_duplex_t *client = chirc_connect_duplex(&ctx);
+ *      chirc_duplex_client_write(client, "NICK amy\r\n", 10, -1);
+ *      ...
+ *      chirc_stop(&ctx);
+ *
+ *  The server does not install signal handlers, and writes to sockets
+ *  without raising SIGPIPE, so it does not interfere with the host
+ *  process. Connections are handled by a fixed pool of worker threads
+ *  (see chirc_set_workers), created by chirc_start; they inherit the
+ *  signal mask of the thread that calls it.
+ *
+ *  The server keeps its user and connection tables in globals, so
+ *  only one server can be running in a process at a time. It can be
+ *  stopped and started again.
+ */
+
+#ifndef LIBCHIRC_H_
+#define LIBCHIRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chirc.h"
+#include "connection.h"
+#include "duplex.h"
+
+/*! \brief Server statistics */
+typedef struct {
+    /*! \brief Open connections (registered or not) */
+    long connections;
+    /*! \brief Registered users */
+    long users;
+    /*! \brief Connections accepted or injected since the server started */
+    unsigned long connections_total;
+    /*! \brief Worker threads handling the connections */
+    int workers;
+    /*! \brief Bytes received from clients */
+    uint64_t bytes_in;
+    /*! \brief Bytes sent to clients */
+    uint64_t bytes_out;
+    /*! \brief Lines received from clients */
+    uint64_t lines_in;
+    /*! \brief Lines sent to clients */
+    uint64_t lines_out;
+} chirc_stats_t;
+
+/*! \brief Initializes a server context for a standalone server
+ *
+ * \param ctx Server context (allocated by the caller)
+ * \param servername Name of the server (NULL for the host's name)
+ * \param port Port to listen on (NULL not to listen at all, and only
+ *             serve connections given to chirc_inject_connection)
+ * \param oper_passwd Operator password
+ * \return CHIRC_OK on success, CHIRC_FAIL on failure
+ */
+int chirc_init(chirc_ctx_t *ctx, const char *servername, const char *port, const char *oper_passwd);
+
+/*! \brief Sets the size of the worker pool
+ *
+ * Connections are served by a fixed number of worker threads, however
+ * many clients there are; the commands of each connection still run in
+ * order, one at a time. Takes effect the next time the server starts.
+ *
+ * \param ctx Server context
+ * \param nthreads Number of workers (0 for the number of CPUs, and at
+ *                 least 4)
+ * \param stack_size Stack size of each worker, in bytes (0 for the
+ *                   system's default)
+ */
+void chirc_set_workers(chirc_ctx_t *ctx, int nthreads, size_t stack_size);
+
+/*! \brief Default for chirc_set_sendq */
+#define CHIRC_DEFAULT_SENDQ (1024 * 1024)
+
+/*! \brief Sets the most bytes that can wait to be sent to a client
+ *
+ * What is sent to a client waits in its mailbox until the client reads
+ * it. A client that does not read its replies is not read from either,
+ * but other clients can keep sending it messages; once more than this
+ * many bytes are waiting, it is disconnected.
+ *
+ * \param ctx Server context
+ * \param bytes Limit (0 for CHIRC_DEFAULT_SENDQ)
+ */
+void chirc_set_sendq(chirc_ctx_t *ctx, size_t bytes);
+
+/*! \brief Defaults for chirc_set_timeouts, in seconds */
+#define CHIRC_DEFAULT_REGISTER_TIMEOUT (60)
+#define CHIRC_DEFAULT_PING_INTERVAL (120)
+#define CHIRC_DEFAULT_PING_TIMEOUT (60)
+
+/*! \brief Sets how long clients can keep a connection without using it
+ *
+ * A client that has not registered register_timeout seconds after it
+ * connected is disconnected. A client that has not sent anything for
+ * ping_interval seconds is sent a PING, and is disconnected if it has
+ * not sent anything (e.g., a PONG) ping_timeout seconds after that.
+ *
+ * \param ctx Server context
+ * \param register_timeout Seconds to register (0 for the default)
+ * \param ping_interval Seconds of silence before a PING (0 for the default)
+ * \param ping_timeout Seconds to answer a PING (0 for the default)
+ */
+void chirc_set_timeouts(chirc_ctx_t *ctx, int register_timeout, int ping_interval, int ping_timeout);
+
+/*! \brief Default for chirc_set_input_budget */
+#define CHIRC_DEFAULT_INPUT_BUDGET (16)
+
+/*! \brief Sets how many commands a client can run before the others
+ *
+ * A worker runs at most this many of a client's commands before it
+ * goes on with the other clients it has ready; the client's other
+ * commands wait for its next turn. So a client that sends thousands of
+ * commands at once does not hold up clients that send a few.
+ *
+ * \param ctx Server context
+ * \param commands Commands per turn (0 for the default)
+ */
+void chirc_set_input_budget(chirc_ctx_t *ctx, int commands);
+
+/*! \brief Defaults for chirc_set_flood: tokens per second, and tokens
+ *         a client can spend at once, of users and of unregistered
+ *         clients */
+#define CHIRC_DEFAULT_FLOOD_RATE (50)
+#define CHIRC_DEFAULT_FLOOD_BURST (200)
+#define CHIRC_DEFAULT_UNREG_FLOOD_RATE (10)
+#define CHIRC_DEFAULT_UNREG_FLOOD_BURST (20)
+
+/*! \brief Sets how fast a class of clients can send commands
+ *
+ * Every command a client sends costs tokens (one for a PING, more for
+ * commands that make more work, such as a PRIVMSG to a channel;
+ * see flood.h), which come back at rate tokens per second, and the
+ * client can hold up to burst of them. A client that runs out has its
+ * commands wait, and is not read from, until it has the tokens; one
+ * that stays behind for more than 10 seconds is disconnected with an
+ * "Excess Flood" ERROR.
+ *
+ * The classes are unregistered clients (CONN_TYPE_UNKNOWN) and users
+ * (CONN_TYPE_USER). Server links are not limited.
+ *
+ * \param ctx Server context
+ * \param type Class of clients
+ * \param rate Tokens per second (0 for the default, negative for no
+ *             limit)
+ * \param burst Tokens a client can hold (0 for the default)
+ */
+void chirc_set_flood(chirc_ctx_t *ctx, conn_type_t type, int rate, int burst);
+
+/*! \brief Defaults for chirc_set_ip_limits: connections an address can
+ *         have open, connections it can make each second, and
+ *         connections it can make at once */
+#define CHIRC_DEFAULT_IP_CONNS (2000)
+#define CHIRC_DEFAULT_IP_CONNECT_RATE (100)
+#define CHIRC_DEFAULT_IP_CONNECT_BURST (1000)
+
+/*! \brief Sets how many connections a single address can make
+ *
+ * A connection from an address that has max_conns connections open
+ * already, or that has been connecting faster than rate connections per
+ * second (after a burst of up to burst of them), is sent an ERROR and
+ * closed as soon as it is accepted. Connections refused for the rate
+ * count towards it too, so a client that keeps retrying has to slow
+ * down to get in (and then gets in right away). See iplimit.h.
+ *
+ * \param ctx Server context
+ * \param max_conns Connections open (0 for the default, negative for no
+ *                  limit)
+ * \param rate Connections per second (0 for the default, negative for
+ *             no limit)
+ * \param burst Connections at once (0 for the default)
+ */
+void chirc_set_ip_limits(chirc_ctx_t *ctx, int max_conns, int rate, int burst);
+
+/*! \brief Defaults for chirc_set_resolver: resolver threads, seconds a
+ *         name is cached for, and milliseconds a client waits for its
+ *         lookup */
+#define CHIRC_DEFAULT_RESOLVER_THREADS (2)
+#define CHIRC_DEFAULT_DNS_TTL (300)
+#define CHIRC_DEFAULT_LOOKUP_TIMEOUT (1500)
+
+/*! \brief Sets how the names of clients' hosts are looked up
+ *
+ * When a client connects, the name of its address is looked up by a
+ * resolver thread (see resolver.h), and the client is not read from
+ * until it is known, or for at most timeout_ms milliseconds: then it
+ * goes on with its numeric address. Names are cached for ttl seconds.
+ *
+ * \param ctx Server context
+ * \param nthreads Resolver threads (0 for the default, negative to not
+ *                 look names up: clients are shown with their numeric
+ *                 address)
+ * \param ttl Seconds a name is cached for (0 for the default)
+ * \param timeout_ms Milliseconds a client waits for its lookup (0 for
+ *                   the default)
+ */
+void chirc_set_resolver(chirc_ctx_t *ctx, int nthreads, int ttl, int timeout_ms);
+
+/*! \brief Starts the server
+ *
+ * If the server has a port, it starts listening on it, and accepts
+ * connections in a thread of its own; otherwise it only serves
+ * injected connections.
+ *
+ * \param ctx Server context
+ * \return CHIRC_OK on success, CHIRC_FAIL on failure (e.g., if the
+ *         port could not be bound, or a server is already running)
+ */
+int chirc_start(chirc_ctx_t *ctx);
+
+/*! \brief Checks whether the server is running
+ *
+ * The server stops by itself if accepting connections fails (e.g.,
+ * when it runs out of descriptors).
+ *
+ * \param ctx Server context
+ * \return true if the server is running (and accepting connections,
+ *         if it has a port)
+ */
+bool chirc_is_running(chirc_ctx_t *ctx);
+
+/*! \brief Stops the server
+ *
+ * Stops accepting connections, disconnects every client, waits for
+ * their connections to be closed, stops the workers, and empties the
+ * server's tables.
+ * The context itself is not freed.
+ *
+ * \param ctx Server context
+ */
+void chirc_stop(chirc_ctx_t *ctx);
+
+/*! \brief Hands a connection to the server
+ *
+ * The server serves the connection exactly like one it accepted. The
+ * connection must have been initialized with
+ * chirc_connection_init_socket or chirc_connection_init_duplex. The
+ * struct is copied, and the server takes over its transport (e.g., it
+ * closes the socket when the client disconnects).
+ *
+ * \param ctx Server context
+ * \param conn Connection
+ * \return CHIRC_OK on success, CHIRC_FAIL if the server is not running
+ *         or out of memory (the transport is closed in that case)
+ */
+int chirc_inject_connection(chirc_ctx_t *ctx, chirc_connection_t *conn);
+
+/*! \brief Connects an in-process client to the server
+ *
+ * Creates a duplex, injects a connection backed by it, and returns
+ * the client's end (see duplex.h), which the caller must eventually
+ * close with chirc_duplex_client_close.
+ *
+ * \param ctx Server context
+ * \return The client's end of the duplex, or NULL on failure
+ */
+chirc_duplex_t *chirc_connect_duplex(chirc_ctx_t *ctx);
+
+/*! \brief Gets the server's statistics
+ *
+ * Reading the statistics does not take any of the locks used when
+ * handling clients, so it can be done in a tight loop.
+ *
+ * \param ctx Server context
+ * \param stats (Output parameter) Statistics
+ */
+void chirc_get_stats(chirc_ctx_t *ctx, chirc_stats_t *stats);
+
+#endif /* LIBCHIRC_H_ */
@@ -1,62 +1,407 @@
 /* See log.h for details about the functions in this module */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #include "log.h"
 
 
 /* Logging level. Set by default to print just informational messages */
-static int loglevel = INFO;
+int chirc_loglevel = INFO;
 
+/* Maximum length of a single (formatted) log message when logging
+ * asynchronously. Longer messages are truncated. */
+#define LOG_RECORD_MAX (480)
 
-void chirc_setloglevel(loglevel_t level)
+/* How long the writer thread sleeps when there is nothing to write */
+#define LOG_WRITER_IDLE_NS (5 * 1000 * 1000)
+
+/* Kinds of records in a log ring */
+#define LOG_RECORD_TEXT  (0)
+#define LOG_RECORD_EVENT (1)
+
+/* A log message (or structured event) waiting in a ring to be written out.
+ * For events, text holds the subject immediately followed by the target. */
+typedef struct
 {
-    loglevel = level;
-}
+    int kind;
+    loglevel_t level;
+    uint64_t time_ms;
+    unsigned int len;
+    int event_type;
+    unsigned long conn_id;
+    unsigned long value;
+    unsigned int subject_len;
+    unsigned int target_len;
+    char text[LOG_RECORD_MAX];
+} log_record_t;
 
-/* This function does the actual logging and is called by chilog().
- * It has a va_list parameter instead of being a variadic function */
-void __chilog(loglevel_t level, char *fmt, va_list argptr)
+/* Single-producer/single-consumer ring. The producer is the thread
+ * that owns the ring (in_use), the consumer is the writer thread.
+ * Rings are never freed while the writer is running: when a thread
+ * exits, its ring is released and can be claimed by a new thread. */
+typedef struct log_ring
 {
-    time_t t;
-    char buf[80], *levelstr;
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    atomic_ulong dropped;
+    atomic_bool in_use;
+    atomic_bool busy;
+    size_t mask;
+    log_record_t *slots;
+    struct log_ring *next;
+} log_ring_t;
 
-    if(level > loglevel)
-        return;
+static struct
+{
+    atomic_bool running;
+    atomic_bool stopping;
+    log_overflow_t overflow;
+    unsigned int ring_size;
+    _Atomic(log_ring_t *) rings;
+    atomic_ulong dropped;
+    _Atomic uint64_t clock_ms;
+    chirc_log_event_sink_t event_sink;
+    pthread_mutex_t sink_lock;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_key_t ring_key;
+    bool key_created;
+} async_log = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .sink_lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+};
 
-    t = time(NULL);
-    strftime(buf,80,"%Y-%m-%d %H:%M:%S",localtime(&t));
+static __thread log_ring_t *thread_ring = NULL;
 
+
+void chirc_setloglevel(loglevel_t level)
+{
+    chirc_loglevel = level;
+}
+
+/* See log.h */
+char *chirc_loglevel_str(loglevel_t level)
+{
     switch(level)
     {
     case CRITICAL:
-        levelstr = "CRITIC";
-        break;
+        return "CRITIC";
     case ERROR:
-        levelstr = "ERROR";
-        break;
+        return "ERROR";
     case WARNING:
-        levelstr = "WARN";
-        break;
+        return "WARN";
     case INFO:
-        levelstr = "INFO";
-        break;
+        return "INFO";
     case DEBUG:
-        levelstr = "DEBUG";
-        break;
+        return "DEBUG";
     case TRACE:
-        levelstr = "TRACE";
-        break;
+        return "TRACE";
     default:
-        levelstr = "UNKNOWN";
-        break;
+        return "UNKNOWN";
     }
+}
+
+/* Called when a thread that owns a ring exits */
+static void release_ring(void *arg)
+{
+    log_ring_t *ring = arg;
+
+    atomic_store_explicit(&ring->in_use, false, memory_order_release);
+}
+
+/* Returns the calling thread's ring, claiming a released ring or
+ * allocating a new one if the thread doesn't have one yet */
+static log_ring_t *get_ring()
+{
+    log_ring_t *ring;
+
+    if (thread_ring)
+        return thread_ring;
+
+    for (ring = atomic_load(&async_log.rings); ring != NULL; ring = ring->next)
+    {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ring->in_use, &expected, true))
+            break;
+    }
+
+    if (!ring)
+    {
+        ring = calloc(1, sizeof(log_ring_t));
+        if (!ring)
+            return NULL;
+        ring->slots = calloc(async_log.ring_size, sizeof(log_record_t));
+        if (!ring->slots)
+        {
+            free(ring);
+            return NULL;
+        }
+        ring->mask = async_log.ring_size - 1;
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->dropped, 0);
+        atomic_init(&ring->in_use, true);
+        atomic_init(&ring->busy, false);
+
+        ring->next = atomic_load(&async_log.rings);
+        while (!atomic_compare_exchange_weak(&async_log.rings, &ring->next, ring))
+            ;
+    }
+
+    pthread_setspecific(async_log.ring_key, ring);
+    thread_ring = ring;
+
+    return ring;
+}
+
+static uint64_t wallclock_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Sentinel returned by reserve() when the message was dropped */
+static log_record_t dropped_record;
+
+/* Reserves the next slot in the calling thread's ring. Returns
+ * &dropped_record if the ring is full and the message must be
+ * dropped, or NULL if the message could not be queued and should
+ * be handled synchronously. Otherwise, the caller fills in the
+ * record and calls commit(). */
+static log_record_t *reserve(log_ring_t *ring)
+{
+    size_t head, tail;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    while (head - tail > ring->mask)
+    {
+        if (async_log.overflow == LOG_OVERFLOW_DROP)
+        {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return &dropped_record;
+        }
+
+        if (!atomic_load(&async_log.running))
+            return NULL;
+
+        pthread_cond_signal(&async_log.wakeup);
+        sched_yield();
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    }
+
+    return &ring->slots[head & ring->mask];
+}
+
+static void commit(log_ring_t *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Claims the calling thread's ring for one message. Returns NULL if
+ * the asynchronous writer is not running. The busy flag lets
+ * chirc_log_stop wait for producers that saw running == true
+ * before it was cleared. */
+static log_ring_t *begin_async()
+{
+    log_ring_t *ring;
+
+    if (!atomic_load_explicit(&async_log.running, memory_order_acquire))
+        return NULL;
+
+    ring = get_ring();
+    if (!ring)
+        return NULL;
+
+    atomic_store(&ring->busy, true);
+    if (!atomic_load(&async_log.running))
+    {
+        atomic_store_explicit(&ring->busy, false, memory_order_release);
+        return NULL;
+    }
+
+    return ring;
+}
+
+static void end_async(log_ring_t *ring)
+{
+    atomic_store_explicit(&ring->busy, false, memory_order_release);
+}
+
+/* Hands an event to the event sink (if there is one) */
+static void deliver_event(chirc_log_event_t *ev)
+{
+    pthread_mutex_lock(&async_log.sink_lock);
+    if (async_log.event_sink)
+        async_log.event_sink(ev);
+    pthread_mutex_unlock(&async_log.sink_lock);
+}
+
+/* Writes out everything that is currently queued. Must only be
+ * called from the writer thread (or once the writer has exited).
+ * Returns the number of messages written. */
+static size_t drain_rings()
+{
+    static time_t last_t = (time_t) -1;
+    static char tbuf[80];
+    size_t written = 0;
+
+    for (log_ring_t *ring = atomic_load(&async_log.rings); ring != NULL; ring = ring->next)
+    {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long dropped;
+
+        for (; tail != head; tail++)
+        {
+            log_record_t *rec = &ring->slots[tail & ring->mask];
+            time_t t = rec->time_ms / 1000;
+
+            if (rec->kind == LOG_RECORD_EVENT)
+            {
+                chirc_log_event_t ev = {
+                    .level = rec->level,
+                    .type = rec->event_type,
+                    .time_ms = rec->time_ms,
+                    .conn_id = rec->conn_id,
+                    .subject = rec->subject_len ? rec->text : NULL,
+                    .subject_len = rec->subject_len,
+                    .target = rec->target_len ? rec->text + rec->subject_len : NULL,
+                    .target_len = rec->target_len,
+                    .value = rec->value
+                };
+                deliver_event(&ev);
+                written++;
+                continue;
+            }
+
+            /* Formatting the date is the expensive part, so we only
+             * do it when the second changes */
+            if (t != last_t)
+            {
+                struct tm tm;
+                localtime_r(&t, &tm);
+                strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+                last_t = t;
+            }
+
+            fprintf(stdout, "[%s] %6s ", tbuf, chirc_loglevel_str(rec->level));
+            fwrite(rec->text, 1, rec->len, stdout);
+            fputc('\n', stdout);
+            written++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped)
+        {
+            atomic_fetch_add(&async_log.dropped, dropped);
+            fprintf(stdout, "[%s] %6s %lu log messages dropped (ring full)\n",
+                    tbuf, chirc_loglevel_str(WARNING), dropped);
+        }
+    }
+
+    return written;
+}
+
+static void *writer_thread(void *args)
+{
+    (void) args;
+
+    while (!atomic_load(&async_log.stopping))
+    {
+        atomic_store_explicit(&async_log.clock_ms, wallclock_ms(), memory_order_relaxed);
+
+        if (drain_rings() == 0)
+        {
+            struct timespec ts;
+
+            fflush(stdout);
+            deliver_event(NULL);
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOG_WRITER_IDLE_NS;
+            if (ts.tv_nsec >= 1000000000L)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+
+            pthread_mutex_lock(&async_log.lock);
+            if (!atomic_load(&async_log.stopping))
+                pthread_cond_timedwait(&async_log.wakeup, &async_log.lock, &ts);
+            pthread_mutex_unlock(&async_log.lock);
+        }
+    }
+
+    /* Final flush: producers that raced with chirc_log_stop may still
+     * have queued messages, so drain until the rings are empty */
+    while (drain_rings() > 0)
+        ;
+    fflush(stdout);
+    deliver_event(NULL);
+
+    return NULL;
+}
+
+/* This function does the actual logging and is called by chilog().
+ * It has a va_list parameter instead of being a variadic function */
+void __chilog(loglevel_t level, char *fmt, va_list argptr)
+{
+    time_t t;
+    char buf[80];
+
+    if((int) level > chirc_loglevel)
+        return;
+
+    log_ring_t *ring = begin_async();
+
+    if (ring)
+    {
+        log_record_t *rec = reserve(ring);
+
+        if (rec && rec != &dropped_record)
+        {
+            va_list copy;
+            int n;
+
+            rec->kind = LOG_RECORD_TEXT;
+            rec->level = level;
+            rec->time_ms = atomic_load_explicit(&async_log.clock_ms, memory_order_relaxed);
+            va_copy(copy, argptr);
+            n = vsnprintf(rec->text, LOG_RECORD_MAX, fmt, copy);
+            va_end(copy);
+            rec->len = (n < 0) ? 0 : (n >= LOG_RECORD_MAX ? LOG_RECORD_MAX - 1 : n);
+            commit(ring);
+        }
+        end_async(ring);
+
+        if (rec)
+            return;
+    }
+
+    t = time(NULL);
+    strftime(buf,80,"%Y-%m-%d %H:%M:%S",localtime(&t));
 
     flockfile(stdout);
-    printf("[%s] %6s ", buf, levelstr);
+    printf("[%s] %6s ", buf, chirc_loglevel_str(level));
 
     vprintf(fmt, argptr);
     printf("\n");
@@ -65,7 +410,7 @@ void __chilog(loglevel_t level, char *fmt, va_list argptr)
 }
 
 /* See log.h */
-void chilog(loglevel_t level, char *fmt, ...)
+void chilog_write(loglevel_t level, char *fmt, ...)
 {
     va_list argptr;
 
@@ -75,31 +420,33 @@ void chilog(loglevel_t level, char *fmt, ...)
 }
 
 /* See log.h */
-void serverlog(loglevel_t level, chirc_connection_t *conn, char *fmt, ...)
+void serverlog_write(loglevel_t level, chirc_connection_t *conn, char *fmt, ...)
 {
     char buf[256];
 
+    buf[0] = '\0';
+
     if (conn)
     {
         if(conn->type == CONN_TYPE_UNKNOWN)
         {
-            sprintf(buf, "%s -- ", conn->hostname);
+            snprintf(buf, sizeof(buf), "%s -- ", conn->hostname);
         }
         else if(conn->type == CONN_TYPE_USER)
         {
+            /* The server core keeps its users in its own tables, so
+             * a user's connection may have no chirc_user_t */
             chirc_user_t *user = conn->peer.user;
-            if(user->nick)
-                sprintf(buf, "%s!%s@%s -- ", user->nick, user->username, conn->hostname);
+            if(user && user->nick)
+                snprintf(buf, sizeof(buf), "%s!%s@%s -- ", user->nick, user->username, conn->hostname);
             else
-                sprintf(buf, "unknown!unknown@%s -- ", conn->hostname);
+                snprintf(buf, sizeof(buf), "unknown!unknown@%s -- ", conn->hostname);
         }
         else if (conn->type == CONN_TYPE_SERVER)
         {
-            sprintf(buf, "%s -- ", conn->peer.server->servername);
+            snprintf(buf, sizeof(buf), "%s -- ", conn->peer.server->servername);
         }
     }
-    else
-        buf[0] = '\0';
 
     strncat(buf, fmt, 256 - strlen(buf) - 1);
 
@@ -109,3 +456,125 @@ void serverlog(loglevel_t level, chirc_connection_t *conn, char *fmt, ...)
     __chilog(level, buf, argptr);
     va_end(argptr);
 }
+
+/* See log.h */
+int chirc_log_start(log_overflow_t overflow, unsigned int ring_size)
+{
+    unsigned int size = 2;
+
+    if (atomic_load(&async_log.running))
+        return CHIRC_OK;
+
+    /* A negative size from the environment ends up here as a huge one,
+     * which would never be reached by doubling */
+    if (ring_size > CHIRC_LOG_RING_MAX)
+        return CHIRC_FAIL;
+
+    while (size < ring_size)
+        size <<= 1;
+
+    if (!async_log.key_created)
+    {
+        if (pthread_key_create(&async_log.ring_key, release_ring) != 0)
+            return CHIRC_FAIL;
+        async_log.key_created = true;
+    }
+
+    async_log.overflow = overflow;
+    async_log.ring_size = size;
+    atomic_store(&async_log.stopping, false);
+    atomic_store(&async_log.clock_ms, wallclock_ms());
+
+    if (pthread_create(&async_log.writer, NULL, writer_thread, NULL) != 0)
+        return CHIRC_FAIL;
+
+    atomic_store_explicit(&async_log.running, true, memory_order_release);
+
+    return CHIRC_OK;
+}
+
+/* See log.h */
+void chirc_log_stop(void)
+{
+    if (!atomic_exchange(&async_log.running, false))
+        return;
+
+    for (log_ring_t *ring = atomic_load(&async_log.rings); ring != NULL; ring = ring->next)
+        while (atomic_load(&ring->busy))
+            sched_yield();
+
+    pthread_mutex_lock(&async_log.lock);
+    atomic_store(&async_log.stopping, true);
+    pthread_cond_signal(&async_log.wakeup);
+    pthread_mutex_unlock(&async_log.lock);
+
+    pthread_join(async_log.writer, NULL);
+}
+
+/* See log.h */
+unsigned long chirc_log_dropped(void)
+{
+    return atomic_load(&async_log.dropped);
+}
+
+/* See log.h */
+uint64_t chirc_log_clock_ms(void)
+{
+    if (atomic_load_explicit(&async_log.running, memory_order_relaxed))
+        return atomic_load_explicit(&async_log.clock_ms, memory_order_relaxed);
+
+    return wallclock_ms();
+}
+
+/* See log.h */
+void chirc_log_set_event_sink(chirc_log_event_sink_t sink)
+{
+    pthread_mutex_lock(&async_log.sink_lock);
+    async_log.event_sink = sink;
+    pthread_mutex_unlock(&async_log.sink_lock);
+}
+
+/* See log.h */
+void chirc_log_event(chirc_log_event_t *ev)
+{
+    log_ring_t *ring = begin_async();
+
+    if (ring)
+    {
+        log_record_t *rec = reserve(ring);
+
+        if (rec && rec != &dropped_record)
+        {
+            unsigned int subject_len = ev->subject ? ev->subject_len : 0;
+            unsigned int target_len = ev->target ? ev->target_len : 0;
+
+            /* Strings that don't fit are truncated */
+            if (subject_len > LOG_RECORD_MAX / 2)
+                subject_len = LOG_RECORD_MAX / 2;
+            if (subject_len + target_len > LOG_RECORD_MAX)
+                target_len = LOG_RECORD_MAX - subject_len;
+
+            rec->kind = LOG_RECORD_EVENT;
+            rec->level = ev->level;
+            rec->time_ms = atomic_load_explicit(&async_log.clock_ms, memory_order_relaxed);
+            rec->event_type = ev->type;
+            rec->conn_id = ev->conn_id;
+            rec->value = ev->value;
+            rec->subject_len = subject_len;
+            rec->target_len = target_len;
+            /* subject and target are NULL when they are not given */
+            if (subject_len)
+                memcpy(rec->text, ev->subject, subject_len);
+            if (target_len)
+                memcpy(rec->text + subject_len, ev->target, target_len);
+            commit(ring);
+        }
+        end_async(ring);
+
+        if (rec)
+            return;
+    }
+
+    ev->time_ms = wallclock_ms();
+    deliver_event(ev);
+}
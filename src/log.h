@@ -11,11 +11,20 @@
  *  DEBUG: Lower-level information
  *  TRACE: Very low-level information.
  *
+ *  By default, messages are written synchronously to stdout. Once
+ *  chirc_log_start has been called, chilog only copies the formatted
+ *  message into a ring buffer owned by the calling thread, and a
+ *  background writer thread takes care of timestamping, printing and
+ *  flushing. chirc_log_stop drains every ring before returning, so
+ *  no message that was accepted into a ring is lost on shutdown.
+ *
  */
 
 #ifndef CHIRC_LOG_H_
 #define CHIRC_LOG_H_
 
+#include <stdint.h>
+
 #include "connection.h"
 
 /*! \brief Log levels */
@@ -29,6 +38,14 @@ typedef enum {
     TRACE    = 60
 } loglevel_t;
 
+/*! \brief What to do when a thread's log ring is full */
+typedef enum {
+    /*! Discard the message (the writer reports how many were dropped) */
+    LOG_OVERFLOW_DROP  = 0,
+    /*! Wait until the writer thread frees up a slot */
+    LOG_OVERFLOW_BLOCK = 1
+} log_overflow_t;
+
 /*! \brief Sets the logging level
  *
  * When a log level is set, all messages at that level or "worse" are
@@ -39,24 +56,161 @@ typedef enum {
  */
 void chirc_setloglevel(loglevel_t level);
 
+/*! \brief Returns the name of a logging level (as it appears in the log)
+ *
+ * \param level Logging level
+ * \return Name of the level (e.g., "WARN")
+ */
+char *chirc_loglevel_str(loglevel_t level);
+
+/*! \brief Compile-time logging level
+ *
+ * Log calls for levels above this one are compiled out entirely.
+ * Release builds set it to INFO (see CMakeLists.txt), so TRACE and
+ * DEBUG messages cost nothing there.
+ */
+#ifndef CHIRC_LOG_COMPILE_LEVEL
+#define CHIRC_LOG_COMPILE_LEVEL TRACE
+#endif
+
+/*! \brief Current (run-time) logging level. Use chirc_setloglevel to change it. */
+extern int chirc_loglevel;
+
+/*! \brief Checks whether a message at the given level would be printed
+ *
+ * Useful to guard code that only exists to build a log message.
+ *
+ * \param level Logging level of the message
+ */
+#define chilog_enabled(level) \
+    ((level) <= CHIRC_LOG_COMPILE_LEVEL && (level) <= chirc_loglevel)
+
 /*! \brief Print a log message
+ *
+ * This is a macro: the level is checked before any of the other
+ * arguments are evaluated, so a disabled log call costs a single
+ * comparison (or nothing at all, if the level is compiled out).
  *
  * \param level Logging level of the message
  * \param fmt printf-style formatting string
  * \param ... Extra parameters if needed by fmt
  */
-void chilog(loglevel_t level, char *fmt, ...);
+#define chilog(level, ...) \
+    do { if (chilog_enabled(level)) chilog_write(level, __VA_ARGS__); } while (0)
 
-/*! \brief Convenience function for logging information related to a connection
+/*! \brief Convenience macro for logging information related to a connection
  *
- * This function is a wrapper around chilog, and will include useful information
- * about a connection in the log message.
+ * This is a wrapper around chilog, and will include useful information
+ * about a connection in the log message. Like chilog, the connection
+ * prefix is only built if the message is going to be printed.
  *
  * \param level Logging level of the message
  * \param conn Connection
  * \param fmt printf-style formatting string
  * \param ... Extra parameters if needed by fmt
  */
-void serverlog(loglevel_t level, chirc_connection_t *conn, char *fmt, ...);
+#define serverlog(level, conn, ...) \
+    do { if (chilog_enabled(level)) serverlog_write(level, conn, __VA_ARGS__); } while (0)
+
+/*! \brief Print a log message (without checking the logging level first)
+ *
+ * Use the chilog macro instead of calling this function directly.
+ */
+void chilog_write(loglevel_t level, char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*! \brief Print a log message with connection information (without
+ *         checking the logging level first)
+ *
+ * Use the serverlog macro instead of calling this function directly.
+ */
+void serverlog_write(loglevel_t level, chirc_connection_t *conn, char *fmt, ...);
+
+/*! \brief Largest ring chirc_log_start accepts, in messages */
+#define CHIRC_LOG_RING_MAX (1 << 20)
+
+/*! \brief Starts the asynchronous log writer
+ *
+ * After this call, log messages are queued in per-thread lock-free
+ * ring buffers and written out by a background thread.
+ *
+ * \param overflow What to do when a thread's ring is full
+ * \param ring_size Number of messages each per-thread ring can hold
+ *                  (rounded up to a power of two, and at least 2). A
+ *                  size over CHIRC_LOG_RING_MAX is refused
+ * \return 0 on success, non-zero on failure (in which case logging
+ *         remains synchronous)
+ */
+int chirc_log_start(log_overflow_t overflow, unsigned int ring_size);
+
+/*! \brief Stops the asynchronous log writer
+ *
+ * Blocks until every pending message has been written and flushed.
+ * Logging reverts to being synchronous after this call. It is safe
+ * to call this function more than once, or if chirc_log_start was
+ * never called.
+ */
+void chirc_log_stop(void);
+
+/*! \brief Number of messages dropped because a log ring was full
+ *
+ * \return Total number of dropped messages since the writer started
+ */
+unsigned long chirc_log_dropped(void);
+
+/*! \brief A structured event
+ *
+ * Events travel through the same per-thread rings as log messages,
+ * but instead of being printed they are handed to the event sink
+ * (see eventlog.h, which encodes them into a binary event log).
+ * The subject and target strings are not NUL-terminated.
+ */
+typedef struct {
+    /*! \brief Logging level of the event */
+    loglevel_t level;
+    /*! \brief Event type (see eventlog.h) */
+    int type;
+    /*! \brief Milliseconds since the epoch (filled in by the logger) */
+    uint64_t time_ms;
+    /*! \brief Connection the event relates to */
+    unsigned long conn_id;
+    /*! \brief Subject of the event (e.g., a nick). Can be NULL. */
+    const char *subject;
+    unsigned int subject_len;
+    /*! \brief Target of the event (e.g., a channel). Can be NULL. */
+    const char *target;
+    unsigned int target_len;
+    /*! \brief Event-specific numeric value */
+    unsigned long value;
+} chirc_log_event_t;
+
+/*! \brief Receives events from the logger
+ *
+ * Called from the writer thread (or, if the writer is not running,
+ * from the thread that logged the event), never concurrently.
+ * A NULL event means there is nothing else to write for now, and
+ * the sink should flush any buffered output.
+ */
+typedef void (*chirc_log_event_sink_t)(chirc_log_event_t *ev);
+
+/*! \brief Sets (or, with NULL, clears) the event sink */
+void chirc_log_set_event_sink(chirc_log_event_sink_t sink);
+
+/*! \brief Queues a structured event
+ *
+ * The strings in the event are copied, so they only need to remain
+ * valid for the duration of the call. The level is not checked.
+ *
+ * \param ev Event (time_ms is ignored)
+ */
+void chirc_log_event(chirc_log_event_t *ev);
+
+/*! \brief Cached wall-clock time, in milliseconds since the epoch
+ *
+ * While the asynchronous writer is running, this is a value that the
+ * writer refreshes every few milliseconds (so reading it is just a
+ * memory load). Otherwise, the clock is read directly.
+ */
+uint64_t chirc_log_clock_ms(void);
 
 #endif /* CHIRC_LOG_H_ */
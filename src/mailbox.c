@@ -0,0 +1,196 @@
+/* See mailbox.h for details about the functions in this module */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mailbox.h"
+#include "chirc.h"
+
+
+static void push(chirc_mailqueue_t *q, chirc_maillink_t *link)
+{
+    chirc_maillink_t *prev;
+
+    atomic_store_explicit(&link->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&q->head, link, memory_order_acq_rel);
+    /* Until this store, the consumer cannot get past prev */
+    atomic_store_explicit(&prev->next, link, memory_order_release);
+}
+
+/* Takes the first buffer out of the queue, or returns NULL if there is
+ * none, or if the next one is still being linked in */
+static chirc_outbuf_t *pop(chirc_mailqueue_t *q)
+{
+    chirc_maillink_t *tail = q->tail;
+    chirc_maillink_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub)
+    {
+        if (!next)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next)
+    {
+        q->tail = next;
+        return (chirc_outbuf_t *) tail;
+    }
+
+    /* tail is the last link, unless a producer is linking another one
+     * after it; the stub is put back behind it so it can be taken */
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+
+    push(q, &q->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next)
+    {
+        q->tail = next;
+        return (chirc_outbuf_t *) tail;
+    }
+
+    return NULL;
+}
+
+/* Takes the buffer to write next: the first one of the highest
+ * priority, unless a lower priority has been passed over too often */
+static chirc_outbuf_t *take(chirc_mailbox_t *mb)
+{
+    chirc_outbuf_t *ob = NULL;
+    int prio;
+
+    for (prio = CHIRC_PRIO_COUNT - 1; prio > 0; prio--)
+        if (mb->queues[prio].passed >= CHIRC_MAILBOX_STARVE_LIMIT && (ob = pop(&mb->queues[prio])) != NULL)
+            break;
+
+    if (!ob)
+        for (prio = 0; prio < CHIRC_PRIO_COUNT; prio++)
+            if ((ob = pop(&mb->queues[prio])) != NULL)
+                break;
+
+    if (!ob)
+        return NULL;
+
+    mb->queues[prio].passed = 0;
+    for (int lower = prio + 1; lower < CHIRC_PRIO_COUNT; lower++)
+        if (atomic_load(&mb->queues[lower].bytes) > 0)
+            mb->queues[lower].passed++;
+
+    return ob;
+}
+
+/* See mailbox.h */
+void chirc_mailbox_init(chirc_mailbox_t *mb)
+{
+    for (int prio = 0; prio < CHIRC_PRIO_COUNT; prio++)
+    {
+        chirc_mailqueue_t *q = &mb->queues[prio];
+
+        atomic_store(&q->stub.next, NULL);
+        atomic_store(&q->head, &q->stub);
+        q->tail = &q->stub;
+        atomic_store(&q->bytes, 0);
+        q->passed = 0;
+    }
+
+    mb->first = mb->last = NULL;
+    mb->offset = 0;
+}
+
+/* See mailbox.h */
+int chirc_mailbox_put(chirc_mailbox_t *mb, chirc_prio_t prio, const void *buf, size_t len)
+{
+    chirc_mailqueue_t *q = &mb->queues[prio];
+    chirc_outbuf_t *ob = malloc(sizeof(chirc_outbuf_t) + len);
+
+    if (!ob)
+        return CHIRC_FAIL;
+
+    ob->prio = prio;
+    ob->len = len;
+    memcpy(ob->data, buf, len);
+
+    /* Counted first, so the count is never below what can be taken */
+    atomic_fetch_add(&q->bytes, len);
+    push(q, &ob->link);
+
+    return CHIRC_OK;
+}
+
+/* See mailbox.h */
+int chirc_mailbox_peekv(chirc_mailbox_t *mb, struct iovec *iov, int max)
+{
+    chirc_outbuf_t *ob;
+    int n = 0;
+
+    /* What was taken out already goes first, and in the same order */
+    for (ob = mb->first; ob && n < max; ob = ob->next, n++)
+    {
+        size_t offset = ob == mb->first ? mb->offset : 0;
+
+        iov[n].iov_base = ob->data + offset;
+        iov[n].iov_len = ob->len - offset;
+    }
+
+    for (; n < max && (ob = take(mb)) != NULL; n++)
+    {
+        ob->next = NULL;
+        if (mb->last)
+            mb->last->next = ob;
+        else
+            mb->first = ob;
+        mb->last = ob;
+
+        iov[n].iov_base = ob->data;
+        iov[n].iov_len = ob->len;
+    }
+
+    return n;
+}
+
+/* See mailbox.h */
+void chirc_mailbox_consume(chirc_mailbox_t *mb, size_t n)
+{
+    while (n > 0)
+    {
+        chirc_outbuf_t *ob = mb->first;
+        size_t written = ob->len - mb->offset < n ? ob->len - mb->offset : n;
+
+        mb->offset += written;
+        n -= written;
+        atomic_fetch_sub(&mb->queues[ob->prio].bytes, written);
+
+        if (mb->offset == ob->len)
+        {
+            mb->first = ob->next;
+            if (!mb->first)
+                mb->last = NULL;
+            mb->offset = 0;
+            free(ob);
+        }
+    }
+}
+
+/* See mailbox.h */
+size_t chirc_mailbox_bytes(chirc_mailbox_t *mb)
+{
+    size_t bytes = 0;
+
+    for (int prio = 0; prio < CHIRC_PRIO_COUNT; prio++)
+        bytes += atomic_load(&mb->queues[prio].bytes);
+
+    return bytes;
+}
+
+/* See mailbox.h */
+void chirc_mailbox_free(chirc_mailbox_t *mb)
+{
+    struct iovec iov;
+
+    while (chirc_mailbox_peekv(mb, &iov, 1) > 0)
+        chirc_mailbox_consume(mb, iov.iov_len);
+}
@@ -0,0 +1,167 @@
+/*! \file mailbox.h
+ *  \brief Outbound mailboxes
+ *
+ *  Every connection has a mailbox: a queue of buffers waiting to be
+ *  written to its peer. Any thread can put a buffer in a mailbox (e.g.,
+ *  to relay a message to another user), but only the thread that owns
+ *  the connection (the worker running it, see workers.h) takes buffers
+ *  out and writes them. So a socket only ever has one writer, and the
+ *  lines sent to a client are never interleaved.
+ *
+ *  The queue is a lock-free multiple-producer, single-consumer linked
+ *  list (an intrusive MPSC queue with a stub node): putting a buffer
+ *  is an atomic exchange, and taking one does not need any atomic
+ *  read-modify-write at all. Buffers come out in the order they were
+ *  put in by each thread.
+ *
+ *  A buffer that was put by one thread can, for a very short time, be
+ *  invisible to the consumer while a buffer put after it by another
+ *  thread is not; chirc_mailbox_peek returns NULL in that case. The
+ *  producer wakes the owner up once it is done (see
+ *  chirc_connection_send), so nothing is left behind.
+ *
+ *  Buffers have a priority (see chirc_prio_t), and each priority has
+ *  a queue of its own: the consumer writes the buffers of the highest
+ *  priority first, so a keepalive PING is not stuck behind a backlog
+ *  of channel messages. Buffers are only reordered between priorities,
+ *  and a buffer is always written whole before the next one is
+ *  started, so lines are never split. So that the lower priorities are
+ *  not starved, one whose buffers have been passed over
+ *  CHIRC_MAILBOX_STARVE_LIMIT times goes next.
+ *
+ *  The consumer takes several buffers out at once (see
+ *  chirc_mailbox_peekv), so that a burst of replies can be written with
+ *  a single system call. Once taken out, buffers are written in that
+ *  order, so a buffer put afterwards can wait behind up to that many
+ *  buffers of a lower priority.
+ */
+
+#ifndef MAILBOX_H_
+#define MAILBOX_H_
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/*! \brief Priority of what is sent to a connection, highest first */
+typedef enum
+{
+    /*! \brief Keepalives, errors and server links */
+    CHIRC_PRIO_HIGH = 0,
+    /*! \brief Replies to the client's own commands */
+    CHIRC_PRIO_REPLY,
+    /*! \brief What other clients send it (e.g., channel messages) */
+    CHIRC_PRIO_BULK,
+    CHIRC_PRIO_COUNT
+} chirc_prio_t;
+
+/*! \brief Times the buffers of a priority can be passed over for those
+ *         of higher priorities before they go first */
+#define CHIRC_MAILBOX_STARVE_LIMIT (8)
+
+/*! \brief Link in a mailbox's queue */
+typedef struct chirc_maillink
+{
+    _Atomic(struct chirc_maillink *) next;
+} chirc_maillink_t;
+
+/*! \brief A buffer waiting to be written */
+typedef struct chirc_outbuf
+{
+    chirc_maillink_t link;
+    /*! \brief Next buffer taken out of the queues (consumer only) */
+    struct chirc_outbuf *next;
+    /*! \brief Priority */
+    chirc_prio_t prio;
+    /*! \brief Number of bytes */
+    size_t len;
+    /*! \brief Bytes */
+    char data[];
+} chirc_outbuf_t;
+
+/*! \brief Queue of the buffers of one priority */
+typedef struct
+{
+    /*! \brief Last link in the queue (where producers put buffers) */
+    _Atomic(chirc_maillink_t *) head;
+    /*! \brief First link in the queue (consumer only) */
+    chirc_maillink_t *tail;
+    /*! \brief Link that keeps the queue from ever being empty */
+    chirc_maillink_t stub;
+
+    /*! \brief Bytes put in the queue and not written yet */
+    atomic_size_t bytes;
+    /*! \brief Times the queue has been passed over since it was last
+     *         taken from (consumer only) */
+    int passed;
+} chirc_mailqueue_t;
+
+/*! \brief A mailbox */
+typedef struct chirc_mailbox
+{
+    /*! \brief Queues, by priority */
+    chirc_mailqueue_t queues[CHIRC_PRIO_COUNT];
+
+    /*! \brief Buffers taken out of the queues, in the order they are
+     *         written (consumer only) */
+    chirc_outbuf_t *first, *last;
+    /*! \brief Bytes of the first buffer already written */
+    size_t offset;
+} chirc_mailbox_t;
+
+/*! \brief Initializes an empty mailbox
+ *
+ * A mailbox must not be moved (or copied) once it is initialized.
+ *
+ * \param mb Mailbox
+ */
+void chirc_mailbox_init(chirc_mailbox_t *mb);
+
+/*! \brief Puts a copy of some bytes in a mailbox (any thread)
+ *
+ * \param mb Mailbox
+ * \param prio Priority
+ * \param buf Bytes
+ * \param len Number of bytes
+ * \return CHIRC_OK on success, CHIRC_FAIL if out of memory
+ */
+int chirc_mailbox_put(chirc_mailbox_t *mb, chirc_prio_t prio, const void *buf, size_t len);
+
+/*! \brief Gets the buffers to write next (consumer only)
+ *
+ * Until all of them are written, the same buffers are returned again
+ * (first), so the bytes can be written with a single writev.
+ *
+ * \param mb Mailbox
+ * \param iov (Output parameter) Bytes left to write in each buffer
+ * \param max Most buffers to return
+ * \return Number of buffers, 0 if there is none (for now)
+ */
+int chirc_mailbox_peekv(chirc_mailbox_t *mb, struct iovec *iov, int max);
+
+/*! \brief Records that bytes of the buffers returned by
+ *         chirc_mailbox_peekv were written (consumer only)
+ *
+ * Each buffer is freed once all its bytes are written.
+ *
+ * \param mb Mailbox
+ * \param n Number of bytes written
+ */
+void chirc_mailbox_consume(chirc_mailbox_t *mb, size_t n);
+
+/*! \brief Gets the number of bytes in a mailbox
+ *
+ * \param mb Mailbox
+ * \return Bytes put in the mailbox and not written yet
+ */
+size_t chirc_mailbox_bytes(chirc_mailbox_t *mb);
+
+/*! \brief Frees every buffer left in a mailbox
+ *
+ * No thread may put buffers in the mailbox anymore.
+ *
+ * \param mb Mailbox
+ */
+void chirc_mailbox_free(chirc_mailbox_t *mb);
+
+#endif /* MAILBOX_H_ */
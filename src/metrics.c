@@ -0,0 +1,672 @@
+/* See metrics.h for details about the functions in this module */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+
+#include "metrics.h"
+#include "cmdstats.h"
+#include "utils.h"
+#include "log.h"
+
+/* Largest descriptor we keep track of (for send-queue depths) */
+#define MAX_TRACKED_FDS (1 << 20)
+
+/* Upper bounds of the send-queue depth histogram buckets */
+static const int sendq_buckets[] = {0, 1024, 4096, 16384, 65536, 262144};
+#define NUM_SENDQ_BUCKETS (sizeof(sendq_buckets) / sizeof(sendq_buckets[0]))
+
+static const char *counter_names[CHIRC_METRIC_COUNT][2] = {
+    {"chirc_received_bytes_total", "Bytes received from clients"},
+    {"chirc_sent_bytes_total", "Bytes sent to clients"},
+    {"chirc_received_lines_total", "Lines (messages) received from clients"},
+    {"chirc_sent_lines_total", "Lines (messages) sent to clients"},
+    {"chirc_flushes_total", "Bursts of replies written to clients"},
+    {"chirc_socket_writes_total", "System calls that wrote replies to clients"},
+    {"chirc_refused_connections_total", "Connections refused for too many connections from their address"},
+};
+
+static const char *conn_type_names[] = {"unknown", "user", "server", "quit"};
+#define NUM_CONN_TYPES (sizeof(conn_type_names) / sizeof(conn_type_names[0]))
+
+/* Per-thread counters (same scheme as the command statistics: each
+ * shard has a single writer, and shards are reused by new threads) */
+typedef struct metrics_shard
+{
+    atomic_bool in_use;
+    _Atomic uint64_t counters[CHIRC_METRIC_COUNT];
+    struct metrics_shard *next;
+} metrics_shard_t;
+
+static _Atomic(metrics_shard_t *) shards = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread metrics_shard_t *thread_shard = NULL;
+
+static atomic_long conns_by_type[NUM_CONN_TYPES];
+static atomic_long channels = ATOMIC_VAR_INIT(0);
+static atomic_long table_entries[CHIRC_TABLE_COUNT];
+
+static const char *table_names[CHIRC_TABLE_COUNT] = {"connections", "sockets", "nicks", "users"};
+
+/* Data segments sent on client sockets that were closed */
+static _Atomic uint64_t closed_segments = ATOMIC_VAR_INIT(0);
+
+/* open_fds[fd] is the mailbox of the connection while fd is a client
+ * socket. The scraper dereferences it with open_fds_lock held, so that
+ * chirc_metrics_conn_close does not return while it is being read */
+static _Atomic(chirc_mailbox_t *) *open_fds = NULL;
+static pthread_mutex_t open_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+static int max_fds = 0;
+
+/* Admin listener */
+static struct
+{
+    int listenfd;
+    int stop_pipe[2];
+    char *unix_path;
+    pthread_t thread;
+    bool running;
+} endpoint = {-1, {-1, -1}, NULL, 0, false};
+
+
+static void release_shard(void *arg)
+{
+    metrics_shard_t *shard = arg;
+
+    atomic_store_explicit(&shard->in_use, false, memory_order_release);
+}
+
+static void create_shard_key()
+{
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static metrics_shard_t *get_shard()
+{
+    metrics_shard_t *shard;
+
+    if (thread_shard)
+        return thread_shard;
+
+    pthread_once(&shard_key_once, create_shard_key);
+
+    for (shard = atomic_load(&shards); shard != NULL; shard = shard->next)
+    {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&shard->in_use, &expected, true))
+            break;
+    }
+
+    if (!shard)
+    {
+        shard = calloc(1, sizeof(metrics_shard_t));
+        if (!shard)
+            return NULL;
+        atomic_init(&shard->in_use, true);
+
+        shard->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &shard->next, shard))
+            ;
+    }
+
+    pthread_setspecific(shard_key, shard);
+    thread_shard = shard;
+
+    return shard;
+}
+
+
+/* See metrics.h */
+void chirc_metrics_count(chirc_counter_t counter, uint64_t n)
+{
+    metrics_shard_t *shard = get_shard();
+
+    if (!shard)
+        return;
+
+    /* Single writer, so a load and a store will do */
+    atomic_store_explicit(&shard->counters[counter],
+                          atomic_load_explicit(&shard->counters[counter], memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/* See metrics.h */
+void chirc_metrics_conn_open(int fd, chirc_mailbox_t *mb)
+{
+    atomic_fetch_add_explicit(&conns_by_type[CONN_TYPE_UNKNOWN], 1, memory_order_relaxed);
+
+    if (open_fds && fd >= 0 && fd < max_fds)
+        atomic_store_explicit(&open_fds[fd], mb, memory_order_release);
+}
+
+/* See metrics.h */
+void chirc_metrics_conn_type(conn_type_t from, conn_type_t to)
+{
+    if (from == to)
+        return;
+
+    atomic_fetch_sub_explicit(&conns_by_type[from], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&conns_by_type[to], 1, memory_order_relaxed);
+}
+
+/* Data segments the kernel has sent on a socket (0 if it is not a TCP
+ * socket, or if it was closed) */
+static uint64_t socket_segments(int fd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0
+        || len < offsetof(struct tcp_info, tcpi_data_segs_out) + sizeof(info.tcpi_data_segs_out))
+        return 0;
+
+    return info.tcpi_data_segs_out;
+}
+
+/* See metrics.h */
+void chirc_metrics_conn_close(int fd, conn_type_t type)
+{
+    atomic_fetch_sub_explicit(&conns_by_type[type], 1, memory_order_relaxed);
+
+    if (open_fds && fd >= 0 && fd < max_fds)
+    {
+        pthread_mutex_lock(&open_fds_lock);
+        atomic_store_explicit(&open_fds[fd], NULL, memory_order_relaxed);
+        pthread_mutex_unlock(&open_fds_lock);
+        atomic_fetch_add_explicit(&closed_segments, socket_segments(fd), memory_order_relaxed);
+    }
+}
+
+/* See metrics.h */
+void chirc_metrics_channels(int delta)
+{
+    atomic_fetch_add_explicit(&channels, delta, memory_order_relaxed);
+}
+
+/* See metrics.h */
+void chirc_metrics_table(chirc_table_t table, int delta)
+{
+    atomic_fetch_add_explicit(&table_entries[table], delta, memory_order_relaxed);
+}
+
+/* See metrics.h */
+uint64_t chirc_metrics_total(chirc_counter_t counter)
+{
+    uint64_t total = 0;
+
+    for (metrics_shard_t *shard = atomic_load(&shards); shard != NULL; shard = shard->next)
+        total += atomic_load_explicit(&shard->counters[counter], memory_order_relaxed);
+
+    return total;
+}
+
+/* See metrics.h */
+long chirc_metrics_table_size(chirc_table_t table)
+{
+    return atomic_load_explicit(&table_entries[table], memory_order_relaxed);
+}
+
+
+
+static void write_header(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void write_connections(FILE *out)
+{
+    write_header(out, "chirc_connections", "gauge", "Open client connections, by connection type");
+    for (size_t t = 0; t < NUM_CONN_TYPES; t++)
+        fprintf(out, "chirc_connections{type=\"%s\"} %ld\n", conn_type_names[t],
+                atomic_load_explicit(&conns_by_type[t], memory_order_relaxed));
+
+    write_header(out, "chirc_users", "gauge", "Registered users");
+    fprintf(out, "chirc_users %ld\n", atomic_load_explicit(&conns_by_type[CONN_TYPE_USER], memory_order_relaxed));
+
+    write_header(out, "chirc_channels", "gauge", "Channels");
+    fprintf(out, "chirc_channels %ld\n", atomic_load_explicit(&channels, memory_order_relaxed));
+
+    write_header(out, "chirc_table_entries", "gauge", "Entries in the server's lookup tables");
+    for (int t = 0; t < CHIRC_TABLE_COUNT; t++)
+        fprintf(out, "chirc_table_entries{table=\"%s\"} %ld\n", table_names[t],
+                atomic_load_explicit(&table_entries[t], memory_order_relaxed));
+}
+
+static void write_counters(FILE *out)
+{
+    uint64_t totals[CHIRC_METRIC_COUNT] = {0};
+
+    for (metrics_shard_t *shard = atomic_load(&shards); shard != NULL; shard = shard->next)
+        for (int c = 0; c < CHIRC_METRIC_COUNT; c++)
+            totals[c] += atomic_load_explicit(&shard->counters[c], memory_order_relaxed);
+
+    for (int c = 0; c < CHIRC_METRIC_COUNT; c++)
+    {
+        write_header(out, counter_names[c][0], "counter", counter_names[c][1]);
+        fprintf(out, "%s %llu\n", counter_names[c][0], (unsigned long long) totals[c]);
+    }
+
+    write_header(out, "chirc_log_dropped_total", "counter", "Log messages dropped because a log ring was full");
+    fprintf(out, "chirc_log_dropped_total %lu\n", chirc_log_dropped());
+}
+
+/* What is sent to a client waits in its mailbox until its owner
+ * writes it, and then in the kernel's socket buffer until the client
+ * acknowledges it; a client's send queue is both. */
+static void write_send_queues(FILE *out)
+{
+    unsigned long long counts[NUM_SENDQ_BUCKETS] = {0}, n = 0, sum = 0;
+    uint64_t segments = atomic_load(&closed_segments);
+    unsigned long long max = 0;
+
+    for (int fd = 0; open_fds && fd < max_fds; fd++)
+    {
+        unsigned long long depth;
+        chirc_mailbox_t *mb;
+        int kernel;
+
+        if (!atomic_load_explicit(&open_fds[fd], memory_order_relaxed))
+            continue;
+
+        /* The mailbox is not freed while we hold the lock, and the
+         * bytes in it are atomics, so no lock of its owner is needed */
+        pthread_mutex_lock(&open_fds_lock);
+        mb = atomic_load_explicit(&open_fds[fd], memory_order_acquire);
+        depth = mb ? chirc_mailbox_bytes(mb) : 0;
+        pthread_mutex_unlock(&open_fds_lock);
+        if (!mb)
+            continue;
+
+        /* The socket may have been closed since we looked at the
+         * table, in which case this just fails */
+        if (ioctl(fd, SIOCOUTQ, &kernel) < 0)
+            continue;
+        depth += kernel;
+        segments += socket_segments(fd);
+
+        for (size_t b = 0; b < NUM_SENDQ_BUCKETS; b++)
+            if (depth <= (unsigned long long) sendq_buckets[b])
+                counts[b]++;
+        n++;
+        sum += depth;
+        if (depth > max)
+            max = depth;
+    }
+
+    write_header(out, "chirc_send_queue_bytes", "histogram",
+                 "Unsent bytes queued for each client socket, in its mailbox and in the kernel");
+    for (size_t b = 0; b < NUM_SENDQ_BUCKETS; b++)
+        fprintf(out, "chirc_send_queue_bytes_bucket{le=\"%d\"} %llu\n", sendq_buckets[b], counts[b]);
+    fprintf(out, "chirc_send_queue_bytes_bucket{le=\"+Inf\"} %llu\n", n);
+    fprintf(out, "chirc_send_queue_bytes_sum %llu\n", sum);
+    fprintf(out, "chirc_send_queue_bytes_count %llu\n", n);
+
+    write_header(out, "chirc_send_queue_max_bytes", "gauge", "Largest send queue of any client socket");
+    fprintf(out, "chirc_send_queue_max_bytes %llu\n", max);
+
+    write_header(out, "chirc_sent_segments_total", "counter", "TCP segments with data sent to clients");
+    fprintf(out, "chirc_sent_segments_total %llu\n", (unsigned long long) segments);
+}
+
+static void write_memory(FILE *out)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    unsigned long size, resident;
+
+    if (f)
+    {
+        if (fscanf(f, "%lu %lu", &size, &resident) == 2)
+        {
+            long page = sysconf(_SC_PAGESIZE);
+
+            write_header(out, "process_virtual_memory_bytes", "gauge", "Virtual memory size in bytes");
+            fprintf(out, "process_virtual_memory_bytes %lu\n", size * page);
+            write_header(out, "process_resident_memory_bytes", "gauge", "Resident memory size in bytes");
+            fprintf(out, "process_resident_memory_bytes %lu\n", resident * page);
+        }
+        fclose(f);
+    }
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    /* mallinfo2 briefly locks every malloc arena, which client threads
+     * also use, so it has to be asked for explicitly */
+    if (chirc_env_int("CHIRC_METRICS_MALLINFO", 0))
+    {
+        struct mallinfo2 mi = mallinfo2();
+
+        write_header(out, "chirc_malloc_arena_bytes", "gauge", "Bytes obtained from the system by malloc");
+        fprintf(out, "chirc_malloc_arena_bytes %zu\n", mi.arena + mi.hblkhd);
+        write_header(out, "chirc_malloc_in_use_bytes", "gauge", "Bytes allocated with malloc and not freed");
+        fprintf(out, "chirc_malloc_in_use_bytes %zu\n", mi.uordblks + mi.hblkhd);
+        write_header(out, "chirc_malloc_free_bytes", "gauge", "Free bytes held by malloc");
+        fprintf(out, "chirc_malloc_free_bytes %zu\n", mi.fordblks);
+        write_header(out, "chirc_malloc_mmapped_regions", "gauge", "Allocations served with mmap");
+        fprintf(out, "chirc_malloc_mmapped_regions %zu\n", mi.hblks);
+    }
+#endif
+}
+
+static void write_commands(FILE *out)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99};
+    chirc_cmdstats_t *stats = malloc(sizeof(chirc_cmdstats_t));
+
+    if (!stats)
+        return;
+
+    chirc_cmdstats_snapshot(stats);
+
+    write_header(out, "chirc_command_duration_seconds", "summary", "Time spent processing a command");
+    for (int c = 0; c < CHIRC_CMD_COUNT; c++)
+    {
+        chirc_histogram_t *h = &stats->cmds[c].latency;
+        const char *name = chirc_cmdstats_name(c);
+
+        if (h->total == 0)
+            continue;
+
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            fprintf(out, "chirc_command_duration_seconds{command=\"%s\",quantile=\"%g\"} %.9f\n",
+                    name, quantiles[q], chirc_histogram_quantile(h, quantiles[q]) / 1e9);
+        fprintf(out, "chirc_command_duration_seconds_sum{command=\"%s\"} %.9f\n", name, h->sum_ns / 1e9);
+        fprintf(out, "chirc_command_duration_seconds_count{command=\"%s\"} %llu\n",
+                name, (unsigned long long) h->total);
+    }
+
+    write_header(out, "chirc_commands_total", "counter", "Commands processed");
+    for (int c = 0; c < CHIRC_CMD_COUNT; c++)
+        if (stats->cmds[c].calls)
+            fprintf(out, "chirc_commands_total{command=\"%s\"} %llu\n",
+                    chirc_cmdstats_name(c), (unsigned long long) stats->cmds[c].calls);
+
+    write_header(out, "chirc_command_errors_total", "counter", "Commands that resulted in an error reply");
+    for (int c = 0; c < CHIRC_CMD_COUNT; c++)
+        if (stats->cmds[c].calls)
+            fprintf(out, "chirc_command_errors_total{command=\"%s\"} %llu\n",
+                    chirc_cmdstats_name(c), (unsigned long long) stats->cmds[c].errors);
+
+    free(stats);
+}
+
+/* See metrics.h */
+void chirc_metrics_write(FILE *out)
+{
+    write_connections(out);
+    write_counters(out);
+    write_send_queues(out);
+    write_memory(out);
+    write_commands(out);
+}
+
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return CHIRC_FAIL;
+        buf += n;
+        len -= n;
+    }
+
+    return CHIRC_OK;
+}
+
+static void serve_request(int fd)
+{
+    char req[2048], *body = NULL, *resp = NULL;
+    size_t len = 0, body_len = 0, resp_len = 0;
+    struct timeval tv = {1, 0};
+    FILE *out;
+
+    /* Don't let a slow client hold up the endpoint */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    while (len < sizeof(req) - 1)
+    {
+        ssize_t n = read(fd, req + len, sizeof(req) - 1 - len);
+        if (n <= 0)
+            return;
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+
+    if (strncmp(req, "GET /metrics ", 13) != 0 && strncmp(req, "GET / ", 6) != 0)
+    {
+        const char *notfound = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        write_all(fd, notfound, strlen(notfound));
+        return;
+    }
+
+    out = open_memstream(&body, &body_len);
+    if (!out)
+        return;
+    chirc_metrics_write(out);
+    fclose(out);
+
+    out = open_memstream(&resp, &resp_len);
+    if (out)
+    {
+        fprintf(out, "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n\r\n", body_len);
+        fclose(out);
+        if (write_all(fd, resp, resp_len) == CHIRC_OK)
+            write_all(fd, body, body_len);
+    }
+
+    free(resp);
+    free(body);
+}
+
+static void *endpoint_thread(void *arg)
+{
+    struct pollfd fds[2] = {
+        {.fd = endpoint.listenfd, .events = POLLIN},
+        {.fd = endpoint.stop_pipe[0], .events = POLLIN}
+    };
+
+    (void) arg;
+
+    for (;;)
+    {
+        int fd;
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        fd = accept(endpoint.listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        serve_request(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/* Creates the listening socket for the endpoint */
+static int endpoint_listen(const char *addr)
+{
+    int fd;
+
+    if (strncmp(addr, "unix:", 5) == 0)
+    {
+        struct sockaddr_un sun = {.sun_family = AF_UNIX};
+
+        if (strlen(addr + 5) >= sizeof(sun.sun_path))
+        {
+            chilog(ERROR, "Metrics socket path is too long: %s", addr + 5);
+            return -1;
+        }
+        strcpy(sun.sun_path, addr + 5);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+
+        unlink(sun.sun_path);
+        if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+        {
+            chilog(ERROR, "Could not bind metrics socket %s: %s", sun.sun_path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        endpoint.unix_path = strdup(sun.sun_path);
+    }
+    else
+    {
+        struct sockaddr_in sin = {.sin_family = AF_INET};
+        const char *colon = strrchr(addr, ':');
+        char host[INET_ADDRSTRLEN] = "127.0.0.1";
+        int one = 1;
+
+        if (colon)
+        {
+            size_t hlen = colon - addr;
+            if (hlen >= sizeof(host))
+                hlen = sizeof(host) - 1;
+            memcpy(host, addr, hlen);
+            host[hlen] = '\0';
+            addr = colon + 1;
+        }
+
+        if (inet_pton(AF_INET, host, &sin.sin_addr) != 1 || atoi(addr) <= 0 || atoi(addr) > 65535)
+        {
+            chilog(ERROR, "Invalid metrics address: %s", addr);
+            return -1;
+        }
+
+        /* The endpoint is for local scrapers only */
+        if ((ntohl(sin.sin_addr.s_addr) >> 24) != 127)
+        {
+            chilog(ERROR, "The metrics endpoint can only listen on a loopback address (not %s)", host);
+            return -1;
+        }
+        sin.sin_port = htons(atoi(addr));
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        {
+            chilog(ERROR, "Could not bind metrics endpoint to %s:%s: %s", host, addr, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 16) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* See metrics.h */
+int chirc_metrics_start(const char *addr)
+{
+    struct rlimit rl;
+
+    if (endpoint.running)
+        return CHIRC_FAIL;
+
+    if (!open_fds)
+    {
+        max_fds = MAX_TRACKED_FDS;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < MAX_TRACKED_FDS)
+            max_fds = rl.rlim_cur;
+        open_fds = calloc(max_fds, sizeof(*open_fds));
+        if (!open_fds)
+            return CHIRC_FAIL;
+    }
+
+    endpoint.listenfd = endpoint_listen(addr);
+    if (endpoint.listenfd < 0)
+        return CHIRC_FAIL;
+
+    if (pipe2(endpoint.stop_pipe, O_CLOEXEC) < 0)
+        goto _error;
+
+    if (pthread_create(&endpoint.thread, NULL, endpoint_thread, NULL) != 0)
+        goto _error;
+
+    endpoint.running = true;
+    chilog(INFO, "Serving metrics on %s", addr);
+
+    return CHIRC_OK;
+
+_error:
+    close(endpoint.listenfd);
+    endpoint.listenfd = -1;
+    if (endpoint.stop_pipe[0] >= 0)
+    {
+        close(endpoint.stop_pipe[0]);
+        close(endpoint.stop_pipe[1]);
+        endpoint.stop_pipe[0] = endpoint.stop_pipe[1] = -1;
+    }
+    return CHIRC_FAIL;
+}
+
+/* See metrics.h */
+void chirc_metrics_stop(void)
+{
+    if (!endpoint.running)
+        return;
+
+    while (write(endpoint.stop_pipe[1], "x", 1) < 0 && errno == EINTR)
+        ;
+    pthread_join(endpoint.thread, NULL);
+
+    close(endpoint.listenfd);
+    close(endpoint.stop_pipe[0]);
+    close(endpoint.stop_pipe[1]);
+    endpoint.listenfd = endpoint.stop_pipe[0] = endpoint.stop_pipe[1] = -1;
+
+    if (endpoint.unix_path)
+    {
+        unlink(endpoint.unix_path);
+        free(endpoint.unix_path);
+        endpoint.unix_path = NULL;
+    }
+
+    endpoint.running = false;
+}
@@ -0,0 +1,143 @@
+/*! \file metrics.h
+ *  \brief Server metrics and the admin (metrics) endpoint
+ *
+ *  This module keeps server-wide counters and gauges (connections,
+ *  traffic, channels, etc.) and can serve them, together with the
+ *  per-command statistics from cmdstats.h, in the Prometheus text
+ *  exposition format.
+ *
+ *  The metrics are served by an optional admin listener, which runs in
+ *  its own thread and only listens on loopback or on a Unix socket.
+ *  Scraping never takes any of the locks used when handling clients:
+ *  counters live in per-thread shards (like the command statistics),
+ *  gauges are atomics, and send-queue depths are read from the kernel
+ *  and from the connections' mailboxes, using a table of open sockets
+ *  indexed by descriptor. (A mailbox is read under a lock that is
+ *  otherwise only taken when a connection is closed.)
+ *
+ *  The TCP segments sent to clients are also read from the kernel
+ *  (TCP_INFO), when the metrics are scraped and when a socket is
+ *  closed. Divided by the flushes, they give the segments each burst
+ *  of replies took.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chirc.h"
+#include "mailbox.h"
+
+/*! \brief Server lookup tables whose sizes are exported */
+typedef enum {
+    /*! Registered nicks (nick -> connection) */
+    CHIRC_TABLE_CONNECTIONS = 0,
+    /*! Registered sockets (socket -> nick) */
+    CHIRC_TABLE_SOCKETS,
+    /*! Nicks given with NICK */
+    CHIRC_TABLE_NICKS,
+    /*! Users given with USER */
+    CHIRC_TABLE_USERS,
+    CHIRC_TABLE_COUNT
+} chirc_table_t;
+
+/*! \brief Traffic counters */
+typedef enum {
+    CHIRC_METRIC_BYTES_IN = 0,
+    CHIRC_METRIC_BYTES_OUT,
+    CHIRC_METRIC_LINES_IN,
+    CHIRC_METRIC_LINES_OUT,
+    /*! Flushes that wrote replies (see chirc_connection_flush) */
+    CHIRC_METRIC_FLUSHES,
+    /*! System calls that wrote replies */
+    CHIRC_METRIC_WRITES,
+    /*! Connections refused for their address's limits (see iplimit.h) */
+    CHIRC_METRIC_REFUSED,
+    CHIRC_METRIC_COUNT
+} chirc_counter_t;
+
+/*! \brief Adds to a traffic counter
+ *
+ * \param counter Counter
+ * \param n Amount to add
+ */
+void chirc_metrics_count(chirc_counter_t counter, uint64_t n);
+
+/*! \brief Records a new (unregistered) connection
+ *
+ * \param fd Socket of the connection
+ * \param mb Mailbox of the connection, which must stay valid until
+ *           chirc_metrics_conn_close is called
+ */
+void chirc_metrics_conn_open(int fd, chirc_mailbox_t *mb);
+
+/*! \brief Records a change in the type of a connection
+ *
+ * \param from Old type
+ * \param to New type
+ */
+void chirc_metrics_conn_type(conn_type_t from, conn_type_t to);
+
+/*! \brief Records that a connection is about to be closed
+ *
+ * Must be called *before* the socket is closed (once it is closed,
+ * the descriptor can be reused by another connection)
+ *
+ * \param fd Socket of the connection
+ * \param type Type of the connection
+ */
+void chirc_metrics_conn_close(int fd, conn_type_t type);
+
+/*! \brief Records that channels were created or removed
+ *
+ * \param delta Number of channels created (negative if removed)
+ */
+void chirc_metrics_channels(int delta);
+
+/*! \brief Records that entries were added to or removed from a table
+ *
+ * \param table Table
+ * \param delta Number of entries added (negative if removed)
+ */
+void chirc_metrics_table(chirc_table_t table, int delta);
+
+/*! \brief Gets the value of a traffic counter
+ *
+ * \param counter Counter
+ * \return Sum of the counter over all threads, since the process started
+ */
+uint64_t chirc_metrics_total(chirc_counter_t counter);
+
+/*! \brief Gets the number of entries in a table
+ *
+ * \param table Table
+ * \return Number of entries
+ */
+long chirc_metrics_table_size(chirc_table_t table);
+
+/*! \brief Writes all the metrics in the Prometheus text format
+ *
+ * \param out Stream to write the metrics to
+ */
+void chirc_metrics_write(FILE *out);
+
+/*! \brief Starts the metrics endpoint
+ *
+ * The endpoint serves the metrics over HTTP (any GET request for
+ * "/metrics" or "/"). The address can be:
+ *
+ *  - "PORT": listen on 127.0.0.1:PORT
+ *  - "HOST:PORT": listen on HOST:PORT (HOST must be a loopback address)
+ *  - "unix:PATH": listen on a Unix socket
+ *
+ * \param addr Address to listen on
+ * \return 0 on success, non-zero on failure
+ */
+int chirc_metrics_start(const char *addr);
+
+/*! \brief Stops the metrics endpoint (if it was started) */
+void chirc_metrics_stop(void);
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,192 @@
+/* See poller.h for details about the functions in this module */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "poller.h"
+#include "connection.h"
+#include "log.h"
+#include "timers.h"
+
+/* Events collected with each epoll_wait */
+#define POLLER_BATCH 64
+
+static struct
+{
+    int epfd;
+    /* Written to wake the thread up (to stop, to run deferred tasks, or
+     * to sleep less, see chirc_poller_wake) */
+    int wakefd;
+    pthread_t thread;
+    atomic_bool stopping;
+
+    /* Tasks deferred with chirc_poller_defer */
+    pthread_mutex_t lock;
+    chirc_task_t *deferred;
+} poller = {-1, -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+
+/* See poller.h */
+void chirc_poller_wake(void)
+{
+    uint64_t one = 1;
+
+    if (poller.wakefd >= 0 && write(poller.wakefd, &one, sizeof(one)) != sizeof(one))
+        chilog(ERROR, "failed to wake the poller up!");
+}
+
+/* Runs the tasks deferred so far */
+static void run_deferred(void)
+{
+    chirc_task_t *task, *next;
+
+    pthread_mutex_lock(&poller.lock);
+    task = poller.deferred;
+    poller.deferred = NULL;
+    pthread_mutex_unlock(&poller.lock);
+
+    for (; task; task = next)
+    {
+        next = task->next;
+        task->run(task);
+    }
+}
+
+
+static void *poller_work(void *args)
+{
+    struct epoll_event events[POLLER_BATCH];
+    uint64_t count;
+
+    (void) args;
+
+    while (true)
+    {
+        int n;
+
+        /* Every notification collected by the previous epoll_wait has
+         * been delivered, so no deferred task can race with one */
+        run_deferred();
+
+        /* Sleeps until the next timer is due, if any (see timers.h) */
+        n = epoll_wait(poller.epfd, events, POLLER_BATCH, chirc_timers_run());
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            chilog(ERROR, "epoll_wait failed!");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            chirc_connection_t *conn = events[i].data.ptr;
+
+            /* The wake descriptor is the only one without a connection */
+            if (!conn)
+            {
+                if (read(poller.wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    chilog(ERROR, "failed to read the poller's wake descriptor!");
+                if (atomic_load(&poller.stopping))
+                    return NULL;
+                continue;
+            }
+
+            conn->ready(conn, conn->ready_arg);
+        }
+    }
+
+    return NULL;
+}
+
+/* See poller.h */
+int chirc_poller_start(void)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+
+    poller.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller.epfd < 0)
+    {
+        chilog(ERROR, "failed to create the epoll instance!");
+        return CHIRC_FAIL;
+    }
+
+    atomic_store(&poller.stopping, false);
+    poller.wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (poller.wakefd < 0 || epoll_ctl(poller.epfd, EPOLL_CTL_ADD, poller.wakefd, &ev) < 0)
+    {
+        chilog(ERROR, "failed to create the poller's wake descriptor!");
+        goto _error;
+    }
+
+    if (pthread_create(&poller.thread, NULL, poller_work, NULL) != 0)
+    {
+        chilog(ERROR, "failed to create the poller thread!");
+        goto _error;
+    }
+
+    return CHIRC_OK;
+
+_error:
+    if (poller.wakefd >= 0)
+        close(poller.wakefd);
+    close(poller.epfd);
+    poller.wakefd = poller.epfd = -1;
+    return CHIRC_FAIL;
+}
+
+/* See poller.h */
+void chirc_poller_stop(void)
+{
+    if (poller.epfd < 0)
+        return;
+
+    atomic_store(&poller.stopping, true);
+    chirc_poller_wake();
+    pthread_join(poller.thread, NULL);
+    run_deferred();
+
+    close(poller.wakefd);
+    close(poller.epfd);
+    poller.wakefd = poller.epfd = -1;
+}
+
+/* See poller.h */
+int chirc_poller_arm(chirc_connection_t *conn, int events)
+{
+    struct epoll_event ev = {.events = EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn};
+
+    if (events & CHIRC_ARM_READ)
+        ev.events |= EPOLLIN;
+    if (events & CHIRC_ARM_WRITE)
+        ev.events |= EPOLLOUT;
+
+    /* Sockets are added the first time they are armed, and stay in the
+     * epoll set (disarmed between notifications) until they are closed */
+    if (epoll_ctl(poller.epfd, EPOLL_CTL_MOD, conn->socket, &ev) == 0)
+        return CHIRC_OK;
+    if (errno == ENOENT && epoll_ctl(poller.epfd, EPOLL_CTL_ADD, conn->socket, &ev) == 0)
+        return CHIRC_OK;
+
+    chilog(ERROR, "failed to arm socket %d!", conn->socket);
+    return CHIRC_FAIL;
+}
+
+/* See poller.h */
+void chirc_poller_defer(chirc_task_t *task)
+{
+    pthread_mutex_lock(&poller.lock);
+    task->next = poller.deferred;
+    poller.deferred = task;
+    pthread_mutex_unlock(&poller.lock);
+
+    chirc_poller_wake();
+}
@@ -0,0 +1,75 @@
+/*! \file poller.h
+ *  \brief Readiness notifications for socket connections
+ *
+ *  Connections do not have a thread blocked reading from them. The
+ *  poller is a single thread that waits (with epoll) for any armed
+ *  socket to become readable, and then calls the connection's ready
+ *  function (see chirc_connection_set_ready), which hands it to a
+ *  worker (see workers.h).
+ *
+ *  The poller thread also fires timers (see timers.h): it sleeps no
+ *  longer than until the next one is due.
+ *
+ *  Sockets are armed for a single notification: once a connection has
+ *  been reported as ready, it is not reported again until it is armed
+ *  again (usually once the worker has read everything there was to
+ *  read). So a connection is only ever reported to one thread at a
+ *  time, and the poller does not spin on sockets that a worker is
+ *  still reading from.
+ */
+
+#ifndef POLLER_H_
+#define POLLER_H_
+
+#include "chirc.h"
+#include "workers.h"
+
+/*! \brief Starts the poller thread
+ *
+ * \return CHIRC_OK on success, CHIRC_FAIL on failure
+ */
+int chirc_poller_start(void);
+
+/*! \brief Stops the poller thread
+ *
+ * Sockets that are still armed are not reported anymore.
+ */
+void chirc_poller_stop(void);
+
+/*! \brief Wakes the poller thread up
+ *
+ * Used when it must sleep less than it planned to, because a timer
+ * that is due sooner was set (see timers.h).
+ */
+void chirc_poller_wake(void);
+
+/*! \brief Arms a socket connection for a single notification
+ *
+ * The connection's ready function is called (from the poller thread)
+ * as soon as the socket has bytes to read (CHIRC_ARM_READ) or room to
+ * write (CHIRC_ARM_WRITE), has reached end of stream, or has failed;
+ * right away if it already has.
+ *
+ * A notification that was already collected can still be delivered
+ * after the socket is closed, so a connection must only be freed from
+ * a task deferred with chirc_poller_defer.
+ *
+ * \param conn Connection (backed by a socket)
+ * \param events CHIRC_ARM_READ, CHIRC_ARM_WRITE, or both
+ * \return CHIRC_OK on success, CHIRC_FAIL on failure
+ */
+int chirc_poller_arm(chirc_connection_t *conn, int events);
+
+/*! \brief Runs a task on the poller thread once every notification
+ *         collected so far has been delivered
+ *
+ * Used to free connections: once their socket is closed, they are not
+ * reported anymore, but a notification collected before that can still
+ * be on its way. Tasks still waiting when the poller stops are run by
+ * chirc_poller_stop.
+ *
+ * \param task Task
+ */
+void chirc_poller_defer(chirc_task_t *task);
+
+#endif /* POLLER_H_ */
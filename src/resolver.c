@@ -0,0 +1,324 @@
+/* See resolver.h for details about the functions in this module */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <uthash.h>
+#include <utlist.h>
+
+#include "resolver.h"
+#include "chirc.h"
+#include "log.h"
+#include "timers.h"
+
+/* Longest names that were not found are cached for, in seconds */
+#define NEGATIVE_TTL 60
+
+/* Lookups between two sweeps of the expired entries */
+#define SWEEP_EVERY 1024
+
+typedef enum
+{
+    /* Waiting for a resolver thread */
+    ENTRY_QUEUED,
+    /* Being looked up */
+    ENTRY_RESOLVING,
+    /* Looked up: host is its name (empty if there is none) */
+    ENTRY_DONE
+} entry_state_t;
+
+/* An address in the cache */
+typedef struct entry
+{
+    /* Address (in network order) */
+    uint32_t addr;
+    entry_state_t state;
+    char host[CHIRC_HOST_MAX + 1];
+    /* When the name has to be looked up again (see chirc_timers_now) */
+    uint64_t expires;
+    /* Lookups waiting for the name */
+    chirc_lookup_t *waiters;
+    /* Next entry in the queue */
+    struct entry *next;
+    UT_hash_handle hh;
+} entry_t;
+
+static bool dns_backend(struct in_addr addr, char *host, size_t len);
+
+static struct
+{
+    /* Protects everything else, and the lookups that were started */
+    pthread_mutex_t lock;
+    /* Signaled when an entry is queued, or to stop */
+    pthread_cond_t queued;
+    pthread_t *threads;
+    int nthreads;
+    bool stopping;
+
+    /* Cache, by address */
+    entry_t *cache;
+    /* Entries waiting for a thread, oldest first */
+    entry_t *head, *tail;
+    /* Seconds a name is cached for */
+    int ttl;
+    unsigned long lookups;
+
+    chirc_resolver_backend_t backend;
+} resolver = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, .backend = dns_backend};
+
+
+/* Looks an address up in the DNS. A name is only used if it looks up
+ * back to the address. */
+static bool dns_backend(struct in_addr addr, char *host, size_t len)
+{
+    struct sockaddr_in sa = {.sin_family = AF_INET, .sin_addr = addr};
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *res, *ai;
+    char name[NI_MAXHOST];
+    bool confirmed = false;
+
+    if (getnameinfo((struct sockaddr *)&sa, sizeof(sa), name, sizeof(name), NULL, 0, NI_NAMEREQD) != 0)
+        return false;
+    if (strlen(name) >= len || getaddrinfo(name, NULL, &hints, &res) != 0)
+        return false;
+
+    for (ai = res; ai && !confirmed; ai = ai->ai_next)
+        confirmed = ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr == addr.s_addr;
+    freeaddrinfo(res);
+
+    if (confirmed)
+        snprintf(host, len, "%s", name);
+
+    return confirmed;
+}
+
+/* Checks that a name can go in a message as a host (e.g., that it has
+ * no spaces or colons) */
+static bool valid_host(const char *host)
+{
+    if (host[0] == '\0' || host[0] == '-' || host[0] == '.')
+        return false;
+
+    for (const char *c = host; *c; c++)
+        if (!isalnum((unsigned char) *c) && *c != '-' && *c != '.')
+            return false;
+
+    return true;
+}
+
+/* Removes the entries whose names have expired (resolver locked) */
+static void sweep(uint64_t now)
+{
+    entry_t *entry, *tmp;
+
+    HASH_ITER(hh, resolver.cache, entry, tmp)
+    {
+        if (entry->state == ENTRY_DONE && entry->expires <= now)
+        {
+            HASH_DEL(resolver.cache, entry);
+            free(entry);
+        }
+    }
+}
+
+/* Queues an entry to be looked up (resolver locked) */
+static void enqueue(entry_t *entry)
+{
+    entry->state = ENTRY_QUEUED;
+    entry->next = NULL;
+    if (resolver.tail)
+        resolver.tail->next = entry;
+    else
+        resolver.head = entry;
+    resolver.tail = entry;
+
+    pthread_cond_signal(&resolver.queued);
+}
+
+static void *resolver_work(void *args)
+{
+    chirc_lookup_t *lookup, *tmp;
+    char host[CHIRC_HOST_MAX + 1];
+    chirc_resolver_backend_t backend;
+    struct in_addr addr;
+    entry_t *entry;
+    bool found;
+
+    (void) args;
+
+    pthread_mutex_lock(&resolver.lock);
+
+    while (true)
+    {
+        while (!resolver.stopping && !resolver.head)
+            pthread_cond_wait(&resolver.queued, &resolver.lock);
+        if (resolver.stopping)
+            break;
+
+        entry = resolver.head;
+        resolver.head = entry->next;
+        if (!resolver.head)
+            resolver.tail = NULL;
+        entry->state = ENTRY_RESOLVING;
+        addr.s_addr = entry->addr;
+        backend = resolver.backend;
+
+        /* Entries are not removed while they are being looked up */
+        pthread_mutex_unlock(&resolver.lock);
+        host[0] = '\0';
+        found = backend(addr, host, sizeof(host)) && valid_host(host);
+        pthread_mutex_lock(&resolver.lock);
+
+        snprintf(entry->host, sizeof(entry->host), "%s", found ? host : "");
+        entry->state = ENTRY_DONE;
+        entry->expires = chirc_timers_now() +
+                         (uint64_t) (found || resolver.ttl < NEGATIVE_TTL ? resolver.ttl : NEGATIVE_TTL) * 1000;
+
+        LL_FOREACH_SAFE(entry->waiters, lookup, tmp)
+        {
+            memcpy(lookup->host, entry->host, sizeof(lookup->host));
+            lookup->entry = NULL;
+            lookup->done(lookup);
+        }
+        entry->waiters = NULL;
+    }
+
+    pthread_mutex_unlock(&resolver.lock);
+
+    return NULL;
+}
+
+
+/* See resolver.h */
+void chirc_lookup_init(chirc_lookup_t *lookup, void (*done)(chirc_lookup_t *lookup))
+{
+    lookup->done = done;
+    lookup->host[0] = '\0';
+    lookup->next = NULL;
+    lookup->entry = NULL;
+}
+
+/* See resolver.h */
+int chirc_resolver_start(int nthreads, int ttl)
+{
+    resolver.threads = calloc(nthreads, sizeof(pthread_t));
+    if (!resolver.threads)
+        return CHIRC_FAIL;
+
+    resolver.stopping = false;
+    resolver.ttl = ttl;
+
+    for (resolver.nthreads = 0; resolver.nthreads < nthreads; resolver.nthreads++)
+    {
+        if (pthread_create(&resolver.threads[resolver.nthreads], NULL, resolver_work, NULL) != 0)
+        {
+            chilog(ERROR, "failed to create a resolver thread!");
+            chirc_resolver_stop();
+            return CHIRC_FAIL;
+        }
+    }
+
+    return CHIRC_OK;
+}
+
+/* See resolver.h */
+void chirc_resolver_stop(void)
+{
+    entry_t *entry, *tmp;
+
+    if (!resolver.threads)
+        return;
+
+    pthread_mutex_lock(&resolver.lock);
+    resolver.stopping = true;
+    pthread_cond_broadcast(&resolver.queued);
+    pthread_mutex_unlock(&resolver.lock);
+
+    /* Threads that are in the middle of a lookup finish it first */
+    for (int i = 0; i < resolver.nthreads; i++)
+        pthread_join(resolver.threads[i], NULL);
+    free(resolver.threads);
+    resolver.threads = NULL;
+    resolver.nthreads = 0;
+
+    HASH_ITER(hh, resolver.cache, entry, tmp)
+    {
+        HASH_DEL(resolver.cache, entry);
+        free(entry);
+    }
+    resolver.head = resolver.tail = NULL;
+}
+
+/* See resolver.h */
+bool chirc_resolver_lookup(chirc_lookup_t *lookup, struct in_addr addr)
+{
+    uint64_t now = chirc_timers_now();
+    entry_t *entry;
+
+    lookup->host[0] = '\0';
+
+    pthread_mutex_lock(&resolver.lock);
+
+    /* Not started, or out of memory: there is no name */
+    if (!resolver.threads)
+        goto _done;
+
+    if (++resolver.lookups % SWEEP_EVERY == 0)
+        sweep(now);
+
+    HASH_FIND(hh, resolver.cache, &addr.s_addr, sizeof(uint32_t), entry);
+    if (!entry)
+    {
+        entry = calloc(1, sizeof(entry_t));
+        if (!entry)
+            goto _done;
+        entry->addr = addr.s_addr;
+        HASH_ADD(hh, resolver.cache, addr, sizeof(uint32_t), entry);
+        enqueue(entry);
+    }
+    else if (entry->state == ENTRY_DONE && entry->expires <= now)
+        enqueue(entry);
+
+    if (entry->state == ENTRY_DONE)
+    {
+        memcpy(lookup->host, entry->host, sizeof(lookup->host));
+        goto _done;
+    }
+
+    lookup->entry = entry;
+    LL_PREPEND(entry->waiters, lookup);
+    pthread_mutex_unlock(&resolver.lock);
+
+    return false;
+
+_done:
+    pthread_mutex_unlock(&resolver.lock);
+    return true;
+}
+
+/* See resolver.h */
+void chirc_resolver_cancel(chirc_lookup_t *lookup)
+{
+    entry_t *entry;
+
+    pthread_mutex_lock(&resolver.lock);
+    entry = lookup->entry;
+    if (entry)
+    {
+        LL_DELETE(entry->waiters, lookup);
+        lookup->entry = NULL;
+    }
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+/* See resolver.h */
+void chirc_resolver_set_backend(chirc_resolver_backend_t backend)
+{
+    pthread_mutex_lock(&resolver.lock);
+    resolver.backend = backend ? backend : dns_backend;
+    pthread_mutex_unlock(&resolver.lock);
+}
@@ -0,0 +1,119 @@
+/*! \file resolver.h
+ *  \brief Reverse lookups of client addresses
+ *
+ *  Looking up the name of a client's address can take seconds, so it
+ *  is never done by the thread that handles the connection: lookups
+ *  are queued to a small pool of resolver threads of their own, and
+ *  the connection is told (see chirc_lookup_t) when its lookup is done.
+ *  A connection that does not want to wait that long cancels its
+ *  lookup and goes on with the numeric address.
+ *
+ *  Results are cached by address for a while (names that were not
+ *  found too, for less time), so clients that reconnect, or many
+ *  clients behind the same address, cost a single lookup. A lookup of
+ *  an address that is being looked up already waits for the same
+ *  answer instead of starting another one.
+ *
+ *  A name is only used if it looks up back to the address, so a
+ *  client cannot pick its own name by controlling its reverse zone.
+ *  The lookups themselves are done by a backend that can be replaced
+ *  (see chirc_resolver_set_backend), e.g., by a stub that answers from
+ *  a table, so the cache can be exercised without a DNS server.
+ */
+
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+/*! \brief Longest name a client's host can have (longer names are
+ *         not used) */
+#define CHIRC_HOST_MAX (63)
+
+/*! \brief A connection's lookup
+ *
+ * Embedded in the struct of whatever waits for it, like a timer.
+ */
+typedef struct chirc_lookup
+{
+    /*! \brief Called once the lookup is done, on a resolver thread
+     *         (with the resolver locked: it must be quick, e.g., wake
+     *         a connection up) */
+    void (*done)(struct chirc_lookup *lookup);
+
+    /*! \brief Name that was found (empty if there is none) */
+    char host[CHIRC_HOST_MAX + 1];
+
+    /*! \brief Other lookups waiting for the same address (used by the
+     *         resolver) */
+    struct chirc_lookup *next;
+    /*! \brief Address being looked up (NULL if none, used by the
+     *         resolver) */
+    void *entry;
+} chirc_lookup_t;
+
+/*! \brief Looks an address up, waiting for the answer
+ *
+ * \param addr Address
+ * \param host Where to put the name
+ * \param len Size of host
+ * \return true if a name was found
+ */
+typedef bool (*chirc_resolver_backend_t)(struct in_addr addr, char *host, size_t len);
+
+/*! \brief Initializes a lookup, which is not started
+ *
+ * \param lookup Lookup
+ * \param done Called when a lookup that was started is done
+ */
+void chirc_lookup_init(chirc_lookup_t *lookup, void (*done)(chirc_lookup_t *lookup));
+
+/*! \brief Starts the resolver threads
+ *
+ * \param nthreads Number of threads (at least 1)
+ * \param ttl Seconds a name is cached for (names that were not found
+ *            are cached for at most a minute)
+ * \return CHIRC_OK on success, CHIRC_FAIL on failure
+ */
+int chirc_resolver_start(int nthreads, int ttl);
+
+/*! \brief Stops the resolver threads
+ *
+ * No lookup must be running (every one must have been cancelled or be
+ * done). The lookups that were queued are dropped, and the cache is
+ * emptied.
+ */
+void chirc_resolver_stop(void);
+
+/*! \brief Starts looking up an address
+ *
+ * If the address is in the cache, the lookup is done right away: its
+ * host is set, and done is not called. Otherwise, done is called once
+ * it is, unless it is cancelled first.
+ *
+ * \param lookup Lookup (not running)
+ * \param addr Address
+ * \return true if the lookup is done already
+ */
+bool chirc_resolver_lookup(chirc_lookup_t *lookup, struct in_addr addr);
+
+/*! \brief Cancels a lookup
+ *
+ * Once this returns, done is not called anymore. The address goes on
+ * being looked up, and its name cached, for whoever asks next. Does
+ * nothing if the lookup is done or was not started.
+ *
+ * \param lookup Lookup
+ */
+void chirc_resolver_cancel(chirc_lookup_t *lookup);
+
+/*! \brief Replaces the backend that does the lookups
+ *
+ * \param backend Backend (NULL for the default one, which uses
+ *                getnameinfo and getaddrinfo)
+ */
+void chirc_resolver_set_backend(chirc_resolver_backend_t backend);
+
+#endif /* RESOLVER_H_ */
@@ -0,0 +1,205 @@
+/* See timers.h for details about the functions in this module */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "timers.h"
+#include "poller.h"
+
+/* Each level has 2^WHEEL_BITS slots, and covers 2^WHEEL_BITS times the
+ * ticks of the level below (with 100 ms ticks, the first level covers
+ * 6.4 seconds, and the last one about 19 days) */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+/* Ticks that a level's slots stand for */
+#define LEVEL_SPAN(level) (UINT64_C(1) << (WHEEL_BITS * (level)))
+
+static struct
+{
+    pthread_mutex_t lock;
+    chirc_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    /* Last tick that was run */
+    uint64_t current;
+    /* Timers that are set */
+    long count;
+    /* Tick the poller thread will wake up at (UINT64_MAX if it will not
+     * wake up until it is woken up) */
+    uint64_t wake_at;
+} wheel = {PTHREAD_MUTEX_INITIALIZER, .wake_at = UINT64_MAX};
+
+
+static void wheel_unlink(chirc_timer_t *timer)
+{
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    timer->slot = NULL;
+}
+
+/* Puts a timer in the slot for its expiry time (which must not be
+ * before the current tick), in the lowest level that reaches it */
+static void wheel_add(chirc_timer_t *timer)
+{
+    uint64_t delta = timer->expires - wheel.current;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= LEVEL_SPAN(level + 1))
+        level++;
+
+    /* Farther than the wheel reaches: the timer fires (too early) once
+     * the wheel has gone all the way round */
+    if (delta >= LEVEL_SPAN(WHEEL_LEVELS))
+        timer->expires = wheel.current + LEVEL_SPAN(WHEEL_LEVELS) - 1;
+
+    timer->slot = &wheel.slots[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->prev = NULL;
+    timer->next = *timer->slot;
+    if (timer->next)
+        timer->next->prev = timer;
+    *timer->slot = timer;
+}
+
+/* Spreads the timers of a slot over the levels below */
+static void wheel_cascade(int level, int index)
+{
+    chirc_timer_t *timer = wheel.slots[level][index], *next;
+
+    wheel.slots[level][index] = NULL;
+
+    for (; timer; timer = next)
+    {
+        next = timer->next;
+        wheel_add(timer);
+    }
+}
+
+static void wheel_run_tick(uint64_t tick)
+{
+    chirc_timer_t *timer;
+    int index = tick & WHEEL_MASK;
+
+    /* Upper levels first, so that their timers can go on down to the
+     * lower levels (and, if they are due now, to this tick's slot) */
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--)
+        if (tick % LEVEL_SPAN(level) == 0)
+            wheel_cascade(level, (tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+    while ((timer = wheel.slots[0][index]) != NULL)
+    {
+        wheel_unlink(timer);
+        wheel.count--;
+        timer->fire(timer);
+    }
+}
+
+/* Finds the next tick that has timers due, or that cascades timers
+ * from the upper levels (which the poller must wake up for, even if
+ * none of them turn out to be due) */
+static uint64_t wheel_next_tick(void)
+{
+    uint64_t tick, cascade = (wheel.current | WHEEL_MASK) + 1;
+
+    if (wheel.count == 0)
+        return UINT64_MAX;
+
+    for (tick = wheel.current + 1; tick < cascade; tick++)
+        if (wheel.slots[0][tick & WHEEL_MASK])
+            return tick;
+
+    return cascade;
+}
+
+
+/* See timers.h */
+void chirc_timer_init(chirc_timer_t *timer, void (*fire)(chirc_timer_t *timer))
+{
+    timer->fire = fire;
+    timer->expires = 0;
+    timer->slot = NULL;
+    timer->prev = timer->next = NULL;
+}
+
+/* See timers.h */
+void chirc_timer_set(chirc_timer_t *timer, uint64_t ms)
+{
+    uint64_t ms_now = chirc_timers_now();
+    uint64_t now = ms_now / CHIRC_TIMER_TICK_MS;
+    uint64_t expires = (ms_now + ms + CHIRC_TIMER_TICK_MS - 1) / CHIRC_TIMER_TICK_MS;
+    bool wake;
+
+    pthread_mutex_lock(&wheel.lock);
+
+    if (timer->slot)
+        wheel_unlink(timer);
+    else if (wheel.count++ == 0 && wheel.current < now)
+        /* Nothing was set, so no tick was missed while the poller slept */
+        wheel.current = now;
+
+    /* The current tick has run already */
+    timer->expires = expires > wheel.current ? expires : wheel.current + 1;
+    wheel_add(timer);
+
+    wake = timer->expires < wheel.wake_at;
+    if (wake)
+        wheel.wake_at = timer->expires;
+
+    pthread_mutex_unlock(&wheel.lock);
+
+    /* The poller is sleeping past the new timer */
+    if (wake)
+        chirc_poller_wake();
+}
+
+/* See timers.h */
+void chirc_timer_cancel(chirc_timer_t *timer)
+{
+    pthread_mutex_lock(&wheel.lock);
+    if (timer->slot)
+    {
+        wheel_unlink(timer);
+        wheel.count--;
+    }
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+/* See timers.h */
+uint64_t chirc_timers_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* See timers.h */
+int chirc_timers_run(void)
+{
+    uint64_t now = chirc_timers_now(), next;
+
+    pthread_mutex_lock(&wheel.lock);
+
+    if (wheel.count == 0)
+        wheel.current = now / CHIRC_TIMER_TICK_MS;
+    while (wheel.current < now / CHIRC_TIMER_TICK_MS)
+        wheel_run_tick(++wheel.current);
+
+    next = wheel.wake_at = wheel_next_tick();
+
+    pthread_mutex_unlock(&wheel.lock);
+
+    if (next == UINT64_MAX)
+        return -1;
+
+    /* The next tick starts after now, since the current one has run */
+    return (int) (next * CHIRC_TIMER_TICK_MS - now);
+}
@@ -0,0 +1,87 @@
+/*! \file timers.h
+ *  \brief Timers
+ *
+ *  Timers are kept in a hashed hierarchical timer wheel: a few levels
+ *  of slots, each level covering 64 times the span of the one below.
+ *  A timer goes in the slot its expiry time falls in, in the lowest
+ *  level that reaches that far; as time goes by, the slots of the upper
+ *  levels are spread over the levels below them. So setting and
+ *  cancelling a timer take constant time (no matter how many timers
+ *  there are), and the wheel does not need a system timer for each
+ *  one: the poller thread (see poller.h) sleeps until the next tick
+ *  that has a timer due, and fires its timers.
+ *
+ *  Time is measured in ticks of CHIRC_TIMER_TICK_MS milliseconds, so
+ *  timers fire up to one tick late.
+ *
+ *  Timers can be set and cancelled from any thread. They fire on the
+ *  poller thread, with the wheel locked: their function must be quick
+ *  (e.g., wake a connection up, see chirc_connection_wake), and must not
+ *  set or cancel timers itself.
+ */
+
+#ifndef TIMERS_H_
+#define TIMERS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*! \brief Length of a tick, in milliseconds */
+#define CHIRC_TIMER_TICK_MS (100)
+
+/*! \brief A timer */
+typedef struct chirc_timer
+{
+    /*! \brief Called (on the poller thread) when the timer fires */
+    void (*fire)(struct chirc_timer *timer);
+
+    /* The rest is managed by the wheel */
+
+    /*! \brief Tick the timer fires at */
+    uint64_t expires;
+    /*! \brief Slot the timer is in (NULL if it is not set) */
+    struct chirc_timer **slot;
+    /*! \brief Other timers in the slot */
+    struct chirc_timer *prev, *next;
+} chirc_timer_t;
+
+/*! \brief Initializes a timer, which is not set
+ *
+ * \param timer Timer
+ * \param fire Function to call when the timer fires
+ */
+void chirc_timer_init(chirc_timer_t *timer, void (*fire)(chirc_timer_t *timer));
+
+/*! \brief Sets a timer to fire after some time
+ *
+ * A timer that was already set is moved.
+ *
+ * \param timer Timer
+ * \param ms Milliseconds from now
+ */
+void chirc_timer_set(chirc_timer_t *timer, uint64_t ms);
+
+/*! \brief Cancels a timer
+ *
+ * Once this returns, the timer does not fire (and is not firing).
+ * Cancelling a timer that is not set does nothing.
+ *
+ * \param timer Timer
+ */
+void chirc_timer_cancel(chirc_timer_t *timer);
+
+/*! \brief Gets the time
+ *
+ * \return Milliseconds since some point in the past (not the time of
+ *         day: only differences between times mean anything)
+ */
+uint64_t chirc_timers_now(void);
+
+/*! \brief Fires the timers that are due (poller thread only)
+ *
+ * \return Milliseconds until the next tick with a timer due, or -1 if
+ *         no timer is set
+ */
+int chirc_timers_run(void);
+
+#endif /* TIMERS_H_ */
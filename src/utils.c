@@ -1,5 +1,6 @@
 /* See utils.h for details about the functions in this module */
 
+#include <stdlib.h>
 #include <string.h>
 
 /* Add your helper functions here.
@@ -51,10 +52,66 @@ int remove_mode(char *modes, char mode)
     return 0;
 }
 
+/* See utils.h */
+int chirc_env_int(const char *name, int def)
+{
+    char *value = getenv(name), *end;
+    long n;
+
+    if (!value || !*value)
+        return def;
+
+    n = strtol(value, &end, 10);
+    if (*end != '\0')
+        return def;
+
+    return (int) n;
+}
+
+
+/* See utils.h */
+const char *chirc_env_str(const char *name, const char *def)
+{
+    char *value = getenv(name);
+
+    if (!value || !*value)
+        return def;
+
+    return value;
+}
+
 int max(int a, int b) {
     return (a > b) ? a : b;
 }
 
 int min(int a, int b) {
     return (a < b) ? a : b;
-}
\ No newline at end of file
+}
+
+/* See utils.h */
+void trim_space(const char *src, int len, char *out)
+{
+    int idx = 0;
+    for (int i = 0; i < len; ++i)
+    {
+        if (' ' != src[i])
+        {
+            int j = i;
+            while (j < len && ' ' != src[j])
+            {
+                out[idx++] = src[j];
+                j++;
+            }
+
+            i = j;
+            if (i < len)
+            {
+                // 分配一个空格
+                out[idx++] = ' ';
+            }
+        }
+    }
+
+    out[idx - 1] = '\n';
+    out[idx - 2] = '\r';
+}
@@ -44,6 +44,39 @@ int set_mode(char *modes, char mode);
  */
 int remove_mode(char *modes, char mode);
 
+/*! \brief Reads an integer setting from the environment
+ *
+ * Run-time tunables that are not part of the command-line
+ * interface are read from CHIRC_* environment variables.
+ *
+ * \param name Name of the environment variable
+ * \param def Value to return if the variable is unset or not a number
+ * \return The value of the variable, or def
+ */
+int chirc_env_int(const char *name, int def);
+
+
+/*! \brief Reads a string setting from the environment
+ *
+ * \param name Name of the environment variable
+ * \param def Value to return if the variable is unset or empty
+ * \return The value of the variable, or def
+ */
+const char *chirc_env_str(const char *name, const char *def);
+
+/*! \brief Collapses runs of spaces in a line
+ *
+ * Copies a line (terminated by "\r\n") removing leading spaces and
+ * collapsing any run of spaces into a single space.
+ *
+ * \param src Line
+ * \param len Length of the line, including the "\r\n"
+ * \param out (Output parameter) Normalized line, terminated by "\r\n".
+ *            Must be at least len bytes long, and zero-filled (the
+ *            function does not add a '\0').
+ */
+void trim_space(const char *src, int len, char *out);
+
 int max(int a, int b);
 
 int min(int a, int b);
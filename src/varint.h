@@ -0,0 +1,67 @@
+/*! \file varint.h
+ *  \brief Variable-length integer encoding
+ *
+ *  Unsigned integers are encoded LEB128-style: seven bits per byte,
+ *  least significant group first, with the high bit set on every
+ *  byte except the last. Small values (the common case for ids,
+ *  lengths and time deltas) take a single byte.
+ *
+ *  These helpers are shared by the binary files chirc writes (see
+ *  eventlog.h) and the tools that read them back.
+ */
+
+#ifndef VARINT_H_
+#define VARINT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*! Maximum number of bytes in an encoded 64-bit varint */
+#define VARINT_MAX (10)
+
+/*! \brief Encodes an unsigned integer
+ *
+ * \param buf Buffer with room for at least VARINT_MAX bytes
+ * \param value Value to encode
+ * \return Number of bytes written
+ */
+static inline size_t varint_encode(unsigned char *buf, uint64_t value)
+{
+    size_t n = 0;
+
+    while (value >= 0x80)
+    {
+        buf[n++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (unsigned char) value;
+
+    return n;
+}
+
+/*! \brief Decodes an unsigned integer
+ *
+ * \param buf Encoded bytes
+ * \param len Number of bytes available in buf
+ * \param value (Output parameter) Decoded value
+ * \return Number of bytes consumed, or 0 if buf does not contain
+ *         a complete varint
+ */
+static inline size_t varint_decode(const unsigned char *buf, size_t len, uint64_t *value)
+{
+    uint64_t v = 0;
+
+    for (size_t i = 0; i < len && i < VARINT_MAX; i++)
+    {
+        v |= (uint64_t) (buf[i] & 0x7f) << (7 * i);
+        if (!(buf[i] & 0x80))
+        {
+            *value = v;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+#endif /* VARINT_H_ */
@@ -0,0 +1,258 @@
+/* See workers.h for details about the functions in this module */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "workers.h"
+#include "log.h"
+
+/* A worker and its queue */
+typedef struct
+{
+    chirc_workers_t *pool;
+    int index;
+    pthread_t thread;
+
+    /* Protects head and tail, which other workers steal from */
+    pthread_mutex_t lock;
+    chirc_task_t *head, *tail;
+} worker_t;
+
+struct chirc_workers
+{
+    worker_t *workers;
+    int nthreads;
+
+    /* Tasks submitted and not finished yet (queued or running) */
+    atomic_long outstanding;
+    /* Tasks in the queues */
+    atomic_long queued;
+    /* Queue that the next task from outside the pool goes to */
+    atomic_uint next_queue;
+
+    /* Idle workers sleep on wake (see worker_sleep) */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_int idle;
+    atomic_bool stopping;
+};
+
+/* Worker that the current thread is, if any (see chirc_workers_submit) */
+static __thread worker_t *self = NULL;
+
+
+static void queue_push(worker_t *w, chirc_task_t *task)
+{
+    task->next = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail)
+        w->tail->next = task;
+    else
+        w->head = task;
+    w->tail = task;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static chirc_task_t *queue_pop(worker_t *w)
+{
+    chirc_task_t *task;
+
+    pthread_mutex_lock(&w->lock);
+    task = w->head;
+    if (task)
+    {
+        w->head = task->next;
+        if (!w->head)
+            w->tail = NULL;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return task;
+}
+
+/* Takes the next task from the worker's own queue or, if it is empty,
+ * steals one from the other workers (starting with the next one, so
+ * thieves spread over the queues) */
+static chirc_task_t *next_task(worker_t *w)
+{
+    chirc_workers_t *pool = w->pool;
+    chirc_task_t *task;
+
+    if (atomic_load(&pool->queued) == 0)
+        return NULL;
+
+    for (int i = 0; i < pool->nthreads; i++)
+    {
+        task = queue_pop(&pool->workers[(w->index + i) % pool->nthreads]);
+        if (task)
+        {
+            atomic_fetch_sub(&pool->queued, 1);
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+/* Waits until there may be a task to run. Returns false if the pool
+ * is stopping and every task has finished. */
+static bool worker_sleep(chirc_workers_t *pool)
+{
+    bool done;
+
+    pthread_mutex_lock(&pool->lock);
+    /* Announced before checking the queues, and submitters queue their
+     * task before checking for idle workers, so either we see the task
+     * or the submitter sees us (and takes the lock to signal us) */
+    atomic_fetch_add(&pool->idle, 1);
+    while (atomic_load(&pool->queued) == 0
+           && !(atomic_load(&pool->stopping) && atomic_load(&pool->outstanding) == 0))
+        pthread_cond_wait(&pool->wake, &pool->lock);
+    atomic_fetch_sub(&pool->idle, 1);
+    done = atomic_load(&pool->queued) == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    return !done;
+}
+
+static void *worker_work(void *args)
+{
+    worker_t *w = args;
+    chirc_workers_t *pool = w->pool;
+    chirc_task_t *task;
+
+    self = w;
+
+    do
+    {
+        while ((task = next_task(w)) != NULL)
+        {
+            task->run(task);
+
+            /* The last task to finish wakes the workers up to exit */
+            if (atomic_fetch_sub(&pool->outstanding, 1) == 1 && atomic_load(&pool->stopping))
+            {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->wake);
+                pthread_mutex_unlock(&pool->lock);
+            }
+        }
+    } while (worker_sleep(pool));
+
+    return NULL;
+}
+
+/* See workers.h */
+chirc_workers_t *chirc_workers_start(int nthreads, size_t stack_size)
+{
+    chirc_workers_t *pool = calloc(1, sizeof(chirc_workers_t));
+    pthread_attr_t attr;
+    int started = 0;
+
+    if (!pool)
+        return NULL;
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    pool->workers = calloc(nthreads, sizeof(worker_t));
+    if (!pool->workers)
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->nthreads = nthreads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    pthread_attr_init(&attr);
+    if (stack_size > 0)
+    {
+        if (stack_size < PTHREAD_STACK_MIN)
+            stack_size = PTHREAD_STACK_MIN;
+        pthread_attr_setstacksize(&attr, stack_size);
+    }
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init(&pool->workers[i].lock, NULL);
+    }
+
+    for (started = 0; started < nthreads; started++)
+    {
+        if (pthread_create(&pool->workers[started].thread, &attr, worker_work, &pool->workers[started]) != 0)
+        {
+            chilog(ERROR, "failed to create worker thread %d!", started);
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    if (started < nthreads)
+    {
+        /* Only the threads that were created are joined */
+        pool->nthreads = started;
+        chirc_workers_stop(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+/* See workers.h */
+void chirc_workers_submit(chirc_workers_t *pool, chirc_task_t *task)
+{
+    worker_t *w;
+
+    if (self && self->pool == pool)
+        w = self;
+    else
+        w = &pool->workers[atomic_fetch_add(&pool->next_queue, 1) % pool->nthreads];
+
+    /* Counted before it is queued, so the count is never negative
+     * (a worker that sees it too early just looks again) */
+    atomic_fetch_add(&pool->outstanding, 1);
+    atomic_fetch_add(&pool->queued, 1);
+    queue_push(w, task);
+
+    if (atomic_load(&pool->idle) > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* See workers.h */
+void chirc_workers_stop(chirc_workers_t *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stopping, true);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (int i = 0; i < pool->nthreads; i++)
+        pthread_mutex_destroy(&pool->workers[i].lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->workers);
+    free(pool);
+}
+
+/* See workers.h */
+int chirc_workers_count(chirc_workers_t *pool)
+{
+    return pool ? pool->nthreads : 0;
+}
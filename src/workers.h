@@ -0,0 +1,81 @@
+/*! \file workers.h
+ *  \brief Fixed-size worker thread pool
+ *
+ *  The server does not create a thread per connection. A connection
+ *  that has something to do (e.g., bytes to read) is submitted as a
+ *  task to a pool with a fixed number of worker threads, so the number
+ *  of threads no longer grows with the number of clients.
+ *
+ *  Each worker has its own queue. A task submitted by a worker goes
+ *  to that worker's queue (it is usually the continuation of what the
+ *  worker is doing, so its data is still in that CPU's cache), and a
+ *  task submitted by any other thread goes to the queues in turn. A
+ *  worker runs the tasks in its queue in order and, when it runs out,
+ *  steals the oldest task from another worker's queue before going to
+ *  sleep.
+ *
+ *  The pool runs tasks in no particular order across queues; tasks
+ *  that must run in order (e.g., the commands of a connection) must be
+ *  serialized by their owner, which is what the server does by never
+ *  having more than one task per connection queued or running.
+ */
+
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include <stddef.h>
+
+/*! \brief A unit of work
+ *
+ * Tasks are embedded in the structs they work on (the pool does not
+ * allocate anything per task); run gets the task back and can find
+ * its enclosing struct from it.
+ */
+typedef struct chirc_task
+{
+    /*! \brief Function that does the work */
+    void (*run)(struct chirc_task *task);
+
+    /*! \brief Next task in a worker's queue (used by the pool) */
+    struct chirc_task *next;
+} chirc_task_t;
+
+typedef struct chirc_workers chirc_workers_t;
+
+/*! \brief Starts a pool
+ *
+ * \param nthreads Number of worker threads (at least 1)
+ * \param stack_size Stack size of each worker, in bytes (0 for the
+ *                   system's default)
+ * \return The pool, or NULL on failure
+ */
+chirc_workers_t *chirc_workers_start(int nthreads, size_t stack_size);
+
+/*! \brief Submits a task to a pool
+ *
+ * The task must not be queued already; it can be submitted again once
+ * it starts running.
+ *
+ * \param pool Pool
+ * \param task Task
+ */
+void chirc_workers_submit(chirc_workers_t *pool, chirc_task_t *task);
+
+/*! \brief Stops a pool and frees it
+ *
+ * Waits for the workers to run every task that was submitted (including
+ * those submitted by the tasks themselves) and to exit. Tasks must not
+ * be submitted from other threads once this is called.
+ *
+ * \param pool Pool (can be NULL)
+ */
+void chirc_workers_stop(chirc_workers_t *pool);
+
+/*! \brief Gets the number of threads in a pool
+ *
+ * \param pool Pool (can be NULL)
+ * \return Number of worker threads (0 if pool is NULL)
+ */
+int chirc_workers_count(chirc_workers_t *pool);
+
+#endif /* WORKERS_H_ */
@@ -0,0 +1,120 @@
+import selectors
+import socket
+import time
+
+
+class PerfClients:
+    '''
+    A set of raw, non-blocking client connections to a server, driven by
+    a single selector. Unlike ChircClient, reading from one connection
+    never blocks the others, so this class can be used to time
+    operations involving hundreds of clients (the PERF tests).
+
+    Every connection buffers the lines it receives; callers wait for
+    specific lines with wait_for(), and everything else is discarded.
+    '''
+
+    def __init__(self, port, host = "localhost"):
+        self.host = host
+        self.port = port
+        self.selector = selectors.DefaultSelector()
+        self.socks = []
+        self.buffers = {}
+
+    def connect(self, n):
+        '''
+        Opens n connections, and returns their indexes.
+        '''
+        first = len(self.socks)
+        for i in range(n):
+            s = socket.create_connection((self.host, self.port), timeout = 5)
+            s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            s.setblocking(False)
+            self.selector.register(s, selectors.EVENT_READ, len(self.socks))
+            self.socks.append(s)
+            self.buffers[len(self.socks) - 1] = b""
+        return range(first, len(self.socks))
+
+    def send(self, idx, cmd):
+        s = self.socks[idx]
+        data = str.encode("%s\r\n" % cmd)
+        s.setblocking(True)
+        try:
+            s.sendall(data)
+        finally:
+            s.setblocking(False)
+
+    def close(self):
+        for s in self.socks:
+            self.selector.unregister(s)
+            s.close()
+        self.selector.close()
+        self.socks = []
+
+    def poll(self, timeout, on_line):
+        '''
+        Waits up to `timeout` seconds for data, and calls on_line(idx, line)
+        for every complete line received (without the CRLF).
+        '''
+        for key, _ in self.selector.select(timeout):
+            idx = key.data
+            try:
+                data = key.fileobj.recv(65536)
+            except BlockingIOError:
+                continue
+            if not data:
+                self.selector.unregister(key.fileobj)
+                on_line(idx, None)
+                continue
+
+            buf = self.buffers[idx] + data
+            lines = buf.split(b"\r\n")
+            self.buffers[idx] = lines.pop()
+            for line in lines:
+                on_line(idx, line.decode(errors = "replace"))
+
+    def wait_for(self, pending, timeout, match):
+        '''
+        Waits until every connection in `pending` (a set of indexes)
+        has received a line for which match(idx, line) returns True.
+        Connections are removed from `pending` as they get one, and
+        also if match() returns False (which fails the connection) or
+        the server closes them. Returns the connections that failed.
+        '''
+        failed = set()
+        deadline = time.monotonic() + timeout
+
+        def on_line(idx, line):
+            if idx not in pending:
+                return
+            result = match(idx, line) if line is not None else False
+            if result is not None:
+                pending.discard(idx)
+                if not result:
+                    failed.add(idx)
+
+        while pending and time.monotonic() < deadline:
+            self.poll(min(0.1, max(0, deadline - time.monotonic())), on_line)
+
+        return failed
+
+
+def command_of(line):
+    '''
+    Returns the command (or numeric reply) of an IRC line.
+    '''
+    if line.startswith(":"):
+        line = line.split(" ", 1)[1] if " " in line else ""
+    return line.split(" ", 1)[0]
+
+
+def is_error_reply(line):
+    cmd = command_of(line)
+    return len(cmd) == 3 and cmd.isdigit() and cmd[0] in "45"
+
+
+def percentile(values, q):
+    values = sorted(values)
+    if not values:
+        return 0
+    return values[min(len(values) - 1, int(q * len(values)))]
@@ -26,7 +26,8 @@ class SingleIRCSession:
 
     def __init__(self, chirc_exe = None, msg_timeout = 0.1,
                  chirc_port = None, loglevel = -1, debug = False,
-                 irc_network = None, irc_network_server = None, external_chirc_port=None):
+                 irc_network = None, irc_network_server = None, external_chirc_port=None,
+                 chirc_env = None):
         if chirc_exe is None:
             self.chirc_exe = "../build/chirc"
         else:            
@@ -59,6 +60,8 @@ class SingleIRCSession:
         self.loglevel = loglevel
         self.debug = debug
         self.external_chirc_port = external_chirc_port
+        # Extra environment variables for the server (e.g., CHIRC_* tunables)
+        self.chirc_env = chirc_env
 
         random_str = "".join([random.choice(string.ascii_letters + string.digits) for _ in range(8)])
         self.oper_password = "oper-{}".format(random_str)
@@ -139,7 +142,12 @@ class SingleIRCSession:
             elif self.loglevel == 2:
                 chirc_cmd.append("-vv")
 
-            self.chirc_proc = subprocess.Popen(chirc_cmd, cwd = self.tmpdir)
+            env = None
+            if self.chirc_env is not None:
+                env = dict(os.environ)
+                env.update(self.chirc_env)
+
+            self.chirc_proc = subprocess.Popen(chirc_cmd, cwd = self.tmpdir, env = env)
             time.sleep(0.01)
             rc = self.chirc_proc.poll()        
             if rc != None:
@@ -8,11 +8,15 @@ def irc_session(request):
     chirc_loglevel = request.config.getoption("--chirc-loglevel")
     chirc_port = request.config.getoption("--chirc-port")
     external_chirc_port = request.config.getoption("--chirc-external-port")
+    # A test module can set CHIRC_ENV to start the server with extra
+    # environment variables
+    chirc_env = getattr(request.module, "CHIRC_ENV", None)
     
     session = SingleIRCSession(chirc_exe=chirc_exe,
                                loglevel=chirc_loglevel,
                                chirc_port=chirc_port,
-                               external_chirc_port=external_chirc_port)
+                               external_chirc_port=external_chirc_port,
+                               chirc_env=chirc_env)
     
     session.start_session()
     
@@ -0,0 +1,219 @@
+import threading
+import time
+
+import pytest
+from chirc.tests.common.perf import PerfClients, command_of, is_error_reply, percentile
+
+#
+# Performance budgets. These tests time operations on loopback and
+# fail if they take longer than the budgets in the perf_budgets fixture
+# (see conftest.py; they can be changed with --chirc-perf-budget and
+# scaled with --chirc-perf-scale on slower machines).
+#
+
+# The clients all come from one address and send as fast as they can,
+# so the server is started without flood control or per-address limits
+# (like the benchmarks that start their own server)
+CHIRC_ENV = {
+    "CHIRC_FLOOD_RATE": "-1",
+    "CHIRC_UNREG_FLOOD_RATE": "-1",
+    "CHIRC_IP_CONNS": "-1",
+    "CHIRC_IP_CONNECT_RATE": "-1",
+}
+
+def _server_port(irc_session):
+    if irc_session.external_chirc_port is not None:
+        return irc_session.external_chirc_port
+    else:
+        return irc_session.port
+
+
+def _register(clients, idxs, timeout, prefix = "perf"):
+    """
+    Registers the connections in `idxs` (with nicks perf0, perf1, ...)
+    and waits for their RPL_WELCOME. Returns how long it took.
+    """
+    start = time.monotonic()
+
+    for i in idxs:
+        clients.send(i, "NICK %s%i" % (prefix, i))
+        clients.send(i, "USER %s%i * * :Perf %i" % (prefix, i, i))
+
+    def welcomed(idx, line):
+        if command_of(line) == "001":
+            return True
+        elif is_error_reply(line):
+            return False
+        return None
+
+    pending = set(idxs)
+    failed = clients.wait_for(pending, timeout, welcomed)
+    elapsed = time.monotonic() - start
+
+    assert not failed, "{} of {} clients could not register".format(len(failed), len(idxs))
+    assert not pending, "{} of {} clients were not welcomed after {:.1f} seconds".format(len(pending), len(idxs), timeout)
+
+    return elapsed
+
+
+def _drain(clients, quiet = 0.2, timeout = 10):
+    """
+    Discards everything the server sends until it has been quiet for
+    `quiet` seconds.
+    """
+    deadline = time.monotonic() + timeout
+    received = [True]
+
+    def discard(idx, line):
+        received[0] = True
+
+    while received[0] and time.monotonic() < deadline:
+        received[0] = False
+        end = time.monotonic() + quiet
+        while time.monotonic() < end:
+            clients.poll(quiet, discard)
+
+
+@pytest.mark.category("PERF_REGISTRATION")
+class TestPerfRegistration(object):
+
+    def test_registration_burst(self, irc_session, perf_budgets):
+        """
+        Connect a burst of clients at once and register all of them. Every
+        client must get its RPL_WELCOME within the budget.
+        """
+        n = perf_budgets["registration_clients"]
+        budget = perf_budgets["registration_s"]
+
+        clients = PerfClients(_server_port(irc_session))
+        try:
+            start = time.monotonic()
+            idxs = clients.connect(n)
+            _register(clients, idxs, timeout = max(5 * budget, 10))
+            elapsed = time.monotonic() - start
+        finally:
+            clients.close()
+
+        assert elapsed <= budget, \
+            "Registering {} clients took {:.3f} seconds (budget: {:.3f})".format(n, elapsed, budget)
+
+
+@pytest.mark.category("PERF_PING")
+class TestPerfPING(object):
+
+    def _background_load(self, port, n, stop):
+        """
+        Keeps `n` registered clients busy with PRIVMSGs to each other
+        and PINGs until `stop` is set.
+        """
+        clients = PerfClients(port)
+        try:
+            idxs = clients.connect(n)
+            _register(clients, idxs, timeout = 10, prefix = "load")
+            i = 0
+            while not stop.is_set():
+                for idx in idxs:
+                    clients.send(idx, "PRIVMSG load%i :background load %i" % ((idx + 1) % n, i))
+                    clients.send(idx, "PING")
+                clients.poll(0.001, lambda idx, line: None)
+                i += 1
+        finally:
+            clients.close()
+
+    def test_ping_p99_under_load(self, irc_session, perf_budgets):
+        """
+        PING the server repeatedly while other clients keep it busy. The
+        99th percentile of the PING/PONG round trip must be within the
+        budget.
+        """
+        port = _server_port(irc_session)
+        npings = perf_budgets["ping_count"]
+        budget = perf_budgets["ping_p99_ms"] / 1000.0
+
+        stop = threading.Event()
+        load = threading.Thread(target = self._background_load,
+                                args = (port, perf_budgets["ping_load_clients"], stop))
+        load.start()
+
+        clients = PerfClients(port)
+        rtts = []
+        try:
+            idxs = clients.connect(1)
+            _register(clients, idxs, timeout = 10)
+            _drain(clients)
+
+            for i in range(npings):
+                start = time.monotonic()
+                clients.send(0, "PING")
+                pending = {0}
+                clients.wait_for(pending, 5,
+                                 lambda idx, line: True if command_of(line) == "PONG" else None)
+                assert not pending, "No PONG received for PING #{}".format(i + 1)
+                rtts.append(time.monotonic() - start)
+        finally:
+            stop.set()
+            load.join()
+            clients.close()
+
+        p99 = percentile(rtts, 0.99)
+        assert p99 <= budget, \
+            "PING round trip p99 is {:.3f} ms (budget: {:.3f} ms)".format(p99 * 1000, budget * 1000)
+
+
+@pytest.mark.category("PERF_CHANNEL_FANOUT")
+class TestPerfChannelFanout(object):
+
+    def test_channel_fanout(self, irc_session, perf_budgets):
+        """
+        Join a large number of clients to a channel, and have one of them
+        send PRIVMSGs to it. Every other member must receive all the
+        messages within the budget.
+        """
+        n = perf_budgets["fanout_members"]
+        nmsgs = perf_budgets["fanout_messages"]
+        budget = perf_budgets["fanout_s"]
+
+        clients = PerfClients(_server_port(irc_session))
+        try:
+            idxs = clients.connect(n)
+            _register(clients, idxs, timeout = max(n / 50, 10))
+
+            for i in idxs:
+                clients.send(i, "JOIN #perf")
+
+            def joined(idx, line):
+                if command_of(line) == "366":
+                    return True
+                elif is_error_reply(line):
+                    return False
+                return None
+
+            pending = set(idxs)
+            failed = clients.wait_for(pending, max(n / 50, 10), joined)
+            assert not failed, "{} of {} clients could not join #perf".format(len(failed), n)
+            assert not pending, "{} of {} clients did not finish joining #perf".format(len(pending), n)
+
+            # Wait for the JOINs relayed to the channel
+            _drain(clients)
+
+            received = dict.fromkeys(idxs, 0)
+
+            def delivered(idx, line):
+                if command_of(line) == "PRIVMSG":
+                    received[idx] += 1
+                    if received[idx] == nmsgs:
+                        return True
+                return None
+
+            start = time.monotonic()
+            for i in range(nmsgs):
+                clients.send(0, "PRIVMSG #perf :Fan-out message %i" % i)
+            pending = set(idxs[1:])
+            clients.wait_for(pending, max(5 * budget, 10), delivered)
+            elapsed = time.monotonic() - start
+        finally:
+            clients.close()
+
+        assert not pending, "{} of {} members did not receive all {} messages".format(len(pending), n - 1, nmsgs)
+        assert elapsed <= budget, \
+            "Delivering {} messages to {} members took {:.3f} seconds (budget: {:.3f})".format(nmsgs, n - 1, elapsed, budget)
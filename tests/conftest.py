@@ -18,6 +18,43 @@ def pytest_addoption(parser):
                      help="Do not launch chirc, and instead connect to chirc on this port")
     parser.addoption("--generate-alltests-file", action="store", type=str, default=None,
                      help="Generate file with all the test categories and names")
+    parser.addoption("--chirc-perf-budget", action="append", default=[], metavar="NAME=VALUE",
+                     help="override a budget of the PERF tests (can be given several times; "
+                          "budgets: {})".format(", ".join(sorted(PERF_BUDGETS))))
+    parser.addoption("--chirc-perf-scale", action="store", type=float, default=1.0, metavar="FACTOR",
+                     help="multiply the time budgets of the PERF tests by FACTOR (e.g., on slow machines)")
+
+
+# Default budgets of the PERF tests. The ones ending in _s or _ms are
+# time budgets, and are scaled by --chirc-perf-scale.
+PERF_BUDGETS = {
+    "registration_clients": 200,    # Clients registering at once
+    "registration_s": 2.0,          # ... all of them welcomed within
+    "ping_load_clients": 20,        # Clients generating background load
+    "ping_count": 200,              # PINGs timed
+    "ping_p99_ms": 20.0,            # PING/PONG round trip p99
+    "fanout_members": 1000,         # Channel members
+    "fanout_messages": 10,          # Messages sent to the channel
+    "fanout_s": 2.0,                # ... all of them delivered within
+}
+
+
+@pytest.fixture
+def perf_budgets(request):
+    budgets = dict(PERF_BUDGETS)
+
+    for override in request.config.getoption("--chirc-perf-budget"):
+        name, sep, value = override.partition("=")
+        if not sep or name not in budgets:
+            pytest.exit("Invalid --chirc-perf-budget: {}".format(override))
+        budgets[name] = type(budgets[name])(value)
+
+    scale = request.config.getoption("--chirc-perf-scale")
+    for name in budgets:
+        if name.endswith("_s") or name.endswith("_ms"):
+            budgets[name] *= scale
+
+    return budgets
 
 
 def pytest_sessionstart(session):
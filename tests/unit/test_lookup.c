@@ -0,0 +1,235 @@
+/*! \file test_lookup.c
+ *  \brief Tests of handlers that wait for I/O, through the host lookup
+ *
+ *  The lookup of a client's host is a handler (see handlers.h) that
+ *  suspends the connection until the resolver answers. These tests run
+ *  a server with a stub resolver backend (see resolver.h) that only
+ *  answers once the test lets it, and check that:
+ *
+ *    - the client's commands wait while the handler is suspended, and
+ *      run once it is resumed, with the name the stub gave;
+ *    - a client that disconnects while the handler is suspended has it
+ *      cancelled (and a late answer does not touch the connection);
+ *    - a client whose lookup takes too long goes on with its numeric
+ *      address.
+ *
+ *  Clients connect from different loopback addresses (127.0.0.x), so
+ *  each one needs a lookup of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libchirc.h"
+#include "resolver.h"
+#include "log.h"
+
+#define CHECK(cond)                                                     \
+    do { if (!(cond)) {                                                 \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); } } while (0)
+
+/* Lookup timeout of the server, in milliseconds */
+#define LOOKUP_TIMEOUT 500
+
+/* The stub answers once open is set (or after 5 seconds, so the server
+ * can always be stopped) */
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stub_opened = PTHREAD_COND_INITIALIZER;
+static bool stub_open = false;
+static int calls = 0;
+
+static bool stub_backend(struct in_addr addr, char *host, size_t len)
+{
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += 5;
+
+    pthread_mutex_lock(&stub_lock);
+    calls++;
+    while (!stub_open)
+        if (pthread_cond_timedwait(&stub_opened, &stub_lock, &until) != 0)
+            break;
+    pthread_mutex_unlock(&stub_lock);
+
+    snprintf(host, len, "host%u.example", (unsigned) (ntohl(addr.s_addr) & 0xff));
+    return true;
+}
+
+static void stub_set_open(bool open)
+{
+    pthread_mutex_lock(&stub_lock);
+    stub_open = open;
+    pthread_cond_broadcast(&stub_opened);
+    pthread_mutex_unlock(&stub_lock);
+}
+
+static int stub_calls(void)
+{
+    int n;
+
+    pthread_mutex_lock(&stub_lock);
+    n = calls;
+    pthread_mutex_unlock(&stub_lock);
+
+    return n;
+}
+
+/* Connects to the server from a loopback address, and registers */
+static int connect_from(const char *src, int port, const char *nick)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    char reg[128];
+    int fd, len;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+
+    inet_pton(AF_INET, src, &addr.sin_addr);
+    CHECK(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    addr.sin_port = htons(port);
+    CHECK(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    len = snprintf(reg, sizeof(reg), "NICK %s\r\nUSER %s * * :Test\r\n", nick, nick);
+    CHECK(write(fd, reg, len) == len);
+
+    return fd;
+}
+
+/* Reads the first line the server sends, waiting at most timeout_ms.
+ * Returns false if there is none by then. */
+static bool read_line(int fd, char *buf, size_t size, int timeout_ms)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    size_t pos = 0;
+    ssize_t n;
+
+    while (pos < size - 1)
+    {
+        if (poll(&pfd, 1, timeout_ms) <= 0)
+            return false;
+        n = read(fd, buf + pos, 1);
+        if (n <= 0)
+            return false;
+        if (buf[pos] == '\n')
+            break;
+        pos++;
+    }
+    buf[pos] = '\0';
+
+    return true;
+}
+
+/* Waits until the server has no connection open */
+static void wait_closed(chirc_ctx_t *ctx)
+{
+    chirc_stats_t stats;
+
+    for (int i = 0; i < 500; i++)
+    {
+        chirc_get_stats(ctx, &stats);
+        if (stats.connections == 0)
+            return;
+        usleep(10 * 1000);
+    }
+    CHECK(!"connections were not closed");
+}
+
+/* The commands wait for the suspended handler, and run once it is
+ * resumed */
+static void test_suspend_resume(int port)
+{
+    char line[512];
+    int fd;
+
+    stub_set_open(false);
+    fd = connect_from("127.0.0.2", port, "amy");
+
+    CHECK(!read_line(fd, line, sizeof(line), LOOKUP_TIMEOUT / 2));
+    CHECK(stub_calls() == 1);
+
+    stub_set_open(true);
+    CHECK(read_line(fd, line, sizeof(line), 2000));
+    CHECK(strstr(line, " 001 amy ") != NULL);
+    CHECK(strstr(line, "amy!amy@host2.example") != NULL);
+
+    close(fd);
+}
+
+/* A client that leaves while its handler is suspended has it
+ * cancelled, and the answer that comes later is only cached */
+static void test_cancel(chirc_ctx_t *ctx, int port)
+{
+    char line[512];
+    int fd, before = stub_calls();
+
+    stub_set_open(false);
+    fd = connect_from("127.0.0.3", port, "bob");
+    usleep(100 * 1000);
+    CHECK(stub_calls() == before + 1);
+    close(fd);
+    wait_closed(ctx);
+
+    stub_set_open(true);
+    usleep(100 * 1000);
+
+    /* The name was cached for the next client from the address */
+    fd = connect_from("127.0.0.3", port, "bob");
+    CHECK(read_line(fd, line, sizeof(line), 2000));
+    CHECK(strstr(line, "bob!bob@host3.example") != NULL);
+    CHECK(stub_calls() == before + 1);
+    close(fd);
+}
+
+/* A client whose lookup takes too long goes on with its numeric
+ * address */
+static void test_timeout(int port)
+{
+    char line[512];
+    int fd;
+
+    stub_set_open(false);
+    fd = connect_from("127.0.0.4", port, "cat");
+
+    CHECK(read_line(fd, line, sizeof(line), LOOKUP_TIMEOUT * 4));
+    CHECK(strstr(line, "cat!cat@127.0.0.4") != NULL);
+
+    stub_set_open(true);
+    close(fd);
+}
+
+int main(void)
+{
+    chirc_ctx_t ctx;
+    char port[16];
+    int p = 20000 + getpid() % 20000;
+
+    chirc_setloglevel(QUIET);
+    snprintf(port, sizeof(port), "%d", p);
+
+    CHECK(chirc_init(&ctx, "test.example", port, "x") == CHIRC_OK);
+    chirc_set_resolver(&ctx, 2, 60, LOOKUP_TIMEOUT);
+    chirc_resolver_set_backend(stub_backend);
+    CHECK(chirc_start(&ctx) == CHIRC_OK);
+
+    test_suspend_resume(p);
+    test_cancel(&ctx, p);
+    test_timeout(p);
+
+    chirc_stop(&ctx);
+
+    printf("test_lookup: ok\n");
+    return 0;
+}
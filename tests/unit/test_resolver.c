@@ -0,0 +1,212 @@
+/*! \file test_resolver.c
+ *  \brief Tests of the resolver's cache
+ *
+ *  Runs the resolver (see resolver.h) with a stub backend that counts
+ *  the lookups it is asked for, and only answers once the test lets
+ *  it, and checks that:
+ *
+ *    - a name that was looked up is answered from the cache;
+ *    - it is looked up again once its TTL is over;
+ *    - an address without a name is cached too;
+ *    - lookups of an address that is being looked up share its answer;
+ *    - names that cannot be a host are not used.
+ *
+ *  How a connection falls back to its numeric address when the lookup
+ *  takes too long is tested in test_lookup.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "chirc.h"
+#include "resolver.h"
+
+#define CHECK(cond)                                                     \
+    do { if (!(cond)) {                                                 \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); } } while (0)
+
+/* Seconds names are cached for */
+#define TTL 1
+
+/* The stub answers once stub_open is set (or after 5 seconds). Names
+ * are hostN.example for 10.0.0.N, except that 10.0.0.9 has none, and
+ * 10.0.0.8 has one that is not a host. */
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stub_opened = PTHREAD_COND_INITIALIZER;
+static bool stub_open = true;
+static int calls = 0;
+
+static bool stub_backend(struct in_addr addr, char *host, size_t len)
+{
+    unsigned n = ntohl(addr.s_addr) & 0xff;
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += 5;
+
+    pthread_mutex_lock(&stub_lock);
+    calls++;
+    while (!stub_open)
+        if (pthread_cond_timedwait(&stub_opened, &stub_lock, &until) != 0)
+            break;
+    pthread_mutex_unlock(&stub_lock);
+
+    if (n == 9)
+        return false;
+    if (n == 8)
+        snprintf(host, len, "evil :host");
+    else
+        snprintf(host, len, "host%u.example", n);
+
+    return true;
+}
+
+static void stub_set_open(bool open)
+{
+    pthread_mutex_lock(&stub_lock);
+    stub_open = open;
+    pthread_cond_broadcast(&stub_opened);
+    pthread_mutex_unlock(&stub_lock);
+}
+
+static int stub_calls(void)
+{
+    int n;
+
+    pthread_mutex_lock(&stub_lock);
+    n = calls;
+    pthread_mutex_unlock(&stub_lock);
+
+    return n;
+}
+
+static atomic_int dones;
+
+static void lookup_done(chirc_lookup_t *lookup)
+{
+    (void) lookup;
+
+    atomic_fetch_add(&dones, 1);
+}
+
+static struct in_addr address(unsigned n)
+{
+    struct in_addr addr = {.s_addr = htonl(0x0a000000 | n)};
+
+    return addr;
+}
+
+/* Looks an address up, and waits for the answer (if it is not in the
+ * cache). Returns whether it was in the cache. */
+static bool lookup(chirc_lookup_t *lookup, unsigned n)
+{
+    int before = atomic_load(&dones);
+
+    chirc_lookup_init(lookup, lookup_done);
+    if (chirc_resolver_lookup(lookup, address(n)))
+        return true;
+
+    for (int i = 0; i < 500 && atomic_load(&dones) == before; i++)
+        usleep(10 * 1000);
+    CHECK(atomic_load(&dones) == before + 1);
+
+    return false;
+}
+
+static void test_hit(void)
+{
+    chirc_lookup_t l;
+    int before = stub_calls();
+
+    CHECK(!lookup(&l, 1));
+    CHECK(strcmp(l.host, "host1.example") == 0);
+
+    CHECK(lookup(&l, 1));
+    CHECK(strcmp(l.host, "host1.example") == 0);
+    CHECK(stub_calls() == before + 1);
+}
+
+static void test_ttl(void)
+{
+    chirc_lookup_t l;
+    int before = stub_calls();
+
+    CHECK(!lookup(&l, 2));
+    usleep(TTL * 1000 * 1000 + 200 * 1000);
+
+    CHECK(!lookup(&l, 2));
+    CHECK(strcmp(l.host, "host2.example") == 0);
+    CHECK(stub_calls() == before + 2);
+}
+
+static void test_negative(void)
+{
+    chirc_lookup_t l;
+    int before = stub_calls();
+
+    CHECK(!lookup(&l, 9));
+    CHECK(l.host[0] == '\0');
+
+    CHECK(lookup(&l, 9));
+    CHECK(l.host[0] == '\0');
+    CHECK(stub_calls() == before + 1);
+}
+
+static void test_shared(void)
+{
+    chirc_lookup_t l[3];
+    int before = stub_calls(), done_before = atomic_load(&dones);
+
+    stub_set_open(false);
+    for (int i = 0; i < 3; i++)
+    {
+        chirc_lookup_init(&l[i], lookup_done);
+        CHECK(!chirc_resolver_lookup(&l[i], address(3)));
+    }
+    /* One of them gives up: it is not told */
+    chirc_resolver_cancel(&l[2]);
+    usleep(100 * 1000);
+    CHECK(stub_calls() == before + 1);
+    stub_set_open(true);
+
+    for (int i = 0; i < 500 && atomic_load(&dones) < done_before + 2; i++)
+        usleep(10 * 1000);
+    usleep(50 * 1000);
+    CHECK(atomic_load(&dones) == done_before + 2);
+    CHECK(strcmp(l[0].host, "host3.example") == 0);
+    CHECK(strcmp(l[1].host, "host3.example") == 0);
+    CHECK(stub_calls() == before + 1);
+}
+
+static void test_invalid(void)
+{
+    chirc_lookup_t l;
+
+    CHECK(!lookup(&l, 8));
+    CHECK(l.host[0] == '\0');
+}
+
+int main(void)
+{
+    chirc_resolver_set_backend(stub_backend);
+    CHECK(chirc_resolver_start(2, TTL) == CHIRC_OK);
+
+    test_hit();
+    test_ttl();
+    test_negative();
+    test_shared();
+    test_invalid();
+
+    chirc_resolver_stop();
+
+    printf("test_resolver: ok\n");
+    return 0;
+}
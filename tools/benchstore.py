@@ -0,0 +1,401 @@
+#!/usr/bin/python3
+"""Stores benchmark results and compares them across commits.
+
+Every chirc benchmark prints its results with -j as a JSON document in
+a common schema (see bench/bench_json.h). This tool keeps those
+documents in a local store, and compares two sets of them:
+
+    benchstore.py record [-d DIR] [-n RUNS] [-l LABEL] -- COMMAND...
+        Runs COMMAND (a benchmark with -j) RUNS times, and appends its
+        results to DIR/LABEL.jsonl (one document per line). LABEL
+        defaults to the current commit (git describe --always --dirty),
+        and is also passed to the benchmark as CHIRC_BENCH_COMMIT.
+
+    benchstore.py list [-d DIR]
+        Lists the labels in the store.
+
+    benchstore.py compare [-d DIR] [-t PERCENT] [-a ALPHA] [-m PATTERN]
+                          [--all] [--strict] [-j] BASE NEW
+        Compares the results in BASE and NEW, which are labels in the
+        store or files (with one or more documents each, e.g., the output
+        of several runs appended to one file).
+
+A result is identified by its suite, scenario and params. Every value
+of a result with a known direction (lower percentiles and allocations
+are better, higher throughputs, and other metrics say which way they
+go) is compared: the observations on each side are the value's samples
+(e.g., every run of a microbenchmark), or the value itself from every
+run, and the change is that of their medians. A change is only
+significant if a two-sided Mann-Whitney U test rejects "no difference"
+at ALPHA; with fewer than four observations on a side it never can,
+so record several runs of benchmarks that do not take samples.
+
+A REGRESSION is a significant change in the wrong direction of more
+than PERCENT (5% by default). Changes over PERCENT that are not
+significant are shown as noise, or as untested if a side has a single
+observation. The exit status is 1 if there are regressions (or, with
+--strict, untested changes over PERCENT in the wrong direction).
+
+Everything runs locally, with nothing but the Python standard library.
+"""
+
+import argparse
+import fnmatch
+import json
+import math
+import os
+import statistics
+import subprocess
+import sys
+
+SCHEMA = "chirc-bench/1"
+
+# Percentiles that are compared (max is too noisy, and count is not a
+# measure of performance)
+COMPARED_PERCENTILES = ("mean", "p50", "p90", "p99", "p999")
+
+
+def load_documents(path):
+    """Loads every JSON document in a file (pretty-printed documents
+    one after the other, or one per line)"""
+    with open(path) as f:
+        text = f.read()
+
+    decoder = json.JSONDecoder()
+    docs = []
+    pos = 0
+    while True:
+        while pos < len(text) and text[pos].isspace():
+            pos += 1
+        if pos >= len(text):
+            break
+        doc, pos = decoder.raw_decode(text, pos)
+        if doc.get("schema") != SCHEMA:
+            raise ValueError("%s: not a %s document" % (path, SCHEMA))
+        docs.append(doc)
+
+    return docs
+
+
+def resolve(store, name):
+    """Finds the file for a label, or takes name as a file"""
+    if os.path.exists(name):
+        return name
+    path = os.path.join(store, name + ".jsonl")
+    if os.path.exists(path):
+        return path
+    raise FileNotFoundError("%s: no such file or label in %s" % (name, store))
+
+
+def result_key(doc, result):
+    params = dict(doc.get("params", {}))
+    params.update(result.get("params", {}))
+    return (doc["suite"], result["scenario"], json.dumps(params, sort_keys=True))
+
+
+def result_values(result, include_none):
+    """Yields (path, value, better) for the values of a result"""
+    for name, pct in result.get("percentiles", {}).items():
+        for q in COMPARED_PERCENTILES:
+            if q in pct:
+                yield "percentiles.%s.%s" % (name, q), pct[q], "lower"
+    for name, value in result.get("throughput", {}).items():
+        yield "throughput." + name, value, "higher"
+    for name, value in result.get("allocations", {}).items():
+        yield "allocations." + name, value, "lower"
+    for name, metric in result.get("metrics", {}).items():
+        better = metric.get("better", "none")
+        if better != "none" or include_none:
+            yield "metrics." + name, metric.get("value"), better
+
+
+def collect(docs, include_none):
+    """Pools the observations of every value over the runs:
+    {key: {path: (better, [observations])}}"""
+    pooled = {}
+    for doc in docs:
+        for result in doc.get("results", []):
+            values = pooled.setdefault(result_key(doc, result), {})
+            samples = result.get("samples", {})
+            for path, value, better in result_values(result, include_none):
+                obs = samples.get(path)
+                if obs is None:
+                    obs = [value]
+                obs = [v for v in obs if v is not None]
+                if obs:
+                    values.setdefault(path, (better, []))[1].extend(obs)
+    return pooled
+
+
+def exact_u_pvalue(n1, n2, u):
+    """Two-sided p-value of U, from its exact distribution (no ties)"""
+    # counts[k] = number of orderings of n1 and n2 values with U = k,
+    # built up one value at a time (dynamic programming over (i, j))
+    table = {}
+
+    def count(i, j):
+        if (i, j) not in table:
+            if i == 0 or j == 0:
+                table[(i, j)] = [1]
+            else:
+                a = count(i - 1, j)
+                b = count(i, j - 1)
+                c = [0] * (i * j + 1)
+                for k, v in enumerate(a):
+                    c[k + j] += v
+                for k, v in enumerate(b):
+                    c[k] += v
+                table[(i, j)] = c
+        return table[(i, j)]
+
+    counts = count(n1, n2)
+    total = sum(counts)
+    u = min(u, n1 * n2 - u)
+    tail = sum(counts[:int(math.floor(u)) + 1]) / total
+    return min(1.0, 2 * tail)
+
+
+def mann_whitney(a, b):
+    """Two-sided Mann-Whitney U test. Returns the p-value, or None if
+    a side has fewer than two observations"""
+    n1, n2 = len(a), len(b)
+    if n1 < 2 or n2 < 2:
+        return None
+
+    # Ranks, with ties given their average rank
+    values = sorted([(v, 0) for v in a] + [(v, 1) for v in b])
+    ranks = [0.0] * len(values)
+    ties = []
+    i = 0
+    while i < len(values):
+        j = i
+        while j + 1 < len(values) and values[j + 1][0] == values[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j) / 2 + 1
+        if j > i:
+            ties.append(j - i + 1)
+        i = j + 1
+
+    r1 = sum(r for r, (_, side) in zip(ranks, values) if side == 0)
+    u = r1 - n1 * (n1 + 1) / 2
+
+    if not ties and n1 + n2 <= 40:
+        return exact_u_pvalue(n1, n2, u)
+
+    # Normal approximation, with the tie correction
+    n = n1 + n2
+    mean = n1 * n2 / 2
+    var = n1 * n2 / 12 * ((n + 1) - sum(t ** 3 - t for t in ties) / (n * (n - 1)))
+    if var <= 0:
+        return 1.0
+    z = (abs(u - mean) - 0.5) / math.sqrt(var)
+    return min(1.0, math.erfc(max(z, 0) / math.sqrt(2)))
+
+
+def compare_values(better, base, new, threshold, alpha):
+    """Returns (change, p, verdict) for one value"""
+    m0 = statistics.median(base)
+    m1 = statistics.median(new)
+    if m0 == 0:
+        change = 0.0 if m1 == 0 else math.copysign(math.inf, m1)
+    else:
+        change = (m1 - m0) / abs(m0)
+
+    p = mann_whitney(base, new)
+    worse = change > 0 if better == "lower" else change < 0
+    if better == "none" or abs(change) <= threshold:
+        verdict = ""
+    elif p is None:
+        verdict = "untested"
+    elif p >= alpha:
+        verdict = "noise"
+    else:
+        verdict = "REGRESSION" if worse else "improved"
+
+    return change, p, verdict, worse
+
+
+def describe_host(docs):
+    hosts = {(d["host"].get("cpu_model"), d["host"].get("cpus"), d["host"].get("build_type")) for d in docs}
+    return hosts
+
+
+def cmd_compare(args):
+    try:
+        base_docs = load_documents(resolve(args.dir, args.base))
+        new_docs = load_documents(resolve(args.dir, args.new))
+    except (OSError, ValueError) as e:
+        print("ERROR: %s" % e, file=sys.stderr)
+        return 2
+
+    base_hosts, new_hosts = describe_host(base_docs), describe_host(new_docs)
+    if base_hosts != new_hosts:
+        print("WARNING: The results come from different hosts or builds: %s vs %s"
+              % (sorted(base_hosts, key=str), sorted(new_hosts, key=str)), file=sys.stderr)
+
+    base = collect(base_docs, args.all)
+    new = collect(new_docs, args.all)
+    threshold = args.threshold / 100
+
+    rows = []
+    for key in sorted(set(base) & set(new)):
+        for path in sorted(set(base[key]) & set(new[key])):
+            if args.metric and not any(fnmatch.fnmatch(path, m) for m in args.metric):
+                continue
+            better, obs0 = base[key][path]
+            obs1 = new[key][path][1]
+            change, p, verdict, worse = compare_values(better, obs0, obs1, threshold, args.alpha)
+            rows.append({
+                "suite": key[0], "scenario": key[1], "params": json.loads(key[2]), "value": path,
+                "better": better, "base": statistics.median(obs0), "new": statistics.median(obs1),
+                "base_n": len(obs0), "new_n": len(obs1),
+                "change": change if math.isfinite(change) else None, "p": p,
+                "verdict": verdict, "worse": worse
+            })
+
+    only_base = sorted(set(base) - set(new))
+    only_new = sorted(set(new) - set(base))
+
+    regressions = [r for r in rows if r["verdict"] == "REGRESSION"]
+    untested = [r for r in rows if r["verdict"] == "untested" and r["worse"]]
+
+    if args.json:
+        json.dump({"base": args.base, "new": args.new, "threshold": args.threshold, "alpha": args.alpha,
+                   "comparisons": rows,
+                   "only_base": [list(k) for k in only_base], "only_new": [list(k) for k in only_new],
+                   "regressions": len(regressions)}, sys.stdout, indent=2)
+        print()
+    else:
+        last = None
+        for r in rows:
+            title = (r["suite"], r["scenario"], json.dumps(r["params"], sort_keys=True))
+            if title != last:
+                params = ", ".join("%s=%s" % kv for kv in sorted(r["params"].items()))
+                print("\n%s %s%s" % (r["suite"], r["scenario"], " (%s)" % params if params else ""))
+                last = title
+            change = "%+.1f%%" % (100 * r["change"]) if r["change"] is not None else "n/a"
+            p = "%.3f" % r["p"] if r["p"] is not None else "-"
+            print("  %-32s %14.6g %14.6g %9s  n=%d/%d  p=%-6s %s"
+                  % (r["value"], r["base"], r["new"], change, r["base_n"], r["new_n"], p, r["verdict"]))
+
+        for label, keys in (("base", only_base), ("new", only_new)):
+            for k in keys:
+                print("\nOnly in %s: %s %s %s" % (label, k[0], k[1], k[2]))
+
+        print("\n%d values compared, %d regressions, %d improvements, %d untested"
+              % (len(rows), len(regressions), len([r for r in rows if r["verdict"] == "improved"]),
+                 len([r for r in rows if r["verdict"] == "untested"])))
+
+    if regressions or (args.strict and untested):
+        return 1
+    return 0
+
+
+def git_label():
+    try:
+        out = subprocess.run(["git", "describe", "--always", "--dirty"], capture_output=True, text=True, check=True)
+        return out.stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+
+def cmd_record(args):
+    if not args.command:
+        print("ERROR: No command given", file=sys.stderr)
+        return 2
+
+    label = args.label or git_label()
+    env = dict(os.environ, CHIRC_BENCH_COMMIT=label)
+    os.makedirs(args.dir, exist_ok=True)
+    path = os.path.join(args.dir, label + ".jsonl")
+
+    for run in range(args.runs):
+        proc = subprocess.run(args.command, stdout=subprocess.PIPE, text=True, env=env)
+        try:
+            docs = []
+            decoder = json.JSONDecoder()
+            text = proc.stdout.strip()
+            pos = 0
+            while pos < len(text):
+                doc, pos = decoder.raw_decode(text, pos)
+                while pos < len(text) and text[pos].isspace():
+                    pos += 1
+                docs.append(doc)
+            if not docs or any(d.get("schema") != SCHEMA for d in docs):
+                raise ValueError("not a %s document" % SCHEMA)
+        except ValueError as e:
+            print("ERROR: Run %d: the output of %s is %s" % (run + 1, args.command[0], e), file=sys.stderr)
+            return 2
+
+        with open(path, "a") as f:
+            for doc in docs:
+                f.write(json.dumps(doc, sort_keys=True) + "\n")
+
+        status = "" if proc.returncode == 0 else " (exit status %d)" % proc.returncode
+        print("Run %d/%d recorded in %s%s" % (run + 1, args.runs, path, status), file=sys.stderr)
+
+    return 0
+
+
+def cmd_list(args):
+    if not os.path.isdir(args.dir):
+        return 0
+
+    labels = []
+    for name in os.listdir(args.dir):
+        if not name.endswith(".jsonl"):
+            continue
+        docs = load_documents(os.path.join(args.dir, name))
+        suites = {}
+        for d in docs:
+            suites[d["suite"]] = suites.get(d["suite"], 0) + 1
+        latest = max((d.get("timestamp", "") for d in docs), default="")
+        labels.append((latest, name[:-len(".jsonl")], suites))
+
+    for latest, label, suites in sorted(labels):
+        print("%-24s %s  %s" % (label, latest,
+                                ", ".join("%s x%d" % kv for kv in sorted(suites.items()))))
+
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Stores benchmark results and compares them across commits.")
+    parser.add_argument("-d", "--dir", default=os.environ.get("CHIRC_BENCH_STORE", "bench-results"),
+                        help="Result store (default: $CHIRC_BENCH_STORE or bench-results)")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    rec = sub.add_parser("record", help="Run a benchmark and store its results")
+    rec.add_argument("-n", "--runs", type=int, default=1, help="Number of runs (default: 1)")
+    rec.add_argument("-l", "--label", help="Label (default: the current commit)")
+    rec.add_argument("command", nargs=argparse.REMAINDER, help="Benchmark command (with -j)")
+    rec.set_defaults(func=cmd_record)
+
+    lst = sub.add_parser("list", help="List the labels in the store")
+    lst.set_defaults(func=cmd_list)
+
+    cmp = sub.add_parser("compare", help="Compare two sets of results")
+    cmp.add_argument("base", help="Label or file of the baseline")
+    cmp.add_argument("new", help="Label or file to compare with the baseline")
+    cmp.add_argument("-t", "--threshold", type=float, default=5.0,
+                     help="Smallest change reported as a regression, in percent (default: 5)")
+    cmp.add_argument("-a", "--alpha", type=float, default=0.05, help="Significance level (default: 0.05)")
+    cmp.add_argument("-m", "--metric", action="append",
+                     help="Only compare values whose path matches this pattern (e.g., 'percentiles.*.p99')")
+    cmp.add_argument("--all", action="store_true", help="Also show metrics with no direction (counts, etc.)")
+    cmp.add_argument("--strict", action="store_true", help="Fail on untested changes in the wrong direction too")
+    cmp.add_argument("-j", "--json", action="store_true", help="Print the comparison as JSON")
+    cmp.set_defaults(func=cmd_compare)
+
+    args = parser.parse_args()
+    if args.cmd == "record" and args.command and args.command[0] == "--":
+        args.command = args.command[1:]
+    if args.cmd == "record" and args.runs < 1:
+        parser.error("the number of runs must be positive")
+
+    sys.exit(args.func(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,227 @@
+/*! \file eventlog_decode.c
+ *  \brief Renders a chirc binary event log as text or JSON
+ *
+ *  See eventlog.h for a description of the file format.
+ *
+ *  Usage: chirc-eventlog-decode [-j] FILE
+ *
+ *  By default, one line of text is printed per event. With -j, each
+ *  event is printed as a JSON object (one object per line).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "eventlog.h"
+#include "varint.h"
+
+/* Table of interned strings, indexed by id */
+static char **strings = NULL;
+static size_t nstrings = 0;
+
+static void set_string(uint64_t id, const unsigned char *s, size_t len)
+{
+    if (id >= nstrings)
+    {
+        size_t n = nstrings ? nstrings : 64;
+        while (n <= id)
+            n *= 2;
+        strings = realloc(strings, n * sizeof(char *));
+        memset(strings + nstrings, 0, (n - nstrings) * sizeof(char *));
+        nstrings = n;
+    }
+
+    free(strings[id]);
+    strings[id] = malloc(len + 1);
+    memcpy(strings[id], s, len);
+    strings[id][len] = '\0';
+}
+
+static const char *get_string(uint64_t id)
+{
+    if (id == 0 || id >= nstrings)
+        return NULL;
+
+    return strings[id];
+}
+
+static void reset_strings()
+{
+    for (size_t i = 0; i < nstrings; i++)
+    {
+        free(strings[i]);
+        strings[i] = NULL;
+    }
+}
+
+static void print_json_string(const char *s)
+{
+    if (!s)
+    {
+        fputs("null", stdout);
+        return;
+    }
+
+    putchar('"');
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static void print_event(bool json, int type, int level, uint64_t time_ms,
+                        uint64_t conn_id, uint64_t subject, uint64_t target, uint64_t value)
+{
+    const char *name = chirc_event_type_name(type);
+    char tbuf[32];
+    time_t t = time_ms / 1000;
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+
+    if (json)
+    {
+        printf("{\"time_ms\":%llu,\"time\":\"%s.%03u\",\"level\":\"%s\",\"event\":",
+               (unsigned long long) time_ms, tbuf, (unsigned) (time_ms % 1000),
+               chirc_loglevel_str(level));
+        if (name)
+            printf("\"%s\"", name);
+        else
+            printf("%d", type);
+        printf(",\"conn\":%llu,\"subject\":", (unsigned long long) conn_id);
+        print_json_string(get_string(subject));
+        fputs(",\"target\":", stdout);
+        print_json_string(get_string(target));
+        printf(",\"value\":%llu}\n", (unsigned long long) value);
+    }
+    else
+    {
+        printf("[%s.%03u] %6s ", tbuf, (unsigned) (time_ms % 1000), chirc_loglevel_str(level));
+        if (name)
+            printf("%-10s", name);
+        else
+            printf("TYPE-%-5d", type);
+        printf(" conn=%llu", (unsigned long long) conn_id);
+        if (subject)
+            printf(" subject=%s", get_string(subject) ? get_string(subject) : "?");
+        if (target)
+            printf(" target=%s", get_string(target) ? get_string(target) : "?");
+        printf(" value=%llu\n", (unsigned long long) value);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    bool json = false;
+    FILE *f;
+    unsigned char hdr[CHIRC_EVENTLOG_HEADER_SIZE];
+    unsigned char rhdr[CHIRC_EVENTLOG_RECORD_HEADER_SIZE];
+    unsigned char payload[0x10000];
+    uint64_t time_ms = 0;
+    unsigned long nrecords = 0;
+
+    while ((opt = getopt(argc, argv, "jh")) != -1)
+        switch (opt)
+        {
+        case 'j':
+            json = true;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: chirc-eventlog-decode [-j] FILE\n");
+            exit(opt == 'h' ? 0 : -1);
+        }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Usage: chirc-eventlog-decode [-j] FILE\n");
+        exit(-1);
+    }
+
+    f = fopen(argv[optind], "rb");
+    if (!f)
+    {
+        fprintf(stderr, "ERROR: No such file: %s\n", argv[optind]);
+        exit(-1);
+    }
+
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || memcmp(hdr, CHIRC_EVENTLOG_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "ERROR: %s is not a chirc event log\n", argv[optind]);
+        exit(-1);
+    }
+
+    for (int i = 0; i < 8; i++)
+        time_ms |= (uint64_t) hdr[8 + i] << (8 * i);
+
+    while (fread(rhdr, 1, sizeof(rhdr), f) == sizeof(rhdr))
+    {
+        int type = rhdr[0], level = rhdr[1];
+        size_t len = rhdr[2] | (rhdr[3] << 8), pos, n;
+        uint64_t delta, fields[4] = {0, 0, 0, 0};
+
+        if (fread(payload, 1, len, f) != len)
+        {
+            fprintf(stderr, "WARNING: truncated record at the end of the file\n");
+            break;
+        }
+        nrecords++;
+
+        pos = varint_decode(payload, len, &delta);
+        if (pos == 0)
+        {
+            fprintf(stderr, "ERROR: malformed record #%lu\n", nrecords);
+            exit(-1);
+        }
+        time_ms += delta;
+
+        if (type == CHIRC_EV_STRING)
+        {
+            n = varint_decode(payload + pos, len - pos, &fields[0]);
+            if (n == 0)
+            {
+                fprintf(stderr, "ERROR: malformed string record #%lu\n", nrecords);
+                exit(-1);
+            }
+            set_string(fields[0], payload + pos + n, len - pos - n);
+            continue;
+        }
+        else if (type == CHIRC_EV_STRINGS_RESET)
+        {
+            reset_strings();
+            continue;
+        }
+
+        /* Missing trailing fields are treated as zero, so that newer
+         * writers can append fields without breaking this decoder */
+        for (int i = 0; i < 4 && pos < len; i++)
+        {
+            n = varint_decode(payload + pos, len - pos, &fields[i]);
+            if (n == 0)
+                break;
+            pos += n;
+        }
+
+        print_event(json, type, level, time_ms, fields[0], fields[1], fields[2], fields[3]);
+    }
+
+    fclose(f);
+    reset_strings();
+    free(strings);
+
+    return 0;
+}